@@ -0,0 +1,349 @@
+/********************************************************************************
+  > FileName:	CaptureReplay.cpp
+  > Author:	Mingping Zhang
+  > Email:	mingpingzhang@163.com
+  > Create Time:	Thu Apr  6 10:15:42 2023
+ ********************************************************************************/
+
+// re-drive a server with the traffic recorded by its capture mode(EpollTcpServer::setCaptureConfig):
+// one connection per captured connection, the client bytes of every connection in captured order, either
+// at the original inter-arrival times(scaled by --speed) or as fast as the server answers(--fast, at most
+// --window requests waiting for their reply). a request is answered when as many reply bytes arrived
+// as the server sent after it in the capture, that is its latency.
+//   usage: ./capture_replay capture_path host port [--fast] [--speed x] [--window n]
+
+#include "EventLoop.h"
+#include "LatencyHistogram.h"
+#include "SocketAddress.h"
+#include "TcpConnection.h"
+#include "TimeUtil.h"
+#include "TrafficCapture.h"
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// one captured event to replay, client bytes are copied out of the mapped capture
+struct Step
+{
+    uint64_t ns;              // since capture start
+    size_t stream;            // index into streams
+    CaptureRecordType type;   // kOpen, kIn or kClose
+    std::string data;
+    uint64_t replyEnd { 0 };  // reply bytes of the stream expected once this request is answered
+};
+
+// one replayed connection, loop thread only except conn
+struct Stream
+{
+    TcpConnectionPtr conn;
+    uint64_t received { 0 };
+    uint64_t expected { 0 }; // replyEnd of the last request sent
+    struct Pending
+    {
+        uint64_t end;
+        uint64_t sentNs;
+    };
+    std::deque<Pending> pending;
+    bool closing { false }; // the capture closed it, close once the replies are in
+};
+
+struct ReplayStats
+{
+    std::atomic<uint64_t> requests { 0 };
+    std::atomic<uint64_t> answered { 0 };
+    std::atomic<uint64_t> inflight { 0 };  // requests sent and waiting for their reply
+    std::atomic<uint64_t> sentBytes { 0 };
+    std::atomic<uint64_t> receivedBytes { 0 };
+    std::atomic<uint64_t> failedConnects { 0 };
+    LatencyHistogram latency;
+};
+
+// read the capture into steps, false when nothing could be read
+static bool loadCapture(const std::string& path, std::vector<Step>& steps, size_t& stream_count,
+    uint64_t& expected_reply_bytes)
+{
+    CaptureReader reader;
+    if (!reader.open(path))
+    {
+        return false;
+    }
+    // captured fd -> stream, a later open of the same fd starts a new stream
+    std::unordered_map<int32_t, size_t> current;
+    std::vector<uint64_t> reply_bytes;
+    std::vector<size_t> last_request;
+    auto streamOf = [&](int32_t fd, bool open) {
+        auto it = current.find(fd);
+        if (open || it == current.end())
+        {
+            // a stream whose open record was rotated away starts at its first record
+            current[fd] = reply_bytes.size();
+            reply_bytes.push_back(0);
+            last_request.push_back(SIZE_MAX);
+            return reply_bytes.size() - 1;
+        }
+        return it->second;
+    };
+    uint64_t first_ns = UINT64_MAX;
+    CaptureRecord record;
+    while (reader.next(record))
+    {
+        if (first_ns == UINT64_MAX)
+        {
+            first_ns = record.ns;
+        }
+        if (record.type == CaptureRecordType::kOut)
+        {
+            // replies answer the request before them
+            size_t s = streamOf(record.stream, false);
+            reply_bytes[s] += record.length;
+            expected_reply_bytes += record.length;
+            if (last_request[s] != SIZE_MAX)
+            {
+                steps[last_request[s]].replyEnd = reply_bytes[s];
+            }
+            continue;
+        }
+        Step step;
+        step.ns = record.ns - first_ns;
+        step.stream = streamOf(record.stream, record.type == CaptureRecordType::kOpen);
+        step.type = record.type;
+        if (record.type == CaptureRecordType::kIn)
+        {
+            step.data.assign(record.payload, record.length);
+            step.replyEnd = reply_bytes[step.stream];
+            last_request[step.stream] = steps.size();
+        }
+        else if (record.type == CaptureRecordType::kClose)
+        {
+            current.erase(record.stream);
+        }
+        steps.push_back(std::move(step));
+    }
+    stream_count = reply_bytes.size();
+    std::cout << "loaded " << steps.size() << " records of " << stream_count << " connections from "
+        << reader.files().size() << " files" << std::endl;
+    return !steps.empty();
+}
+
+// blocking connect, then non-blocking for the connection; -1 on failure
+static int32_t connectTo(const SocketAddress& addr)
+{
+    int fd = ::socket(addr.family(), SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    if (::connect(fd, addr.addr(), addr.length()) != 0)
+    {
+        ::close(fd);
+        return -1;
+    }
+    if (!addr.isUnix())
+    {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    return fd;
+}
+
+// the replies of stream s arrived up to its received bytes, loop thread
+static void onReplies(std::vector<Stream>& streams, size_t s, ReplayStats& stats)
+{
+    Stream& stream = streams[s];
+    uint64_t now = monotonicNs();
+    while (!stream.pending.empty() && stream.pending.front().end <= stream.received)
+    {
+        stats.latency.record(now - stream.pending.front().sentNs);
+        stream.pending.pop_front();
+        stats.answered.fetch_add(1, std::memory_order_relaxed);
+        stats.inflight.fetch_sub(1, std::memory_order_relaxed);
+    }
+    if (stream.closing && stream.pending.empty() && stream.conn)
+    {
+        stream.conn->closeAfterWrite();
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 4)
+    {
+        std::cout << "usage: " << argv[0] << " capture_path host port [--fast] [--speed x] [--window n]" << std::endl;
+        return 1;
+    }
+    std::string path = argv[1];
+    SocketAddress target;
+    if (!SocketAddress::parse(argv[2], std::atoi(argv[3]), target))
+    {
+        std::cout << "invalid address " << argv[2] << ":" << argv[3] << std::endl;
+        return 1;
+    }
+    bool fast = false;
+    double speed = 1.0;
+    uint64_t window = 256;
+    for (int i = 4; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "--fast")
+        {
+            fast = true;
+        }
+        else if (arg == "--speed" && i + 1 < argc)
+        {
+            speed = std::atof(argv[++i]);
+        }
+        else if (arg == "--window" && i + 1 < argc)
+        {
+            window = std::strtoull(argv[++i], nullptr, 10);
+        }
+    }
+    if (speed <= 0 || window == 0)
+    {
+        std::cout << "speed and window must be positive" << std::endl;
+        return 1;
+    }
+
+    std::vector<Step> steps;
+    size_t stream_count = 0;
+    uint64_t expected_reply_bytes = 0;
+    if (!loadCapture(path, steps, stream_count, expected_reply_bytes))
+    {
+        std::cout << "nothing to replay" << std::endl;
+        return 1;
+    }
+
+    EventLoopPtr loop = std::make_shared<EventLoop>();
+    if (!loop->start())
+    {
+        return 1;
+    }
+    std::vector<Stream> streams(stream_count);
+    ReplayStats stats;
+
+    // this thread paces the steps and hands them to the loop thread in order
+    uint64_t start_ns = monotonicNs();
+    for (size_t i = 0; i < steps.size(); ++i)
+    {
+        const Step& step = steps[i];
+        if (!fast)
+        {
+            uint64_t due = start_ns + (uint64_t)(step.ns / speed);
+            uint64_t now = monotonicNs();
+            if (due > now)
+            {
+                std::this_thread::sleep_for(std::chrono::nanoseconds(due - now));
+            }
+        }
+        if (step.type == CaptureRecordType::kOpen)
+        {
+            int32_t fd = connectTo(target);
+            if (fd < 0)
+            {
+                stats.failedConnects.fetch_add(1, std::memory_order_relaxed);
+                continue;
+            }
+            size_t s = step.stream;
+            loop->post([&streams, &stats, &loop, s, fd]() {
+                TcpConnectionPtr conn = std::make_shared<TcpConnection>(loop, fd);
+                conn->setRecvCallback([&streams, &stats, s](const PacketPtr& data) {
+                    streams[s].received += data->message().size();
+                    stats.receivedBytes.fetch_add(data->message().size(), std::memory_order_relaxed);
+                    onReplies(streams, s, stats);
+                });
+                conn->setCloseCallback([&streams, s](const TcpConnectionPtr& c) {
+                    if (streams[s].conn == c)
+                    {
+                        streams[s].conn.reset();
+                    }
+                });
+                streams[s].conn = conn;
+                if (!conn->start())
+                {
+                    conn->close();
+                }
+            });
+            continue;
+        }
+        if (fast)
+        {
+            // keep the server's output queues bounded
+            while (stats.inflight.load(std::memory_order_relaxed) >= window)
+            {
+                std::this_thread::sleep_for(std::chrono::microseconds(20));
+            }
+        }
+        if (step.type == CaptureRecordType::kIn)
+        {
+            stats.requests.fetch_add(1, std::memory_order_relaxed);
+            stats.sentBytes.fetch_add(step.data.size(), std::memory_order_relaxed);
+            stats.inflight.fetch_add(1, std::memory_order_relaxed);
+        }
+        loop->post([&streams, &stats, &step]() {
+            Stream& stream = streams[step.stream];
+            if (step.type == CaptureRecordType::kClose)
+            {
+                stream.closing = true;
+                onReplies(streams, step.stream, stats);
+                return;
+            }
+            if (!stream.conn || step.replyEnd <= stream.expected)
+            {
+                // no connection, or the capture has no reply to wait for
+                stats.inflight.fetch_sub(1, std::memory_order_relaxed);
+            }
+            else
+            {
+                stream.expected = step.replyEnd;
+                stream.pending.push_back({ step.replyEnd, monotonicNs() });
+            }
+            if (stream.conn)
+            {
+                stream.conn->send(step.data);
+            }
+        });
+    }
+    // replies still on their way
+    uint64_t deadline = monotonicNs() + 5000000000ULL;
+    while (stats.inflight.load(std::memory_order_relaxed) > 0 && monotonicNs() < deadline)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    uint64_t elapsed_ns = monotonicNs() - start_ns;
+    loop->runAndWait([&streams]() {
+        for (auto& stream : streams)
+        {
+            if (stream.conn)
+            {
+                stream.conn->close();
+            }
+        }
+    });
+    loop->stop();
+
+    double seconds = elapsed_ns / 1e9;
+    printf("mode: %s, %zu connections, %llu connect failures\n", fast ? "as fast as possible" : "original timing",
+        stream_count, (unsigned long long)stats.failedConnects.load());
+    printf("captured span %.1f ms, replayed in %.1f ms\n", steps.back().ns / 1e6, elapsed_ns / 1e6);
+    printf("requests %llu, answered %llu, %.0f req/s\n", (unsigned long long)stats.requests.load(),
+        (unsigned long long)stats.answered.load(), stats.requests.load() / seconds);
+    printf("sent %.2f MB, received %.2f MB(captured replies %.2f MB), %.2f MB/s\n", stats.sentBytes.load() / 1e6,
+        stats.receivedBytes.load() / 1e6, expected_reply_bytes / 1e6,
+        (stats.sentBytes.load() + stats.receivedBytes.load()) / 1e6 / seconds);
+    printf("latency %s\n", stats.latency.summary().c_str());
+    return 0;
+}
@@ -0,0 +1,244 @@
+/********************************************************************************
+  > FileName:	CompressionBench.cpp
+  > Author:	Mingping Zhang
+  > Email:	mingpingzhang@163.com
+  > Create Time:	Wed Apr  5 14:06:31 2023
+ ********************************************************************************/
+
+// cpu cost vs bytes saved of per message lz4 compression:
+//   1. the codec alone on log text, json and random payloads of several sizes
+//   2. EpollTcpClient -> EpollTcpServer echo over loopback with compression off and on
+//   usage: ./compression_bench [messages] [message_size]
+
+#include "EpollTcpClient.h"
+#include "EpollTcpServer.h"
+#include "FrameCodec.h"
+#include "Lz4Codec.h"
+#include "SocketAddress.h"
+#include <sys/resource.h>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+enum class PayloadKind
+{
+    kLogText,
+    kJson,
+    kRandom,
+};
+
+static const char* kindName(PayloadKind kind)
+{
+    switch (kind)
+    {
+    case PayloadKind::kLogText:
+        return "log-text";
+    case PayloadKind::kJson:
+        return "json";
+    default:
+        return "random";
+    }
+}
+
+// payload of the kind, different content for every seed
+static std::string makePayload(PayloadKind kind, size_t size, uint32_t seed)
+{
+    std::mt19937 engine(seed);
+    auto rng = [&engine]() { return (unsigned)engine(); };
+    std::string out;
+    char line[256];
+    while (out.size() < size)
+    {
+        if (kind == PayloadKind::kLogText)
+        {
+            snprintf(line, sizeof(line), "2023-04-05 14:06:%02u.%03u INFO  [worker-%u] request id=%u path=/api/v1/items/%u "
+                "status=200 latency_us=%u\n", rng() % 60, rng() % 1000, rng() % 8, rng(), rng() % 10000, rng() % 5000);
+        }
+        else if (kind == PayloadKind::kJson)
+        {
+            snprintf(line, sizeof(line), "{\"id\":%u,\"name\":\"item-%u\",\"tags\":[\"new\",\"sale\"],\"price\":%u.%02u,"
+                "\"active\":true},", rng(), rng() % 10000, rng() % 500, rng() % 100);
+        }
+        else
+        {
+            for (size_t i = 0; i < 64; ++i)
+            {
+                line[i] = (char)rng();
+            }
+            line[64] = '\0';
+            out.append(line, 64);
+            continue;
+        }
+        out += line;
+    }
+    out.resize(size);
+    return out;
+}
+
+static double cpuMs()
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1e3 + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e3;
+}
+
+static void benchCodec(PayloadKind kind, size_t size)
+{
+    const int kVariants = 16;
+    std::vector<std::string> payloads;
+    for (int i = 0; i < kVariants; ++i)
+    {
+        payloads.push_back(makePayload(kind, size, i));
+    }
+    Lz4Codec codec;
+    std::vector<char> packed(Lz4Codec::compressBound(size));
+    std::vector<char> unpacked(size);
+    size_t in_bytes = 0;
+    size_t out_bytes = 0;
+    uint64_t n = 0;
+    Clock::time_point begin = Clock::now();
+    double compress_s = 0;
+    while ((compress_s = std::chrono::duration<double>(Clock::now() - begin).count()) < 0.2)
+    {
+        for (int k = 0; k < 64; ++k, ++n)
+        {
+            const std::string& p = payloads[n % kVariants];
+            out_bytes += codec.compress(p.data(), p.size(), packed.data(), packed.size());
+            in_bytes += p.size();
+        }
+    }
+    size_t packed_len = codec.compress(payloads[0].data(), size, packed.data(), packed.size());
+    uint64_t m = 0;
+    begin = Clock::now();
+    double decompress_s = 0;
+    while ((decompress_s = std::chrono::duration<double>(Clock::now() - begin).count()) < 0.2)
+    {
+        for (int k = 0; k < 64; ++k, ++m)
+        {
+            Lz4Codec::decompress(packed.data(), packed_len, unpacked.data(), unpacked.size());
+        }
+    }
+    printf("%-10s %8zu %10.3f %12.1f %14.0f %14.0f\n", kindName(kind), size, (double)out_bytes / in_bytes,
+            compress_s * 1e9 / n, in_bytes / 1e6 / compress_s, m * (double)size / 1e6 / decompress_s);
+}
+
+struct EchoResult
+{
+    double wall_ms { 0 };
+    double cpu_ms { 0 };
+    uint64_t message_bytes { 0 };
+    uint64_t wire_bytes { 0 };
+    std::string stats;
+};
+
+// send messages through the echo server and wait for all of them to come back
+static bool benchEcho(PayloadKind kind, size_t size, int messages, bool compress, uint16_t port, EchoResult& result)
+{
+    SocketAddress addr;
+    SocketAddress::parse("127.0.0.1", port, addr);
+    auto server = std::make_shared<EpollTcpServer>(addr);
+    EpollTcpServer* raw = server.get();
+    CompressionConfig config;
+    config.enabled = compress;
+    server->setCompressionConfig(config);
+    server->registerOnRecvCallback([raw](const PacketPtr& data) { raw->sendData(data); });
+    if (!server->start())
+    {
+        return false;
+    }
+    auto client = std::make_shared<EpollTcpClient>(addr);
+    client->setCompressionConfig(config);
+    std::atomic<uint64_t> received { 0 };
+    client->registerOnRecvCallback([&received](const PacketPtr& data) { received += data->message().size(); });
+    if (!client->start())
+    {
+        server->stop();
+        return false;
+    }
+
+    std::vector<PacketPtr> packets;
+    for (int i = 0; i < 64; ++i)
+    {
+        packets.push_back(std::make_shared<Packet>(-1, makePayload(kind, size, i)));
+    }
+    const uint64_t kWindow = 4 * 1024 * 1024; // bytes in flight, below the output queue limit
+    uint64_t total = (uint64_t)messages * size;
+    uint64_t sent = 0;
+    double cpu_begin = cpuMs();
+    Clock::time_point begin = Clock::now();
+    for (int i = 0; i < messages; ++i)
+    {
+        while (sent - received > kWindow)
+        {
+            std::this_thread::yield();
+        }
+        client->sendData(packets[i % packets.size()]);
+        sent += size;
+    }
+    Clock::time_point deadline = Clock::now() + std::chrono::seconds(30);
+    while (received < total && Clock::now() < deadline)
+    {
+        std::this_thread::yield();
+    }
+    result.wall_ms = std::chrono::duration<double, std::milli>(Clock::now() - begin).count();
+    result.cpu_ms = cpuMs() - cpu_begin;
+    result.message_bytes = 2 * total;
+    const CompressionStats& cs = client->compressionStats();
+    const CompressionStats& ss = server->compressionStats();
+    result.wire_bytes = compress ? cs.wireBytes + ss.wireBytes : result.message_bytes;
+    result.stats = compress ? "client " + cs.toString() : "";
+    bool ok = (received == total);
+    client->stop();
+    server->stop();
+    return ok;
+}
+
+int main(int argc, char* argv[])
+{
+    int messages = argc >= 2 ? std::atoi(argv[1]) : 20000;
+    size_t message_size = argc >= 3 ? std::atoi(argv[2]) : 4096;
+
+    printf("%-10s %8s %10s %12s %14s %14s\n", "payload", "size", "ratio", "ns/compress", "compress_MB/s", "decompress_MB/s");
+    const PayloadKind kinds[] = { PayloadKind::kLogText, PayloadKind::kJson, PayloadKind::kRandom };
+    for (PayloadKind kind : kinds)
+    {
+        for (size_t size : { 128, 1024, 16384 })
+        {
+            benchCodec(kind, size);
+        }
+    }
+
+
+    printf("\necho of %d x %zu byte messages, both directions\n", messages, message_size);
+    printf("%-10s %-5s %10s %10s %10s %10s %8s\n", "payload", "lz4", "wall_ms", "cpu_ms", "msg_MB", "wire_MB", "saved");
+    uint16_t port = 16690;
+    for (PayloadKind kind : kinds)
+    {
+        for (bool compress : { false, true })
+        {
+            EchoResult r;
+            if (!benchEcho(kind, message_size, messages, compress, port++, r))
+            {
+                printf("%-10s %-5s %10s\n", kindName(kind), compress ? "on" : "off", "failed");
+                continue;
+            }
+            printf("%-10s %-5s %10.1f %10.1f %10.1f %10.1f %7.1f%%\n", kindName(kind), compress ? "on" : "off",
+                    r.wall_ms, r.cpu_ms, r.message_bytes / 1e6, r.wire_bytes / 1e6,
+                    100.0 * ((double)r.message_bytes - r.wire_bytes) / r.message_bytes);
+            if (compress)
+            {
+                printf("    %s\n", r.stats.c_str());
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,227 @@
+/********************************************************************************
+  > FileName:	FootprintBench.cpp
+  > Author:	Mingping Zhang
+  > Email:	mingpingzhang@163.com
+  > Create Time:	Mon Apr 10 10:03:27 2023
+ ********************************************************************************/
+
+// memory per connection of EpollTcpServer: a forked client process opens N loopback connections from
+// 127.0.0.2, 127.0.0.3 ... (about 28k ephemeral ports per source address), the server process reports its
+// RSS and the kernel tcp memory per connection once all are accepted(idle), after one echo on every
+// connection and once they are idle again. 1M connections need RLIMIT_NOFILE and fs.nr_open >= 1M + a few
+// in both processes, the count is cut to what the fd limit allows
+//   usage: ./footprint_bench [connections] [socket_buffer_bytes]
+
+#include "EpollTcpServer.h"
+#include "SocketAddress.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef IP_BIND_ADDRESS_NO_PORT
+#define IP_BIND_ADDRESS_NO_PORT 24
+#endif
+
+static const uint16_t kPort = 16681;
+static const size_t kPortsPerSource = 25000;
+
+static size_t rssBytes()
+{
+    FILE* f = fopen("/proc/self/statm", "r");
+    if (!f)
+    {
+        return 0;
+    }
+    unsigned long size = 0;
+    unsigned long resident = 0;
+    int r = fscanf(f, "%lu %lu", &size, &resident);
+    fclose(f);
+    return r == 2 ? resident * sysconf(_SC_PAGESIZE) : 0;
+}
+
+// pages of tcp socket buffers of the whole host("TCP: ... mem N" of /proc/net/sockstat)
+static size_t tcpMemBytes()
+{
+    FILE* f = fopen("/proc/net/sockstat", "r");
+    if (!f)
+    {
+        return 0;
+    }
+    char line[256];
+    size_t pages = 0;
+    while (fgets(line, sizeof(line), f))
+    {
+        const char* mem = strstr(line, " mem ");
+        if (strncmp(line, "TCP:", 4) == 0 && mem)
+        {
+            pages = strtoul(mem + 5, nullptr, 10);
+        }
+    }
+    fclose(f);
+    return pages * sysconf(_SC_PAGESIZE);
+}
+
+static size_t raiseFdLimit()
+{
+    struct rlimit rl;
+    getrlimit(RLIMIT_NOFILE, &rl);
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+    return rl.rlim_cur;
+}
+
+// client process: connect, report, echo one message per connection on request, exit when the pipe closes
+static void runClients(size_t count, int report_fd, int command_fd)
+{
+    std::vector<int> fds;
+    fds.reserve(count);
+    for (size_t i = 0; i < count; ++i)
+    {
+        int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0)
+        {
+            break;
+        }
+        // the source port is picked at connect() for the whole 4-tuple, not at bind()
+        int one = 1;
+        setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one));
+        struct sockaddr_in src;
+        memset(&src, 0, sizeof(src));
+        src.sin_family = AF_INET;
+        src.sin_addr.s_addr = htonl(0x7f000002 + (uint32_t)(i / kPortsPerSource));
+        struct sockaddr_in dst;
+        memset(&dst, 0, sizeof(dst));
+        dst.sin_family = AF_INET;
+        dst.sin_port = htons(kPort);
+        dst.sin_addr.s_addr = htonl(0x7f000001);
+        if (::bind(fd, (struct sockaddr*)&src, sizeof(src)) != 0 ||
+            ::connect(fd, (struct sockaddr*)&dst, sizeof(dst)) != 0)
+        {
+            ::close(fd);
+            break;
+        }
+        fds.push_back(fd);
+    }
+    size_t connected = fds.size();
+    ssize_t w = ::write(report_fd, &connected, sizeof(connected));
+    char command = 0;
+    while (::read(command_fd, &command, 1) == 1)
+    {
+        // one 64 byte round trip on every connection
+        char message[64];
+        memset(message, 'x', sizeof(message));
+        for (int fd : fds)
+        {
+            w = ::write(fd, message, sizeof(message));
+        }
+        for (int fd : fds)
+        {
+            size_t got = 0;
+            while (got < sizeof(message))
+            {
+                ssize_t r = ::read(fd, message, sizeof(message) - got);
+                if (r <= 0)
+                {
+                    break;
+                }
+                got += r;
+            }
+        }
+        w = ::write(report_fd, &connected, sizeof(connected));
+    }
+    (void)w;
+    _exit(0);
+}
+
+static void printRow(const char* phase, size_t conns, size_t rss, size_t rss_base, size_t tcp, size_t tcp_base)
+{
+    double n = conns ? conns : 1;
+    printf("%-22s %10zu %12.1f %14.0f %14.0f\n", phase, conns, rss / 1048576.0,
+        (rss > rss_base ? rss - rss_base : 0) / n, (tcp > tcp_base ? tcp - tcp_base : 0) / n);
+}
+
+int main(int argc, char* argv[])
+{
+    size_t count = argc >= 2 ? std::strtoul(argv[1], nullptr, 10) : 10000;
+    size_t socket_buffer = argc >= 3 ? std::strtoul(argv[2], nullptr, 10) : 0;
+    size_t limit = raiseFdLimit();
+    if (count + 64 > limit)
+    {
+        count = limit > 64 ? limit - 64 : 0;
+        printf("fd limit %zu, testing %zu connections\n", limit, count);
+    }
+
+
+    auto server = std::make_shared<EpollTcpServer>("127.0.0.1", kPort);
+    FootprintConfig footprint;
+    footprint.socketBuffer = socket_buffer;
+    server->setFootprintConfig(footprint);
+    server->registerOnRecvCallback([&server](const PacketPtr& data) { server->sendData(data); });
+    if (!server->start())
+    {
+        return 1;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    size_t rss_base = rssBytes();
+    size_t tcp_base = tcpMemBytes();
+
+    int report[2];
+    int command[2];
+    if (pipe(report) != 0 || pipe(command) != 0)
+    {
+        return 1;
+    }
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        // only this thread exists in the child, the server is left alone
+        ::close(report[0]);
+        ::close(command[1]);
+        runClients(count, report[1], command[0]);
+    }
+    ::close(report[1]);
+    ::close(command[0]);
+    size_t connected = 0;
+    if (::read(report[0], &connected, sizeof(connected)) != sizeof(connected))
+    {
+        return 1;
+    }
+    // the last connects may still sit in the accept backlog
+    for (int i = 0; i < 500 && server->connectionCount() < connected; ++i)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    printf("sizeof(TcpConnection) %zu(callbacks: %zu bytes once per server), socket buffer %s\n",
+        sizeof(TcpConnection), sizeof(TcpCallbacks),
+        socket_buffer ? std::to_string(socket_buffer).c_str() : "kernel default");
+    printf("%-22s %10s %12s %14s %14s\n", "phase", "conns", "rss_MB", "rss_B/conn", "kernel_B/conn");
+    printRow("idle", server->connectionCount(), rssBytes(), rss_base, tcpMemBytes(), tcp_base);
+
+    char go = 1;
+    ssize_t w = ::write(command[1], &go, 1);
+    (void)w;
+    size_t done = 0;
+    if (::read(report[0], &done, sizeof(done)) == sizeof(done))
+    {
+        printRow("after one echo each", server->connectionCount(), rssBytes(), rss_base, tcpMemBytes(), tcp_base);
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        printRow("idle again", server->connectionCount(), rssBytes(), rss_base, tcpMemBytes(), tcp_base);
+    }
+    ::close(command[1]);
+    waitpid(pid, nullptr, 0);
+    server->stop();
+    return 0;
+}
@@ -0,0 +1,354 @@
+/********************************************************************************
+  > FileName:	KvBench.cpp
+  > Author:	Mingping Zhang
+  > Email:	mingpingzhang@163.com
+  > Create Time:	Fri Apr 14 16:45:03 2023
+ ********************************************************************************/
+
+// memtier style load on the kvcache service(KvCacheServer in this process): connections with a pipeline of
+// requests each, random keys of a key space, set:get 1:10, values of a fixed size. ops per second, request
+// latency and hit rate with and without pipelining, and with a memory limit far below the data(lru evictions)
+//   usage: ./kv_bench [seconds] [connections] [value_bytes] [threads]
+
+#include "KvCacheServer.h"
+#include "LatencyHistogram.h"
+#include "SocketAddress.h"
+#include "TimeUtil.h"
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+// one client connection with its requests in flight
+struct Conn
+{
+    int fd { -1 };
+    std::string out;             // requests not written yet
+    std::string in;              // replies not parsed yet
+    std::deque<uint64_t> sentNs; // in flight, oldest first
+    bool sawValue { false };     // the get being parsed has a VALUE
+};
+
+struct LoadResult
+{
+    uint64_t ops { 0 };
+    uint64_t gets { 0 };
+    uint64_t hits { 0 };
+    uint64_t errors { 0 };
+    LatencyHistogram latency;
+};
+
+static int connectTo(uint16_t port)
+{
+    int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in dst;
+    memset(&dst, 0, sizeof(dst));
+    dst.sin_family = AF_INET;
+    dst.sin_port = htons(port);
+    dst.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (fd < 0 || ::connect(fd, (struct sockaddr*)&dst, sizeof(dst)) != 0)
+    {
+        if (fd >= 0)
+        {
+            ::close(fd);
+        }
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+// complete the whole replies buffered in c.in, false on a reply this bench doesn't expect
+static bool parseReplies(Conn& c, LoadResult& result, uint64_t now)
+{
+    size_t pos = 0;
+    while (true)
+    {
+        const char* begin = c.in.data() + pos;
+        const char* nl = (const char*)memchr(begin, '\n', c.in.size() - pos);
+        if (!nl)
+        {
+            break;
+        }
+        size_t line_len = nl - begin + 1;
+        if (line_len > 6 && memcmp(begin, "VALUE ", 6) == 0)
+        {
+            // VALUE key flags bytes\r\n, then the data block
+            const char* last_space = (const char*)memrchr(begin, ' ', line_len);
+            size_t bytes = std::strtoul(last_space + 1, nullptr, 10);
+            if (c.in.size() - pos < line_len + bytes + 2)
+            {
+                break;
+            }
+            c.sawValue = true;
+            pos += line_len + bytes + 2;
+            continue;
+        }
+        pos += line_len;
+        if (c.sentNs.empty())
+        {
+            return false;
+        }
+        if (line_len == 5 && memcmp(begin, "END\r\n", 5) == 0)
+        {
+            ++result.gets;
+            result.hits += c.sawValue;
+            c.sawValue = false;
+        }
+        else if (!(line_len == 8 && memcmp(begin, "STORED\r\n", 8) == 0))
+        {
+            ++result.errors;
+        }
+        result.latency.record(now - c.sentNs.front());
+        c.sentNs.pop_front();
+        ++result.ops;
+    }
+    c.in.erase(0, pos);
+    return true;
+}
+
+class LoadGenerator
+{
+public:
+    LoadGenerator(uint16_t port, size_t connections, size_t key_space, size_t value_bytes)
+        : keySpace_(key_space),
+          value_(value_bytes, 'v'),
+          rng_(42)
+    {
+        for (size_t i = 0; i < connections; ++i)
+        {
+            Conn c;
+            c.fd = connectTo(port);
+            conns_.push_back(c);
+        }
+    }
+
+    ~LoadGenerator()
+    {
+        for (Conn& c : conns_)
+        {
+            if (c.fd >= 0)
+            {
+                ::close(c.fd);
+            }
+        }
+    }
+
+    bool connected() const
+    {
+        for (const Conn& c : conns_)
+        {
+            if (c.fd < 0)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // set every key once, pipelined
+    bool fill(LoadResult& result)
+    {
+        size_t next = 0;
+        return drive(~0ULL, 64, [this, &next](std::string& out) {
+            if (next >= keySpace_)
+            {
+                return false;
+            }
+            appendSet(out, next++);
+            return true;
+        }, result);
+    }
+
+    // random keys with sets:gets 1:ratio for seconds, pipeline requests in flight per connection
+    bool run(double seconds, size_t pipeline, size_t ratio, LoadResult& result)
+    {
+        std::uniform_int_distribution<size_t> key(0, keySpace_ - 1);
+        std::uniform_int_distribution<size_t> op(0, ratio);
+        uint64_t end = monotonicNs() + (uint64_t)(seconds * 1e9);
+        return drive(end, pipeline, [&](std::string& out) {
+            if (op(rng_) == 0)
+            {
+                appendSet(out, key(rng_));
+            }
+            else
+            {
+                appendGet(out, key(rng_));
+            }
+            return true;
+        }, result);
+    }
+
+private:
+    void appendKey(std::string& out, size_t key)
+    {
+        char text[32];
+        int n = snprintf(text, sizeof(text), "memtier-%zu", key);
+        out.append(text, n);
+    }
+
+    void appendSet(std::string& out, size_t key)
+    {
+        out.append("set ", 4);
+        appendKey(out, key);
+        char tail[48];
+        int n = snprintf(tail, sizeof(tail), " 0 0 %zu\r\n", value_.size());
+        out.append(tail, n);
+        out.append(value_);
+        out.append("\r\n", 2);
+    }
+
+    void appendGet(std::string& out, size_t key)
+    {
+        out.append("get ", 4);
+        appendKey(out, key);
+        out.append("\r\n", 2);
+    }
+
+    // keep pipeline requests of next() in flight on every connection until end or next() runs out, then
+    // wait for the replies
+    template <typename Next>
+    bool drive(uint64_t end, size_t pipeline, Next next, LoadResult& result)
+    {
+        std::vector<struct pollfd> fds(conns_.size());
+        bool more = true;
+        while (true)
+        {
+            uint64_t now = monotonicNs();
+            more = more && now < end;
+            size_t inflight = 0;
+            for (size_t i = 0; i < conns_.size(); ++i)
+            {
+                Conn& c = conns_[i];
+                while (more && c.sentNs.size() < pipeline)
+                {
+                    if (!next(c.out))
+                    {
+                        more = false;
+                        break;
+                    }
+                    c.sentNs.push_back(now);
+                }
+                if (!c.out.empty())
+                {
+                    ssize_t w = ::write(c.fd, c.out.data(), c.out.size());
+                    if (w < 0 && errno != EAGAIN)
+                    {
+                        return false;
+                    }
+                    c.out.erase(0, w > 0 ? w : 0);
+                }
+                inflight += c.sentNs.size();
+                fds[i].fd = c.fd;
+                fds[i].events = POLLIN | (c.out.empty() ? 0 : POLLOUT);
+                fds[i].revents = 0;
+            }
+            if (!more && inflight == 0)
+            {
+                return true;
+            }
+            if (::poll(fds.data(), fds.size(), 1000) <= 0)
+            {
+                return false;
+            }
+            now = monotonicNs();
+            for (size_t i = 0; i < conns_.size(); ++i)
+            {
+                if (!(fds[i].revents & POLLIN))
+                {
+                    continue;
+                }
+                Conn& c = conns_[i];
+                char buffer[64 * 1024];
+                ssize_t r;
+                while ((r = ::read(c.fd, buffer, sizeof(buffer))) > 0)
+                {
+                    c.in.append(buffer, r);
+                }
+                if (r == 0 || !parseReplies(c, result, now))
+                {
+                    return false;
+                }
+            }
+        }
+    }
+
+    size_t keySpace_;
+    std::string value_;
+    std::mt19937_64 rng_;
+    std::vector<Conn> conns_;
+};
+
+// one scenario against a fresh server
+static bool scenario(const char* name, uint16_t port, const KvServerConfig& config, double seconds,
+    size_t connections, size_t pipeline, size_t key_space, size_t value_bytes)
+{
+    SocketAddress addr;
+    SocketAddress::parse("127.0.0.1", port, addr);
+    KvCacheServer server(addr, config);
+    if (!server.start())
+    {
+        return false;
+    }
+    bool ok = false;
+    {
+        LoadGenerator load(port, connections, key_space, value_bytes);
+        LoadResult fill;
+        LoadResult result;
+        ok = load.connected() && load.fill(fill) && load.run(seconds, pipeline, 10, result);
+        if (ok)
+        {
+            KvStats stats = server.store().stats();
+            printf("%-12s %6zu %8zu %12.0f %9.1f %9.1f %7.1f%% %10llu %8llu\n", name, connections, pipeline,
+                result.ops / seconds, result.latency.percentile(50) / 1e3, result.latency.percentile(99) / 1e3,
+                result.gets ? 100.0 * result.hits / result.gets : 0.0, (unsigned long long)stats.evictions,
+                (unsigned long long)result.errors);
+        }
+    }
+    server.stop();
+    return ok;
+}
+
+int main(int argc, char* argv[])
+{
+    double seconds = argc >= 2 ? std::atof(argv[1]) : 2.0;
+    size_t connections = argc >= 3 ? std::strtoul(argv[2], nullptr, 10) : 50;
+    size_t value_bytes = argc >= 4 ? std::strtoul(argv[3], nullptr, 10) : 32;
+    size_t threads = argc >= 5 ? std::strtoul(argv[4], nullptr, 10) : 1;
+
+
+    KvServerConfig config;
+    config.threads = threads;
+    const size_t key_space = 100000;
+    printf("%zu keys of %zu byte values, set:get 1:10, %zu server thread(s), %.1fs each\n", key_space, value_bytes,
+        threads, seconds);
+    printf("%-12s %6s %8s %12s %9s %9s %8s %10s %8s\n", "scenario", "conns", "pipeline", "ops/s", "p50_us",
+        "p99_us", "hits", "evictions", "errors");
+    if (!scenario("no pipeline", 16721, config, seconds, connections, 1, key_space, value_bytes) ||
+        !scenario("pipeline", 16722, config, seconds, connections, 16, key_space, value_bytes))
+    {
+        return 1;
+    }
+    // a quarter of the data fits
+    KvServerConfig small = config;
+    small.store.memoryLimit = key_space * (value_bytes + 150) / 4;
+    if (!scenario("lru", 16723, small, seconds, connections, 16, key_space, value_bytes))
+    {
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,156 @@
+/********************************************************************************
+  > FileName:	LineBench.cpp
+  > Author:	Mingping Zhang
+  > Email:	mingpingzhang@163.com
+  > Create Time:	Tue Apr 11 15:22:48 2023
+ ********************************************************************************/
+
+// newline scanning of the line framing: the scalar/sse2/avx2 scans of LineFramer against memchr() over
+// buffers of lines of one length, then LineFramer::feed() on 4KB reads(the connection's read size) that
+// split lines across reads. GB/s of input and ns per line
+//   usage: ./line_bench [megabytes] [rounds]
+
+#include "LineFramer.h"
+#include "TimeUtil.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+typedef size_t (*find_byte_t)(const char* data, size_t len, char c);
+
+static size_t findByteMemchr(const char* data, size_t len, char c)
+{
+    const void* p = memchr(data, c, len);
+    return p ? (const char*)p - data : len;
+}
+
+// lines of line_length bytes, newline included, with random printable content
+static std::string makeInput(size_t bytes, size_t line_length)
+{
+    std::string input;
+    input.reserve(bytes + line_length);
+    uint32_t seed = 12345;
+    while (input.size() < bytes)
+    {
+        for (size_t i = 0; i + 1 < line_length; ++i)
+        {
+            seed = seed * 1103515245 + 12345;
+            input.push_back((char)(' ' + (seed >> 16) % 94));
+        }
+        input.push_back('\n');
+    }
+    return input;
+}
+
+// count the delimiters of input with find, best of rounds; ns in best_ns
+static size_t countLines(find_byte_t find, const std::string& input, int rounds, uint64_t& best_ns)
+{
+    size_t lines = 0;
+    best_ns = UINT64_MAX;
+    for (int r = 0; r < rounds; ++r)
+    {
+        uint64_t begin = monotonicNs();
+        const char* p = input.data();
+        size_t left = input.size();
+        lines = 0;
+        while (left > 0)
+        {
+            size_t pos = find(p, left, '\n');
+            if (pos == left)
+            {
+                break;
+            }
+            ++lines;
+            p += pos + 1;
+            left -= pos + 1;
+        }
+        uint64_t ns = monotonicNs() - begin;
+        best_ns = ns < best_ns ? ns : best_ns;
+    }
+    return lines;
+}
+
+// feed input to a LineFramer in 4KB reads, best of rounds; ns in best_ns
+static size_t frameLines(const std::string& input, int rounds, uint64_t& best_ns)
+{
+    const size_t read_size = 4096;
+    LineFramingConfig config;
+    config.enabled = true;
+    config.maxLineLength = 1 << 20;
+    std::vector<std::string> lines;
+    size_t total = 0;
+    best_ns = UINT64_MAX;
+    for (int r = 0; r < rounds; ++r)
+    {
+        LineFramer framer(config);
+        total = 0;
+        uint64_t begin = monotonicNs();
+        for (size_t off = 0; off < input.size(); off += read_size)
+        {
+            size_t n = input.size() - off < read_size ? input.size() - off : read_size;
+            framer.feed(input.data() + off, n, lines);
+            total += lines.size();
+            lines.clear();
+        }
+        uint64_t ns = monotonicNs() - begin;
+        best_ns = ns < best_ns ? ns : best_ns;
+    }
+    return total;
+}
+
+int main(int argc, char* argv[])
+{
+    size_t megabytes = argc >= 2 ? std::strtoul(argv[1], nullptr, 10) : 16;
+    int rounds = argc >= 3 ? std::atoi(argv[2]) : 5;
+    if (megabytes == 0 || rounds <= 0)
+    {
+        printf("megabytes and rounds must be positive\n");
+        return 1;
+    }
+
+    struct Scan
+    {
+        const char* name;
+        find_byte_t find;
+    };
+    std::vector<Scan> scans = {
+        { "memchr", findByteMemchr },
+        { "scalar", findByteScalar },
+        { "sse2", findByteSse2 },
+    };
+    if (std::string(findByteName()) == "avx2")
+    {
+        scans.push_back({ "avx2", findByteAvx2 });
+    }
+
+    printf("%zu MB per case, best of %d, findByte() uses %s\n", megabytes, rounds, findByteName());
+    printf("%-8s %-10s %10s %10s\n", "line_B", "scan", "GB/s", "ns/line");
+    const size_t lengths[] = { 16, 64, 256, 1024, 16384 };
+    for (size_t length : lengths)
+    {
+        std::string input = makeInput(megabytes << 20, length);
+        size_t expected = input.size() / length;
+        uint64_t ns = 0;
+        for (const auto& scan : scans)
+        {
+            size_t lines = countLines(scan.find, input, rounds, ns);
+            if (lines != expected)
+            {
+                printf("%-8zu %-10s found %zu lines, expected %zu\n", length, scan.name, lines, expected);
+                return 1;
+            }
+            printf("%-8zu %-10s %10.2f %10.1f\n", length, scan.name, input.size() / (double)ns,
+                (double)ns / lines);
+        }
+        size_t lines = frameLines(input, rounds, ns);
+        if (lines != expected)
+        {
+            printf("%-8zu %-10s framed %zu lines, expected %zu\n", length, "framer", lines, expected);
+            return 1;
+        }
+        printf("%-8zu %-10s %10.2f %10.1f\n", length, "framer", input.size() / (double)ns, (double)ns / lines);
+    }
+    return 0;
+}
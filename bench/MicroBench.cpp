@@ -0,0 +1,627 @@
+/********************************************************************************
+  > FileName:	MicroBench.cpp
+  > Author:	Mingping Zhang
+  > Email:	mingpingzhang@163.com
+  > Create Time:	Fri Mar 31 09:26:44 2023
+ ********************************************************************************/
+
+// microbenchmarks of the i/o hot paths: packet construction, loop dispatch and posted tasks,
+// echo over socketpair/loopback tcp and udp bursts. every case reports ns and syscalls/allocations
+// per operation; syscalls are counted by wrapping the libc functions the library calls(-Wl,--wrap)
+// and allocations by replacing operator new, so both only see this process.
+// a case whose setup or operations fail is reported as FAILED(error_occurred in json) and the exit status is 1.
+//   usage: ./micro_bench [--filter substring] [--seconds per_case] [--json path|-] [--label text]
+
+#include "EpollTcpServer.h"
+#include "EpollUdpServer.h"
+#include "EventLoop.h"
+#include "LatencyHistogram.h"
+#include "Packet.h"
+#include "TcpConnection.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <iostream>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+static std::atomic<uint64_t> g_syscalls { 0 };
+static std::atomic<uint64_t> g_allocs { 0 };
+
+// the library's syscalls, linked with -Wl,--wrap=<name>; the bench clients use send()/recv() which are not counted
+extern "C" {
+ssize_t __real_read(int fd, void* buf, size_t n);
+ssize_t __real_write(int fd, const void* buf, size_t n);
+ssize_t __real_writev(int fd, const struct iovec* iov, int n);
+ssize_t __real_recvmsg(int fd, struct msghdr* msg, int flags);
+ssize_t __real_sendmsg(int fd, const struct msghdr* msg, int flags);
+int __real_recvmmsg(int fd, struct mmsghdr* msgs, unsigned int n, int flags, struct timespec* timeout);
+int __real_sendmmsg(int fd, struct mmsghdr* msgs, unsigned int n, int flags);
+ssize_t __real_sendto(int fd, const void* buf, size_t n, int flags, const struct sockaddr* addr, socklen_t len);
+int __real_epoll_wait(int efd, struct epoll_event* events, int max, int timeout);
+int __real_epoll_ctl(int efd, int op, int fd, struct epoll_event* ev);
+
+ssize_t __wrap_read(int fd, void* buf, size_t n)
+{ ++g_syscalls; return __real_read(fd, buf, n); }
+ssize_t __wrap_write(int fd, const void* buf, size_t n)
+{ ++g_syscalls; return __real_write(fd, buf, n); }
+ssize_t __wrap_writev(int fd, const struct iovec* iov, int n)
+{ ++g_syscalls; return __real_writev(fd, iov, n); }
+ssize_t __wrap_recvmsg(int fd, struct msghdr* msg, int flags)
+{ ++g_syscalls; return __real_recvmsg(fd, msg, flags); }
+ssize_t __wrap_sendmsg(int fd, const struct msghdr* msg, int flags)
+{ ++g_syscalls; return __real_sendmsg(fd, msg, flags); }
+int __wrap_recvmmsg(int fd, struct mmsghdr* msgs, unsigned int n, int flags, struct timespec* timeout)
+{ ++g_syscalls; return __real_recvmmsg(fd, msgs, n, flags, timeout); }
+int __wrap_sendmmsg(int fd, struct mmsghdr* msgs, unsigned int n, int flags)
+{ ++g_syscalls; return __real_sendmmsg(fd, msgs, n, flags); }
+ssize_t __wrap_sendto(int fd, const void* buf, size_t n, int flags, const struct sockaddr* addr, socklen_t len)
+{ ++g_syscalls; return __real_sendto(fd, buf, n, flags, addr, len); }
+int __wrap_epoll_wait(int efd, struct epoll_event* events, int max, int timeout)
+{ ++g_syscalls; return __real_epoll_wait(efd, events, max, timeout); }
+int __wrap_epoll_ctl(int efd, int op, int fd, struct epoll_event* ev)
+{ ++g_syscalls; return __real_epoll_ctl(efd, op, fd, ev); }
+}
+
+void* operator new(size_t n)
+{
+    g_allocs.fetch_add(1, std::memory_order_relaxed);
+    void* p = malloc(n);
+    if (!p)
+    {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+    free(p);
+}
+
+struct BenchResult
+{
+    std::string name;
+    uint64_t iterations { 0 };
+    double nsPerOp { 0 };
+    double opsPerSec { 0 };
+    double allocsPerOp { 0 };
+    double syscallsPerOp { 0 };
+    bool ok { false }; // false when the setup or an operation failed, the numbers are meaningless then
+};
+
+// run body(n) with growing n until it takes ~seconds, report the last run; body returns false when an
+// operation failed, that fails the benchmark
+static BenchResult measure(const std::string& name, double seconds, const std::function<bool(uint64_t)>& body)
+{
+    BenchResult result;
+    result.name = name;
+    // warm up caches, socket buffers and lazily created state
+    if (!body(100))
+    {
+        return result;
+    }
+    uint64_t n = 100;
+    while (true)
+    {
+        uint64_t allocs = g_allocs;
+        uint64_t syscalls = g_syscalls;
+        Clock::time_point begin = Clock::now();
+        if (!body(n))
+        {
+            return result;
+        }
+        double elapsed = std::chrono::duration<double>(Clock::now() - begin).count();
+        if (elapsed >= seconds || n >= (1ULL << 32))
+        {
+            result.iterations = n;
+            result.nsPerOp = elapsed * 1e9 / n;
+            result.opsPerSec = n / elapsed;
+            result.allocsPerOp = (double)(g_allocs - allocs) / n;
+            result.syscallsPerOp = (double)(g_syscalls - syscalls) / n;
+            result.ok = true;
+            return result;
+        }
+        // aim a bit past the target so the next run is the last one
+        double scale = elapsed > 0 ? seconds * 1.2 / elapsed : 10;
+        n = (uint64_t)(n * (scale < 10 ? (scale > 2 ? scale : 2) : 10));
+    }
+}
+
+static volatile size_t g_sink = 0;
+
+// Packet construction as done for every read
+static BenchResult benchPacket(double seconds)
+{
+    char buffer[64];
+    memset(buffer, 'x', sizeof(buffer));
+    return measure("packet_construct_64b", seconds, [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i)
+        {
+            PacketPtr data = std::make_shared<Packet>(7, std::string(buffer, sizeof(buffer)));
+            g_sink += data->message().size();
+        }
+        return true;
+    });
+}
+
+// histogram record of latency tracing
+static BenchResult benchHistogram(double seconds)
+{
+    LatencyHistogram histogram;
+    return measure("histogram_record", seconds, [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i)
+        {
+            histogram.record(i * 37);
+        }
+        return true;
+    });
+}
+
+// tasks posted from another thread: queue, wakeup and run
+static BenchResult benchPost(double seconds)
+{
+    EventLoop loop;
+    if (!loop.start())
+    {
+        return BenchResult();
+    }
+    std::atomic<uint64_t> done { 0 };
+    BenchResult result = measure("loop_post_task", seconds, [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i)
+        {
+            loop.post([&done]() { ++done; });
+        }
+        loop.runAndWait([]() {});
+        return true;
+    });
+    loop.stop();
+    return result;
+}
+
+// handler dispatch: 64 always readable level triggered eventfds, one epoll_wait returns all of them
+class CountingHandler : public EventHandler
+{
+public:
+    void handleEvent(uint32_t) override
+    { count.fetch_add(1, std::memory_order_relaxed); }
+    std::atomic<uint64_t> count { 0 };
+};
+
+static BenchResult benchDispatch(double seconds)
+{
+    const int kFds = 64;
+    EventLoop loop;
+    if (!loop.start())
+    {
+        return BenchResult();
+    }
+    CountingHandler handler;
+    std::vector<int> fds;
+    for (int i = 0; i < kFds; ++i)
+    {
+        int fd = eventfd(1, EFD_NONBLOCK);
+        fds.push_back(fd);
+        loop.addHandler(fd, EPOLLIN, &handler);
+    }
+    BenchResult result = measure("loop_dispatch_event", seconds, [&](uint64_t n) {
+        uint64_t target = handler.count + n;
+        while (handler.count < target)
+        {
+            std::this_thread::yield();
+        }
+        return true;
+    });
+    loop.runAndWait([&]() {
+        for (int fd : fds)
+        {
+            loop.removeHandler(fd);
+            ::close(fd);
+        }
+    });
+    loop.stop();
+    return result;
+}
+
+static bool recvFull(int fd, char* buf, size_t n)
+{
+    size_t got = 0;
+    while (got < n)
+    {
+        ssize_t r = ::recv(fd, buf + got, n - got, 0);
+        if (r <= 0)
+        {
+            return false;
+        }
+        got += r;
+    }
+    return true;
+}
+
+// one TcpConnection on a socketpair echoing 64 byte messages: read, Packet, callback, send
+static BenchResult benchConnEcho(double seconds)
+{
+    EventLoopPtr loop = std::make_shared<EventLoop>();
+    loop->start();
+    int sv[2];
+    socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv);
+    int client = sv[1];
+    int flags = 0;
+    ioctl(client, FIONBIO, &flags);
+    TcpConnectionPtr conn = std::make_shared<TcpConnection>(loop, sv[0]);
+    TcpConnection* raw = conn.get();
+    conn->setRecvCallback([raw](const PacketPtr& data) { raw->send(data->message()); });
+    conn->start();
+    char msg[64];
+    char buf[64];
+    memset(msg, 'x', sizeof(msg));
+    BenchResult result = measure("conn_echo_socketpair_64b", seconds, [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i)
+        {
+            if (::send(client, msg, sizeof(msg), 0) != sizeof(msg) || !recvFull(client, buf, sizeof(buf)))
+            {
+                return false;
+            }
+        }
+        return true;
+    });
+    conn->close();
+    loop->stop();
+    ::close(client);
+    return result;
+}
+
+// EpollTcpServer echo over loopback tcp: accept path excluded, per message cost of the full server
+static BenchResult benchServerEcho(double seconds)
+{
+    SocketAddress addr;
+    SocketAddress::parse("127.0.0.1", 16681, addr);
+    auto server = std::make_shared<EpollTcpServer>(addr);
+    EpollTcpServer* raw = server.get();
+    server->registerOnRecvCallback([raw](const PacketPtr& data) { raw->sendData(data); });
+    BenchResult result;
+    result.name = "server_echo_tcp_64b";
+    if (!server->start())
+    {
+        return result;
+    }
+    int client = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (::connect(client, addr.addr(), addr.length()) == 0)
+    {
+        int one = 1;
+        setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        char msg[64];
+        char buf[64];
+        memset(msg, 'x', sizeof(msg));
+        result = measure(result.name, seconds, [&](uint64_t n) {
+            for (uint64_t i = 0; i < n; ++i)
+            {
+                if (::send(client, msg, sizeof(msg), 0) != sizeof(msg) || !recvFull(client, buf, sizeof(buf)))
+                {
+                    return false;
+                }
+            }
+            return true;
+        });
+    }
+    ::close(client);
+    server->stop();
+    return result;
+}
+
+// EpollUdpServer echo of bursts of 32 datagrams: recvmmsg/sendmmsg batching per datagram
+static BenchResult benchUdpBurst(double seconds)
+{
+    const int kBurst = 32;
+    SocketAddress addr;
+    SocketAddress::parse("127.0.0.1", 16682, addr);
+    auto server = std::make_shared<EpollUdpServer>(addr);
+    EpollUdpServer* raw = server.get();
+    server->registerOnRecvCallback([raw](const PacketPtr& data) { raw->sendData(data); });
+    BenchResult result;
+    result.name = "server_echo_udp_burst32_64b";
+    if (!server->start())
+    {
+        return result;
+    }
+    int client = ::socket(AF_INET, SOCK_DGRAM, 0);
+    ::connect(client, addr.addr(), addr.length());
+    struct timeval tv = { 1, 0 };
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    char msg[64];
+    char buf[2048];
+    memset(msg, 'x', sizeof(msg));
+    // one operation is one datagram echoed
+    result = measure(result.name, seconds, [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; i += kBurst)
+        {
+            for (int k = 0; k < kBurst; ++k)
+            {
+                if (::send(client, msg, sizeof(msg), 0) != sizeof(msg))
+                {
+                    return false;
+                }
+            }
+            for (int k = 0; k < kBurst; ++k)
+            {
+                if (::recv(client, buf, sizeof(buf), 0) < 0)
+                {
+                    if (errno != EAGAIN && errno != EWOULDBLOCK)
+                    {
+                        // e.g. ECONNREFUSED: no server
+                        return false;
+                    }
+                    // lost under load, udp is best effort
+                    break;
+                }
+            }
+        }
+        return true;
+    });
+    ::close(client);
+    server->stop();
+    return result;
+}
+
+// EpollTcpServer publish of one 64 byte payload to 16 loopback subscribers, one operation is one publish
+// received by every subscriber
+static BenchResult benchPublishFanout(double seconds)
+{
+    const int kSubscribers = 16;
+    SocketAddress addr;
+    SocketAddress::parse("127.0.0.1", 16683, addr);
+    auto server = std::make_shared<EpollTcpServer>(addr);
+    EpollTcpServer* raw = server.get();
+    std::atomic<int> subscribed { 0 };
+    server->registerOnRecvCallback([raw, &subscribed](const PacketPtr& data) {
+        if (raw->subscribe(data->fd(), data->message()))
+        {
+            ++subscribed;
+        }
+    });
+    BenchResult result;
+    result.name = "server_publish_fanout16_64b";
+    if (!server->start())
+    {
+        return result;
+    }
+    std::vector<int> clients;
+    for (int i = 0; i < kSubscribers; ++i)
+    {
+        int client = ::socket(AF_INET, SOCK_STREAM, 0);
+        if (::connect(client, addr.addr(), addr.length()) != 0)
+        {
+            ::close(client);
+            break;
+        }
+        ::send(client, "ticks", 5, 0);
+        clients.push_back(client);
+    }
+    while (subscribed < (int)clients.size())
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    if (clients.size() == kSubscribers)
+    {
+        std::string msg(64, 'x');
+        PayloadPtr payload = std::make_shared<const std::string>(msg);
+        char buf[64];
+        result = measure(result.name, seconds, [&](uint64_t n) {
+            for (uint64_t i = 0; i < n; ++i)
+            {
+                raw->publish("ticks", payload);
+                for (int client : clients)
+                {
+                    if (!recvFull(client, buf, sizeof(buf)))
+                    {
+                        return false;
+                    }
+                }
+            }
+            return true;
+        });
+    }
+    for (int client : clients)
+    {
+        ::close(client);
+    }
+    server->stop();
+    return result;
+}
+
+// EpollTcpServer as load balancer in front of an echo backend, one operation is a 64 byte round trip
+// client -> balancer -> backend -> balancer -> client
+static BenchResult benchLbRelay(double seconds)
+{
+    SocketAddress backend_addr;
+    SocketAddress::parse("127.0.0.1", 16684, backend_addr);
+    SocketAddress addr;
+    SocketAddress::parse("127.0.0.1", 16685, addr);
+    auto backend = std::make_shared<EpollTcpServer>(backend_addr);
+    EpollTcpServer* raw = backend.get();
+    backend->registerOnRecvCallback([raw](const PacketPtr& data) { raw->sendData(data); });
+    auto balancer = std::make_shared<EpollTcpServer>(addr);
+    LoadBalancerConfig config;
+    config.backends.push_back(backend_addr);
+    balancer->setLoadBalancer(config);
+    BenchResult result;
+    result.name = "lb_relay_echo_tcp_64b";
+    if (!backend->start())
+    {
+        return result;
+    }
+    if (!balancer->start())
+    {
+        backend->stop();
+        return result;
+    }
+    int client = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (::connect(client, addr.addr(), addr.length()) == 0)
+    {
+        int one = 1;
+        setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        char msg[64];
+        char buf[64];
+        memset(msg, 'x', sizeof(msg));
+        result = measure(result.name, seconds, [&](uint64_t n) {
+            for (uint64_t i = 0; i < n; ++i)
+            {
+                if (::send(client, msg, sizeof(msg), 0) != sizeof(msg) || !recvFull(client, buf, sizeof(buf)))
+                {
+                    return false;
+                }
+            }
+            return true;
+        });
+    }
+    ::close(client);
+    balancer->stop();
+    backend->stop();
+    return result;
+}
+
+static std::string jsonEscape(const std::string& s)
+{
+    std::string out;
+    for (char c : s)
+    {
+        if (c == '"' || c == '\\')
+        {
+            out += '\\';
+        }
+        out += c;
+    }
+    return out;
+}
+
+static void writeJson(FILE* out, const std::string& label, const std::vector<BenchResult>& results)
+{
+    char date[64];
+    time_t now = time(nullptr);
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+    fprintf(out, "{\n  \"context\": {\"date\": \"%s\", \"label\": \"%s\", \"num_cpus\": %u},\n",
+            date, jsonEscape(label).c_str(), std::thread::hardware_concurrency());
+    fprintf(out, "  \"benchmarks\": [\n");
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        const BenchResult& r = results[i];
+        if (!r.ok)
+        {
+            fprintf(out, "    {\"name\": \"%s\", \"error_occurred\": true, \"error_message\": \"failed\"}%s\n",
+                    jsonEscape(r.name).c_str(), i + 1 < results.size() ? "," : "");
+            continue;
+        }
+        fprintf(out, "    {\"name\": \"%s\", \"iterations\": %llu, \"ns_per_op\": %.2f, \"ops_per_sec\": %.1f, "
+                "\"allocs_per_op\": %.3f, \"syscalls_per_op\": %.3f}%s\n",
+                jsonEscape(r.name).c_str(), (unsigned long long)r.iterations, r.nsPerOp, r.opsPerSec,
+                r.allocsPerOp, r.syscallsPerOp, i + 1 < results.size() ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+}
+
+int main(int argc, char* argv[])
+{
+    std::string filter;
+    std::string json_path;
+    std::string label;
+    double seconds = 0.5;
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        std::string key = argv[i];
+        if (key == "--filter")
+        {
+            filter = argv[i + 1];
+        }
+        else if (key == "--seconds")
+        {
+            seconds = std::atof(argv[i + 1]);
+        }
+        else if (key == "--json")
+        {
+            json_path = argv[i + 1];
+        }
+        else if (key == "--label")
+        {
+            label = argv[i + 1];
+        }
+    }
+
+
+    std::vector<std::pair<std::string, std::function<BenchResult(double)>>> cases = {
+        { "packet_construct_64b", benchPacket },
+        { "histogram_record", benchHistogram },
+        { "loop_post_task", benchPost },
+        { "loop_dispatch_event", benchDispatch },
+        { "conn_echo_socketpair_64b", benchConnEcho },
+        { "server_echo_tcp_64b", benchServerEcho },
+        { "server_echo_udp_burst32_64b", benchUdpBurst },
+        { "server_publish_fanout16_64b", benchPublishFanout },
+        { "lb_relay_echo_tcp_64b", benchLbRelay },
+    };
+
+    std::vector<BenchResult> results;
+    bool failed = false;
+    FILE* table = (json_path == "-") ? stderr : stdout;
+    fprintf(table, "%-30s %12s %12s %14s %10s %12s\n", "benchmark", "iterations", "ns/op", "ops/s", "allocs/op", "syscalls/op");
+    for (const auto& c : cases)
+    {
+        if (!filter.empty() && c.first.find(filter) == std::string::npos)
+        {
+            continue;
+        }
+        BenchResult r = c.second(seconds);
+        if (r.name.empty())
+        {
+            r.name = c.first;
+        }
+        if (!r.ok)
+        {
+            fprintf(table, "%-30s %12s\n", r.name.c_str(), "FAILED");
+            failed = true;
+        }
+        else
+        {
+            fprintf(table, "%-30s %12llu %12.1f %14.0f %10.2f %12.2f\n", r.name.c_str(),
+                    (unsigned long long)r.iterations, r.nsPerOp, r.opsPerSec, r.allocsPerOp, r.syscallsPerOp);
+        }
+        results.push_back(r);
+    }
+
+    if (!json_path.empty())
+    {
+        FILE* out = (json_path == "-") ? stdout : fopen(json_path.c_str(), "w");
+        if (!out)
+        {
+            fprintf(stderr, "open %s failed!\n", json_path.c_str());
+            return 1;
+        }
+        writeJson(out, label, results);
+        if (out != stdout)
+        {
+            fclose(out);
+        }
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,223 @@
+/********************************************************************************
+  > FileName:	RpcBench.cpp
+  > Author:	Mingping Zhang
+  > Email:	mingpingzhang@163.com
+  > Create Time:	Wed Apr 12 16:31:09 2023
+ ********************************************************************************/
+
+// pipelined calls of RpcClient over one loopback connection to an echo EpollTcpServer(it returns every frame
+// as its own reply): calls per second and call latency with a window of 1 .. 4096 requests in flight, kept
+// full from the completion callbacks; futures from another thread; and deadlines against a server that
+// never answers(how late the timeouts fire)
+//   usage: ./rpc_bench [seconds] [request_bytes]
+
+#include "EpollTcpServer.h"
+#include "LatencyHistogram.h"
+#include "RpcClient.h"
+#include "SocketAddress.h"
+#include "TimeUtil.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+// keeps window calls outstanding until stop, loop thread after start
+class ClosedLoop
+{
+public:
+    ClosedLoop(RpcClient& client, const std::string& request)
+        : client_(client),
+          request_(request)
+    {
+    }
+
+    void start(size_t window)
+    {
+        for (size_t i = 0; i < window; ++i)
+        {
+            issue();
+        }
+    }
+
+    void stop()
+    { stop_ = true; }
+
+    // calls issued and still outstanding
+    uint64_t outstanding() const
+    { return issued_.load() - done_.load(); }
+
+    LatencyHistogram latency;
+    std::atomic<uint64_t> ok { 0 };
+    std::atomic<uint64_t> failed { 0 };
+
+private:
+    void issue()
+    {
+        uint64_t begin = monotonicNs();
+        issued_.fetch_add(1);
+        client_.call(request_, [this, begin](RpcStatus status, std::string&& reply) {
+            if (status == RpcStatus::kOk && reply.size() == request_.size())
+            {
+                latency.record(monotonicNs() - begin);
+                ok.fetch_add(1, std::memory_order_relaxed);
+            }
+            else
+            {
+                failed.fetch_add(1, std::memory_order_relaxed);
+            }
+            done_.fetch_add(1);
+            if (!stop_)
+            {
+                issue();
+            }
+        });
+    }
+
+    RpcClient& client_;
+    std::string request_;
+    std::atomic<bool> stop_ { false };
+    std::atomic<uint64_t> issued_ { 0 };
+    std::atomic<uint64_t> done_ { 0 };
+};
+
+static std::shared_ptr<EpollTcpServer> startServer(const SocketAddress& addr, bool echo)
+{
+    auto server = std::make_shared<EpollTcpServer>(addr);
+    EpollTcpServer* raw = server.get();
+    server->registerOnRecvCallback([raw, echo](const PacketPtr& data) {
+        if (echo)
+        {
+            raw->sendData(data);
+        }
+    });
+    return server->start() ? server : nullptr;
+}
+
+int main(int argc, char* argv[])
+{
+    double seconds = argc >= 2 ? std::atof(argv[1]) : 1.0;
+    size_t request_bytes = argc >= 3 ? std::strtoul(argv[2], nullptr, 10) : 64;
+    std::string request(request_bytes, 'r');
+
+
+    SocketAddress addr;
+    SocketAddress::parse("127.0.0.1", 16691, addr);
+    auto server = startServer(addr, true);
+    if (!server)
+    {
+        return 1;
+    }
+
+    printf("%zu byte requests, one connection, %.1fs per window\n", request_bytes, seconds);
+    printf("%-8s %12s %10s %10s %10s %8s\n", "window", "calls/s", "p50_us", "p99_us", "max_us", "failed");
+    const size_t windows[] = { 1, 16, 256, 4096 };
+    for (size_t window : windows)
+    {
+        RpcClient client(addr);
+        RpcConfig config;
+        config.window = window;
+        client.setConfig(config);
+        if (!client.start())
+        {
+            return 1;
+        }
+        ClosedLoop driver(client, request);
+        // the first calls from the loop thread, the rest follow from the callbacks there
+        client.transport().loop()->runAndWait([&driver, window]() { driver.start(window); });
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        driver.latency.reset();
+        uint64_t ok_before = driver.ok.load();
+        uint64_t begin = monotonicNs();
+        std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+        double elapsed = (monotonicNs() - begin) / 1e9;
+        uint64_t ok = driver.ok.load() - ok_before;
+        driver.stop();
+        while (driver.outstanding() > 0)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        printf("%-8zu %12.0f %10.1f %10.1f %10.1f %8llu\n", window, ok / elapsed,
+            driver.latency.percentile(50) / 1e3, driver.latency.percentile(99) / 1e3,
+            driver.latency.percentile(100) / 1e3, (unsigned long long)driver.failed.load());
+        client.stop();
+    }
+
+    // futures from this thread, handed to the loop in batches
+    {
+        RpcClient client(addr);
+        RpcConfig config;
+        config.window = 1024;
+        client.setConfig(config);
+        if (!client.start())
+        {
+            return 1;
+        }
+        const size_t total = 100000;
+        const size_t batch = 1000;
+        size_t ok = 0;
+        uint64_t begin = monotonicNs();
+        std::vector<std::future<RpcResult>> futures;
+        futures.reserve(batch);
+        for (size_t n = 0; n < total; n += batch)
+        {
+            for (size_t i = 0; i < batch; ++i)
+            {
+                futures.push_back(client.callFuture(request));
+            }
+            for (auto& f : futures)
+            {
+                ok += f.get().status == RpcStatus::kOk;
+            }
+            futures.clear();
+        }
+        double elapsed = (monotonicNs() - begin) / 1e9;
+        printf("futures: %zu calls in batches of %zu, %.0f calls/s, %zu ok\n", total, batch, total / elapsed, ok);
+        client.stop();
+    }
+
+    // deadlines: nothing is ever answered
+    {
+        SocketAddress sink_addr;
+        SocketAddress::parse("127.0.0.1", 16692, sink_addr);
+        auto sink = startServer(sink_addr, false);
+        RpcClient client(sink_addr);
+        RpcConfig config;
+        config.window = 256; // the rest wait, their deadline counts from call()
+        client.setConfig(config);
+        if (!sink || !client.start())
+        {
+            return 1;
+        }
+        const size_t total = 2000;
+        const uint64_t timeout_ms = 50;
+        LatencyHistogram lateness;
+        std::atomic<size_t> timeouts { 0 };
+        std::atomic<size_t> done { 0 };
+        for (size_t i = 0; i < total; ++i)
+        {
+            uint64_t deadline = monotonicNs() + timeout_ms * 1000000ULL;
+            client.call(request, [&, deadline](RpcStatus status, std::string&&) {
+                uint64_t now = monotonicNs();
+                lateness.record(now > deadline ? now - deadline : 0);
+                timeouts += status == RpcStatus::kTimeout;
+                ++done;
+            }, timeout_ms);
+        }
+        while (done.load() < total)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        printf("deadlines: %zu calls of %llums to a silent server, %zu timed out, late by %s\n", total,
+            (unsigned long long)timeout_ms, timeouts.load(), lateness.summary().c_str());
+        client.stop();
+        sink->stop();
+    }
+    server->stop();
+    return 0;
+}
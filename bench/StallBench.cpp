@@ -0,0 +1,181 @@
+/********************************************************************************
+  > FileName:	StallBench.cpp
+  > Author:	Mingping Zhang
+  > Email:	mingpingzhang@163.com
+  > Create Time:	Thu Apr 13 14:52:16 2023
+ ********************************************************************************/
+
+// LoopWatchdog against an echo EpollTcpServer whose receive callback blocks on a "slow" request: the stall
+// report(stage, handler, fd and the loop thread's stack), the loop's busy time per iteration, and what the
+// per iteration tracking costs the echo round trip(one blocking client, tracking off vs on)
+//   usage: ./stall_bench [seconds] [stall_ms]
+
+#include "EpollTcpServer.h"
+#include "LatencyHistogram.h"
+#include "LoopWatchdog.h"
+#include "SocketAddress.h"
+#include "TimeUtil.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+static uint64_t g_stall_ms = 250;
+
+// stands for a synchronous lookup done on the loop thread, out of line and exported to be named in the stack
+__attribute__((noinline)) void blockingLookup()
+{
+    std::this_thread::sleep_for(std::chrono::milliseconds(g_stall_ms));
+}
+
+static int connectTo(uint16_t port)
+{
+    int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in dst;
+    memset(&dst, 0, sizeof(dst));
+    dst.sin_family = AF_INET;
+    dst.sin_port = htons(port);
+    dst.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (fd < 0 || ::connect(fd, (struct sockaddr*)&dst, sizeof(dst)) != 0)
+    {
+        if (fd >= 0)
+        {
+            ::close(fd);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+// one request, wait for the whole echo
+static bool roundTrip(int fd, const char* message, size_t len)
+{
+    if (::write(fd, message, len) != (ssize_t)len)
+    {
+        return false;
+    }
+    char buffer[256];
+    size_t got = 0;
+    while (got < len)
+    {
+        ssize_t r = ::read(fd, buffer, sizeof(buffer));
+        if (r <= 0)
+        {
+            return false;
+        }
+        got += r;
+    }
+    return true;
+}
+
+// echo round trips for seconds, round trips per second
+static double echoRate(int fd, double seconds, LatencyHistogram& latency)
+{
+    const char message[] = "ping ping ping ping ping ping ping";
+    uint64_t begin = monotonicNs();
+    uint64_t end = begin + (uint64_t)(seconds * 1e9);
+    uint64_t count = 0;
+    uint64_t now = begin;
+    while (now < end)
+    {
+        if (!roundTrip(fd, message, sizeof(message) - 1))
+        {
+            return 0;
+        }
+        uint64_t done = monotonicNs();
+        latency.record(done - now);
+        now = done;
+        ++count;
+    }
+    return count / ((now - begin) / 1e9);
+}
+
+int main(int argc, char* argv[])
+{
+    double seconds = argc >= 2 ? std::atof(argv[1]) : 1.0;
+    g_stall_ms = argc >= 3 ? std::strtoul(argv[2], nullptr, 10) : 250;
+
+
+    SocketAddress addr;
+    SocketAddress::parse("127.0.0.1", 16711, addr);
+    auto server = std::make_shared<EpollTcpServer>(addr);
+    EpollTcpServer* raw = server.get();
+    server->registerOnRecvCallback([raw](const PacketPtr& data) {
+        if (data->message().compare(0, 4, "slow") == 0)
+        {
+            blockingLookup();
+        }
+        raw->sendData(data);
+    });
+    if (!server->start())
+    {
+        return 1;
+    }
+    int fd = connectTo(16711);
+    if (fd < 0)
+    {
+        return 1;
+    }
+
+    printf("echo round trips, one blocking client, %.1fs each\n", seconds);
+    printf("%-10s %12s %10s %10s\n", "tracking", "trips/s", "p50_us", "p99_us");
+    LatencyHistogram off_latency;
+    double off_rate = echoRate(fd, seconds, off_latency);
+    printf("%-10s %12.0f %10.1f %10.1f\n", "off", off_rate, off_latency.percentile(50) / 1e3,
+        off_latency.percentile(99) / 1e3);
+
+    WatchdogConfig config;
+    config.stallMs = 100;
+    LoopWatchdog watchdog(config);
+    std::mutex reports_mutex;
+    std::vector<StallReport> reports;
+    watchdog.setReportCallback([&](const StallReport& report) {
+        std::lock_guard<std::mutex> lock(reports_mutex);
+        reports.push_back(report);
+    });
+    watchdog.watch(server->loop(), "server");
+    if (!watchdog.start())
+    {
+        return 1;
+    }
+    LatencyHistogram on_latency;
+    double on_rate = echoRate(fd, seconds, on_latency);
+    printf("%-10s %12.0f %10.1f %10.1f\n", "on", on_rate, on_latency.percentile(50) / 1e3,
+        on_latency.percentile(99) / 1e3);
+
+    // one request blocking the loop for stall_ms
+    const char slow[] = "slow request";
+    uint64_t begin = monotonicNs();
+    bool answered = roundTrip(fd, slow, sizeof(slow) - 1);
+    printf("\nslow request answered %s after %.1f ms, watchdog threshold %llu ms\n", answered ? "yes" : "no",
+        (monotonicNs() - begin) / 1e6, (unsigned long long)config.stallMs);
+    // the report is taken while the loop is still blocked
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    {
+        std::lock_guard<std::mutex> lock(reports_mutex);
+        printf("%llu stall(s) reported\n", (unsigned long long)watchdog.stalls());
+        for (const StallReport& report : reports)
+        {
+            printf("%s\n", report.toString().c_str());
+        }
+    }
+    printf("\nbusy time per loop iteration: %s\n", server->loop()->activity().busyNs.summary().c_str());
+
+    watchdog.stop();
+    ::close(fd);
+    server->stop();
+    return 0;
+}
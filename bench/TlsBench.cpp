@@ -0,0 +1,263 @@
+/********************************************************************************
+  > FileName:	TlsBench.cpp
+  > Author:	Mingping Zhang
+  > Email:	mingpingzhang@163.com
+  > Create Time:	Fri Mar 24 11:05:47 2023
+ ********************************************************************************/
+
+// tls echo benchmark of EpollTcpServer: plaintext vs userspace tls vs kernel tls(ktls) offload
+//   usage: ./tls_bench [round_trips] [throughput_mbytes]
+
+#include "EpollTcpServer.h"
+#include "SocketAddress.h"
+#include "TlsContext.h"
+#include <openssl/ssl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+struct BenchCase
+{
+    const char* name;
+    bool tls;
+    bool ktls;
+    bool tls12; // openssl 3.0 offloads tls1.3 transmit only, tls1.2 in both directions
+};
+
+struct BenchResult
+{
+    double rtt_avg_us { 0 };
+    double rtt_p99_us { 0 };
+    double mbytes_per_sec { 0 };
+    bool ktls_tx { false };
+    bool ktls_rx { false };
+    std::string cipher;
+};
+
+// blocking client side of one connection, plaintext when ssl is nullptr
+class BenchConn
+{
+public:
+    BenchConn(int fd, SSL* ssl) : fd_(fd), ssl_(ssl) {}
+    ~BenchConn()
+    {
+        SSL_free(ssl_);
+        ::close(fd_);
+    }
+
+    ssize_t write(const char* buf, size_t len)
+    {
+        if (!ssl_)
+        {
+            return ::write(fd_, buf, len);
+        }
+        int r = SSL_write(ssl_, buf, len);
+        return r > 0 ? r : -1;
+    }
+
+    ssize_t read(char* buf, size_t len)
+    {
+        if (!ssl_)
+        {
+            return ::read(fd_, buf, len);
+        }
+        while (true)
+        {
+            int r = SSL_read(ssl_, buf, len);
+            // tls1.3 session tickets are consumed without application data
+            if (r <= 0 && SSL_get_error(ssl_, r) == SSL_ERROR_WANT_READ)
+            {
+                continue;
+            }
+            return r > 0 ? r : -1;
+        }
+    }
+
+    bool readFull(char* buf, size_t n)
+    {
+        size_t got = 0;
+        while (got < n)
+        {
+            ssize_t r = read(buf + got, n - got);
+            if (r <= 0)
+            {
+                return false;
+            }
+            got += r;
+        }
+        return true;
+    }
+
+private:
+    int fd_;
+    SSL* ssl_;
+};
+
+static int connectTo(const SocketAddress& addr)
+{
+    int fd = ::socket(addr.family(), SOCK_STREAM, 0);
+    for (int i = 0; fd >= 0 && i < 100; ++i)
+    {
+        if (::connect(fd, addr.addr(), addr.length()) == 0)
+        {
+            return fd;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    if (fd >= 0)
+    {
+        ::close(fd);
+    }
+    return -1;
+}
+
+static bool measure(BenchConn& conn, int round_trips, size_t total_bytes, BenchResult& result)
+{
+    // ping-pong small messages, one in flight
+    std::string msg(64, 'x');
+    std::vector<char> buf(64 * 1024);
+    std::vector<double> samples;
+    samples.reserve(round_trips);
+    for (int i = 0; i < round_trips; ++i)
+    {
+        auto begin = Clock::now();
+        if (conn.write(msg.data(), msg.size()) != (ssize_t)msg.size() || !conn.readFull(buf.data(), msg.size()))
+        {
+            return false;
+        }
+        samples.push_back(std::chrono::duration<double, std::micro>(Clock::now() - begin).count());
+    }
+    std::sort(samples.begin(), samples.end());
+    double sum = 0;
+    for (double s : samples)
+    {
+        sum += s;
+    }
+    result.rtt_avg_us = sum / samples.size();
+    result.rtt_p99_us = samples[samples.size() * 99 / 100];
+
+    // bulk stream with a bounded window in flight
+    const size_t kChunk = 16 * 1024;
+    const size_t kWindow = 64 * 1024;
+    std::string chunk(kChunk, 'y');
+    size_t sent = 0;
+    size_t received = 0;
+    auto begin = Clock::now();
+    while (received < total_bytes)
+    {
+        if (sent < total_bytes && sent - received + kChunk <= kWindow)
+        {
+            ssize_t w = conn.write(chunk.data(), std::min(kChunk, total_bytes - sent));
+            if (w <= 0)
+            {
+                return false;
+            }
+            sent += w;
+            continue;
+        }
+        ssize_t r = conn.read(buf.data(), buf.size());
+        if (r <= 0)
+        {
+            return false;
+        }
+        received += r;
+    }
+    double secs = std::chrono::duration<double>(Clock::now() - begin).count();
+    result.mbytes_per_sec = total_bytes / secs / (1024.0 * 1024.0);
+    return true;
+}
+
+static bool runCase(const BenchCase& c, const SocketAddress& addr, int round_trips, size_t total_bytes, BenchResult& result)
+{
+    auto server = std::make_shared<EpollTcpServer>(addr);
+    TlsContextPtr client_ctx;
+    if (c.tls)
+    {
+        TlsContextPtr server_ctx = TlsContext::createSelfSignedServer("localhost");
+        client_ctx = TlsContext::createClient("", "localhost");
+        if (!server_ctx || !client_ctx)
+        {
+            return false;
+        }
+        server_ctx->setKtlsEnabled(c.ktls);
+        server_ctx->setMaxTls12(c.tls12);
+        client_ctx->setKtlsEnabled(c.ktls);
+        server->setTlsContext(server_ctx);
+    }
+    server->registerOnRecvCallback([&server](const PacketPtr& data) { server->sendData(data); });
+    if (!server->start())
+    {
+        return false;
+    }
+
+    bool ok = false;
+    int fd = connectTo(addr);
+    if (fd >= 0)
+    {
+        SSL* ssl = nullptr;
+        if (client_ctx)
+        {
+            ssl = SSL_new(client_ctx->native());
+            SSL_set_fd(ssl, fd);
+            // blocking socket: openssl retries internally, handshake completes or fails here
+            SSL_set_mode(ssl, SSL_MODE_AUTO_RETRY);
+        }
+        BenchConn conn(fd, ssl);
+        if (!ssl || SSL_connect(ssl) == 1)
+        {
+            if (ssl)
+            {
+#ifdef BIO_get_ktls_send
+                result.ktls_tx = BIO_get_ktls_send(SSL_get_wbio(ssl));
+                result.ktls_rx = BIO_get_ktls_recv(SSL_get_rbio(ssl));
+#endif
+                result.cipher = std::string(SSL_get_version(ssl)) + " " + SSL_get_cipher_name(ssl);
+            }
+            ok = measure(conn, round_trips, total_bytes, result);
+        }
+    }
+    // joins the loop thread
+    server->stop();
+    return ok;
+}
+
+int main(int argc, char* argv[])
+{
+    int round_trips = argc >= 2 ? std::atoi(argv[1]) : 10000;
+    size_t total_bytes = (argc >= 3 ? std::atoi(argv[2]) : 256) * 1024UL * 1024UL;
+
+    const BenchCase cases[] = {
+        { "plaintext", false, false, false },
+        { "tls-userspace", true, false, false },
+        { "tls-ktls", true, true, false },
+        { "tls1.2-ktls", true, true, true },
+    };
+
+
+    printf("%-16s %12s %12s %10s %8s %8s  %s\n", "case", "rtt_avg_us", "rtt_p99_us", "MB/s", "ktls_tx", "ktls_rx", "cipher");
+    uint16_t port = 16670;
+    for (const BenchCase& c : cases)
+    {
+        SocketAddress addr;
+        SocketAddress::parse("127.0.0.1", port++, addr);
+        BenchResult result;
+        if (!runCase(c, addr, round_trips, total_bytes, result))
+        {
+            printf("%-16s %12s\n", c.name, "failed");
+            continue;
+        }
+        printf("%-16s %12.2f %12.2f %10.1f %8d %8d  %s\n", c.name, result.rtt_avg_us, result.rtt_p99_us,
+                result.mbytes_per_sec, result.ktls_tx, result.ktls_rx, result.cipher.c_str());
+    }
+    return 0;
+}
@@ -0,0 +1,193 @@
+/********************************************************************************
+  > FileName:	TransportBench.cpp
+  > Author:	Mingping Zhang
+  > Email:	mingpingzhang@163.com
+  > Create Time:	Mon Mar 20 14:21:05 2023
+ ********************************************************************************/
+
+// echo benchmark of the same EpollTcpServer over loopback tcp, loopback tcp6 and unix domain socket
+//   usage: ./transport_bench [round_trips] [throughput_mbytes] [trace]
+//   trace: enable server latency tracing and print where the ping-pong round trips spent their time
+
+#include "EpollTcpServer.h"
+#include "SocketAddress.h"
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+struct BenchResult
+{
+    double rtt_avg_us { 0 };
+    double rtt_p50_us { 0 };
+    double rtt_p99_us { 0 };
+    double mbytes_per_sec { 0 };
+    std::string stages; // server latency stages of the ping-pong phase, when traced
+};
+
+static int connectTo(const SocketAddress& addr)
+{
+    int fd = ::socket(addr.family(), SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    // the server may still be starting its loop
+    for (int i = 0; i < 100; ++i)
+    {
+        if (::connect(fd, addr.addr(), addr.length()) == 0)
+        {
+            return fd;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    ::close(fd);
+    return -1;
+}
+
+// read exactly n bytes, return false on error or eof
+static bool readFull(int fd, char* buf, size_t n)
+{
+    size_t got = 0;
+    while (got < n)
+    {
+        ssize_t r = ::read(fd, buf + got, n - got);
+        if (r <= 0)
+        {
+            return false;
+        }
+        got += r;
+    }
+    return true;
+}
+
+// ping-pong small messages, one in flight
+static bool measureLatency(int fd, int round_trips, BenchResult& result)
+{
+    std::string msg(64, 'x');
+    std::vector<char> buf(msg.size());
+    std::vector<double> samples;
+    samples.reserve(round_trips);
+    for (int i = 0; i < round_trips; ++i)
+    {
+        auto begin = Clock::now();
+        if (::write(fd, msg.data(), msg.size()) != (ssize_t)msg.size() || !readFull(fd, buf.data(), buf.size()))
+        {
+            return false;
+        }
+        samples.push_back(std::chrono::duration<double, std::micro>(Clock::now() - begin).count());
+    }
+    std::sort(samples.begin(), samples.end());
+    double sum = 0;
+    for (double s : samples)
+    {
+        sum += s;
+    }
+    result.rtt_avg_us = sum / samples.size();
+    result.rtt_p50_us = samples[samples.size() / 2];
+    result.rtt_p99_us = samples[samples.size() * 99 / 100];
+    return true;
+}
+
+// stream bulk data keeping a bounded window in flight, the echo server drops data when its send buffer is full
+static bool measureThroughput(int fd, size_t total_bytes, BenchResult& result)
+{
+    const size_t kChunk = 16 * 1024;
+    const size_t kWindow = 64 * 1024;
+    std::string chunk(kChunk, 'y');
+    std::vector<char> buf(kWindow);
+    size_t sent = 0;
+    size_t received = 0;
+    auto begin = Clock::now();
+    while (received < total_bytes)
+    {
+        if (sent < total_bytes && sent - received + kChunk <= kWindow)
+        {
+            ssize_t w = ::write(fd, chunk.data(), std::min(kChunk, total_bytes - sent));
+            if (w <= 0)
+            {
+                return false;
+            }
+            sent += w;
+            continue;
+        }
+        ssize_t r = ::read(fd, buf.data(), buf.size());
+        if (r <= 0)
+        {
+            return false;
+        }
+        received += r;
+    }
+    double secs = std::chrono::duration<double>(Clock::now() - begin).count();
+    result.mbytes_per_sec = total_bytes / secs / (1024.0 * 1024.0);
+    return true;
+}
+
+static bool runTransport(const SocketAddress& addr, int round_trips, size_t total_bytes, bool trace, BenchResult& result)
+{
+    auto server = std::make_shared<EpollTcpServer>(addr);
+    server->setLatencyTracing(trace);
+    server->registerOnRecvCallback([&server](const PacketPtr& data) { server->sendData(data); });
+    if (!server->start())
+    {
+        return false;
+    }
+    bool ok = false;
+    int fd = connectTo(addr);
+    if (fd >= 0)
+    {
+        ok = measureLatency(fd, round_trips, result);
+        if (ok && trace)
+        {
+            result.stages = server->latencyStats().toString();
+        }
+        ok = ok && measureThroughput(fd, total_bytes, result);
+        ::close(fd);
+    }
+    // joins the loop thread
+    server->stop();
+    return ok;
+}
+
+int main(int argc, char* argv[])
+{
+    int round_trips = argc >= 2 ? std::atoi(argv[1]) : 20000;
+    size_t total_bytes = (argc >= 3 ? std::atoi(argv[2]) : 512) * 1024UL * 1024UL;
+    bool trace = (argc >= 4 && std::string(argv[3]) == "trace");
+
+    std::vector<std::pair<std::string, uint16_t>> transports = {
+        { "127.0.0.1", 16661 },
+        { "::1", 16662 },
+        { "unix:@epoll_examples_bench", 0 },
+    };
+
+
+    printf("%-30s %12s %12s %12s %12s\n", "transport", "rtt_avg_us", "rtt_p50_us", "rtt_p99_us", "MB/s");
+    for (const auto& t : transports)
+    {
+        SocketAddress addr;
+        if (!SocketAddress::parse(t.first, t.second, addr))
+        {
+            continue;
+        }
+        BenchResult result;
+        if (!runTransport(addr, round_trips, total_bytes, trace, result))
+        {
+            printf("%-30s %12s\n", addr.toString().c_str(), "failed");
+            continue;
+        }
+        printf("%-30s %12.2f %12.2f %12.2f %12.1f\n", addr.toString().c_str(),
+                result.rtt_avg_us, result.rtt_p50_us, result.rtt_p99_us, result.mbytes_per_sec);
+        printf("%s", result.stages.c_str());
+    }
+    return 0;
+}
@@ -0,0 +1,306 @@
+/********************************************************************************
+  > FileName:	TriggerBench.cpp
+  > Author:	Mingping Zhang
+  > Email:	mingpingzhang@163.com
+  > Create Time:	Fri Apr  7 09:52:18 2023
+ ********************************************************************************/
+
+// echo throughput and fairness of EpollTcpServer per epoll trigger mode and dispatch thread count:
+// heavy connections keep a window of big messages in flight, light connections ping-pong small ones.
+// fairness is jain's index over the bytes of the heavy connections(1.0: all served equally), the light
+// round trips show how long a small request waits behind the heavy ones
+//   usage: ./trigger_bench [seconds] [heavy_connections] [light_connections]
+
+#include "EpollTcpServer.h"
+#include "LatencyHistogram.h"
+#include "SocketAddress.h"
+#include "TimeUtil.h"
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+// one client connection driven by a ClientGroup
+struct BenchConn
+{
+    int fd { -1 };
+    size_t sendOffset { 0 };   // bytes of the current message written
+    size_t recvBytes { 0 };    // bytes of the oldest outstanding message echoed
+    uint32_t outstanding { 0 }; // messages started and not completely echoed
+    std::deque<uint64_t> sentNs;
+    bool wantWrite { false };  // EPOLLOUT registered
+};
+
+// connections sending messages of one size with a window, driven by one thread with its own epoll
+class ClientGroup
+{
+public:
+    ClientGroup(size_t message_size, uint32_t window)
+        : message_(message_size, 'x'),
+          window_(window),
+          buffer_(256 * 1024)
+    {
+    }
+
+    ~ClientGroup()
+    {
+        for (auto& c : conns_)
+        {
+            ::close(c.fd);
+        }
+        if (efd_ >= 0)
+        {
+            ::close(efd_);
+        }
+    }
+
+    bool connect(const SocketAddress& addr, size_t count)
+    {
+        efd_ = epoll_create1(EPOLL_CLOEXEC);
+        conns_.resize(count);
+        completed_.reset(new std::atomic<uint64_t>[count]);
+        baseline_.assign(count, 0);
+        for (size_t i = 0; i < count; ++i)
+        {
+            int fd = ::socket(addr.family(), SOCK_STREAM, 0);
+            if (fd < 0 || ::connect(fd, addr.addr(), addr.length()) != 0)
+            {
+                return false;
+            }
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+            conns_[i].fd = fd;
+            completed_[i] = 0;
+            struct epoll_event ev = {0};
+            ev.events = EPOLLIN;
+            ev.data.u64 = i;
+            epoll_ctl(efd_, EPOLL_CTL_ADD, fd, &ev);
+        }
+        return true;
+    }
+
+    // drive the connections until stop is set
+    void run(const std::atomic<bool>& stop)
+    {
+        for (size_t i = 0; i < conns_.size(); ++i)
+        {
+            fill(i);
+        }
+        std::vector<struct epoll_event> events(64);
+        while (!stop.load(std::memory_order_relaxed))
+        {
+            int n = epoll_wait(efd_, events.data(), events.size(), 10);
+            for (int k = 0; k < n; ++k)
+            {
+                size_t i = events[k].data.u64;
+                if (events[k].events & EPOLLIN)
+                {
+                    drain(i);
+                }
+                fill(i);
+            }
+        }
+    }
+
+    // start of the measurement, called while running
+    void reset()
+    {
+        for (size_t i = 0; i < conns_.size(); ++i)
+        {
+            baseline_[i] = completed_[i].load(std::memory_order_relaxed);
+        }
+        rtt_.reset();
+    }
+
+    // messages completed by connection i since reset()
+    uint64_t completed(size_t i) const
+    { return completed_[i].load(std::memory_order_relaxed) - baseline_[i]; }
+
+    uint64_t bytes() const
+    {
+        uint64_t total = 0;
+        for (size_t i = 0; i < conns_.size(); ++i)
+        {
+            total += completed(i) * message_.size();
+        }
+        return total;
+    }
+
+    // jain's fairness index of the completed messages per connection
+    double fairness() const
+    {
+        double sum = 0;
+        double squares = 0;
+        for (size_t i = 0; i < conns_.size(); ++i)
+        {
+            double x = completed(i);
+            sum += x;
+            squares += x * x;
+        }
+        return squares == 0 ? 0 : sum * sum / (conns_.size() * squares);
+    }
+
+    const LatencyHistogram& rtt() const
+    { return rtt_; }
+
+private:
+    // start messages up to the window
+    void fill(size_t i)
+    {
+        BenchConn& c = conns_[i];
+        while (c.outstanding < window_ || c.sendOffset > 0)
+        {
+            ssize_t w = ::write(c.fd, message_.data() + c.sendOffset, message_.size() - c.sendOffset);
+            if (w <= 0)
+            {
+                break;
+            }
+            if (c.sendOffset == 0)
+            {
+                ++c.outstanding;
+                c.sentNs.push_back(monotonicNs());
+            }
+            c.sendOffset += w;
+            if (c.sendOffset == message_.size())
+            {
+                c.sendOffset = 0;
+            }
+        }
+        bool want_write = c.sendOffset > 0 || c.outstanding < window_;
+        if (want_write != c.wantWrite)
+        {
+            c.wantWrite = want_write;
+            struct epoll_event ev = {0};
+            ev.events = EPOLLIN | (want_write ? EPOLLOUT : 0);
+            ev.data.u64 = i;
+            epoll_ctl(efd_, EPOLL_CTL_MOD, c.fd, &ev);
+        }
+    }
+
+    // count echoed messages
+    void drain(size_t i)
+    {
+        BenchConn& c = conns_[i];
+        ssize_t r;
+        while ((r = ::read(c.fd, buffer_.data(), buffer_.size())) > 0)
+        {
+            c.recvBytes += r;
+            while (c.recvBytes >= message_.size() && c.outstanding > 0)
+            {
+                c.recvBytes -= message_.size();
+                --c.outstanding;
+                completed_[i].fetch_add(1, std::memory_order_relaxed);
+                rtt_.record(monotonicNs() - c.sentNs.front());
+                c.sentNs.pop_front();
+            }
+        }
+    }
+
+    std::string message_;
+    uint32_t window_;
+    std::vector<char> buffer_;
+    int efd_ { -1 };
+    std::vector<BenchConn> conns_;
+    std::unique_ptr<std::atomic<uint64_t>[]> completed_; // read by the measuring thread
+    std::vector<uint64_t> baseline_;
+    LatencyHistogram rtt_;
+};
+
+struct TriggerResult
+{
+    double mbytesPerSec { 0 };
+    double heavyFairness { 0 };
+    double lightPerSec { 0 };
+    uint64_t lightP50 { 0 };
+    uint64_t lightP99 { 0 };
+};
+
+static bool runMode(TriggerMode mode, size_t threads, uint16_t port, double seconds, size_t heavy, size_t light,
+    TriggerResult& result)
+{
+    SocketAddress addr;
+    SocketAddress::parse("127.0.0.1", port, addr);
+    auto server = std::make_shared<EpollTcpServer>(addr);
+    server->setTriggerMode(mode);
+    server->setDispatchThreads(threads);
+    server->registerOnRecvCallback([&server](const PacketPtr& data) { server->sendData(data); });
+    if (!server->start())
+    {
+        return false;
+    }
+    ClientGroup heavy_group(16 * 1024, 8);
+    ClientGroup light_group(64, 1);
+    bool ok = heavy_group.connect(addr, heavy) && light_group.connect(addr, light);
+    if (ok)
+    {
+        std::atomic<bool> stop { false };
+        std::thread heavy_thread([&]() { heavy_group.run(stop); });
+        std::thread light_thread([&]() { light_group.run(stop); });
+        // warm up, then measure
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        heavy_group.reset();
+        light_group.reset();
+        uint64_t begin = monotonicNs();
+        std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+        double elapsed = (monotonicNs() - begin) / 1e9;
+        result.mbytesPerSec = (heavy_group.bytes() + light_group.bytes()) / elapsed / (1024.0 * 1024.0);
+        result.heavyFairness = heavy_group.fairness();
+        result.lightPerSec = light_group.rtt().count() / elapsed;
+        result.lightP50 = light_group.rtt().percentile(50);
+        result.lightP99 = light_group.rtt().percentile(99);
+        stop = true;
+        heavy_thread.join();
+        light_thread.join();
+    }
+    server->stop();
+    return ok;
+}
+
+int main(int argc, char* argv[])
+{
+    double seconds = argc >= 2 ? std::atof(argv[1]) : 1.0;
+    size_t heavy = argc >= 3 ? std::atoi(argv[2]) : 16;
+    size_t light = argc >= 4 ? std::atoi(argv[3]) : 4;
+
+    // several dispatch threads need oneshot
+    std::vector<std::pair<TriggerMode, size_t>> matrix = {
+        { TriggerMode::kEdge, 1 },
+        { TriggerMode::kLevel, 1 },
+        { TriggerMode::kOneShot, 1 },
+        { TriggerMode::kOneShot, 2 },
+        { TriggerMode::kOneShot, 4 },
+    };
+
+
+    printf("%zu heavy connections(16KB x 8 in flight), %zu light connections(64B ping-pong), %.1fs each\n",
+        heavy, light, seconds);
+    printf("%-8s %8s %10s %10s %12s %12s %12s\n", "mode", "threads", "MB/s", "fairness", "light_rt/s",
+        "light_p50_us", "light_p99_us");
+    uint16_t port = 16671;
+    for (const auto& m : matrix)
+    {
+        TriggerResult result;
+        if (!runMode(m.first, m.second, port++, seconds, heavy, light, result))
+        {
+            printf("%-8s %8zu %10s\n", triggerModeName(m.first), m.second, "failed");
+            continue;
+        }
+        printf("%-8s %8zu %10.1f %10.3f %12.0f %12.1f %12.1f\n", triggerModeName(m.first), m.second,
+            result.mbytesPerSec, result.heavyFairness, result.lightPerSec, result.lightP50 / 1e3,
+            result.lightP99 / 1e3);
+    }
+    return 0;
+}
@@ -7,17 +7,41 @@
 
 #include "EpollTcpClient.h"
 #include <iostream>
-#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <cassert>
 
 EpollTcpClient::EpollTcpClient(const std::string& server_ip, uint16_t server_port)
     : server_ip_ ( server_ip ),
       server_port_ ( server_port )
 {
+    // "unix:/path" and "unix:@name" select a unix domain socket, otherwise ipv4 or ipv6 literal
+    if (!SocketAddress::parse(server_ip, server_port, server_addr_))
+    {
+        std::cout << "invalid server address " << server_ip << ":" << server_port << std::endl;
+    }
+}
+
+EpollTcpClient::EpollTcpClient(const SocketAddress& server_addr)
+    : server_ip_ ( server_addr.toString() ),
+      server_port_ ( server_addr.port() ),
+      server_addr_ ( server_addr )
+{
+}
+
+EpollTcpClient::EpollTcpClient(const std::string& server_ip, uint16_t server_port, const EventLoopPtr& loop)
+    : EpollTcpClient(server_ip, server_port)
+{
+    loop_ = loop;
+}
+
+EpollTcpClient::EpollTcpClient(const SocketAddress& server_addr, const EventLoopPtr& loop)
+    : EpollTcpClient(server_addr)
+{
+    loop_ = loop;
 }
 
 EpollTcpClient::~EpollTcpClient()
@@ -27,11 +51,7 @@ EpollTcpClient::~EpollTcpClient()
 
 bool EpollTcpClient::start()
 {
-    // create epoll instance
-    if (createEpoll() < 0)
-    {
-        return false;
-    }
+    assert(!conn_);
     // create socket and bind
     int cli_fd  = createSocket();
     if (cli_fd < 0)
@@ -43,62 +63,110 @@ bool EpollTcpClient::start()
     int lr = this->connect(cli_fd);
     if (lr < 0)
     {
+        ::close(cli_fd);
         return false;
     }
-    std::cout << "EpollTcpClient Init success!" << std::endl;
-    handle_ = cli_fd;
+    if (verbose_)
+    {
+        std::cout << "EpollTcpClient Init success!" << std::endl;
+    }
 
-    // after connected successfully, add this socket to epoll instance, and focus on EPOLLIN and EPOLLOUT event
-    int er = updateEpollEvents(efd_, EPOLL_CTL_ADD, handle_, EPOLLIN | EPOLLET);
-    if (er < 0)
+    // epoll et mode drains the socket until EAGAIN, a blocking socket would park the loop in read()
+    if (makeSocketNonBlock(cli_fd) < 0)
     {
-        // if something goes wrong, close listen socket and return false
-        ::close(handle_);
+        ::close(cli_fd);
         return false;
     }
 
-    assert(!th_loop_);
-
-    // the implementation of one loop per thread: create a thread to loop epoll
-    th_loop_ = std::make_shared<std::thread>(&EpollTcpClient::epollLoop, this);
-    if (!th_loop_)
+    if (!loop_)
     {
+        // no shared loop given: one loop per thread of its own
+        loop_ = std::make_shared<EventLoop>();
+        own_loop_ = true;
+    }
+    if (own_loop_ && !loop_->start())
+    {
+        ::close(cli_fd);
         return false;
     }
-    // detach the thread(using loop_flag_ to control the start/stop of loop)
-    th_loop_->detach();
+    assert(loop_->running());
+
+    // the connection owns cli_fd from here
+    TcpConnectionPtr conn = std::make_shared<TcpConnection>(loop_, cli_fd);
+    if (tls_context_)
+    {
+        TlsSessionPtr session = TlsSession::create(tls_context_, cli_fd, false);
+        if (!session)
+        {
+            return false;
+        }
+        conn->setTlsSession(std::move(session));
+    }
+    if (compression_.enabled)
+    {
+        conn->setCompression(compression_, false, &compression_stats_);
+    }
+    conn->setRecvCallback([this](const PacketPtr& data) {
+        if (recv_callback_)
+        {
+            // handle recv packet
+            recv_callback_(data);
+        }
+    });
+    conn->setCloseCallback([this](const TcpConnectionPtr& c) {
+        if (verbose_)
+        {
+            std::cout << "fd: " << c->fd() << " connection closed!" << std::endl;
+        }
+        if (close_callback_)
+        {
+            close_callback_();
+        }
+    });
 
+    // after connected successfully, add this socket to the loop, and focus on EPOLLIN(EPOLLOUT while output is pending)
+    if (!conn->start())
+    {
+        return false;
+    }
+    conn_ = conn;
     return true;
 }
 
 bool EpollTcpClient::stop()
 {
-    loop_flag_ = false;
-    ::close(handle_);
-    ::close(efd_);
-    std::cout << "stop epoll!" << std::endl;
-    unregisterOnRecvCallback();
+    if (conn_)
+    {
+        // the connection belongs to the loop thread, close it there
+        TcpConnectionPtr conn = conn_;
+        loop_->runAndWait([conn]() { conn->close(); });
+        conn_.reset();
+        if (own_loop_)
+        {
+            loop_->stop();
+        }
+        if (verbose_)
+        {
+            std::cout << "stop epoll!" << std::endl;
+        }
+    }
+    // stop() is also called by destructor, unregister only once
+    if (recv_callback_)
+    {
+        unregisterOnRecvCallback();
+    }
     return true;
 }
 
-int32_t EpollTcpClient::createEpoll()
+int32_t EpollTcpClient::createSocket()
 {
-    // the basic epoll api of create a epoll instance
-    int epollfd = epoll_create(1);
-    if (epollfd < 0)
+    if (!server_addr_.valid())
     {
-        // if something goes wrong, return -1
-        std::cout << "epoll_create failed!" << std::endl;
+        std::cout << "create socket failed, invalid address!" << std::endl;
         return -1;
     }
-    efd_ = epollfd;
-    return epollfd;
-}
-
-int32_t EpollTcpClient::createSocket()
-{
-    // create tcp socket
-    int s = ::socket(AF_INET, SOCK_STREAM, 0);
+    // create stream socket of the address family(AF_INET/AF_INET6/AF_UNIX)
+    int s = ::socket(server_addr_.family(), SOCK_STREAM, 0);
     if (s < 0)
     {
         std::cout << "create socket failed!" << std::endl;
@@ -108,33 +176,23 @@ int32_t EpollTcpClient::createSocket()
     return s;
 }
 
-int32_t EpollTcpClient::connect(int32_t cli_fd)
+int32_t EpollTcpClient::makeSocketNonBlock(int32_t fd)
 {
-    struct sockaddr_in address = {0};  // server info
-    address.sin_family = AF_INET;
-    address.sin_port = htons(server_port_);
-    address.sin_addr.s_addr  = inet_addr(server_ip_.c_str());
-
-    int r = ::connect(cli_fd, (struct sockaddr*)&address, sizeof(address));
-    if ( r < 0)
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
     {
-        std::cout << "connect failed! r=" << r << " errno:" << errno << std::endl;
+        std::cout << "fcntl failed!" << std::endl;
         return -1;
     }
     return 0;
 }
 
-// add/modify/remove a item(socket/fd) in epoll instance(rbtree), for this example, just add a socket to epoll rbtree
-int32_t EpollTcpClient::updateEpollEvents(int efd, int op, int fd, int events)
+int32_t EpollTcpClient::connect(int32_t cli_fd)
 {
-    struct epoll_event ev = {0};
-    ev.events = events;
-    ev.data.fd = fd;
-    fprintf(stdout,"%s fd %d events read %d write %d\n", op == EPOLL_CTL_MOD ? "mod" : "add", fd, ev.events & EPOLLIN, ev.events & EPOLLOUT);
-    int r = epoll_ctl(efd, op, fd, &ev);
-    if (r < 0)
+    int r = ::connect(cli_fd, server_addr_.addr(), server_addr_.length());
+    if ( r < 0)
     {
-        std::cout << "epoll_ctl failed!" << std::endl;
+        std::cout << "connect " << server_addr_.toString() << " failed! r=" << r << " errno:" << errno << std::endl;
         return -1;
     }
     return 0;
@@ -153,113 +211,39 @@ void EpollTcpClient::unregisterOnRecvCallback()
     recv_callback_ = nullptr;
 }
 
-// handle read events on fd
-void EpollTcpClient::onSocketRead(int32_t fd)
+void EpollTcpClient::setTlsContext(const TlsContextPtr& ctx)
 {
-    char read_buf[4096] = {0};
-    int n = -1;
-    while ( (n = ::read(fd, read_buf, sizeof(read_buf))) > 0)
-    {
-        // callback for recv
-        std::string msg(read_buf, n);
-        PacketPtr data = std::make_shared<Packet>(fd, msg);
-        if (recv_callback_)
-        {
-            // handle recv packet
-            recv_callback_(data);
-        }
-    }
-    if (n == -1)
-    {
-        if (errno == EAGAIN || errno == EWOULDBLOCK)
-        {
-            // read finished
-            return;
-        }
-        // something goes wrong for this fd, should close it
-        ::close(fd);
-        return;
-    }
-    if (n == 0)
-    {
-        // this may happen when client close socket. EPOLLRDHUP usually handle this, but just make sure; should close this fd
-        ::close(fd);
-        return;
-    }
+    assert(!conn_);
+    tls_context_ = ctx;
 }
 
+void EpollTcpClient::setCompressionConfig(const CompressionConfig& config)
+{
+    assert(!conn_);
+    compression_ = config;
+}
 
-void EpollTcpClient::onSocketWrite(int32_t fd)
+void EpollTcpClient::setCloseCallback(std::function<void()> callback)
 {
-    std::cout << "fd: " << fd << " writeable!" << std::endl;
+    assert(!conn_);
+    close_callback_ = std::move(callback);
 }
 
 int32_t EpollTcpClient::sendData(const PacketPtr& data)
 {
-    int r = ::write(handle_, data->message().data(), data->message().size());
-    if (r == -1)
+    if (!conn_)
     {
-        if (errno == EAGAIN || errno == EWOULDBLOCK)
-        {
-            return -1;
-        }
-        // error happend
-        ::close(handle_);
-        std::cout << "fd: " << handle_ << " write error, close it!" << std::endl;
         return -1;
     }
-    return r;
+    // written now if the socket takes it, otherwise queued and flushed on EPOLLOUT
+    return conn_->send(data->message());
 }
 
-
-void EpollTcpClient::epollLoop()
+int32_t EpollTcpClient::send(const char* data, size_t len)
 {
-    // request some memory, if events ready, socket events will copy to this memory from kernel
-    struct epoll_event* alive_events =  static_cast<epoll_event*>(calloc(kMaxEvents, sizeof(epoll_event)));
-    if (!alive_events)
+    if (!conn_)
     {
-        std::cout << "calloc memory failed for epoll_events!" << std::endl;
-        return;
+        return -1;
     }
-    while (loop_flag_)
-    {
-        int num = epoll_wait(efd_, alive_events, kMaxEvents, kEpollWaitTime);
-
-        for (int i = 0; i < num; ++i)
-        {
-            int fd = alive_events[i].data.fd;
-            int events = alive_events[i].events;
-
-            if ( (events & EPOLLERR) || (events & EPOLLHUP) )
-            {
-                std::cout << "epoll_wait error!" << std::endl;
-                // An error has occured on this fd, or the socket is not ready for reading (why were we notified then?).
-                ::close(fd);
-            }
-            else  if (events & EPOLLRDHUP)
-            {
-                // Stream socket peer closed connection, or shut down writing half of connection.
-                // more inportant, We still to handle disconnection when read()/recv() return 0 or -1 just to be sure.
-                std::cout << "fd:" << fd << " closed EPOLLRDHUP!" << std::endl;
-                // close fd and epoll will remove it
-                ::close(fd);
-            }
-            else if ( events & EPOLLIN )
-            {
-                // other fd read event coming, meaning data coming
-                onSocketRead(fd);
-            }
-            else if ( events & EPOLLOUT )
-            {
-                // write event for fd (not including listen-fd), meaning send buffer is available for big files
-                onSocketWrite(fd);
-            }
-            else
-            {
-                std::cout << "unknow epoll event!" << std::endl;
-            }
-        } // end for (int i = 0; ...
-
-    } // end while (loop_flag_)
-    free(alive_events);
+    return conn_->send(data, len);
 }
@@ -8,7 +8,11 @@
 #define EPOLLTCPCLIENT_H
 
 #include "EpollTcpBase.h"
-#include <thread>
+#include "EventLoop.h"
+#include "FrameCodec.h"
+#include "SocketAddress.h"
+#include "TcpConnection.h"
+#include "TlsContext.h"
 
 class EpollTcpClient : public EpollTcpBase
 {
@@ -22,39 +26,60 @@ public:
 
     // the server ip and port
     EpollTcpClient(const std::string& server_ip, uint16_t server_port);
+    // the server address: ipv4, ipv6 or unix domain socket
+    explicit EpollTcpClient(const SocketAddress& server_addr);
+    // run on a started loop shared with other servers/clients instead of an own loop thread
+    EpollTcpClient(const std::string& server_ip, uint16_t server_port, const EventLoopPtr& loop);
+    EpollTcpClient(const SocketAddress& server_addr, const EventLoopPtr& loop);
 
 public:
     bool start() override;
     bool stop() override;
     int32_t sendData(const PacketPtr& data) override;
+    // write bytes without a Packet, callable from any thread; return len or -1
+    int32_t send(const char* data, size_t len);
     void registerOnRecvCallback(callback_recv_t callback) override;
     void unregisterOnRecvCallback() override;
 
+    // print start/stop and the close of the connection on stdout(errors are always printed), off by default
+    void setVerbose(bool verbose)
+    { verbose_ = verbose; }
+    // connect with tls, must be called before start()
+    void setTlsContext(const TlsContextPtr& ctx);
+    // ask the server for framed lz4 compression of messages, must be called before start();
+    // messages sent before the server answered are held(plain stream if it doesn't know compression)
+    void setCompressionConfig(const CompressionConfig& config);
+    const CompressionStats& compressionStats() const
+    { return compression_stats_; }
+    // called on the loop thread when the connection to the server is closed(by either side, stop() included),
+    // must be called before start()
+    void setCloseCallback(std::function<void()> callback);
+    // the loop this client runs on
+    const EventLoopPtr& loop() const
+    { return loop_; }
+
 protected:
-    // create epoll instance using epoll_create and return a fd of epoll
-    int32_t createEpoll();
     // create a socket fd using api socket()
     int32_t createSocket();
     // connect to server
     int32_t connect(int32_t listenfd);
-    // add/modify/remove a item(socket/fd) in epoll instance(rbtree), for this example, just add a socket to epoll rbtree
-    int32_t updateEpollEvents(int efd, int op, int fd, int events);
-    // handle tcp socket readable event(read())
-    void onSocketRead(int32_t fd);
-    // handle tcp socket writeable event(write())
-    void onSocketWrite(int32_t fd);
-    // one loop per thread, call epoll_wait and return ready socket(readable,writeable,error...)
-    void epollLoop();
+    // set socket noblock
+    int32_t makeSocketNonBlock(int32_t fd);
 
 
 private:
     std::string server_ip_; // tcp server ip
     uint16_t server_port_ { 0 }; // tcp server port
-    int32_t handle_ { -1 }; // client fd
-    int32_t efd_ { -1 }; // epoll fd
-    std::shared_ptr<std::thread> th_loop_ { nullptr }; // one loop per thread(call epoll_wait in loop)
-    bool loop_flag_ { true }; // if loop_flag_ is false, then exit the epoll loop
+    SocketAddress server_addr_; // parsed server address to connect
+    EventLoopPtr loop_; // loop running this client
+    bool own_loop_ { false }; // loop_ created and started by this client
+    bool verbose_ { false }; // info messages on stdout
+    TcpConnectionPtr conn_; // the connection to server, reads and queued writes are driven by loop_
     callback_recv_t recv_callback_ { nullptr }; // callback when received
+    std::function<void()> close_callback_; // callback when the connection is closed
+    TlsContextPtr tls_context_; // not null when connecting with tls
+    CompressionConfig compression_; // enabled: negotiate compression
+    CompressionStats compression_stats_;
 };
 
 
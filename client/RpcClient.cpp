@@ -0,0 +1,353 @@
+/********************************************************************************
+  > FileName:	RpcClient.cpp
+  > Author:	Mingping Zhang
+  > Email:	mingpingzhang@163.com
+  > Create Time:	Wed Apr 12 10:08:35 2023
+ ********************************************************************************/
+
+#include "RpcClient.h"
+#include "TimeUtil.h"
+#include <cassert>
+#include <iostream>
+#include <memory>
+
+const char* rpcStatusName(RpcStatus status)
+{
+    switch (status)
+    {
+    case RpcStatus::kOk:
+        return "ok";
+    case RpcStatus::kTimeout:
+        return "timeout";
+    case RpcStatus::kOverloaded:
+        return "overloaded";
+    case RpcStatus::kClosed:
+        return "closed";
+    }
+    return "unknown";
+}
+
+RpcClient::RpcClient(const SocketAddress& server_addr)
+    : client_ ( server_addr ),
+      decoder_ ( config_.maxFrameSize )
+{
+}
+
+RpcClient::RpcClient(const SocketAddress& server_addr, const EventLoopPtr& loop)
+    : client_ ( server_addr, loop ),
+      decoder_ ( config_.maxFrameSize )
+{
+}
+
+RpcClient::~RpcClient()
+{
+    stop();
+    if (client_.loop())
+    {
+        // a drain task posted by a call() that raced stop() finds the client gone
+        client_.loop()->runAndWait([this]() { alive_.reset(); });
+    }
+}
+
+void RpcClient::setConfig(const RpcConfig& config)
+{
+    assert(!running_);
+    config_ = config;
+    if (config_.window == 0)
+    {
+        config_.window = 1;
+    }
+    decoder_ = RpcDecoder(config_.maxFrameSize);
+}
+
+bool RpcClient::start()
+{
+    assert(!running_);
+    client_.registerOnRecvCallback([this](const PacketPtr& data) { onReply(data); });
+    client_.setCloseCallback([this]() { onClosed(); });
+    if (!client_.start())
+    {
+        client_.unregisterOnRecvCallback();
+        return false;
+    }
+    running_ = true;
+    return true;
+}
+
+bool RpcClient::stop()
+{
+    if (!client_.loop())
+    {
+        // never started
+        return true;
+    }
+    running_ = false;
+    // calls of other threads posted before this are taken and failed with the rest
+    client_.loop()->runAndWait([this]() {
+        drainSubmitted();
+        failAll(RpcStatus::kClosed);
+        if (timer_ != 0)
+        {
+            client_.loop()->cancelTimer(timer_);
+            timer_ = 0;
+        }
+    });
+    return client_.stop();
+}
+
+void RpcClient::call(const std::string& request, callback_rpc_t callback, uint64_t timeout_ms)
+{
+    stats_.calls.fetch_add(1, std::memory_order_relaxed);
+    if (!running_)
+    {
+        stats_.closed.fetch_add(1, std::memory_order_relaxed);
+        callback(RpcStatus::kClosed, std::string());
+        return;
+    }
+    uint64_t id = nextId_.fetch_add(1, std::memory_order_relaxed);
+    uint64_t deadline_ns = monotonicNs() + (timeout_ms ? timeout_ms : config_.timeoutMs) * 1000000ULL;
+    // encoded on the calling thread, the loop only moves the frame
+    std::string frame;
+    encodeRpcFrame(id, request.data(), request.size(), frame);
+    const EventLoopPtr& loop = client_.loop();
+    if (loop->isInLoopThread())
+    {
+        startCall(id, deadline_ns, frame, callback);
+        if (!batching_)
+        {
+            flush();
+        }
+        return;
+    }
+    bool first = false;
+    {
+        std::lock_guard<std::mutex> lock(submitMutex_);
+        first = submitted_.empty();
+        submitted_.push_back(Submitted { id, deadline_ns, std::move(frame), std::move(callback) });
+    }
+    if (first)
+    {
+        // one task takes everything submitted until it runs
+        std::weak_ptr<int> alive = alive_;
+        loop->post([this, alive]() {
+            if (alive.lock())
+            {
+                drainSubmitted();
+            }
+        });
+    }
+}
+
+std::future<RpcResult> RpcClient::callFuture(const std::string& request, uint64_t timeout_ms)
+{
+    std::shared_ptr<std::promise<RpcResult>> done = std::make_shared<std::promise<RpcResult>>();
+    std::future<RpcResult> f = done->get_future();
+    call(request, [done](RpcStatus status, std::string&& reply) {
+        RpcResult result;
+        result.status = status;
+        result.reply = std::move(reply);
+        done->set_value(std::move(result));
+    }, timeout_ms);
+    return f;
+}
+
+void RpcClient::drainSubmitted()
+{
+    {
+        std::lock_guard<std::mutex> lock(submitMutex_);
+        draining_.swap(submitted_);
+    }
+    batching_ = true;
+    for (Submitted& s : draining_)
+    {
+        startCall(s.id, s.deadlineNs, s.frame, s.callback);
+    }
+    draining_.clear();
+    batching_ = false;
+    flush();
+}
+
+void RpcClient::startCall(uint64_t id, uint64_t deadline_ns, std::string& frame, callback_rpc_t& callback)
+{
+    if (!running_)
+    {
+        // closed after call() looked
+        stats_.closed.fetch_add(1, std::memory_order_relaxed);
+        callback(RpcStatus::kClosed, std::string());
+        return;
+    }
+    if (inflight_ >= config_.window && waiting_.size() >= config_.maxWaiting)
+    {
+        stats_.overloaded.fetch_add(1, std::memory_order_relaxed);
+        callback(RpcStatus::kOverloaded, std::string());
+        return;
+    }
+    Call& c = calls_[id];
+    c.callback = std::move(callback);
+    c.deadlineNs = deadline_ns;
+    bool earliest = deadlines_.empty() || deadline_ns < deadlines_.begin()->first;
+    deadlines_.insert(std::make_pair(deadline_ns, id));
+    if (inflight_ < config_.window && waiting_.empty())
+    {
+        ++inflight_;
+        stats_.inflight.fetch_add(1, std::memory_order_relaxed);
+        outgoing_.append(frame);
+    }
+    else
+    {
+        c.frame = std::move(frame);
+        waiting_.push_back(id);
+        stats_.waiting.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (earliest)
+    {
+        armTimer();
+    }
+}
+
+void RpcClient::sendWaiting()
+{
+    while (inflight_ < config_.window && !waiting_.empty())
+    {
+        uint64_t id = waiting_.front();
+        waiting_.pop_front();
+        auto it = calls_.find(id);
+        if (it == calls_.end() || it->second.frame.empty())
+        {
+            // timed out while waiting
+            continue;
+        }
+        stats_.waiting.fetch_sub(1, std::memory_order_relaxed);
+        ++inflight_;
+        stats_.inflight.fetch_add(1, std::memory_order_relaxed);
+        outgoing_.append(it->second.frame);
+        std::string().swap(it->second.frame);
+    }
+}
+
+void RpcClient::flush()
+{
+    if (outgoing_.empty())
+    {
+        return;
+    }
+    // a write error closes the connection, onClosed() fails the calls
+    client_.send(outgoing_.data(), outgoing_.size());
+    outgoing_.clear();
+}
+
+void RpcClient::onReply(const PacketPtr& data)
+{
+    const std::string& bytes = data->message();
+    if (!decoder_.feed(bytes.data(), bytes.size(), frames_))
+    {
+        // the stream can't be resynchronized, every call fails from here until stop()
+        std::cout << "rpc: malformed reply frame, connection unusable!" << std::endl;
+        frames_.clear();
+        running_ = false;
+        failAll(RpcStatus::kClosed);
+        return;
+    }
+    batching_ = true;
+    for (RpcFrame& frame : frames_)
+    {
+        auto it = calls_.find(frame.id);
+        if (it == calls_.end())
+        {
+            // timed out already, its slot was freed then
+            stats_.lateReplies.fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
+        --inflight_;
+        stats_.inflight.fetch_sub(1, std::memory_order_relaxed);
+        stats_.completed.fetch_add(1, std::memory_order_relaxed);
+        finish(it, RpcStatus::kOk, std::move(frame.body));
+    }
+    frames_.clear();
+    sendWaiting();
+    batching_ = false;
+    flush();
+}
+
+void RpcClient::onClosed()
+{
+    running_ = false;
+    failAll(RpcStatus::kClosed);
+}
+
+void RpcClient::finish(std::unordered_map<uint64_t, Call>::iterator it, RpcStatus status, std::string&& reply)
+{
+    callback_rpc_t callback = std::move(it->second.callback);
+    deadlines_.erase(std::make_pair(it->second.deadlineNs, it->first));
+    calls_.erase(it);
+    // may call() again, calls_ is consistent here
+    callback(status, std::move(reply));
+}
+
+void RpcClient::failAll(RpcStatus status)
+{
+    std::unordered_map<uint64_t, Call> calls;
+    calls.swap(calls_);
+    deadlines_.clear();
+    waiting_.clear();
+    outgoing_.clear();
+    stats_.inflight.fetch_sub(inflight_, std::memory_order_relaxed);
+    stats_.waiting.store(0, std::memory_order_relaxed);
+    inflight_ = 0;
+    for (auto& kv : calls)
+    {
+        stats_.closed.fetch_add(1, std::memory_order_relaxed);
+        kv.second.callback(status, std::string());
+    }
+}
+
+void RpcClient::onTimer()
+{
+    timer_ = 0;
+    uint64_t now = monotonicNs();
+    batching_ = true;
+    while (!deadlines_.empty() && deadlines_.begin()->first <= now)
+    {
+        auto it = calls_.find(deadlines_.begin()->second);
+        if (it->second.frame.empty())
+        {
+            // sent: free the slot now, a late reply is only counted
+            --inflight_;
+            stats_.inflight.fetch_sub(1, std::memory_order_relaxed);
+        }
+        else
+        {
+            // still in waiting_, skipped there
+            stats_.waiting.fetch_sub(1, std::memory_order_relaxed);
+        }
+        stats_.timeouts.fetch_add(1, std::memory_order_relaxed);
+        finish(it, RpcStatus::kTimeout, std::string());
+    }
+    sendWaiting();
+    batching_ = false;
+    flush();
+    armTimer();
+}
+
+void RpcClient::armTimer()
+{
+    if (deadlines_.empty())
+    {
+        return;
+    }
+    uint64_t deadline = deadlines_.begin()->first;
+    if (timer_ != 0 && timerDeadlineNs_ <= deadline)
+    {
+        // fires first, re-armed then
+        return;
+    }
+    if (timer_ != 0)
+    {
+        client_.loop()->cancelTimer(timer_);
+    }
+    uint64_t now = monotonicNs();
+    // round up, the loop's timers have millisecond resolution
+    uint64_t delay_ms = deadline <= now ? 0 : (deadline - now + 999999) / 1000000;
+    timerDeadlineNs_ = deadline;
+    timer_ = client_.loop()->runAfter(delay_ms, [this]() { onTimer(); });
+}
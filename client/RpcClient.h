@@ -0,0 +1,159 @@
+/********************************************************************************
+> FileName:	RpcClient.h
+> Author:	Mingping Zhang
+> Email:	mingpingzhang@163.com
+> Create Time:	Wed Apr 12 10:08:35 2023
+********************************************************************************/
+#ifndef RPCCLIENT_H
+#define RPCCLIENT_H
+
+#include "EpollTcpClient.h"
+#include "EventLoop.h"
+#include "RpcCodec.h"
+#include "SocketAddress.h"
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+struct RpcConfig
+{
+    // requests sent and not answered yet, the others wait in the client. a call that times out gives its slot
+    // back at once, so a server that drops requests can't fill the window(it may still be working on them)
+    size_t window { 1024 };
+    size_t maxWaiting { 64 * 1024 };      // requests waiting for the window, more fail with kOverloaded
+    uint64_t timeoutMs { 5000 };          // deadline of calls without their own, counted from call()
+    size_t maxFrameSize { 16 * 1024 * 1024 }; // bigger replies are malformed and close the connection
+};
+
+enum class RpcStatus
+{
+    kOk,
+    kTimeout,    // no reply before the deadline(a late reply is dropped)
+    kOverloaded, // too many requests waiting for the window
+    kClosed,     // not connected, or the connection closed before the reply
+};
+
+const char* rpcStatusName(RpcStatus status);
+
+struct RpcResult
+{
+    RpcStatus status { RpcStatus::kClosed };
+    std::string reply;
+};
+
+// counters of an RpcClient, readable from any thread
+struct RpcStats
+{
+    std::atomic<uint64_t> calls { 0 };
+    std::atomic<uint64_t> completed { 0 };   // answered
+    std::atomic<uint64_t> timeouts { 0 };
+    std::atomic<uint64_t> overloaded { 0 };
+    std::atomic<uint64_t> closed { 0 };
+    std::atomic<uint64_t> lateReplies { 0 }; // replies to calls that timed out already
+    std::atomic<uint64_t> inflight { 0 };    // sent and neither answered nor timed out now
+    std::atomic<uint64_t> waiting { 0 };     // waiting for the window now
+};
+
+// called once per call on the loop thread(on the calling thread when the client isn't connected)
+using callback_rpc_t = std::function<void(RpcStatus status, std::string&& reply)>;
+
+// request/response calls over one connection(see RpcCodec): every request gets an id, the reply with the
+// same id completes it in whatever order replies come. up to window requests are in flight at once, the
+// others wait in order; deadlines are enforced by one timer on the loop. requests from other threads are
+// handed to the loop in batches and written together
+class RpcClient
+{
+public:
+    explicit RpcClient(const SocketAddress& server_addr);
+    // run on a started loop shared with other servers/clients instead of an own loop thread
+    RpcClient(const SocketAddress& server_addr, const EventLoopPtr& loop);
+    RpcClient(const RpcClient& other)            = delete;
+    RpcClient& operator=(const RpcClient& other) = delete;
+    ~RpcClient();
+
+public:
+    // must be called before start()
+    void setConfig(const RpcConfig& config);
+    // tls and compression of the connection, configured before start()
+    EpollTcpClient& transport()
+    { return client_; }
+    bool start();
+    // the calls not answered yet complete with kClosed
+    bool stop();
+
+    // send request, callable from any thread; timeout_ms 0 takes RpcConfig::timeoutMs
+    void call(const std::string& request, callback_rpc_t callback, uint64_t timeout_ms = 0);
+    // the same, completed through a future; don't wait for it on the loop thread
+    std::future<RpcResult> callFuture(const std::string& request, uint64_t timeout_ms = 0);
+
+    const RpcStats& stats() const
+    { return stats_; }
+
+private:
+    // one call from call() to its completion
+    struct Call
+    {
+        callback_rpc_t callback;
+        uint64_t deadlineNs;
+        std::string frame; // encoded request while waiting for the window
+    };
+    // a call handed over from another thread
+    struct Submitted
+    {
+        uint64_t id;
+        uint64_t deadlineNs;
+        std::string frame;
+        callback_rpc_t callback;
+    };
+
+    // the rest run on the loop thread
+    void startCall(uint64_t id, uint64_t deadline_ns, std::string& frame, callback_rpc_t& callback);
+    // take the calls of other threads
+    void drainSubmitted();
+    void onReply(const PacketPtr& data);
+    void onClosed();
+    // send waiting calls while the window has room
+    void sendWaiting();
+    // write the frames collected in outgoing_
+    void flush();
+    // complete a call, it is removed from calls_
+    void finish(std::unordered_map<uint64_t, Call>::iterator it, RpcStatus status, std::string&& reply);
+    void failAll(RpcStatus status);
+    // fire the deadlines due, keep the timer at the earliest one
+    void onTimer();
+    void armTimer();
+
+    EpollTcpClient client_;
+    RpcConfig config_;
+    std::atomic<bool> running_ { false }; // started and connected
+    std::atomic<uint64_t> nextId_ { 1 };
+    std::mutex submitMutex_;
+    std::vector<Submitted> submitted_; // calls of other threads, one drain task posted while not empty
+    // lifetime token of the drain tasks on a shared loop, reset on the loop thread by the destructor
+    std::shared_ptr<int> alive_ { std::make_shared<int>(0) };
+
+    // loop thread only
+    RpcDecoder decoder_;
+    std::vector<RpcFrame> frames_; // scratch of onReply()
+    std::unordered_map<uint64_t, Call> calls_; // sent or waiting
+    std::set<std::pair<uint64_t, uint64_t>> deadlines_; // (deadline, id) of calls_
+    std::deque<uint64_t> waiting_; // ids waiting for the window in call order, completed ones are skipped
+    size_t inflight_ { 0 }; // window slots taken by sent calls_
+    std::string outgoing_; // frames to write at the end of the batch
+    bool batching_ { false }; // in onReply()/drainSubmitted(), flush when done
+    EventLoop::TimerId timer_ { 0 };
+    uint64_t timerDeadlineNs_ { 0 };
+    std::vector<Submitted> draining_; // scratch of drainSubmitted()
+
+    RpcStats stats_;
+};
+
+#endif//RPCCLIENT_H
@@ -73,6 +73,20 @@ int main(int argc, char* argv[])
         std::cout << "tcp_client create faield!" << std::endl;
         exit(-1);
     }
+    tcp_client->setVerbose(true);
+
+    // the third argument "tls" connects with tls, verify server with ca file argv[4] if given, against the
+    // certificate name argv[5](the server address by default)
+    if (argc >= 4 && std::string(argv[3]) == "tls")
+    {
+        TlsContextPtr ctx = TlsContext::createClient(argc >= 5 ? argv[4] : "", argc >= 6 ? argv[5] : server_ip);
+        if (!ctx)
+        {
+            std::cout << "tls context create failed!" << std::endl;
+            exit(-1);
+        }
+        tcp_client->setTlsContext(ctx);
+    }
 
 
     // recv callback in lambda mode, you can set your own callback here
@@ -99,8 +113,13 @@ int main(int argc, char* argv[])
     {
         // read content from stdin
         std::cout << std::endl << "input:";
-        std::getline(std::cin, message);
-        auto packet = std::make_shared<Packet>(message);
+        if (!std::getline(std::cin, message))
+        {
+            // stdin closed
+            break;
+        }
+        // newline delimited, getline() dropped it
+        auto packet = std::make_shared<Packet>(message + "\n");
         tcp_client->sendData(packet);
         //std::this_thread::sleep_for(std::chrono::seconds(1));
     }
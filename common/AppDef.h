@@ -1,6 +1,8 @@
 #ifndef APPDEF_H
 #define APPDEF_H
 
+#include <cstdint>
+
 constexpr uint32_t EpollWaitTime()
 {
 	return 10; // epoll wait timeout 10 ms
@@ -11,4 +13,34 @@ constexpr uint32_t MaxEvents()
 	return 100;    // epoll wait return max size
 }
 
+constexpr uint32_t LevelReadsPerEvent()
+{
+	return 4;      // reads/accepts/recvmmsg batches per event of a level triggered or oneshot fd
+}
+
+constexpr uint32_t MaxOutputBufferSize()
+{
+	return 64 * 1024 * 1024; // bytes queued per connection for a slow reader before sends fail
+}
+
+constexpr uint32_t OutputQueuePoolSize()
+{
+	return 1024;   // drained output queues kept for reuse by all connections, idle connections hold none
+}
+
+constexpr uint32_t UdpBatchSize()
+{
+	return 64;     // datagrams read/written by one recvmmsg()/sendmmsg()
+}
+
+constexpr uint32_t UdpMaxDatagramSize()
+{
+	return 2048;   // receive slot size, bigger datagrams are truncated and dropped
+}
+
+constexpr uint32_t UdpMaxGsoSegments()
+{
+	return 64;     // kernel limit UDP_MAX_SEGMENTS of one UDP_SEGMENT send
+}
+
 #endif//APPDEF_H
@@ -0,0 +1,549 @@
+/********************************************************************************
+  > FileName:	EventLoop.cpp
+  > Author:	Mingping Zhang
+  > Email:	mingpingzhang@163.com
+  > Create Time:	Wed Mar 29 09:40:22 2023
+ ********************************************************************************/
+
+#include "EventLoop.h"
+#include "AppDef.h"
+#include "TimeUtil.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cassert>
+#include <future>
+#include <iostream>
+#include <typeinfo>
+
+// the loop whose loop thread or dispatch thread this is
+static thread_local const EventLoop* tCurrentLoop = nullptr;
+
+const char* loopStageName(LoopStage stage)
+{
+    switch (stage)
+    {
+    case LoopStage::kWaiting:
+        return "waiting";
+    case LoopStage::kEvents:
+        return "events";
+    case LoopStage::kTimers:
+        return "timers";
+    case LoopStage::kTasks:
+        return "tasks";
+    }
+    return "unknown";
+}
+
+void EventLoop::WakeupHandler::handleEvent(uint32_t)
+{
+    uint64_t n = 0;
+    // the counter only needs to be reset, tasks are taken from the queue
+    ssize_t r = ::read(fd_, &n, sizeof(n));
+    (void)r;
+}
+
+
+EventLoop::EventLoop()
+{
+}
+
+EventLoop::~EventLoop()
+{
+    stop();
+}
+
+void EventLoop::setDispatchThreads(size_t count)
+{
+    assert(!running_);
+    dispatchThreads_ = count == 0 ? 1 : count;
+}
+
+bool EventLoop::isInLoopThread() const
+{
+    return tCurrentLoop == this;
+}
+
+bool EventLoop::start()
+{
+    assert(!running_);
+    // the basic epoll api of create a epoll instance
+    efd_ = epoll_create1(EPOLL_CLOEXEC);
+    if (efd_ < 0)
+    {
+        std::cout << "epoll_create failed!" << std::endl;
+        return false;
+    }
+    wakeupFd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakeupFd_ < 0)
+    {
+        std::cout << "eventfd failed!" << std::endl;
+        closeFds();
+        return false;
+    }
+    wakeupHandler_.reset(new WakeupHandler(wakeupFd_));
+    if (dispatchThreads_ > 1)
+    {
+        // a wakeup taken by a dispatch thread would be lost for the tasks, the loop thread waits on its own set
+        taskFd_ = epoll_create1(EPOLL_CLOEXEC);
+        struct epoll_event ev = {0};
+        ev.events = EPOLLIN;
+        ev.data.ptr = wakeupHandler_.get();
+        if (taskFd_ < 0)
+        {
+            std::cout << "epoll_create failed!" << std::endl;
+            closeFds();
+            return false;
+        }
+        if (epoll_ctl(taskFd_, EPOLL_CTL_ADD, wakeupFd_, &ev) < 0)
+        {
+            std::cout << "epoll_ctl add wakeup fd " << wakeupFd_ << " failed! errno:" << errno << std::endl;
+            closeFds();
+            return false;
+        }
+    }
+    else if (addHandler(wakeupFd_, EPOLLIN, wakeupHandler_.get()) < 0)
+    {
+        closeFds();
+        return false;
+    }
+
+    if (dispatchThreads_ > 1)
+    {
+        rounds_.reset(new std::atomic<uint64_t>[dispatchThreads_]);
+        for (size_t i = 0; i < dispatchThreads_; ++i)
+        {
+            rounds_[i] = 0;
+        }
+    }
+
+    running_ = true;
+    // the implementation of one loop per thread
+    thread_ = std::thread(&EventLoop::loop, this);
+    for (size_t i = 0; dispatchThreads_ > 1 && i < dispatchThreads_; ++i)
+    {
+        dispatchers_.push_back(std::thread(&EventLoop::dispatchLoop, this, i));
+    }
+    return true;
+}
+
+void EventLoop::stop()
+{
+    if (!thread_.joinable())
+    {
+        return;
+    }
+    // must not be destroyed from its own thread, the loop exits after the current iteration
+    running_ = false;
+    wakeup();
+    if (isInLoopThread())
+    {
+        // stopped by one of its own callbacks: the loop exits after this iteration
+        thread_.detach();
+        for (auto& t : dispatchers_)
+        {
+            t.detach();
+        }
+        return;
+    }
+    thread_.join();
+    // dispatch threads notice within one epoll_wait() timeout
+    for (auto& t : dispatchers_)
+    {
+        t.join();
+    }
+    dispatchers_.clear();
+    retired_.clear();
+    closeFds();
+}
+
+void EventLoop::closeFds()
+{
+    if (taskFd_ >= 0)
+    {
+        ::close(taskFd_);
+        taskFd_ = -1;
+    }
+    if (wakeupFd_ >= 0)
+    {
+        ::close(wakeupFd_);
+        wakeupFd_ = -1;
+    }
+    ::close(efd_);
+    efd_ = -1;
+    wakeupHandler_.reset();
+}
+
+int32_t EventLoop::addHandler(int32_t fd, uint32_t events, EventHandler* handler)
+{
+    struct epoll_event ev = {0};
+    ev.events = events;
+    ev.data.ptr = handler;
+    if (epoll_ctl(efd_, EPOLL_CTL_ADD, fd, &ev) < 0)
+    {
+        std::cout << "epoll_ctl add fd " << fd << " failed! errno:" << errno << std::endl;
+        return -1;
+    }
+    return 0;
+}
+
+int32_t EventLoop::modifyHandler(int32_t fd, uint32_t events, EventHandler* handler)
+{
+    struct epoll_event ev = {0};
+    ev.events = events;
+    ev.data.ptr = handler;
+    if (epoll_ctl(efd_, EPOLL_CTL_MOD, fd, &ev) < 0)
+    {
+        std::cout << "epoll_ctl mod fd " << fd << " failed! errno:" << errno << std::endl;
+        return -1;
+    }
+    return 0;
+}
+
+int32_t EventLoop::removeHandler(int32_t fd)
+{
+    if (epoll_ctl(efd_, EPOLL_CTL_DEL, fd, nullptr) < 0)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+void EventLoop::post(Task task)
+{
+    {
+        std::lock_guard<std::mutex> lock(taskMutex_);
+        tasks_.push_back(std::move(task));
+    }
+    if (!isTaskThread())
+    {
+        wakeup();
+    }
+}
+
+void EventLoop::runInLoop(Task task)
+{
+    if (isInLoopThread())
+    {
+        task();
+        return;
+    }
+    post(std::move(task));
+}
+
+void EventLoop::runAndWait(Task task)
+{
+    if (isInLoopThread() || !running_)
+    {
+        task();
+        return;
+    }
+    std::shared_ptr<std::promise<void>> done = std::make_shared<std::promise<void>>();
+    std::future<void> f = done->get_future();
+    post([task, done]() {
+        task();
+        done->set_value();
+    });
+    f.wait();
+}
+
+void EventLoop::deferRelease(std::shared_ptr<void> object)
+{
+    if (dispatchThreads_ == 1)
+    {
+        // tasks run after the batch, the lambda drops the last reference there
+        post([object]() {});
+        return;
+    }
+    // a dispatch thread may hold the object's event from an epoll_wait() that returned before it was removed,
+    // that round is over once its counter moved on
+    Retired retired;
+    retired.object = std::move(object);
+    retired.rounds.resize(dispatchThreads_);
+    for (size_t i = 0; i < dispatchThreads_; ++i)
+    {
+        retired.rounds[i] = rounds_[i].load(std::memory_order_acquire);
+    }
+    std::lock_guard<std::mutex> lock(retiredMutex_);
+    retired_.push_back(std::move(retired));
+}
+
+void EventLoop::reclaim()
+{
+    std::vector<Retired> released;
+    {
+        std::lock_guard<std::mutex> lock(retiredMutex_);
+        if (retired_.empty())
+        {
+            return;
+        }
+        size_t kept = 0;
+        for (size_t r = 0; r < retired_.size(); ++r)
+        {
+            bool busy = false;
+            for (size_t i = 0; i < dispatchThreads_ && !busy; ++i)
+            {
+                busy = rounds_[i].load(std::memory_order_acquire) == retired_[r].rounds[i];
+            }
+            if (busy)
+            {
+                if (kept != r)
+                {
+                    retired_[kept] = std::move(retired_[r]);
+                }
+                ++kept;
+            }
+            else
+            {
+                released.push_back(std::move(retired_[r]));
+            }
+        }
+        retired_.resize(kept);
+    }
+    // destructors run without the lock
+}
+
+EventLoop::TimerId EventLoop::runAfter(uint64_t delay_ms, Task task)
+{
+    return addTimer(delay_ms, 0, std::move(task));
+}
+
+EventLoop::TimerId EventLoop::runEvery(uint64_t interval_ms, Task task)
+{
+    return addTimer(interval_ms, interval_ms, std::move(task));
+}
+
+EventLoop::TimerId EventLoop::addTimer(uint64_t delay_ms, uint64_t interval_ms, Task task)
+{
+    TimerId id = nextTimerId_++;
+    uint64_t deadline = monotonicNs() + delay_ms * 1000000ULL;
+    std::shared_ptr<Task> t = std::make_shared<Task>(std::move(task));
+    Task add = [this, id, deadline, interval_ms, t]() {
+        timers_[id] = Timer { deadline, interval_ms * 1000000ULL, t };
+        timerQueue_.push(std::make_pair(deadline, id));
+    };
+    // not runInLoop(): dispatch threads are loop threads too but timers are the loop thread's
+    if (isTaskThread())
+    {
+        add();
+    }
+    else
+    {
+        post(std::move(add));
+    }
+    return id;
+}
+
+void EventLoop::cancelTimer(TimerId id)
+{
+    Task cancel = [this, id]() {
+        // the heap entry is skipped when it comes up
+        timers_.erase(id);
+    };
+    if (isTaskThread())
+    {
+        cancel();
+    }
+    else
+    {
+        post(std::move(cancel));
+    }
+}
+
+void EventLoop::wakeup()
+{
+    uint64_t one = 1;
+    ssize_t r = ::write(wakeupFd_, &one, sizeof(one));
+    (void)r;
+}
+
+void EventLoop::runTasks()
+{
+    {
+        std::lock_guard<std::mutex> lock(taskMutex_);
+        if (tasks_.empty())
+        {
+            return;
+        }
+        runningTasks_.swap(tasks_);
+    }
+    // tasks posted by these tasks run in the next iteration
+    for (Task& task : runningTasks_)
+    {
+        task();
+    }
+    runningTasks_.clear();
+}
+
+void EventLoop::runTimers()
+{
+    uint64_t now = monotonicNs();
+    while (!timerQueue_.empty() && timerQueue_.top().first <= now)
+    {
+        TimerId id = timerQueue_.top().second;
+        uint64_t deadline = timerQueue_.top().first;
+        timerQueue_.pop();
+        auto it = timers_.find(id);
+        if (it == timers_.end() || it->second.deadlineNs != deadline)
+        {
+            // cancelled
+            continue;
+        }
+        if (it->second.intervalNs == 0)
+        {
+            std::shared_ptr<Task> task = it->second.task;
+            timers_.erase(it);
+            (*task)();
+            continue;
+        }
+        // periodic timer: schedule next run before calling it, the task may cancel itself
+        it->second.deadlineNs = now + it->second.intervalNs;
+        timerQueue_.push(std::make_pair(it->second.deadlineNs, id));
+        std::shared_ptr<Task> task = it->second.task;
+        (*task)();
+    }
+}
+
+int EventLoop::nextTimeout() const
+{
+    int timeout = EpollWaitTime();
+    if (!timerQueue_.empty())
+    {
+        uint64_t now = monotonicNs();
+        uint64_t deadline = timerQueue_.top().first;
+        // round up, waking before the deadline would spin
+        int ms = deadline <= now ? 0 : (int)((deadline - now + 999999) / 1000000);
+        if (ms < timeout)
+        {
+            timeout = ms;
+        }
+    }
+    return timeout;
+}
+
+void EventLoop::track(LoopStage stage, const EventHandler* handler)
+{
+    if (stage == LoopStage::kEvents && handler)
+    {
+        activity_.fd.store(handler->handlerFd(), std::memory_order_relaxed);
+        activity_.handlerType.store(typeid(*handler).name(), std::memory_order_relaxed);
+    }
+    else
+    {
+        activity_.fd.store(-1, std::memory_order_relaxed);
+        activity_.handlerType.store(nullptr, std::memory_order_relaxed);
+    }
+    activity_.stage.store(stage, std::memory_order_release);
+}
+
+void EventLoop::loop()
+{
+    threadId_ = std::this_thread::get_id();
+    tCurrentLoop = this;
+    activity_.tid = (pid_t)syscall(SYS_gettid);
+    // with dispatch threads only the wakeup is waited for here
+    int32_t fd = dispatchThreads_ == 1 ? efd_ : taskFd_;
+    // request some memory, if events ready, socket events will copy to this memory from kernel
+    std::vector<struct epoll_event> alive_events(MaxEvents());
+    // if running_ is false, will exit this loop
+    while (running_)
+    {
+        // call epoll_wait and return ready fds
+        int num = epoll_wait(fd, alive_events.data(), MaxEvents(), nextTimeout());
+        // a few stores per handler while watched, nothing otherwise
+        bool tracking = activity_.tracking.load(std::memory_order_relaxed);
+        uint64_t busy_since = 0;
+        if (tracking)
+        {
+            busy_since = monotonicNs();
+            activity_.busySinceNs.store(busy_since, std::memory_order_release);
+        }
+        for (int i = 0; i < num; ++i)
+        {
+            // dispatch by handler pointer instead of comparing fds
+            EventHandler* handler = static_cast<EventHandler*>(alive_events[i].data.ptr);
+            if (tracking)
+            {
+                track(LoopStage::kEvents, handler);
+            }
+            handler->handleEvent(alive_events[i].events);
+        }
+        if (tracking)
+        {
+            track(LoopStage::kTimers, nullptr);
+        }
+        runTimers();
+        if (tracking)
+        {
+            track(LoopStage::kTasks, nullptr);
+        }
+        runTasks();
+        reclaim();
+        if (tracking)
+        {
+            activity_.busyNs.record(monotonicNs() - busy_since);
+            track(LoopStage::kWaiting, nullptr);
+            activity_.busySinceNs.store(0, std::memory_order_release);
+        }
+        ++iterations_;
+    }
+    // tasks posted while stopping(e.g. deferred releases)
+    runTasks();
+}
+
+void EventLoop::dispatchLoop(size_t index)
+{
+    tCurrentLoop = this;
+    std::vector<struct epoll_event> alive_events(MaxEvents());
+    while (running_)
+    {
+        // oneshot handlers: an fd is in the batch of one thread at a time until its handler re-arms it
+        int num = epoll_wait(efd_, alive_events.data(), MaxEvents(), EpollWaitTime());
+        for (int i = 0; i < num; ++i)
+        {
+            EventHandler* handler = static_cast<EventHandler*>(alive_events[i].data.ptr);
+            handler->handleEvent(alive_events[i].events);
+        }
+        rounds_[index].fetch_add(1, std::memory_order_release);
+    }
+}
+
+
+EventLoopGroup::EventLoopGroup(size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        loops_.push_back(std::make_shared<EventLoop>());
+    }
+}
+
+EventLoopGroup::~EventLoopGroup()
+{
+    stop();
+}
+
+bool EventLoopGroup::start()
+{
+    for (auto& loop : loops_)
+    {
+        if (!loop->start())
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void EventLoopGroup::stop()
+{
+    for (auto& loop : loops_)
+    {
+        loop->stop();
+    }
+}
+
+EventLoopPtr EventLoopGroup::next()
+{
+    return loops_[next_++ % loops_.size()];
+}
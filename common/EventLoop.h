@@ -0,0 +1,236 @@
+/********************************************************************************
+> FileName:	EventLoop.h
+> Author:	Mingping Zhang
+> Email:	mingpingzhang@163.com
+> Create Time:	Wed Mar 29 09:40:22 2023
+********************************************************************************/
+#ifndef EVENTLOOP_H
+#define EVENTLOOP_H
+
+#include "LatencyHistogram.h"
+#include <sys/epoll.h>
+#include <sys/types.h>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// receiver of epoll events of one fd, epoll_event.data.ptr points to it
+class EventHandler
+{
+public:
+    virtual ~EventHandler() = default;
+    // events is the epoll_event.events mask(EPOLLIN/EPOLLOUT/EPOLLRDHUP/EPOLLERR/EPOLLHUP)
+    virtual void handleEvent(uint32_t events) = 0;
+    // the fd served, only for diagnostics(stall reports); -1 when the handler doesn't tell
+    virtual int32_t handlerFd() const
+    { return -1; }
+};
+
+// how a handler registers its fd: edge triggered handlers must drain the fd on every event; level triggered
+// ones may stop early(fairness between fds) and are reported again; oneshot ones are level triggered and
+// disabled after every event until the handler re-arms them(EPOLL_CTL_MOD), so several threads can wait
+// on one epoll set without two of them handling the same fd at a time
+enum class TriggerMode
+{
+    kEdge,
+    kLevel,
+    kOneShot,
+};
+
+// epoll flags added to the events of a handler in mode
+inline uint32_t triggerFlags(TriggerMode mode)
+{
+    return mode == TriggerMode::kEdge ? EPOLLET : (mode == TriggerMode::kOneShot ? EPOLLONESHOT : 0);
+}
+
+inline const char* triggerModeName(TriggerMode mode)
+{
+    return mode == TriggerMode::kEdge ? "edge" : (mode == TriggerMode::kOneShot ? "oneshot" : "level");
+}
+
+// what the loop thread is busy with
+enum class LoopStage
+{
+    kWaiting, // in epoll_wait()
+    kEvents,  // fd handlers
+    kTimers,
+    kTasks,
+};
+
+const char* loopStageName(LoopStage stage);
+
+// the loop thread's current work, written by it only while tracking is set(a LoopWatchdog watches the loop)
+// and read from other threads
+struct LoopActivity
+{
+    std::atomic<bool> tracking { false };
+    std::atomic<pid_t> tid { 0 }; // kernel thread id of the loop thread, signal target
+    std::atomic<uint64_t> busySinceNs { 0 }; // epoll_wait() returned(monotonic), 0 while waiting
+    std::atomic<LoopStage> stage { LoopStage::kWaiting };
+    std::atomic<int32_t> fd { -1 }; // of the handler running, -1 in timers and tasks
+    std::atomic<const char*> handlerType { nullptr }; // mangled type name of the handler running
+    LatencyHistogram busyNs; // work of every iteration, epoll_wait() excluded
+};
+
+// one epoll instance driven by one thread: fd handlers, timers and tasks posted from other threads.
+// servers and clients register on a loop instead of owning a thread each, so many of them can share it.
+// with several dispatch threads, worker threads wait on the epoll set and run the handlers while the loop
+// thread only runs timers and tasks; every handler must then be registered EPOLLONESHOT
+class EventLoop
+{
+public:
+    using Task = std::function<void()>;
+    using TimerId = uint64_t;
+
+    EventLoop();
+    EventLoop(const EventLoop& other)            = delete;
+    EventLoop& operator=(const EventLoop& other) = delete;
+    ~EventLoop();
+
+public:
+    // threads waiting on the epoll set(default 1: the loop thread itself), must be called before start()
+    void setDispatchThreads(size_t count);
+    size_t dispatchThreads() const
+    { return dispatchThreads_; }
+    // create epoll instance and start the loop thread(and the dispatch threads)
+    bool start();
+    // exit the loop and join the thread(from the loop thread itself only ask it to exit,
+    // the loop must then outlive its thread)
+    void stop();
+    bool running() const
+    { return running_; }
+    // the loop thread or one of its dispatch threads
+    bool isInLoopThread() const;
+
+    // add/modify/remove fd in the epoll instance, events of fd are dispatched to handler->handleEvent();
+    // callable from any thread, the handler must stay alive until removed and the current batch is done
+    int32_t addHandler(int32_t fd, uint32_t events, EventHandler* handler);
+    int32_t modifyHandler(int32_t fd, uint32_t events, EventHandler* handler);
+    int32_t removeHandler(int32_t fd);
+
+    // run task on the loop thread after the current batch of events
+    void post(Task task);
+    // run task now if called from the loop thread, otherwise post it
+    void runInLoop(Task task);
+    // run task on the loop thread and wait for it
+    void runAndWait(Task task);
+    // keep object alive until the current batch of events is handled(handlers closed in the middle of a batch),
+    // with several dispatch threads until every one of them finished the batch it is in
+    void deferRelease(std::shared_ptr<void> object);
+
+    // timers run on the loop thread, resolution is one millisecond
+    TimerId runAfter(uint64_t delay_ms, Task task);
+    TimerId runEvery(uint64_t interval_ms, Task task);
+    void cancelTimer(TimerId id);
+
+    // loop iterations so far, read by monitors from other threads
+    uint64_t iterations() const
+    { return iterations_; }
+    // what the loop thread is doing, tracked while activity().tracking is set; with dispatch threads it
+    // covers the timers and tasks of the loop thread only
+    LoopActivity& activity()
+    { return activity_; }
+
+private:
+    struct Timer
+    {
+        uint64_t deadlineNs;
+        uint64_t intervalNs; // 0 for one shot
+        std::shared_ptr<Task> task; // shared so a periodic run doesn't copy the function
+    };
+    // wakes epoll_wait when tasks are posted
+    class WakeupHandler : public EventHandler
+    {
+    public:
+        explicit WakeupHandler(int fd) : fd_(fd) {}
+        void handleEvent(uint32_t events) override;
+        int32_t handlerFd() const override
+        { return fd_; }
+    private:
+        int fd_;
+    };
+
+    void loop();
+    // wait on the epoll set and dispatch, one per dispatch thread when there are several
+    void dispatchLoop(size_t index);
+    // release objects of deferRelease() no dispatch thread can still be using
+    void reclaim();
+    // close the epoll, wakeup and task fds(stop() or a failed start())
+    void closeFds();
+    // timers and tasks belong to the loop thread
+    bool isTaskThread() const
+    { return std::this_thread::get_id() == threadId_; }
+    void wakeup();
+    void runTasks();
+    void runTimers();
+    // epoll_wait timeout in ms: EpollWaitTime() or earlier when a timer is due
+    int nextTimeout() const;
+    TimerId addTimer(uint64_t delay_ms, uint64_t interval_ms, Task task);
+    // the loop thread enters stage, running handler in kEvents
+    void track(LoopStage stage, const EventHandler* handler);
+
+    int32_t efd_ { -1 }; // epoll fd
+    int32_t wakeupFd_ { -1 }; // eventfd
+    size_t dispatchThreads_ { 1 };
+    int32_t taskFd_ { -1 }; // epoll fd of the loop thread(wakeup only) when dispatch threads run the handlers
+    std::vector<std::thread> dispatchers_;
+    std::unique_ptr<std::atomic<uint64_t>[]> rounds_; // epoll_wait() rounds finished by every dispatch thread
+    // an object of deferRelease() and the rounds of the dispatch threads when it was retired
+    struct Retired
+    {
+        std::shared_ptr<void> object;
+        std::vector<uint64_t> rounds;
+    };
+    std::mutex retiredMutex_; // guard retired_
+    std::vector<Retired> retired_;
+    std::unique_ptr<WakeupHandler> wakeupHandler_;
+    std::thread thread_;
+    std::atomic<std::thread::id> threadId_ { std::thread::id() }; // set by the loop thread itself
+    std::atomic<bool> running_ { false };
+    std::atomic<uint64_t> iterations_ { 0 };
+    LoopActivity activity_;
+
+    std::mutex taskMutex_; // guard tasks_
+    std::vector<Task> tasks_;
+    std::vector<Task> runningTasks_; // swapped with tasks_ by the loop thread
+
+    // timers are only touched on the loop thread
+    std::unordered_map<TimerId, Timer> timers_;
+    std::priority_queue<std::pair<uint64_t, TimerId>, std::vector<std::pair<uint64_t, TimerId>>,
+        std::greater<std::pair<uint64_t, TimerId>>> timerQueue_; // (deadline, id), cancelled ids are skipped
+    std::atomic<TimerId> nextTimerId_ { 1 };
+};
+
+typedef std::shared_ptr<EventLoop> EventLoopPtr;
+
+// a fixed set of started loops handed out round robin, so hundreds of clients/servers share a few threads
+class EventLoopGroup
+{
+public:
+    explicit EventLoopGroup(size_t count);
+    EventLoopGroup(const EventLoopGroup& other)            = delete;
+    EventLoopGroup& operator=(const EventLoopGroup& other) = delete;
+    ~EventLoopGroup();
+
+public:
+    bool start();
+    void stop();
+    // next loop in round robin order
+    EventLoopPtr next();
+    EventLoopPtr loop(size_t index) const
+    { return loops_[index]; }
+    size_t size() const
+    { return loops_.size(); }
+
+private:
+    std::vector<EventLoopPtr> loops_;
+    std::atomic<size_t> next_ { 0 };
+};
+
+#endif//EVENTLOOP_H
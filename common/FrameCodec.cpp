@@ -0,0 +1,296 @@
+/********************************************************************************
+  > FileName:	FrameCodec.cpp
+  > Author:	Mingping Zhang
+  > Email:	mingpingzhang@163.com
+  > Create Time:	Wed Apr  5 14:06:31 2023
+ ********************************************************************************/
+
+#include "FrameCodec.h"
+#include "AppDef.h"
+#include "TimeUtil.h"
+#include <cstdio>
+#include <cstring>
+
+namespace
+{
+
+// "EPZ" + version/kind, then 4 bytes of feature flags
+const char kHelloMagic[4] = { 'E', 'P', 'Z', 1 };
+const char kAckMagic[4] = { 'E', 'P', 'Z', 2 };
+const size_t kHandshakeSize = 8;
+const uint32_t kFeatureLz4 = 1;
+const uint32_t kCompressedBit = 0x80000000U;
+const size_t kHeaderSize = 4;
+
+inline void write32(char* p, uint32_t v)
+{
+    p[0] = (char)v;
+    p[1] = (char)(v >> 8);
+    p[2] = (char)(v >> 16);
+    p[3] = (char)(v >> 24);
+}
+
+inline uint32_t read32(const char* p)
+{
+    const uint8_t* u = reinterpret_cast<const uint8_t*>(p);
+    return u[0] | (u[1] << 8) | (u[2] << 16) | ((uint32_t)u[3] << 24);
+}
+
+std::string handshake(const char* magic, uint32_t features)
+{
+    std::string out(kHandshakeSize, '\0');
+    std::memcpy(&out[0], magic, 4);
+    write32(&out[4], features);
+    return out;
+}
+
+} // namespace
+
+std::string CompressionStats::toString() const
+{
+    char line[256];
+    uint64_t in = messageBytes;
+    uint64_t out = wireBytes;
+    snprintf(line, sizeof(line), "messages=%llu compressed=%llu not_paid=%llu skipped=%llu bytes=%llu wire=%llu "
+        "saved=%.1f%% compress=%.1fms decompress=%.1fms",
+        (unsigned long long)messages.load(), (unsigned long long)compressed.load(),
+        (unsigned long long)notPaid.load(), (unsigned long long)skipped.load(),
+        (unsigned long long)in, (unsigned long long)out, in ? 100.0 * ((double)in - out) / in : 0.0,
+        compressNs / 1e6, decompressNs / 1e6);
+    return line;
+}
+
+FrameCodec::FrameCodec(const CompressionConfig& config, bool server, CompressionStats* stats)
+    : config_ ( config ),
+      stats_ ( stats ),
+      state_ ( server ? kAwaitHello : kAwaitAck ),
+      threshold_ ( config.minSize )
+{
+}
+
+std::string FrameCodec::hello() const
+{
+    return state_ == kAwaitAck ? handshake(kHelloMagic, kFeatureLz4) : std::string();
+}
+
+bool FrameCodec::decode(const char* data, size_t len, std::vector<std::string>& messages, std::string& reply)
+{
+    if (state_ == kAwaitHello || state_ == kAwaitAck)
+    {
+        std::string expected = handshake(state_ == kAwaitHello ? kHelloMagic : kAckMagic, kFeatureLz4);
+        // a plain echo server sends our hello back
+        std::string echo = hello();
+        bool handshaking = true;
+        bool echoed = !echo.empty();
+        while (len > 0 && handshake_.size() < kHandshakeSize && (handshaking || echoed))
+        {
+            size_t i = handshake_.size();
+            handshake_.push_back(*data++);
+            --len;
+            // the feature flags are not compared, only the magic
+            handshaking = handshaking && (i >= 4 || handshake_[i] == expected[i]);
+            echoed = echoed && handshake_[i] == echo[i];
+        }
+        if ((handshaking || echoed) && handshake_.size() < kHandshakeSize)
+        {
+            // wait for the rest
+            return true;
+        }
+        if (handshaking && (read32(&handshake_[4]) & kFeatureLz4))
+        {
+            if (state_ == kAwaitHello)
+            {
+                reply += handshake(kAckMagic, kFeatureLz4);
+            }
+            finishHandshake(true, reply);
+        }
+        else
+        {
+            // a peer without compression: what looked like a handshake is data, but not our echoed hello
+            if (!echoed)
+            {
+                messages.push_back(handshake_);
+            }
+            finishHandshake(false, reply);
+        }
+        handshake_.clear();
+        handshake_.shrink_to_fit();
+    }
+    if (len == 0)
+    {
+        return true;
+    }
+    if (state_ == kPlain)
+    {
+        messages.emplace_back(data, len);
+        return true;
+    }
+    return decodeFrames(data, len, messages);
+}
+
+void FrameCodec::finishHandshake(bool framed, std::string& reply)
+{
+    state_ = framed ? kFramed : kPlain;
+    for (const std::string& message : held_)
+    {
+        const char* wire = nullptr;
+        size_t wire_len = 0;
+        encode(message.data(), message.size(), wire, wire_len);
+        reply.append(wire, wire_len);
+    }
+    held_.clear();
+    held_.shrink_to_fit();
+}
+
+bool FrameCodec::decodeFrames(const char* data, size_t len, std::vector<std::string>& messages)
+{
+    // whole frames are decoded straight from data, only a partial frame is copied
+    const char* p = data;
+    size_t n = len;
+    if (!input_.empty())
+    {
+        input_.append(data, len);
+        p = input_.data();
+        n = input_.size();
+    }
+    size_t off = 0;
+    while (n - off >= kHeaderSize)
+    {
+        uint32_t header = read32(p + off);
+        size_t body_len = header & ~kCompressedBit;
+        if (body_len > MaxOutputBufferSize())
+        {
+            return false;
+        }
+        if (n - off < kHeaderSize + body_len)
+        {
+            break;
+        }
+        const char* body = p + off + kHeaderSize;
+        if (header & kCompressedBit)
+        {
+            if (body_len < 4)
+            {
+                return false;
+            }
+            size_t orig_len = read32(body);
+            if (orig_len > MaxOutputBufferSize())
+            {
+                return false;
+            }
+            uint64_t begin = monotonicNs();
+            messages.emplace_back(orig_len, '\0');
+            ssize_t r = Lz4Codec::decompress(body + 4, body_len - 4, &messages.back()[0], orig_len);
+            if (r != (ssize_t)orig_len)
+            {
+                return false;
+            }
+            if (stats_)
+            {
+                stats_->decompressNs += monotonicNs() - begin;
+            }
+        }
+        else
+        {
+            messages.emplace_back(body, body_len);
+        }
+        off += kHeaderSize + body_len;
+    }
+    if (p == input_.data())
+    {
+        input_.erase(0, off);
+    }
+    else
+    {
+        input_.assign(p + off, n - off);
+    }
+    return true;
+}
+
+bool FrameCodec::encode(const char* data, size_t len, const char*& wire, size_t& wire_len)
+{
+    if (state_ == kAwaitAck)
+    {
+        held_.emplace_back(data, len);
+        return false;
+    }
+    if (state_ != kFramed)
+    {
+        // plain stream, or a server that hasn't seen the first bytes of its client yet
+        wire = data;
+        wire_len = len;
+        return true;
+    }
+    frame(data, len);
+    wire = frame_.data();
+    wire_len = frameLen_;
+    if (stats_)
+    {
+        ++stats_->messages;
+        stats_->messageBytes += len;
+        stats_->wireBytes += wire_len;
+    }
+    return true;
+}
+
+void FrameCodec::frame(const char* data, size_t len)
+{
+    bool eligible = (len >= threshold_);
+    if (eligible && backoff_ > 0)
+    {
+        // recent messages didn't compress, don't spend cpu on every one
+        --backoff_;
+        eligible = false;
+        if (stats_)
+        {
+            ++stats_->skipped;
+        }
+    }
+    if (eligible)
+    {
+        // header, original length, block; the scratch only grows
+        size_t bound = kHeaderSize + 4 + Lz4Codec::compressBound(len);
+        if (frame_.size() < bound)
+        {
+            frame_.resize(bound);
+        }
+        uint64_t begin = monotonicNs();
+        size_t n = lz4_.compress(data, len, &frame_[kHeaderSize + 4], bound - kHeaderSize - 4);
+        if (stats_)
+        {
+            stats_->compressNs += monotonicNs() - begin;
+        }
+        if (n > 0 && n < len * config_.payoffRatio)
+        {
+            write32(&frame_[0], (uint32_t)(n + 4) | kCompressedBit);
+            write32(&frame_[kHeaderSize], (uint32_t)len);
+            frameLen_ = kHeaderSize + 4 + n;
+            misses_ = 0;
+            // messages of this size pay, try smaller ones again
+            threshold_ = (threshold_ / 2 > config_.minSize) ? threshold_ / 2 : config_.minSize;
+            if (stats_)
+            {
+                ++stats_->compressed;
+            }
+            return;
+        }
+        // back off exponentially(1, 3, 7 .. 63 messages) and raise the threshold when small messages don't pay
+        ++misses_;
+        backoff_ = (1U << (misses_ < 6 ? misses_ : 6)) - 1;
+        if (len < threshold_ * 2)
+        {
+            threshold_ = (threshold_ * 2 < config_.maxThreshold) ? threshold_ * 2 : config_.maxThreshold;
+        }
+        if (stats_)
+        {
+            ++stats_->notPaid;
+        }
+    }
+    if (frame_.size() < kHeaderSize + len)
+    {
+        frame_.resize(kHeaderSize + len);
+    }
+    write32(&frame_[0], (uint32_t)len);
+    std::memcpy(&frame_[kHeaderSize], data, len);
+    frameLen_ = kHeaderSize + len;
+}
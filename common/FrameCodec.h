@@ -0,0 +1,97 @@
+/********************************************************************************
+> FileName:	FrameCodec.h
+> Author:	Mingping Zhang
+> Email:	mingpingzhang@163.com
+> Create Time:	Wed Apr  5 14:06:31 2023
+********************************************************************************/
+#ifndef FRAMECODEC_H
+#define FRAMECODEC_H
+
+#include "Lz4Codec.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// per message compression of a tcp connection, off by default
+struct CompressionConfig
+{
+    bool enabled { false };
+    size_t minSize { 256 };           // messages below are never compressed
+    size_t maxThreshold { 64 * 1024 }; // the size threshold rises up to this while small messages don't pay
+    double payoffRatio { 0.9 };       // sent compressed only when compressed/original is below
+};
+
+// counters of the compression of a server's or client's connections, readable from any thread
+struct CompressionStats
+{
+    std::atomic<uint64_t> messages { 0 };     // messages framed for sending
+    std::atomic<uint64_t> compressed { 0 };   // sent compressed
+    std::atomic<uint64_t> notPaid { 0 };      // compressed but sent raw, ratio above payoffRatio
+    std::atomic<uint64_t> skipped { 0 };      // over the threshold, not tried(backing off after misses)
+    std::atomic<uint64_t> messageBytes { 0 }; // message bytes before compression
+    std::atomic<uint64_t> wireBytes { 0 };    // frame bytes written, headers included
+    std::atomic<uint64_t> compressNs { 0 };
+    std::atomic<uint64_t> decompressNs { 0 };
+
+    // "messages=10 compressed=8 ... saved=61.2%"
+    std::string toString() const;
+};
+
+// framing and lz4 compression of messages on a byte stream, negotiated in band: the client starts with a
+// hello, a server that knows it answers with an ack and both sides switch to frames. any other first bytes
+// leave the connection as plain stream(a server without compression, a client that didn't ask).
+// frame: 4 byte little endian header, bit 31 set when compressed, bits 0..30 the body length;
+// compressed bodies start with the 4 byte original length. the client speaks first(a server message before
+// the hello goes out plain). not thread safe, the owner serializes calls
+class FrameCodec
+{
+public:
+    FrameCodec(const CompressionConfig& config, bool server, CompressionStats* stats);
+    FrameCodec(const FrameCodec& other)            = delete;
+    FrameCodec& operator=(const FrameCodec& other) = delete;
+
+public:
+    // bytes to write before anything else, the client hello(empty for the server)
+    std::string hello() const;
+    // feed received bytes: complete messages are appended to messages, bytes to send back raw(the ack,
+    // messages held while negotiating) to reply; false when the stream is malformed
+    bool decode(const char* data, size_t len, std::vector<std::string>& messages, std::string& reply);
+    // frame message for the socket: wire points to the frame(a scratch buffer reused by the next call) or to
+    // data itself on a plain stream; false when the message is held until negotiation is done
+    bool encode(const char* data, size_t len, const char*& wire, size_t& wire_len);
+    // frames in use, false while negotiating or on a plain stream
+    bool framed() const
+    { return state_ == kFramed; }
+
+private:
+    enum State
+    {
+        kAwaitHello, // server: first bytes decide
+        kAwaitAck,   // client: hello sent, messages held
+        kFramed,
+        kPlain,
+    };
+    // end negotiation, held messages go to reply
+    void finishHandshake(bool framed, std::string& reply);
+    // frame message into frame_
+    void frame(const char* data, size_t len);
+    bool decodeFrames(const char* data, size_t len, std::vector<std::string>& messages);
+
+    CompressionConfig config_;
+    CompressionStats* stats_; // may be null
+    State state_;
+    std::string handshake_; // bytes of hello/ack received so far
+    std::vector<std::string> held_; // client messages sent before the ack
+
+    Lz4Codec lz4_;
+    std::vector<char> frame_; // scratch of encode(), only grows
+    size_t frameLen_ { 0 };   // bytes of the last frame in frame_
+    std::string input_; // partial frame received
+    size_t threshold_;  // current size threshold, between config_.minSize and config_.maxThreshold
+    uint32_t misses_ { 0 }; // attempts in a row that didn't pay
+    uint32_t backoff_ { 0 }; // eligible messages left to skip
+};
+
+#endif//FRAMECODEC_H
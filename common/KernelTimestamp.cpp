@@ -0,0 +1,96 @@
+/********************************************************************************
+  > FileName:	KernelTimestamp.cpp
+  > Author:	Mingping Zhang
+  > Email:	mingpingzhang@163.com
+  > Create Time:	Thu Mar 30 11:05:19 2023
+ ********************************************************************************/
+
+#include "KernelTimestamp.h"
+#include <linux/net_tstamp.h>
+#include <netinet/in.h>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+static uint64_t timespecNs(const struct timespec& ts)
+{
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+bool enableKernelTimestamps(int fd, bool tx)
+{
+    int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+    if (tx)
+    {
+        // OPT_ID: tag every timestamp with the byte/send counter, TSONLY: don't loop the payload back
+        flags |= SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+    }
+    if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) < 0)
+    {
+        std::cout << "fd: " << fd << " SO_TIMESTAMPING failed! errno:" << errno << std::endl;
+        return false;
+    }
+    return true;
+}
+
+uint64_t rxTimestampOf(const struct msghdr* msg)
+{
+    for (struct cmsghdr* cm = CMSG_FIRSTHDR(msg); cm; cm = CMSG_NXTHDR(const_cast<struct msghdr*>(msg), cm))
+    {
+        if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPING)
+        {
+            struct scm_timestamping ts;
+            std::memcpy(&ts, CMSG_DATA(cm), sizeof(ts));
+            // ts[0] software, ts[2] raw hardware
+            return timespecNs(ts.ts[0]);
+        }
+    }
+    return 0;
+}
+
+int32_t readTxTimestamps(int fd, const std::function<void(uint32_t id, uint64_t ns)>& cb)
+{
+    int32_t count = 0;
+    char control[512];
+    while (true)
+    {
+        struct msghdr msg;
+        std::memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+        {
+            // EAGAIN: queue drained
+            break;
+        }
+        uint64_t ns = 0;
+        bool has_id = false;
+        uint32_t id = 0;
+        for (struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+        {
+            if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPING)
+            {
+                struct scm_timestamping ts;
+                std::memcpy(&ts, CMSG_DATA(cm), sizeof(ts));
+                ns = timespecNs(ts.ts[0]);
+            }
+            else if ((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR)
+                || (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+            {
+                struct sock_extended_err err;
+                std::memcpy(&err, CMSG_DATA(cm), sizeof(err));
+                if (err.ee_errno == ENOMSG && err.ee_origin == SO_EE_ORIGIN_TIMESTAMPING)
+                {
+                    id = err.ee_data;
+                    has_id = true;
+                }
+            }
+        }
+        if (ns != 0 && has_id)
+        {
+            cb(id, ns);
+            ++count;
+        }
+    }
+    return count;
+}
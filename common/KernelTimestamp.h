@@ -0,0 +1,27 @@
+/********************************************************************************
+> FileName:	KernelTimestamp.h
+> Author:	Mingping Zhang
+> Email:	mingpingzhang@163.com
+> Create Time:	Thu Mar 30 11:05:19 2023
+********************************************************************************/
+#ifndef KERNELTIMESTAMP_H
+#define KERNELTIMESTAMP_H
+
+#include <sys/socket.h>
+#include <linux/errqueue.h>
+#include <cstdint>
+#include <functional>
+
+// control buffer size of recvmsg() for one SCM_TIMESTAMPING message
+static const size_t kTimestampControlSize = CMSG_SPACE(sizeof(struct scm_timestamping));
+
+// software receive timestamps for every packet and, if tx, software transmit timestamps reported on
+// the error queue with a byte(tcp) or send(udp) counter as id; return false if the kernel refuses it
+bool enableKernelTimestamps(int fd, bool tx);
+// receive timestamp(CLOCK_REALTIME ns) carried by the control data of recvmsg(), 0 if none
+uint64_t rxTimestampOf(const struct msghdr* msg);
+// drain the error queue of fd, call cb(id, CLOCK_REALTIME ns) for every transmit timestamp;
+// return the number of timestamps
+int32_t readTxTimestamps(int fd, const std::function<void(uint32_t id, uint64_t ns)>& cb);
+
+#endif//KERNELTIMESTAMP_H
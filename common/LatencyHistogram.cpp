@@ -0,0 +1,122 @@
+/********************************************************************************
+  > FileName:	LatencyHistogram.cpp
+  > Author:	Mingping Zhang
+  > Email:	mingpingzhang@163.com
+  > Create Time:	Thu Mar 30 10:12:37 2023
+ ********************************************************************************/
+
+#include "LatencyHistogram.h"
+#include <cstdio>
+
+LatencyHistogram::LatencyHistogram()
+{
+    reset();
+}
+
+size_t LatencyHistogram::bucketOf(uint64_t ns)
+{
+    if (ns < kSubBuckets)
+    {
+        return ns;
+    }
+    // msb >= 4, the 4 bits below it select the sub bucket
+    size_t msb = 63 - __builtin_clzll(ns);
+    size_t sub = (ns >> (msb - 4)) & (kSubBuckets - 1);
+    return (msb - 3) * kSubBuckets + sub;
+}
+
+uint64_t LatencyHistogram::bucketUpper(size_t index)
+{
+    if (index < kSubBuckets)
+    {
+        return index;
+    }
+    size_t msb = index / kSubBuckets + 3;
+    uint64_t sub = index % kSubBuckets;
+    uint64_t low = (kSubBuckets + sub) << (msb - 4);
+    return low + ((1ULL << (msb - 4)) - 1);
+}
+
+void LatencyHistogram::record(uint64_t ns)
+{
+    buckets_[bucketOf(ns)].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    sum_.fetch_add(ns, std::memory_order_relaxed);
+    uint64_t cur = max_.load(std::memory_order_relaxed);
+    while (ns > cur && !max_.compare_exchange_weak(cur, ns, std::memory_order_relaxed))
+    {
+    }
+}
+
+void LatencyHistogram::reset()
+{
+    for (size_t i = 0; i < kBuckets; ++i)
+    {
+        buckets_[i].store(0, std::memory_order_relaxed);
+    }
+    count_ = 0;
+    sum_ = 0;
+    max_ = 0;
+}
+
+double LatencyHistogram::mean() const
+{
+    uint64_t n = count();
+    return n == 0 ? 0 : (double)sum_.load(std::memory_order_relaxed) / n;
+}
+
+uint64_t LatencyHistogram::percentile(double p) const
+{
+    uint64_t n = count();
+    if (n == 0)
+    {
+        return 0;
+    }
+    // rank of the wanted value, 1 based
+    uint64_t rank = (uint64_t)(p / 100.0 * n + 0.5);
+    if (rank < 1)
+    {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (size_t i = 0; i < kBuckets; ++i)
+    {
+        seen += buckets_[i].load(std::memory_order_relaxed);
+        if (seen >= rank)
+        {
+            uint64_t upper = bucketUpper(i);
+            return upper < max() ? upper : max();
+        }
+    }
+    return max();
+}
+
+std::string LatencyHistogram::summary() const
+{
+    char line[160];
+    snprintf(line, sizeof(line), "n=%llu avg=%.1fus p50=%.1fus p99=%.1fus p999=%.1fus max=%.1fus",
+        (unsigned long long)count(), mean() / 1e3, percentile(50) / 1e3, percentile(99) / 1e3,
+        percentile(99.9) / 1e3, max() / 1e3);
+    return line;
+}
+
+
+void LatencyStats::reset()
+{
+    kernelToRead.reset();
+    readToCallback.reset();
+    callback.reset();
+    callbackToWrite.reset();
+    writeToTx.reset();
+}
+
+std::string LatencyStats::toString() const
+{
+    std::string out;
+    out += "kernel->read      " + kernelToRead.summary() + "\n";
+    out += "read->callback    " + readToCallback.summary() + "\n";
+    out += "callback          " + callback.summary() + "\n";
+    out += "callback->write   " + callbackToWrite.summary() + "\n";
+    out += "write->tx         " + writeToTx.summary() + "\n";
+    return out;
+}
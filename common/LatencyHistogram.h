@@ -0,0 +1,64 @@
+/********************************************************************************
+> FileName:	LatencyHistogram.h
+> Author:	Mingping Zhang
+> Email:	mingpingzhang@163.com
+> Create Time:	Thu Mar 30 10:12:37 2023
+********************************************************************************/
+#ifndef LATENCYHISTOGRAM_H
+#define LATENCYHISTOGRAM_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+// log-linear histogram of nanosecond values: exact below 16, above that 16 buckets per power of two
+// (about 6% error). record() is lock free, so the loop thread and sending threads can share one
+class LatencyHistogram
+{
+public:
+    static const size_t kSubBuckets = 16;
+    static const size_t kBuckets = 61 * kSubBuckets; // up to 2^64 - 1
+
+    LatencyHistogram();
+    LatencyHistogram(const LatencyHistogram& other)            = delete;
+    LatencyHistogram& operator=(const LatencyHistogram& other) = delete;
+
+public:
+    void record(uint64_t ns);
+    void reset();
+
+    uint64_t count() const
+    { return count_.load(std::memory_order_relaxed); }
+    uint64_t max() const
+    { return max_.load(std::memory_order_relaxed); }
+    double mean() const;
+    // upper bound of the bucket holding the p-th percentile(p in 0..100), 0 when empty
+    uint64_t percentile(double p) const;
+    // "n=1000 avg=12.1us p50=11.0us p99=30.2us p999=80.0us max=95.3us"
+    std::string summary() const;
+
+private:
+    static size_t bucketOf(uint64_t ns);
+    static uint64_t bucketUpper(size_t index);
+
+    std::atomic<uint64_t> buckets_[kBuckets];
+    std::atomic<uint64_t> count_ { 0 };
+    std::atomic<uint64_t> sum_ { 0 };
+    std::atomic<uint64_t> max_ { 0 };
+};
+
+// where a message spends its time inside the server, one histogram per stage
+struct LatencyStats
+{
+    LatencyHistogram kernelToRead;    // kernel receive timestamp -> read() returned(socket queue + loop wakeup)
+    LatencyHistogram readToCallback;  // read() returned -> recv callback entered(packet construction, dispatch)
+    LatencyHistogram callback;        // recv callback entered -> returned(handler)
+    LatencyHistogram callbackToWrite; // recv callback entered -> reply accepted by socket(incl. waiting for EPOLLOUT)
+    LatencyHistogram writeToTx;       // reply accepted by socket -> kernel transmit timestamp(tcp plaintext only)
+
+    void reset();
+    // one line per stage
+    std::string toString() const;
+};
+
+#endif//LATENCYHISTOGRAM_H
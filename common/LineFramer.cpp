@@ -0,0 +1,178 @@
+/********************************************************************************
+  > FileName:	LineFramer.cpp
+  > Author:	Mingping Zhang
+  > Email:	mingpingzhang@163.com
+  > Create Time:	Tue Apr 11 09:41:06 2023
+ ********************************************************************************/
+
+#include "LineFramer.h"
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+namespace
+{
+
+typedef size_t (*find_byte_t)(const char* data, size_t len, char c);
+
+find_byte_t pickFindByte(const char*& name)
+{
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        name = "avx2";
+        return findByteAvx2;
+    }
+    // part of x86-64
+    name = "sse2";
+    return findByteSse2;
+#else
+    name = "scalar";
+    return findByteScalar;
+#endif
+}
+
+const char* gFindByteName = "scalar";
+const find_byte_t gFindByte = pickFindByte(gFindByteName);
+
+} // namespace
+
+size_t findByteScalar(const char* data, size_t len, char c)
+{
+    for (size_t i = 0; i < len; ++i)
+    {
+        if (data[i] == c)
+        {
+            return i;
+        }
+    }
+    return len;
+}
+
+#if defined(__x86_64__)
+
+size_t findByteSse2(const char* data, size_t len, char c)
+{
+    const __m128i needle = _mm_set1_epi8(c);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, needle));
+        if (mask != 0)
+        {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + findByteScalar(data + i, len - i, c);
+}
+
+__attribute__((target("avx2")))
+size_t findByteAvx2(const char* data, size_t len, char c)
+{
+    const __m256i needle = _mm256_set1_epi8(c);
+    size_t i = 0;
+    if (len >= 32)
+    {
+        // short lines end in the first block
+        __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data));
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, needle));
+        if (mask != 0)
+        {
+            return __builtin_ctz(mask);
+        }
+        i = 32;
+    }
+    // two blocks per round, one branch for both while there is no match
+    for (; i + 64 <= len; i += 64)
+    {
+        __m256i a = _mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i)), needle);
+        __m256i b = _mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i + 32)), needle);
+        if (!_mm256_testz_si256(_mm256_or_si256(a, b), _mm256_or_si256(a, b)))
+        {
+            uint32_t mask = (uint32_t)_mm256_movemask_epi8(a);
+            if (mask != 0)
+            {
+                return i + __builtin_ctz(mask);
+            }
+            return i + 32 + __builtin_ctz((uint32_t)_mm256_movemask_epi8(b));
+        }
+    }
+    for (; i + 32 <= len; i += 32)
+    {
+        __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, needle));
+        if (mask != 0)
+        {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + findByteSse2(data + i, len - i, c);
+}
+
+#else
+
+size_t findByteSse2(const char* data, size_t len, char c)
+{
+    return findByteScalar(data, len, c);
+}
+
+size_t findByteAvx2(const char* data, size_t len, char c)
+{
+    return findByteScalar(data, len, c);
+}
+
+#endif
+
+size_t findByte(const char* data, size_t len, char c)
+{
+    return gFindByte(data, len, c);
+}
+
+const char* findByteName()
+{
+    return gFindByteName;
+}
+
+LineFramer::LineFramer(const LineFramingConfig& config)
+    : config_ ( config )
+{
+}
+
+bool LineFramer::feed(const char* data, size_t len, std::vector<std::string>& lines)
+{
+    size_t start = 0;
+    while (start < len)
+    {
+        size_t pos = findByte(data + start, len - start, config_.delimiter);
+        if (pos == len - start)
+        {
+            break;
+        }
+        size_t end = start + pos + 1;
+        if (partial_.size() + (end - start) > config_.maxLineLength)
+        {
+            return false;
+        }
+        size_t keep = config_.keepDelimiter ? end : end - 1;
+        if (partial_.empty())
+        {
+            lines.emplace_back(data + start, keep - start);
+        }
+        else
+        {
+            // the line started in an earlier read
+            partial_.append(data + start, keep - start);
+            lines.push_back(std::move(partial_));
+            partial_.clear();
+        }
+        start = end;
+    }
+    if (partial_.size() + (len - start) > config_.maxLineLength)
+    {
+        return false;
+    }
+    partial_.append(data + start, len - start);
+    return true;
+}
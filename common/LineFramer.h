@@ -0,0 +1,64 @@
+/********************************************************************************
+> FileName:	LineFramer.h
+> Author:	Mingping Zhang
+> Email:	mingpingzhang@163.com
+> Create Time:	Tue Apr 11 09:41:06 2023
+********************************************************************************/
+#ifndef LINEFRAMER_H
+#define LINEFRAMER_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// newline delimited messages on a byte stream, off by default
+struct LineFramingConfig
+{
+    bool enabled { false };
+    char delimiter { '\n' };
+    size_t maxLineLength { 64 * 1024 }; // delimiter included, a longer line closes the connection
+    bool keepDelimiter { true };        // delivered lines end with it, an echo stays line framed
+};
+
+// counters of the line framing of a server's connections, readable from any thread
+struct LineStats
+{
+    std::atomic<uint64_t> lines { 0 };    // delivered
+    std::atomic<uint64_t> tooLong { 0 };  // connections closed over maxLineLength
+};
+
+// position of the first c in data, len when there is none. the avx2, sse2 or scalar scan, picked once by what
+// the cpu supports
+size_t findByte(const char* data, size_t len, char c);
+// "avx2", "sse2" or "scalar", the scan findByte() uses
+const char* findByteName();
+// the scans themselves(benchmarks), findByteAvx2() only when findByteName() is "avx2", sse2 falls back to
+// scalar off x86
+size_t findByteScalar(const char* data, size_t len, char c);
+size_t findByteSse2(const char* data, size_t len, char c);
+size_t findByteAvx2(const char* data, size_t len, char c);
+
+// splits a byte stream into lines. the start of a line without its delimiter yet is kept and only the bytes
+// read after it are scanned. not thread safe, the owner serializes calls
+class LineFramer
+{
+public:
+    explicit LineFramer(const LineFramingConfig& config);
+    LineFramer(const LineFramer& other)            = delete;
+    LineFramer& operator=(const LineFramer& other) = delete;
+
+public:
+    // feed received bytes, complete lines are appended to lines; false when a line exceeds maxLineLength
+    bool feed(const char* data, size_t len, std::vector<std::string>& lines);
+    // bytes of the incomplete line
+    size_t buffered() const
+    { return partial_.size(); }
+
+private:
+    LineFramingConfig config_;
+    std::string partial_; // no delimiter in it
+};
+
+#endif//LINEFRAMER_H
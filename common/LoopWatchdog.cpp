@@ -0,0 +1,280 @@
+/********************************************************************************
+  > FileName:	LoopWatchdog.cpp
+  > Author:	Mingping Zhang
+  > Email:	mingpingzhang@163.com
+  > Create Time:	Thu Apr 13 09:27:44 2023
+ ********************************************************************************/
+
+#include "LoopWatchdog.h"
+#include "TimeUtil.h"
+#include <cxxabi.h>
+#include <execinfo.h>
+#include <signal.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+namespace
+{
+
+// the stack of the signalled loop thread, written by its signal handler. one capture at a time in the process;
+// every request carries a sequence number in the signal's value, the handler writes only for the request
+// still waiting, so a signal answered after its capture gave up can't overwrite the frames of the next one
+const int kMaxFrames = 64;
+void* gFrames[kMaxFrames];
+std::atomic<int> gDepth { 0 };
+std::atomic<uint32_t> gRequest { 0 };  // sequence of the capture waiting for its handler, 0: none
+std::atomic<uint32_t> gCaptured { 0 }; // sequence whose stack is in gFrames
+uint32_t gSequence = 0;                // guarded by gCaptureMutex
+std::mutex gCaptureMutex;
+
+void onCaptureSignal(int, siginfo_t* info, void*)
+{
+    uint32_t seq = (uint32_t)info->si_value.sival_int;
+    uint32_t expected = seq;
+    if (seq == 0 || !gRequest.compare_exchange_strong(expected, 0, std::memory_order_acq_rel))
+    {
+        // late, given up already
+        return;
+    }
+    int saved = errno;
+    gDepth.store(backtrace(gFrames, kMaxFrames), std::memory_order_relaxed);
+    gCaptured.store(seq, std::memory_order_release);
+    errno = saved;
+}
+
+std::string demangle(const char* name)
+{
+    int status = 0;
+    char* plain = abi::__cxa_demangle(name, nullptr, nullptr, &status);
+    if (status != 0 || !plain)
+    {
+        return name;
+    }
+    std::string result(plain);
+    free(plain);
+    return result;
+}
+
+// "module(mangled+0x1f) [0x...]" of backtrace_symbols() -> "demangled+0x1f (module)"
+std::string symbolize(const char* line)
+{
+    std::string text(line);
+    size_t open = text.find('(');
+    size_t plus = text.find('+', open);
+    size_t close = text.find(')', open);
+    if (open == std::string::npos || plus == std::string::npos || close == std::string::npos || plus > close ||
+        plus == open + 1)
+    {
+        return text;
+    }
+    std::string name = demangle(text.substr(open + 1, plus - open - 1).c_str());
+    return name + text.substr(plus, close - plus) + " (" + text.substr(0, open) + ")";
+}
+
+} // namespace
+
+std::string StallReport::toString() const
+{
+    char head[256];
+    snprintf(head, sizeof(head), "loop %s stalled %.1f ms in %s", loop.c_str(), busyNs / 1e6, loopStageName(stage));
+    std::string text(head);
+    if (!handler.empty())
+    {
+        text += ", handler " + handler + " fd " + std::to_string(fd);
+    }
+    for (size_t i = 0; i < stack.size(); ++i)
+    {
+        text += "\n  #" + std::to_string(i) + " " + stack[i];
+    }
+    return text;
+}
+
+LoopWatchdog::LoopWatchdog(const WatchdogConfig& config)
+    : config_ ( config )
+{
+    if (config_.signal == 0)
+    {
+        config_.signal = SIGRTMIN + 1;
+    }
+    reportCallback_ = [](const StallReport& report) { std::cout << report.toString() << std::endl; };
+}
+
+LoopWatchdog::~LoopWatchdog()
+{
+    stop();
+}
+
+void LoopWatchdog::watch(const EventLoopPtr& loop, const std::string& name)
+{
+    loop->activity().tracking = true;
+    std::shared_ptr<Watched> w = std::make_shared<Watched>();
+    w->loop = loop;
+    w->name = name;
+    std::lock_guard<std::mutex> lock(mutex_);
+    watched_.push_back(w);
+}
+
+void LoopWatchdog::setReportCallback(std::function<void(const StallReport&)> callback)
+{
+    reportCallback_ = std::move(callback);
+}
+
+bool LoopWatchdog::start()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (running_)
+    {
+        return true;
+    }
+    if (config_.backtrace)
+    {
+        // the first backtrace() loads libgcc, not something to do in a signal handler
+        void* frame[1];
+        backtrace(frame, 1);
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_sigaction = onCaptureSignal;
+        sa.sa_flags = SA_RESTART | SA_SIGINFO;
+        sigemptyset(&sa.sa_mask);
+        if (sigaction(config_.signal, &sa, nullptr) != 0)
+        {
+            std::cout << "watchdog: sigaction " << config_.signal << " failed! errno:" << errno << std::endl;
+            return false;
+        }
+    }
+    running_ = true;
+    thread_ = std::thread(&LoopWatchdog::run, this);
+    return true;
+}
+
+void LoopWatchdog::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!running_)
+        {
+            return;
+        }
+        running_ = false;
+        for (auto& w : watched_)
+        {
+            w->loop->activity().tracking = false;
+        }
+    }
+    cond_.notify_all();
+    thread_.join();
+    // the handler stays installed, a late capture signal must not kill the process
+}
+
+void LoopWatchdog::run()
+{
+    std::vector<std::shared_ptr<Watched>> watched;
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (running_)
+    {
+        cond_.wait_for(lock, std::chrono::milliseconds(config_.checkMs));
+        if (!running_)
+        {
+            break;
+        }
+        watched = watched_;
+        // capture waits and the report callback run without the lock, watch()/stop() don't wait for them
+        lock.unlock();
+        uint64_t now = monotonicNs();
+        for (auto& w : watched)
+        {
+            check(*w, now);
+        }
+        lock.lock();
+    }
+}
+
+void LoopWatchdog::check(Watched& w, uint64_t now)
+{
+    LoopActivity& activity = w.loop->activity();
+    uint64_t since = activity.busySinceNs.load(std::memory_order_acquire);
+    if (since == 0 || since == w.reportedSinceNs || now < since + config_.stallMs * 1000000ULL)
+    {
+        return;
+    }
+    w.reportedSinceNs = since;
+    StallReport report;
+    report.loop = w.name;
+    report.busyNs = now - since;
+    report.stage = activity.stage.load(std::memory_order_acquire);
+    report.fd = activity.fd.load(std::memory_order_relaxed);
+    const char* type = activity.handlerType.load(std::memory_order_relaxed);
+    if (report.stage == LoopStage::kEvents && type)
+    {
+        report.handler = demangle(type);
+    }
+    pid_t tid = activity.tid.load(std::memory_order_relaxed);
+    if (config_.backtrace && tid != 0)
+    {
+        report.stack = captureStack(tid);
+    }
+    stalls_.fetch_add(1, std::memory_order_relaxed);
+    reportCallback_(report);
+}
+
+std::vector<std::string> LoopWatchdog::captureStack(pid_t tid)
+{
+    std::vector<std::string> stack;
+    std::lock_guard<std::mutex> lock(gCaptureMutex);
+    uint32_t seq = ++gSequence;
+    if (seq == 0)
+    {
+        seq = ++gSequence;
+    }
+    gRequest.store(seq, std::memory_order_release);
+    siginfo_t info;
+    memset(&info, 0, sizeof(info));
+    info.si_signo = config_.signal;
+    info.si_code = SI_QUEUE;
+    info.si_pid = getpid();
+    info.si_uid = getuid();
+    info.si_value.sival_int = (int)seq;
+    if (syscall(SYS_rt_tgsigqueueinfo, getpid(), tid, config_.signal, &info) != 0)
+    {
+        gRequest.store(0, std::memory_order_relaxed);
+        return stack;
+    }
+    // the loop thread runs the handler as soon as it is scheduled, even inside a blocking call
+    for (int i = 0; i < 100 && gCaptured.load(std::memory_order_acquire) != seq; ++i)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    if (gCaptured.load(std::memory_order_acquire) != seq)
+    {
+        uint32_t expected = seq;
+        if (gRequest.compare_exchange_strong(expected, 0, std::memory_order_acq_rel))
+        {
+            // given up, the handler of this request does nothing when it runs
+            return stack;
+        }
+        // the handler took the request just now, backtrace() is done in a moment
+        while (gCaptured.load(std::memory_order_acquire) != seq)
+        {
+            std::this_thread::yield();
+        }
+    }
+    int depth = gDepth.load(std::memory_order_relaxed);
+    char** symbols = backtrace_symbols(gFrames, depth);
+    if (!symbols)
+    {
+        return stack;
+    }
+    // frame 0 is the signal handler, frame 1 the kernel's signal return trampoline
+    for (int i = 2; i < depth; ++i)
+    {
+        stack.push_back(symbolize(symbols[i]));
+    }
+    free(symbols);
+    return stack;
+}
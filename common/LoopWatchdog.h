@@ -0,0 +1,90 @@
+/********************************************************************************
+> FileName:	LoopWatchdog.h
+> Author:	Mingping Zhang
+> Email:	mingpingzhang@163.com
+> Create Time:	Thu Apr 13 09:27:44 2023
+********************************************************************************/
+#ifndef LOOPWATCHDOG_H
+#define LOOPWATCHDOG_H
+
+#include "EventLoop.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct WatchdogConfig
+{
+    uint64_t stallMs { 100 };  // one loop iteration busy longer is a stall
+    uint64_t checkMs { 10 };   // how often the loops are looked at
+    bool backtrace { true };   // capture the loop thread's stack with a signal
+    int signal { 0 };          // signal for the capture, 0: SIGRTMIN + 1
+};
+
+// one stall, reported once while it lasts
+struct StallReport
+{
+    std::string loop;         // name given to watch()
+    uint64_t busyNs { 0 };    // of the iteration when detected
+    LoopStage stage { LoopStage::kWaiting };
+    int32_t fd { -1 };        // of the handler running(events stage), -1 when unknown
+    std::string handler;      // demangled type of the handler running, empty outside the events stage
+    std::vector<std::string> stack; // symbolized frames of the loop thread, innermost first
+
+    // multi line text: header line and one line per frame
+    std::string toString() const;
+};
+
+// a thread looking at the iteration of every watched loop: when one is busy longer than stallMs(a blocking
+// callback stalls every connection of that loop) the stage, the handler and its fd are reported together
+// with the loop thread's stack, taken by a signal handler on that thread(backtrace(), symbols need
+// -rdynamic). the loops keep histograms of their busy time per iteration(LoopActivity::busyNs)
+class LoopWatchdog
+{
+public:
+    explicit LoopWatchdog(const WatchdogConfig& config);
+    LoopWatchdog(const LoopWatchdog& other)            = delete;
+    LoopWatchdog& operator=(const LoopWatchdog& other) = delete;
+    ~LoopWatchdog();
+
+public:
+    // start tracking the loop's activity, before or after either is started
+    void watch(const EventLoopPtr& loop, const std::string& name);
+    // called on the watchdog thread, the default prints the report to std::cout; before start()
+    void setReportCallback(std::function<void(const StallReport&)> callback);
+    bool start();
+    // the loops stop tracking
+    void stop();
+
+    uint64_t stalls() const
+    { return stalls_; }
+
+private:
+    struct Watched
+    {
+        EventLoopPtr loop;
+        std::string name;
+        uint64_t reportedSinceNs { 0 }; // busySinceNs of the iteration reported last
+    };
+
+    void run();
+    void check(Watched& w, uint64_t now);
+    // signal the loop thread and symbolize its stack, empty when it didn't answer
+    std::vector<std::string> captureStack(pid_t tid);
+
+    WatchdogConfig config_;
+    std::function<void(const StallReport&)> reportCallback_;
+    std::mutex mutex_; // guard watched_ and running_, not held while checking
+    std::condition_variable cond_;
+    std::vector<std::shared_ptr<Watched>> watched_; // reportedSinceNs is the watchdog thread's
+    bool running_ { false };
+    std::thread thread_;
+    std::atomic<uint64_t> stalls_ { 0 };
+};
+
+#endif//LOOPWATCHDOG_H
@@ -0,0 +1,230 @@
+/********************************************************************************
+  > FileName:	Lz4Codec.cpp
+  > Author:	Mingping Zhang
+  > Email:	mingpingzhang@163.com
+  > Create Time:	Wed Apr  5 14:06:31 2023
+ ********************************************************************************/
+
+#include "Lz4Codec.h"
+#include <cstring>
+
+namespace
+{
+
+const size_t kMinMatch = 4;
+const size_t kLastLiterals = 5; // the block ends with at least 5 literals
+const size_t kMfLimit = 12;     // no match starts in the last 12 bytes
+const size_t kMaxDistance = 65535;
+
+inline uint32_t read32(const uint8_t* p)
+{
+    uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline uint64_t read64(const uint8_t* p)
+{
+    uint64_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// length of the common prefix of mp and rp, mp stops at limit
+inline size_t commonLength(const uint8_t* mp, const uint8_t* rp, const uint8_t* limit)
+{
+    const uint8_t* start = mp;
+    // 8 bytes per step, the first differing byte is the lowest set byte of the xor(little endian)
+    while (mp + 8 <= limit)
+    {
+        uint64_t diff = read64(mp) ^ read64(rp);
+        if (diff)
+        {
+            return mp - start + (__builtin_ctzll(diff) >> 3);
+        }
+        mp += 8;
+        rp += 8;
+    }
+    while (mp < limit && *mp == *rp)
+    {
+        ++mp;
+        ++rp;
+    }
+    return mp - start;
+}
+
+// token nibble 15 is continued by bytes of 255 and a last byte below 255
+inline uint8_t* writeLength(uint8_t* op, size_t len)
+{
+    while (len >= 255)
+    {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+inline bool readLength(const uint8_t*& ip, const uint8_t* iend, size_t& len)
+{
+    uint8_t b;
+    do
+    {
+        if (ip >= iend)
+        {
+            return false;
+        }
+        b = *ip++;
+        len += b;
+    } while (b == 255);
+    return true;
+}
+
+} // namespace
+
+Lz4Codec::Lz4Codec()
+{
+    std::memset(table_, 0, sizeof(table_));
+}
+
+size_t Lz4Codec::compress(const char* src, size_t n, char* dst, size_t cap)
+{
+    const uint8_t* base = reinterpret_cast<const uint8_t*>(src);
+    const uint8_t* end = base + n;
+    const uint8_t* anchor = base; // first byte not yet emitted
+    uint8_t* op = reinterpret_cast<uint8_t*>(dst);
+    uint8_t* oend = op + cap;
+
+    if (n > kMfLimit)
+    {
+        const uint8_t* matchlimit = end - kLastLiterals;
+        const uint8_t* mflimit = end - kMfLimit;
+        const uint8_t* ip = base;
+        while (ip < mflimit)
+        {
+            uint32_t seq = read32(ip);
+            uint32_t h = (seq * 2654435761U) >> (32 - kHashLog);
+            size_t pos = ip - base;
+            size_t ref_pos = table_[h];
+            table_[h] = (uint32_t)pos;
+            if (ref_pos >= pos || pos - ref_pos > kMaxDistance || read32(base + ref_pos) != seq)
+            {
+                // skip faster through data that doesn't compress
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+            const uint8_t* ref = base + ref_pos;
+            while (ip > anchor && ref > base && ip[-1] == ref[-1])
+            {
+                --ip;
+                --ref;
+            }
+            const uint8_t* mp = ip + kMinMatch;
+            mp += commonLength(mp, ref + kMinMatch, matchlimit);
+            size_t lit_len = ip - anchor;
+            size_t match_len = mp - ip - kMinMatch;
+            if ((size_t)(oend - op) < 1 + lit_len / 255 + 1 + lit_len + 2 + match_len / 255 + 1)
+            {
+                return 0;
+            }
+            uint8_t* token = op++;
+            *token = (uint8_t)((lit_len >= 15 ? 15 : lit_len) << 4);
+            if (lit_len >= 15)
+            {
+                op = writeLength(op, lit_len - 15);
+            }
+            std::memcpy(op, anchor, lit_len);
+            op += lit_len;
+            size_t offset = ip - ref;
+            *op++ = (uint8_t)offset;
+            *op++ = (uint8_t)(offset >> 8);
+            *token |= (uint8_t)(match_len >= 15 ? 15 : match_len);
+            if (match_len >= 15)
+            {
+                op = writeLength(op, match_len - 15);
+            }
+            ip = mp;
+            anchor = ip;
+            if (ip < mflimit)
+            {
+                // the position just before the next search improves matches in repetitive text
+                table_[(read32(ip - 2) * 2654435761U) >> (32 - kHashLog)] = (uint32_t)(ip - 2 - base);
+            }
+        }
+    }
+
+    size_t lit_len = end - anchor;
+    if ((size_t)(oend - op) < 1 + lit_len / 255 + 1 + lit_len)
+    {
+        return 0;
+    }
+    *op++ = (uint8_t)((lit_len >= 15 ? 15 : lit_len) << 4);
+    if (lit_len >= 15)
+    {
+        op = writeLength(op, lit_len - 15);
+    }
+    std::memcpy(op, anchor, lit_len);
+    op += lit_len;
+    return op - reinterpret_cast<uint8_t*>(dst);
+}
+
+ssize_t Lz4Codec::decompress(const char* src, size_t n, char* dst, size_t cap)
+{
+    const uint8_t* ip = reinterpret_cast<const uint8_t*>(src);
+    const uint8_t* iend = ip + n;
+    uint8_t* op = reinterpret_cast<uint8_t*>(dst);
+    uint8_t* ostart = op;
+    uint8_t* oend = op + cap;
+    while (ip < iend)
+    {
+        uint8_t token = *ip++;
+        size_t lit_len = token >> 4;
+        if (lit_len == 15 && !readLength(ip, iend, lit_len))
+        {
+            return -1;
+        }
+        if (lit_len > (size_t)(iend - ip) || lit_len > (size_t)(oend - op))
+        {
+            return -1;
+        }
+        std::memcpy(op, ip, lit_len);
+        op += lit_len;
+        ip += lit_len;
+        if (ip == iend)
+        {
+            // the last sequence has literals only
+            break;
+        }
+        if (iend - ip < 2)
+        {
+            return -1;
+        }
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - ostart))
+        {
+            return -1;
+        }
+        size_t match_len = token & 15;
+        if (match_len == 15 && !readLength(ip, iend, match_len))
+        {
+            return -1;
+        }
+        match_len += kMinMatch;
+        if (match_len > (size_t)(oend - op))
+        {
+            return -1;
+        }
+        const uint8_t* match = op - offset;
+        // an overlapping match repeats the last offset bytes: copy what is already there, the distance
+        // to match doubles every round
+        while (match_len > 0)
+        {
+            size_t chunk = (size_t)(op - match) < match_len ? (size_t)(op - match) : match_len;
+            std::memcpy(op, match, chunk);
+            op += chunk;
+            match_len -= chunk;
+        }
+    }
+    return op - ostart;
+}
@@ -0,0 +1,40 @@
+/********************************************************************************
+> FileName:	Lz4Codec.h
+> Author:	Mingping Zhang
+> Email:	mingpingzhang@163.com
+> Create Time:	Wed Apr  5 14:06:31 2023
+********************************************************************************/
+#ifndef LZ4CODEC_H
+#define LZ4CODEC_H
+
+#include <sys/types.h>
+#include <cstddef>
+#include <cstdint>
+
+// lz4 block format(compatible with LZ4_compress_default()/LZ4_decompress_safe()), built in so there is no
+// dependency. the compressor keeps its hash table between calls, one instance per connection avoids
+// allocating and clearing it for every message
+class Lz4Codec
+{
+public:
+    Lz4Codec();
+    Lz4Codec(const Lz4Codec& other)            = delete;
+    Lz4Codec& operator=(const Lz4Codec& other) = delete;
+
+public:
+    // worst case compressed size of n bytes
+    static size_t compressBound(size_t n)
+    { return n + n / 255 + 16; }
+    // compress src into dst, return the compressed size or 0 when it doesn't fit in cap
+    size_t compress(const char* src, size_t n, char* dst, size_t cap);
+    // decompress a block into dst, return the decompressed size or -1 when src is malformed or dst too small
+    static ssize_t decompress(const char* src, size_t n, char* dst, size_t cap);
+
+private:
+    static const int kHashLog = 12;
+    // positions of 4 byte sequences in the current input, entries left from earlier inputs are only hints:
+    // a candidate is used after comparing its bytes
+    uint32_t table_[1 << kHashLog];
+};
+
+#endif//LZ4CODEC_H
@@ -7,19 +7,35 @@
 #ifndef PACKET_H
 #define PACKET_H
 
+#include "SocketAddress.h"
 #include <memory>
 #include <string>
 #include <functional>
 
+// filled only when latency tracing is enabled on the server, 0 means not taken
+struct PacketTimestamps
+{
+	uint64_t kernelRxNs { 0 };  // kernel software receive timestamp(CLOCK_REALTIME, SO_TIMESTAMPING)
+	uint64_t recvNs { 0 };      // read()/recvmsg() returned it(CLOCK_MONOTONIC)
+	uint64_t callbackNs { 0 };  // recv callback entered(CLOCK_MONOTONIC), a reply carrying it is traced until written
+};
+
+// a message of a connection(fd) or, as DatagramPacket, of a udp peer. kept small: tcp packets don't carry a
+// peer address and untraced packets no timestamps
 class Packet 
 {
 	public:
 		Packet(){};
 		Packet(const std::string& message)
 			: message_(message)  {}
+		Packet(std::string&& message)
+			: message_(std::move(message))  {}
 		Packet(int fd, const std::string& message)
 			: fd_(fd),
 			message_(message) {}
+		Packet(int fd, std::string&& message)
+			: fd_(fd),
+			message_(std::move(message)) {}
 	public:
 		int fd()
 		{return fd_;}
@@ -29,15 +45,66 @@ class Packet
 		{ return message_; }
 		void setMessage(const std::string& value)
 		{ message_ = value; }
+		// source/destination of a DatagramPacket, invalid for tcp packets
+		const SocketAddress& peer()const;
+		const PacketTimestamps& timestamps()const
+		{ return timestamps_ ? *timestamps_ : noTimestamps(); }
+		// copy the request timestamps to a new reply packet to trace it
+		void setTimestamps(const PacketTimestamps& value)
+		{ mutableTimestamps() = value; }
+		PacketTimestamps& mutableTimestamps()
+		{
+			if (!timestamps_)
+			{
+				timestamps_.reset(new PacketTimestamps());
+			}
+			return *timestamps_;
+		}
+	protected:
+		bool datagram_ { false }; // a DatagramPacket
 	private:
+		static const PacketTimestamps& noTimestamps()
+		{
+			static const PacketTimestamps none;
+			return none;
+		}
 		int fd_ { -1 };     // meaning socket
 		std::string message_;   // real binary content
+		std::unique_ptr<PacketTimestamps> timestamps_; // latency tracing only
 } ;
 
-typedef std::shared_ptr<Packet> PacketPtr;
+// datagram packet, identified by the peer address instead of a connected fd
+class DatagramPacket : public Packet
+{
+	public:
+		DatagramPacket(const SocketAddress& peer, const std::string& message)
+			: Packet(message),
+			peer_(peer)
+		{ datagram_ = true; }
+		DatagramPacket(const SocketAddress& peer, const char* data, size_t size)
+			: Packet(std::string(data, size)),
+			peer_(peer)
+		{ datagram_ = true; }
+	public:
+		const SocketAddress& peer()const
+		{ return peer_; }
+		void setPeer(const SocketAddress& value)
+		{ peer_ = value; }
+	private:
+		SocketAddress peer_;
+};
 
-static const uint32_t kEpollWaitTime = 10; // epoll wait timeout 10 ms
-static const uint32_t kMaxEvents = 100;    // epoll wait return max size
+inline const SocketAddress& Packet::peer()const
+{
+	if (datagram_)
+	{
+		return static_cast<const DatagramPacket*>(this)->peer();
+	}
+	static const SocketAddress none;
+	return none;
+}
+
+typedef std::shared_ptr<Packet> PacketPtr;
 
 using callback_recv_t = std::function<void(const PacketPtr& data)>;
 #endif//PACKET_H
@@ -0,0 +1,99 @@
+/********************************************************************************
+  > FileName:	RpcCodec.cpp
+  > Author:	Mingping Zhang
+  > Email:	mingpingzhang@163.com
+  > Create Time:	Wed Apr 12 10:08:35 2023
+ ********************************************************************************/
+
+#include "RpcCodec.h"
+
+namespace
+{
+
+const size_t kLengthSize = 4;
+const size_t kIdSize = 8;
+
+inline uint64_t readLe(const char* p, size_t n)
+{
+    const uint8_t* u = reinterpret_cast<const uint8_t*>(p);
+    uint64_t v = 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+        v |= (uint64_t)u[i] << (8 * i);
+    }
+    return v;
+}
+
+inline void appendLe(std::string& out, uint64_t v, size_t n)
+{
+    for (size_t i = 0; i < n; ++i)
+    {
+        out.push_back((char)(v >> (8 * i)));
+    }
+}
+
+} // namespace
+
+void encodeRpcFrame(uint64_t id, const char* body, size_t len, std::string& out)
+{
+    out.reserve(out.size() + kLengthSize + kIdSize + len);
+    appendLe(out, kIdSize + len, kLengthSize);
+    appendLe(out, id, kIdSize);
+    out.append(body, len);
+}
+
+RpcDecoder::RpcDecoder(size_t max_frame_size)
+    : maxFrameSize_ ( max_frame_size )
+{
+}
+
+bool RpcDecoder::feed(const char* data, size_t len, std::vector<RpcFrame>& frames)
+{
+    const char* p = data;
+    size_t left = len;
+    if (offset_ < buffer_.size())
+    {
+        // continue the frame started in an earlier read, consumed from buffer_ below
+        buffer_.append(data, len);
+        p = buffer_.data() + offset_;
+        left = buffer_.size() - offset_;
+    }
+    size_t consumed = 0;
+    while (left - consumed >= kLengthSize)
+    {
+        uint64_t size = readLe(p + consumed, kLengthSize);
+        if (size < kIdSize || size > maxFrameSize_)
+        {
+            return false;
+        }
+        if (left - consumed < kLengthSize + size)
+        {
+            break;
+        }
+        const char* frame = p + consumed + kLengthSize;
+        frames.emplace_back();
+        frames.back().id = readLe(frame, kIdSize);
+        frames.back().body.assign(frame + kIdSize, size - kIdSize);
+        consumed += kLengthSize + size;
+    }
+    if (p != data)
+    {
+        offset_ += consumed;
+        if (offset_ == buffer_.size())
+        {
+            buffer_.clear();
+            offset_ = 0;
+        }
+        else if (offset_ > 64 * 1024 && offset_ * 2 > buffer_.size())
+        {
+            // drop the consumed front once it dominates
+            buffer_.erase(0, offset_);
+            offset_ = 0;
+        }
+        return true;
+    }
+    // everything came in this read, keep only the incomplete rest
+    buffer_.assign(data + consumed, len - consumed);
+    offset_ = 0;
+    return true;
+}
@@ -0,0 +1,47 @@
+/********************************************************************************
+> FileName:	RpcCodec.h
+> Author:	Mingping Zhang
+> Email:	mingpingzhang@163.com
+> Create Time:	Wed Apr 12 10:08:35 2023
+********************************************************************************/
+#ifndef RPCCODEC_H
+#define RPCCODEC_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// request/response frames of RpcClient on a byte stream: 4 byte little endian length of the rest, 8 byte
+// little endian request id, body. a server answers a request with a frame of the same id, in any order(an
+// echo server answers every request with itself)
+struct RpcFrame
+{
+    uint64_t id { 0 };
+    std::string body;
+};
+
+// append the frame of id and body to out
+void encodeRpcFrame(uint64_t id, const char* body, size_t len, std::string& out);
+
+// reassembles frames from received bytes, not thread safe
+class RpcDecoder
+{
+public:
+    // frames above maxFrameSize bytes(id included) are malformed
+    explicit RpcDecoder(size_t max_frame_size);
+
+public:
+    // feed received bytes, complete frames are appended to frames; false when the stream is malformed
+    bool feed(const char* data, size_t len, std::vector<RpcFrame>& frames);
+    // bytes of incomplete frames
+    size_t buffered() const
+    { return buffer_.size() - offset_; }
+
+private:
+    size_t maxFrameSize_;
+    std::string buffer_;  // bytes of an incomplete frame
+    size_t offset_ { 0 }; // consumed bytes at the front of buffer_
+};
+
+#endif//RPCCODEC_H
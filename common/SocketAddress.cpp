@@ -0,0 +1,135 @@
+/********************************************************************************
+  > FileName:	SocketAddress.cpp
+  > Author:	Mingping Zhang
+  > Email:	mingpingzhang@163.com
+  > Create Time:	Mon Mar 20 10:02:31 2023
+ ********************************************************************************/
+
+#include "SocketAddress.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/un.h>
+#include <cstddef>
+
+static const char kUnixPrefix[] = "unix:";
+
+bool SocketAddress::parse(const std::string& host, uint16_t port, SocketAddress& out)
+{
+    out = SocketAddress();
+    if (host.compare(0, sizeof(kUnixPrefix) - 1, kUnixPrefix) == 0)
+    {
+        std::string path = host.substr(sizeof(kUnixPrefix) - 1);
+        struct sockaddr_un* un = reinterpret_cast<struct sockaddr_un*>(&out.storage_);
+        // the trailing '\0' is required for filesystem path, abstract name uses the leading '\0' instead
+        if (path.empty() || path.size() >= sizeof(un->sun_path))
+        {
+            return false;
+        }
+        un->sun_family = AF_UNIX;
+        if (path[0] == '@')
+        {
+            // abstract namespace: sun_path[0] is '\0' and the name is not null-terminated,
+            // so the address length must cover exactly the name
+            std::memcpy(un->sun_path + 1, path.data() + 1, path.size() - 1);
+            out.len_ = offsetof(struct sockaddr_un, sun_path) + path.size();
+        }
+        else
+        {
+            std::memcpy(un->sun_path, path.data(), path.size());
+            out.len_ = offsetof(struct sockaddr_un, sun_path) + path.size() + 1;
+        }
+        return true;
+    }
+
+    std::string ip = host;
+    if (ip.size() >= 2 && ip.front() == '[' && ip.back() == ']')
+    {
+        ip = ip.substr(1, ip.size() - 2);
+    }
+
+    struct sockaddr_in* in4 = reinterpret_cast<struct sockaddr_in*>(&out.storage_);
+    if (inet_pton(AF_INET, ip.c_str(), &in4->sin_addr) == 1)
+    {
+        in4->sin_family = AF_INET;
+        in4->sin_port = htons(port);
+        out.len_ = sizeof(struct sockaddr_in);
+        return true;
+    }
+
+    struct sockaddr_in6* in6 = reinterpret_cast<struct sockaddr_in6*>(&out.storage_);
+    if (inet_pton(AF_INET6, ip.c_str(), &in6->sin6_addr) == 1)
+    {
+        in6->sin6_family = AF_INET6;
+        in6->sin6_port = htons(port);
+        out.len_ = sizeof(struct sockaddr_in6);
+        return true;
+    }
+    return false;
+}
+
+SocketAddress SocketAddress::fromSockaddr(const struct sockaddr* addr, socklen_t len)
+{
+    SocketAddress out;
+    if (addr && len > 0 && len <= sizeof(out.storage_))
+    {
+        std::memcpy(&out.storage_, addr, len);
+        out.len_ = len;
+    }
+    return out;
+}
+
+bool SocketAddress::isAbstract() const
+{
+    const struct sockaddr_un* un = reinterpret_cast<const struct sockaddr_un*>(&storage_);
+    return isUnix() && len_ > offsetof(struct sockaddr_un, sun_path) && un->sun_path[0] == '\0';
+}
+
+std::string SocketAddress::unixPath() const
+{
+    if (!isUnix() || isAbstract() || len_ <= offsetof(struct sockaddr_un, sun_path))
+    {
+        return std::string();
+    }
+    const struct sockaddr_un* un = reinterpret_cast<const struct sockaddr_un*>(&storage_);
+    return std::string(un->sun_path, strnlen(un->sun_path, len_ - offsetof(struct sockaddr_un, sun_path)));
+}
+
+uint16_t SocketAddress::port() const
+{
+    if (family() == AF_INET)
+    {
+        return ntohs(reinterpret_cast<const struct sockaddr_in*>(&storage_)->sin_port);
+    }
+    if (family() == AF_INET6)
+    {
+        return ntohs(reinterpret_cast<const struct sockaddr_in6*>(&storage_)->sin6_port);
+    }
+    return 0;
+}
+
+std::string SocketAddress::toString() const
+{
+    char buf[INET6_ADDRSTRLEN] = {0};
+    if (family() == AF_INET)
+    {
+        inet_ntop(AF_INET, &reinterpret_cast<const struct sockaddr_in*>(&storage_)->sin_addr, buf, sizeof(buf));
+        return std::string(buf) + ":" + std::to_string(port());
+    }
+    if (family() == AF_INET6)
+    {
+        inet_ntop(AF_INET6, &reinterpret_cast<const struct sockaddr_in6*>(&storage_)->sin6_addr, buf, sizeof(buf));
+        return "[" + std::string(buf) + "]:" + std::to_string(port());
+    }
+    if (isUnix())
+    {
+        if (isAbstract())
+        {
+            const struct sockaddr_un* un = reinterpret_cast<const struct sockaddr_un*>(&storage_);
+            size_t n = len_ - offsetof(struct sockaddr_un, sun_path) - 1;
+            return std::string(kUnixPrefix) + "@" + std::string(un->sun_path + 1, n);
+        }
+        // unnamed unix socket (e.g. the peer of accept()) has no path at all
+        return std::string(kUnixPrefix) + unixPath();
+    }
+    return "unknown";
+}
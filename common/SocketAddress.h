@@ -0,0 +1,64 @@
+/********************************************************************************
+> FileName:	SocketAddress.h
+> Author:	Mingping Zhang
+> Email:	mingpingzhang@163.com
+> Create Time:	Mon Mar 20 10:02:31 2023
+********************************************************************************/
+#ifndef SOCKETADDRESS_H
+#define SOCKETADDRESS_H
+
+#include <sys/socket.h>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+// transport neutral address of a stream/datagram socket: AF_INET, AF_INET6 or AF_UNIX
+class SocketAddress
+{
+public:
+    SocketAddress() { std::memset(&storage_, 0, sizeof(storage_)); }
+
+    // parse a host string and port into an address, accepted forms are:
+    //   "127.0.0.1"            ipv4 literal
+    //   "::1" or "[::1]"       ipv6 literal
+    //   "unix:/tmp/echo.sock"  unix domain socket on filesystem (port ignored)
+    //   "unix:@echo"           unix domain socket in abstract namespace (port ignored)
+    // return false if host can not be parsed
+    static bool parse(const std::string& host, uint16_t port, SocketAddress& out);
+    // copy an address returned by accept()/getpeername()/recvfrom()
+    static SocketAddress fromSockaddr(const struct sockaddr* addr, socklen_t len);
+
+public:
+    int family() const
+    { return storage_.ss_family; }
+    bool valid() const
+    { return len_ != 0; }
+    bool isUnix() const
+    { return family() == AF_UNIX; }
+    // unix socket bound in abstract namespace(sun_path[0] == '\0'), no file on disk
+    bool isAbstract() const;
+    // filesystem path of unix socket, empty for other families and abstract unix sockets
+    std::string unixPath() const;
+    // port of AF_INET/AF_INET6 address, 0 for unix sockets
+    uint16_t port() const;
+    // "1.2.3.4:80", "[::1]:80", "unix:/path" or "unix:@name"
+    std::string toString() const;
+
+    const struct sockaddr* addr() const
+    { return reinterpret_cast<const struct sockaddr*>(&storage_); }
+    struct sockaddr* addr()
+    { return reinterpret_cast<struct sockaddr*>(&storage_); }
+    socklen_t length() const
+    { return len_; }
+
+    bool operator==(const SocketAddress& other) const
+    { return len_ == other.len_ && std::memcmp(&storage_, &other.storage_, len_) == 0; }
+    bool operator!=(const SocketAddress& other) const
+    { return !(*this == other); }
+
+private:
+    struct sockaddr_storage storage_; // big enough for every family
+    socklen_t len_ { 0 }; // valid bytes of storage_
+};
+
+#endif//SOCKETADDRESS_H
@@ -0,0 +1,1100 @@
+/********************************************************************************
+  > FileName:	TcpConnection.cpp
+  > Author:	Mingping Zhang
+  > Email:	mingpingzhang@163.com
+  > Create Time:	Wed Mar 29 14:18:53 2023
+ ********************************************************************************/
+
+#include "TcpConnection.h"
+#include "AppDef.h"
+#include "KernelTimestamp.h"
+#include "TimeUtil.h"
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+// drained output queues of all connections: a deque allocates its map and first block up front, an idle
+// connection shouldn't hold them
+struct TcpConnection::OutputPool
+{
+    std::mutex mutex;
+    std::vector<std::unique_ptr<OutputQueue>> queues;
+};
+
+TcpConnection::OutputPool& TcpConnection::outputPool()
+{
+    // never destroyed, connections may be released by static destructors
+    static OutputPool* pool = new OutputPool;
+    return *pool;
+}
+
+const TcpCallbacksPtr& TcpConnection::noCallbacks()
+{
+    // never destroyed, like the output pool
+    static const TcpCallbacksPtr* none = new TcpCallbacksPtr(std::make_shared<const TcpCallbacks>());
+    return *none;
+}
+
+TcpConnection::TcpConnection(const EventLoopPtr& loop, int32_t fd)
+    : loop_ ( loop ),
+      fd_ ( fd )
+{
+}
+
+TcpConnection::~TcpConnection()
+{
+    if (!closed_)
+    {
+        // never started or owner dropped it without close()
+        ::close(fd_);
+    }
+    releaseOutput();
+}
+
+SocketAddress TcpConnection::peer() const
+{
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    if (closed_ || getpeername(fd_, (struct sockaddr*)&addr, &len) != 0)
+    {
+        return SocketAddress();
+    }
+    return SocketAddress::fromSockaddr((struct sockaddr*)&addr, len);
+}
+
+void TcpConnection::setTlsSession(TlsSessionPtr session)
+{
+    tls_ = std::move(session);
+}
+
+void TcpConnection::setLatencyStats(LatencyStats* stats)
+{
+    latency_ = stats;
+    if (latency_ && !trace_)
+    {
+        trace_.reset(new TraceMarks());
+    }
+}
+
+void TcpConnection::setCompression(const CompressionConfig& config, bool server, CompressionStats* stats)
+{
+    codec_.reset(new FrameCodec(config, server, stats));
+}
+
+void TcpConnection::setLineFraming(const LineFramingConfig& config, LineStats* stats)
+{
+    framer_.reset(new LineFramer(config));
+    lineStats_ = stats;
+}
+
+bool TcpConnection::start()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (latency_ && !tls_)
+    {
+        // openssl reads the socket itself, kernel timestamps only for plaintext; unix sockets have no transmit timestamps
+        int domain = AF_UNSPEC;
+        socklen_t domain_len = sizeof(domain);
+        getsockopt(fd_, SOL_SOCKET, SO_DOMAIN, &domain, &domain_len);
+        bool inet = (domain == AF_INET || domain == AF_INET6);
+        txTimestamps_ = enableKernelTimestamps(fd_, inet) && inet;
+    }
+    if (codec_)
+    {
+        // the client's hello goes first, flushed on the first EPOLLOUT edge
+        std::string hello = codec_->hello();
+        if (!hello.empty())
+        {
+            appendOutput(hello.data(), hello.size());
+        }
+    }
+    // the tls handshake needs both readable and writeable edges
+    writing_ = (tls_ != nullptr) || hasOutput();
+    return loop_->addHandler(fd_, eventMask(), this) == 0;
+}
+
+size_t TcpConnection::pendingOutput()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return outputBytes_;
+}
+
+void TcpConnection::handleEvent(uint32_t events)
+{
+    if (trigger_ != TriggerMode::kOneShot)
+    {
+        dispatch(events);
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (closed_)
+        {
+            return;
+        }
+        if (dispatching_)
+        {
+            // the event got to a second thread(re-armed before the first one came in), the thread in
+            // dispatch() takes it over; a re-arm request is served when that thread re-arms
+            pendingEvents_ |= events;
+            return;
+        }
+        dispatching_ = true;
+        dispatchThread_ = std::this_thread::get_id();
+    }
+    bool finish_close = false;
+    while (true)
+    {
+        dispatch(events);
+        std::lock_guard<std::mutex> lock(mutex_);
+        events = pendingEvents_;
+        pendingEvents_ = 0;
+        if (events != 0 && !closed_)
+        {
+            continue;
+        }
+        dispatching_ = false;
+        if (!closed_)
+        {
+            // disabled since this event, next one may go to any dispatch thread; the interest changed by
+            // other threads meanwhile is in eventMask()
+            loop_->modifyHandler(fd_, eventMask(), this);
+        }
+        else if (closePending_)
+        {
+            closePending_ = false;
+            finish_close = true;
+        }
+        break;
+    }
+    if (finish_close)
+    {
+        // closed by another thread while this one dispatched
+        finishClose();
+    }
+}
+
+void TcpConnection::applyEvents()
+{
+    if (trigger_ != TriggerMode::kOneShot)
+    {
+        loop_->modifyHandler(fd_, eventMask(), this);
+        return;
+    }
+    if (dispatching_ || rearmPosted_)
+    {
+        // applied when the dispatching thread re-arms
+        return;
+    }
+    // a oneshot fd is only re-armed from handleEvent(): outside it a thread may hold an event of the fd it
+    // didn't start handling yet, a re-arm here would hand the next event to another thread at the same time
+    rearmPosted_ = true;
+    TcpConnectionPtr self = shared_from_this();
+    loop_->post([self]() {
+        {
+            std::lock_guard<std::mutex> lock(self->mutex_);
+            self->rearmPosted_ = false;
+        }
+        self->handleEvent(0);
+    });
+}
+
+void TcpConnection::dispatch(uint32_t events)
+{
+    if (closed_)
+    {
+        // closed by an earlier event of the same batch
+        return;
+    }
+    if ((events & EPOLLERR) && txTimestamps_ && !(events & EPOLLHUP))
+    {
+        // transmit timestamps are reported through the error queue, only a pending socket error closes
+        onTxTimestamps();
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(fd_, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err == 0)
+        {
+            events &= ~EPOLLERR;
+        }
+    }
+    if ((events & EPOLLHUP) && !(events & EPOLLERR) && (events & EPOLLIN) && !readEof_)
+    {
+        // both halves are shut down, bytes the peer sent before its fin are still readable
+        onReadable();
+    }
+    if (events & (EPOLLERR | EPOLLHUP))
+    {
+        // An error has occured on this fd, or both halves are shut down
+        closeInLoop();
+        return;
+    }
+    if (events & (EPOLLIN | EPOLLRDHUP))
+    {
+        // data or peer closed writing half: read until EAGAIN, read() returning 0 closes the connection
+        onReadable();
+    }
+    if (!closed_ && (events & EPOLLOUT))
+    {
+        // only focused while output is queued or the tls handshake runs
+        onWritable();
+    }
+}
+
+bool TcpConnection::onTlsHandshake()
+{
+    TlsSession::Status st = tls_->handshake();
+    if (st == TlsSession::kWantRead || st == TlsSession::kWantWrite)
+    {
+        // wait for next edge
+        return false;
+    }
+    if (st != TlsSession::kOk)
+    {
+        std::cout << "fd: " << fd_ << " tls handshake failed, close it!" << std::endl;
+        closeInLoop();
+        return false;
+    }
+    // packets sent before the handshake finished
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (flushOutput() < 0)
+    {
+        return false;
+    }
+    updateEvents();
+    return true;
+}
+
+void TcpConnection::readAll()
+{
+    if (!closed_)
+    {
+        setReading(true);
+        onReadable();
+    }
+}
+
+void TcpConnection::pauseReading()
+{
+    readPaused_ = true;
+    setReading(false);
+}
+
+void TcpConnection::resumeReading()
+{
+    if (readPaused_)
+    {
+        readPaused_ = false;
+        // bytes that arrived while paused got their edge already
+        readAll();
+    }
+}
+
+void TcpConnection::setReading(bool reading)
+{
+    if (trigger_ == TriggerMode::kEdge)
+    {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (reading_ == reading || closed_ || (reading && readEof_))
+    {
+        return;
+    }
+    reading_ = reading;
+    applyEvents();
+}
+
+void TcpConnection::onReadable()
+{
+    if (tls_ && !tls_->established() && !onTlsHandshake())
+    {
+        return;
+    }
+    char buffer[4096];
+    uint64_t kernel_rx_ns = 0;
+    // epoll working on et mode, must read all data(tls: until openssl wants more bytes from socket).
+    // level triggered fds are reported again while bytes are left, a few reads per event keep fds fair;
+    // not tls, bytes openssl already took from the socket raise no event
+    uint32_t reads = (trigger_ == TriggerMode::kEdge || tls_) ? 0 : LevelReadsPerEvent();
+    while (!closed_ && !readPaused_ && !readEof_)
+    {
+        size_t want = sizeof(buffer);
+        if (callbacks_->readBudget && !callbacks_->readBudget(*this, want))
+        {
+            // stopped by owner, unread bytes stay in socket buffer until readAll()
+            setReading(false);
+            return;
+        }
+        ssize_t n = -1;
+        if (tls_)
+        {
+            TlsSession::Status st;
+            n = tls_->read(buffer, want, st);
+            if (n <= 0)
+            {
+                if (st != TlsSession::kWantRead && st != TlsSession::kWantWrite)
+                {
+                    // close_notify, eof or fatal error
+                    closeInLoop();
+                }
+                return;
+            }
+        }
+        else
+        {
+            n = readSocket(buffer, want, kernel_rx_ns);
+            if (n == 0)
+            {
+                // peer closed connection(or its writing half)
+                onEof();
+                return;
+            }
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                {
+                    // something goes wrong for this fd, should close it
+                    closeInLoop();
+                }
+                // read all data finished
+                return;
+            }
+        }
+
+        // one timestamp per read for all its messages: later ones wait for the callbacks of earlier ones,
+        // counted as read->callback(as in the udp batch)
+        PacketTimestamps read_ts;
+        if (latency_)
+        {
+            read_ts.recvNs = monotonicNs();
+            read_ts.kernelRxNs = kernel_rx_ns;
+            if (kernel_rx_ns)
+            {
+                uint64_t now = realtimeNs();
+                latency_->kernelToRead.record(now > kernel_rx_ns ? now - kernel_rx_ns : 0);
+            }
+        }
+        if (callbacks_->wire)
+        {
+            callbacks_->wire(*this, false, buffer, n);
+        }
+        size_t messages = 1;
+        if (codec_)
+        {
+            if (!decodeInput(buffer, n, read_ts, messages))
+            {
+                return;
+            }
+        }
+        else if (framer_)
+        {
+            if (!splitLines(buffer, n, read_ts, messages))
+            {
+                return;
+            }
+        }
+        else
+        {
+            deliver(std::string(buffer, n), read_ts);
+        }
+        if (callbacks_->readDone)
+        {
+            callbacks_->readDone(*this, n, messages);
+        }
+        if (reads > 0 && --reads == 0)
+        {
+            return;
+        }
+    }
+}
+
+void TcpConnection::deliver(std::string&& message, const PacketTimestamps& read_ts)
+{
+    const callback_recv_t& recv = callbacks_->recv;
+    if (recv && latency_)
+    {
+        PacketTimestamps ts = read_ts;
+        PacketPtr data = std::make_shared<Packet>(fd_, std::move(message));
+        ts.callbackNs = monotonicNs();
+        data->setTimestamps(ts);
+        latency_->readToCallback.record(ts.callbackNs - ts.recvNs);
+        recv(data);
+        latency_->callback.record(monotonicNs() - ts.callbackNs);
+    }
+    else if (recv)
+    {
+        // create a recv packet and handle it
+        PacketPtr data = std::make_shared<Packet>(fd_, std::move(message));
+        recv(data);
+    }
+}
+
+bool TcpConnection::decodeInput(const char* data, size_t len, const PacketTimestamps& read_ts, size_t& messages)
+{
+    bool ok = true;
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        std::string reply;
+        ok = codec_->decode(data, len, decoded_, reply);
+        // handshake ack or messages held until it came, raw bytes
+        if (ok && !reply.empty() && writeOrQueue(reply.data(), reply.size(), 0, lock) < 0)
+        {
+            decoded_.clear();
+            return false;
+        }
+    }
+    if (!ok)
+    {
+        std::cout << "fd: " << fd_ << " malformed frame, close it!" << std::endl;
+        decoded_.clear();
+        closeInLoop();
+        return false;
+    }
+    messages = decoded_.size();
+    for (size_t i = 0; i < decoded_.size() && !closed_; ++i)
+    {
+        deliver(std::move(decoded_[i]), read_ts);
+    }
+    decoded_.clear();
+    return !closed_;
+}
+
+bool TcpConnection::splitLines(const char* data, size_t len, const PacketTimestamps& read_ts, size_t& messages)
+{
+    if (!framer_->feed(data, len, decoded_))
+    {
+        std::cout << "fd: " << fd_ << " line too long, close it!" << std::endl;
+        if (lineStats_)
+        {
+            lineStats_->tooLong.fetch_add(1, std::memory_order_relaxed);
+        }
+        decoded_.clear();
+        closeInLoop();
+        return false;
+    }
+    if (lineStats_ && !decoded_.empty())
+    {
+        lineStats_->lines.fetch_add(decoded_.size(), std::memory_order_relaxed);
+    }
+    messages = decoded_.size();
+    for (size_t i = 0; i < decoded_.size() && !closed_; ++i)
+    {
+        deliver(std::move(decoded_[i]), read_ts);
+    }
+    decoded_.clear();
+    return !closed_;
+}
+
+void TcpConnection::onWritable()
+{
+    if (tls_ && !tls_->established())
+    {
+        // handshake done here may leave application data readable without a new EPOLLIN edge
+        if (onTlsHandshake())
+        {
+            onReadable();
+        }
+        return;
+    }
+    bool drained = false;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (flushOutput() == 0)
+        {
+            updateEvents();
+            drained = !hasOutput();
+        }
+    }
+    if (drained && closeAfterWrite_)
+    {
+        closeInLoop();
+    }
+    else if (drained && shutdownAfterWrite_)
+    {
+        bool done = false;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            done = shutdownWrite();
+        }
+        if (done)
+        {
+            closeInLoop();
+        }
+    }
+    else if (drained && callbacks_->writeDrained)
+    {
+        callbacks_->writeDrained(*this);
+    }
+}
+
+ssize_t TcpConnection::readSocket(char* buffer, size_t len, uint64_t& kernel_rx_ns)
+{
+    if (!latency_)
+    {
+        return ::read(fd_, buffer, len);
+    }
+    char control[kTimestampControlSize];
+    struct iovec iov = { buffer, len };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t n = ::recvmsg(fd_, &msg, 0);
+    // for tcp the timestamp of the last segment read
+    kernel_rx_ns = n > 0 ? rxTimestampOf(&msg) : 0;
+    return n;
+}
+
+void TcpConnection::onReplyWritten(uint64_t end, uint64_t trace_ns)
+{
+    latency_->callbackToWrite.record(monotonicNs() - trace_ns);
+    if (txTimestamps_ && trace_->txPending.size() < 4096)
+    {
+        trace_->txPending.push_back(WriteMark { end, realtimeNs() });
+    }
+}
+
+void TcpConnection::onTxTimestamps()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    readTxTimestamps(fd_, [this](uint32_t id, uint64_t ns) {
+        // id is the 32 bit offset of the last byte of one write(), it covers every reply ending at or before it
+        std::deque<WriteMark>& pending = trace_->txPending;
+        while (!pending.empty() && (int32_t)((uint32_t)(pending.front().end - 1) - id) <= 0)
+        {
+            uint64_t written = pending.front().ns;
+            latency_->writeToTx.record(ns > written ? ns - written : 0);
+            pending.pop_front();
+        }
+    });
+}
+
+ssize_t TcpConnection::writeSome(const char* data, size_t len)
+{
+    size_t off = 0;
+    while (off < len)
+    {
+        if (tls_)
+        {
+            TlsSession::Status st;
+            int r = tls_->write(data + off, len - off, st);
+            if (r > 0)
+            {
+                if (callbacks_->wire)
+                {
+                    callbacks_->wire(*this, true, data + off, r);
+                }
+                off += r;
+                bytesWritten_ += r;
+                continue;
+            }
+            if (st == TlsSession::kWantWrite || st == TlsSession::kWantRead)
+            {
+                break;
+            }
+            return -1;
+        }
+        ssize_t r = ::write(fd_, data + off, len - off);
+        if (r > 0)
+        {
+            if (callbacks_->wire)
+            {
+                callbacks_->wire(*this, true, data + off, r);
+            }
+            off += r;
+            bytesWritten_ += r;
+            continue;
+        }
+        if (r < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            break;
+        }
+        return -1;
+    }
+    return off;
+}
+
+void TcpConnection::appendOutput(const char* data, size_t len)
+{
+    // small sends are coalesced into the last private chunk, one chunk per publish otherwise
+    OutputQueue& queue = outputQueue();
+    if (!queue.empty() && !queue.back().payload && queue.back().owned.size() + len <= kCoalesceLimit)
+    {
+        queue.back().owned.append(data, len);
+    }
+    else
+    {
+        queue.push_back(OutputChunk());
+        queue.back().owned.assign(data, len);
+    }
+    outputBytes_ += len;
+}
+
+void TcpConnection::consumeOutput(size_t n)
+{
+    while (n > 0)
+    {
+        OutputChunk& chunk = output_->front();
+        size_t left = chunk.size() - chunk.offset;
+        if (n < left)
+        {
+            chunk.offset += n;
+            outputBytes_ -= n;
+            return;
+        }
+        n -= left;
+        outputBytes_ -= left;
+        output_->pop_front();
+    }
+    if (output_->empty())
+    {
+        releaseOutput();
+    }
+}
+
+TcpConnection::OutputQueue& TcpConnection::outputQueue()
+{
+    if (!output_)
+    {
+        OutputPool& pool = outputPool();
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        if (pool.queues.empty())
+        {
+            output_.reset(new OutputQueue());
+        }
+        else
+        {
+            output_ = std::move(pool.queues.back());
+            pool.queues.pop_back();
+        }
+    }
+    return *output_;
+}
+
+void TcpConnection::releaseOutput()
+{
+    if (!output_)
+    {
+        return;
+    }
+    output_->clear();
+    outputBytes_ = 0;
+    OutputPool& pool = outputPool();
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    if (pool.queues.size() < OutputQueuePoolSize())
+    {
+        pool.queues.push_back(std::move(output_));
+    }
+    output_.reset();
+}
+
+ssize_t TcpConnection::writeChunks()
+{
+    size_t total = 0;
+    while (hasOutput())
+    {
+        if (tls_)
+        {
+            // openssl takes one buffer per SSL_write
+            OutputChunk& chunk = output_->front();
+            size_t left = chunk.size() - chunk.offset;
+            ssize_t r = writeSome(chunk.data() + chunk.offset, left);
+            if (r < 0)
+            {
+                return -1;
+            }
+            consumeOutput(r);
+            total += r;
+            if ((size_t)r < left)
+            {
+                break;
+            }
+            continue;
+        }
+        // gather up to kMaxIovecs queued chunks into one writev()
+        struct iovec iov[kMaxIovecs];
+        int count = 0;
+        size_t want = 0;
+        for (auto it = output_->begin(); it != output_->end() && count < kMaxIovecs; ++it, ++count)
+        {
+            iov[count].iov_base = const_cast<char*>(it->data() + it->offset);
+            iov[count].iov_len = it->size() - it->offset;
+            want += iov[count].iov_len;
+        }
+        ssize_t r = ::writev(fd_, iov, count);
+        if (r < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                break;
+            }
+            return -1;
+        }
+        bytesWritten_ += r;
+        if (callbacks_->wire)
+        {
+            size_t left = r;
+            for (int i = 0; i < count && left > 0; ++i)
+            {
+                size_t n = std::min(left, iov[i].iov_len);
+                callbacks_->wire(*this, true, (const char*)iov[i].iov_base, n);
+                left -= n;
+            }
+        }
+        consumeOutput(r);
+        total += r;
+        if ((size_t)r < want)
+        {
+            // socket full
+            break;
+        }
+    }
+    return total;
+}
+
+int32_t TcpConnection::flushOutput()
+{
+    if (!hasOutput())
+    {
+        return 0;
+    }
+    if (writeChunks() < 0)
+    {
+        std::cout << "fd: " << fd_ << " write error, close it!" << std::endl;
+        // the following EPOLLHUP closes the connection
+        ::shutdown(fd_, SHUT_RDWR);
+        return -1;
+    }
+    while (trace_ && !trace_->queuedReplies.empty() && trace_->queuedReplies.front().end <= bytesWritten_)
+    {
+        onReplyWritten(trace_->queuedReplies.front().end, trace_->queuedReplies.front().ns);
+        trace_->queuedReplies.pop_front();
+    }
+    return 0;
+}
+
+void TcpConnection::updateEvents()
+{
+    bool want_write = hasOutput() || (tls_ && !tls_->established());
+    if (want_write == writing_ || closed_)
+    {
+        return;
+    }
+    writing_ = want_write;
+    applyEvents();
+}
+
+uint32_t TcpConnection::eventMask() const
+{
+    uint32_t events = writing_ ? EPOLLOUT : 0;
+    if (reading_)
+    {
+        events |= EPOLLIN | EPOLLRDHUP;
+    }
+    return events | triggerFlags(trigger_);
+}
+
+int32_t TcpConnection::send(const char* data, size_t len, uint64_t trace_ns)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (closed_)
+    {
+        return -1;
+    }
+    const char* wire = data;
+    size_t wire_len = len;
+    if (codec_ && !codec_->encode(data, len, wire, wire_len))
+    {
+        // held until the compression handshake is done
+        return len;
+    }
+    if (writeOrQueue(wire, wire_len, trace_ns, lock) < 0)
+    {
+        return -1;
+    }
+    return len;
+}
+
+int32_t TcpConnection::writeOrQueue(const char* data, size_t len, uint64_t trace_ns, std::unique_lock<std::mutex>& lock)
+{
+    // keep order behind bytes not yet accepted by the socket, a tls record can't be dropped half written
+    if (hasOutput() || (tls_ && !tls_->established()))
+    {
+        if (outputBytes_ + len > MaxOutputBufferSize())
+        {
+            // slow reader, drop instead of growing without bound
+            return -1;
+        }
+        appendOutput(data, len);
+        if (trace_ns && latency_)
+        {
+            trace_->queuedReplies.push_back(WriteMark { bytesWritten_ + outputBytes_, trace_ns });
+        }
+        return 0;
+    }
+    ssize_t r = writeSome(data, len);
+    if (r < 0)
+    {
+        lock.unlock();
+        std::cout << "fd: " << fd_ << " write error, close it!" << std::endl;
+        close();
+        return -1;
+    }
+    if ((size_t)r < len)
+    {
+        // socket full, the rest goes out on EPOLLOUT
+        appendOutput(data + r, len - r);
+        if (trace_ns && latency_)
+        {
+            trace_->queuedReplies.push_back(WriteMark { bytesWritten_ + outputBytes_, trace_ns });
+        }
+        updateEvents();
+    }
+    else if (trace_ns && latency_)
+    {
+        onReplyWritten(bytesWritten_, trace_ns);
+    }
+    return 0;
+}
+
+TcpConnection::SharedSendStatus TcpConnection::sendShared(const PayloadPtr& payload, uint32_t tag, size_t limit, bool conflate)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (closed_)
+    {
+        return kSharedClosed;
+    }
+    size_t len = payload->size();
+    if (codec_)
+    {
+        // frames are per connection, the shared payload is framed into this connection's output
+        if (hasOutput() && outputBytes_ + len > limit)
+        {
+            return kSharedOverLimit;
+        }
+        const char* wire = nullptr;
+        size_t wire_len = 0;
+        if (codec_->encode(payload->data(), len, wire, wire_len) && writeOrQueue(wire, wire_len, 0, lock) < 0)
+        {
+            return closed_ ? kSharedClosed : kSharedOverLimit;
+        }
+        return hasOutput() ? kSharedQueued : kSharedSent;
+    }
+    if (hasOutput() || (tls_ && !tls_->established()))
+    {
+        if (outputBytes_ + len > limit)
+        {
+            if (conflate && tag != 0 && output_)
+            {
+                // replace an older message of the same tag that hasn't started, the subscriber only gets the newest
+                for (auto it = output_->rbegin(); it != output_->rend(); ++it)
+                {
+                    if (it->tag == tag && it->offset == 0 && it->payload)
+                    {
+                        outputBytes_ = outputBytes_ - it->payload->size() + len;
+                        it->payload = payload;
+                        return kSharedConflated;
+                    }
+                }
+            }
+            return kSharedOverLimit;
+        }
+        OutputQueue& queue = outputQueue();
+        queue.push_back(OutputChunk());
+        queue.back().payload = payload;
+        queue.back().tag = tag;
+        outputBytes_ += len;
+        return kSharedQueued;
+    }
+    ssize_t r = writeSome(payload->data(), len);
+    if (r < 0)
+    {
+        lock.unlock();
+        std::cout << "fd: " << fd_ << " write error, close it!" << std::endl;
+        close();
+        return kSharedClosed;
+    }
+    if ((size_t)r < len)
+    {
+        // the rest stays referenced from the shared payload, no copy
+        OutputQueue& queue = outputQueue();
+        queue.push_back(OutputChunk());
+        queue.back().payload = payload;
+        queue.back().tag = tag;
+        queue.back().offset = r;
+        outputBytes_ += len - r;
+        updateEvents();
+        return kSharedQueued;
+    }
+    return kSharedSent;
+}
+
+ssize_t TcpConnection::sendFile(int file_fd, off_t offset, size_t len)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (closed_ || hasOutput() || codec_)
+    {
+        return -1;
+    }
+    if (tls_)
+    {
+        // only possible when kernel encrypts(ktls tx), otherwise caller falls back to send()
+        TlsSession::Status st;
+        return tls_->sendFile(file_fd, offset, len, st);
+    }
+    // plaintext: zero copy from page cache to socket
+    return ::sendfile(fd_, file_fd, &offset, len);
+}
+
+void TcpConnection::close()
+{
+    if (loop_->isInLoopThread())
+    {
+        closeInLoop();
+        return;
+    }
+    // connection state belongs to the loop thread
+    TcpConnectionPtr self = shared_from_this();
+    loop_->post([self]() { self->closeInLoop(); });
+}
+
+void TcpConnection::closeAfterWrite()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (closed_)
+        {
+            return;
+        }
+        if (hasOutput())
+        {
+            // onWritable() closes once the rest is written
+            closeAfterWrite_ = true;
+            return;
+        }
+    }
+    closeInLoop();
+}
+
+void TcpConnection::shutdownAfterWrite()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (closed_ || writeShut_)
+        {
+            return;
+        }
+        if (hasOutput())
+        {
+            // onWritable() shuts down once the rest is written
+            shutdownAfterWrite_ = true;
+            return;
+        }
+        if (!shutdownWrite())
+        {
+            return;
+        }
+    }
+    closeInLoop();
+}
+
+bool TcpConnection::shutdownWrite()
+{
+    shutdownAfterWrite_ = false;
+    writeShut_ = true;
+    ::shutdown(fd_, SHUT_WR);
+    return readEof_;
+}
+
+void TcpConnection::onEof()
+{
+    if (!callbacks_->eof)
+    {
+        closeInLoop();
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        readEof_ = true;
+        if (!writeShut_)
+        {
+            reading_ = false;
+            if (trigger_ != TriggerMode::kEdge)
+            {
+                // a level triggered eof is reported again and again
+                applyEvents();
+            }
+        }
+    }
+    if (writeShut_)
+    {
+        // done both ways
+        closeInLoop();
+        return;
+    }
+    callbacks_->eof(*this);
+}
+
+void TcpConnection::closeInLoop()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (closed_)
+        {
+            return;
+        }
+        // send() from other threads stops writing here, the fd stays open until the close callback returned
+        closed_ = true;
+        loop_->removeHandler(fd_);
+        // unsent output is dropped with the connection
+        releaseOutput();
+        if (dispatching_ && dispatchThread_ != std::this_thread::get_id())
+        {
+            // another dispatch thread is handling an event(maybe in the recv callback), it finishes when done
+            closePending_ = true;
+            return;
+        }
+    }
+    finishClose();
+}
+
+void TcpConnection::finishClose()
+{
+    TcpConnectionPtr self = shared_from_this();
+    if (callbacks_->close)
+    {
+        // the fd number can't belong to a new connection yet, state the owner keeps by fd is released in time
+        callbacks_->close(self);
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (tls_)
+        {
+            tls_->shutdown();
+        }
+        ::close(fd_);
+    }
+    // the owner may drop its reference in the callback, keep this alive until the batch is done
+    loop_->deferRelease(self);
+}
@@ -0,0 +1,302 @@
+/********************************************************************************
+> FileName:	TcpConnection.h
+> Author:	Mingping Zhang
+> Email:	mingpingzhang@163.com
+> Create Time:	Wed Mar 29 14:18:53 2023
+********************************************************************************/
+#ifndef TCPCONNECTION_H
+#define TCPCONNECTION_H
+
+#include "EventLoop.h"
+#include "FrameCodec.h"
+#include "LatencyHistogram.h"
+#include "LineFramer.h"
+#include "Packet.h"
+#include "SocketAddress.h"
+#include "TlsContext.h"
+#include <sys/types.h>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+class TcpConnection;
+typedef std::shared_ptr<TcpConnection> TcpConnectionPtr;
+// immutable message shared by the output queues of many connections(publish fan-out)
+typedef std::shared_ptr<const std::string> PayloadPtr;
+
+// memory of servers holding very many mostly idle connections
+struct FootprintConfig
+{
+    size_t socketBuffer { 0 }; // SO_RCVBUF/SO_SNDBUF of accepted sockets(the kernel doubles it), 0 keeps autotuning
+};
+
+// called on the loop thread once the connection is closed, before its fd is(the number isn't reused yet)
+using callback_close_t = std::function<void(const TcpConnectionPtr& conn)>;
+// called before every read: shrink want to the allowed size, or return false to stop reading for now
+using callback_read_budget_t = std::function<bool(TcpConnection& conn, size_t& want)>;
+// called after every successful read of n bytes once its messages went to the recv callback: packets
+// delivered, 0 when it only held part of a frame or line
+using callback_read_done_t = std::function<void(TcpConnection& conn, size_t n, size_t messages)>;
+// called on the loop thread when queued output has been written completely
+using callback_write_drained_t = std::function<void(TcpConnection& conn)>;
+// called on the loop thread when the peer shut down its writing half(plaintext only, tls closes): the
+// connection stops reading and stays open for writing until shutdownAfterWrite() or close()
+using callback_eof_t = std::function<void(TcpConnection& conn)>;
+// called with the bytes of every read(out false) and write(out true) as they pass the socket, before
+// decompression and line splitting(tls: the plaintext); sendFile() bytes are not seen
+using callback_wire_t = std::function<void(TcpConnection& conn, bool out, const char* data, size_t n)>;
+
+// the callbacks of a connection, empty ones are not called. a server builds one set for all its connections
+// and every connection only points to it, the per connection record stays small; not changed once shared
+struct TcpCallbacks
+{
+    callback_recv_t recv;
+    callback_close_t close;
+    callback_read_budget_t readBudget;
+    callback_read_done_t readDone;
+    callback_write_drained_t writeDrained;
+    callback_eof_t eof;
+    callback_wire_t wire;
+};
+typedef std::shared_ptr<const TcpCallbacks> TcpCallbacksPtr;
+
+// one connected stream socket(plaintext or tls) on an EventLoop, shared by server and client:
+// edge triggered reads are delivered as Packets, writes that don't fit the socket are queued and
+// flushed with writev() on EPOLLOUT
+class TcpConnection : public EventHandler, public std::enable_shared_from_this<TcpConnection>
+{
+public:
+    enum SharedSendStatus
+    {
+        kSharedSent,       // written completely
+        kSharedQueued,     // (rest) queued, references the payload
+        kSharedConflated,  // replaced a queued older payload with the same tag
+        kSharedOverLimit,  // queue over limit, not queued
+        kSharedClosed,
+    };
+
+    // fd must be connected(or connecting) and non-blocking, the connection owns it
+    TcpConnection(const EventLoopPtr& loop, int32_t fd);
+    TcpConnection(const TcpConnection& other)            = delete;
+    TcpConnection& operator=(const TcpConnection& other) = delete;
+    ~TcpConnection() override;
+
+public:
+    // the setters must be called before start()
+    void setTlsSession(TlsSessionPtr session);
+    // all callbacks at once, shared with other connections
+    void setCallbacks(const TcpCallbacksPtr& callbacks)
+    { callbacks_ = callbacks ? callbacks : noCallbacks(); }
+    // one callback: the connection gets a copy of its set with the callback replaced(connections set up one
+    // by one, e.g. load balancer relays)
+    void setRecvCallback(callback_recv_t callback)
+    { setCallback(&TcpCallbacks::recv, std::move(callback)); }
+    void setCloseCallback(callback_close_t callback)
+    { setCallback(&TcpCallbacks::close, std::move(callback)); }
+    void setReadBudgetCallback(callback_read_budget_t callback)
+    { setCallback(&TcpCallbacks::readBudget, std::move(callback)); }
+    void setReadDoneCallback(callback_read_done_t callback)
+    { setCallback(&TcpCallbacks::readDone, std::move(callback)); }
+    void setWriteDrainedCallback(callback_write_drained_t callback)
+    { setCallback(&TcpCallbacks::writeDrained, std::move(callback)); }
+    void setEofCallback(callback_eof_t callback)
+    { setCallback(&TcpCallbacks::eof, std::move(callback)); }
+    void setWireCallback(callback_wire_t callback)
+    { setCallback(&TcpCallbacks::wire, std::move(callback)); }
+    // trace packets into stats(kernel timestamps on plaintext connections), stats must outlive the connection
+    void setLatencyStats(LatencyStats* stats);
+    // frame messages and compress them when the peer agrees(see FrameCodec), the client side sends the hello;
+    // stats may be null, otherwise it must outlive the connection
+    void setCompression(const CompressionConfig& config, bool server, CompressionStats* stats);
+    // deliver one packet per line instead of what each read returned(see LineFramer), a line over
+    // config.maxLineLength closes the connection. not with compression, its frames delimit messages already;
+    // stats may be null, otherwise it must outlive the connection
+    void setLineFraming(const LineFramingConfig& config, LineStats* stats);
+    // epoll trigger mode of the fd(default edge), level/oneshot read at most LevelReadsPerEvent() times per event.
+    // oneshot connections may be handled by any dispatch thread of the loop, one at a time
+    void setTriggerMode(TriggerMode mode)
+    { trigger_ = mode; }
+
+    // register fd on the loop
+    bool start();
+    // write now or queue behind pending output, callable from any thread; return len or -1.
+    // trace_ns is the callback time of the request when traced(PacketTimestamps::callbackNs)
+    int32_t send(const char* data, size_t len, uint64_t trace_ns = 0);
+    int32_t send(const std::string& message, uint64_t trace_ns = 0)
+    { return send(message.data(), message.size(), trace_ns); }
+    // send a payload shared with other connections, queued by reference; when limit bytes are already queued
+    // it is not queued, or with conflate replaces a not yet started queued payload of the same tag(tag 0: never).
+    // with compression every connection gets its own frame
+    SharedSendStatus sendShared(const PayloadPtr& payload, uint32_t tag, size_t limit, bool conflate);
+    // sendfile() on plaintext connections and on tls connections with kernel transmit encryption,
+    // -1 if not possible now(pending output, userspace tls, compression)
+    ssize_t sendFile(int file_fd, off_t offset, size_t len);
+    // read everything readable now(level/oneshot: one event's worth, the rest is reported again),
+    // loop thread only(resume a connection stopped by the read budget)
+    void readAll();
+    // close the connection, callable from any thread; the close callback runs on the loop thread
+    void close();
+    // close once queued output is written(at once when nothing is queued), loop thread only
+    void closeAfterWrite();
+    // shut down the writing half once queued output is written, the peer reads eof; the connection closes
+    // when the peer's eof came as well. loop thread only
+    void shutdownAfterWrite();
+    // stop/continue reading(flow control of a relay), unread bytes stay in socket buffer; loop thread only
+    void pauseReading();
+    void resumeReading();
+
+    int32_t fd() const
+    { return fd_; }
+    // getpeername() of the socket, invalid once closed(the connection doesn't keep a copy)
+    SocketAddress peer() const;
+    const EventLoopPtr& loop() const
+    { return loop_; }
+    bool connected() const
+    { return !closed_; }
+    bool isTls() const
+    { return tls_ != nullptr; }
+    // bytes queued for EPOLLOUT
+    size_t pendingOutput();
+
+    void handleEvent(uint32_t events) override;
+    int32_t handlerFd() const override
+    { return fd_; }
+
+private:
+    // the empty set every connection starts with
+    static const TcpCallbacksPtr& noCallbacks();
+    template <typename F>
+    void setCallback(F TcpCallbacks::* member, F callback)
+    {
+        std::shared_ptr<TcpCallbacks> callbacks = std::make_shared<TcpCallbacks>(*callbacks_);
+        (*callbacks).*member = std::move(callback);
+        callbacks_ = std::move(callbacks);
+    }
+    // continue handshake, return true once established
+    bool onTlsHandshake();
+    // handle the events of one epoll_wait() return
+    void dispatch(uint32_t events);
+    void onReadable();
+    // hand one received message to the recv callback; read_ts(traced only) is the read that produced it,
+    // shared by every message of the read like the datagrams of one udp batch
+    void deliver(std::string&& message, const PacketTimestamps& read_ts);
+    // run received bytes through codec_ and deliver the messages(counted in messages), false when the
+    // connection was closed
+    bool decodeInput(const char* data, size_t len, const PacketTimestamps& read_ts, size_t& messages);
+    // split received bytes into lines and deliver them, false when the connection was closed
+    bool splitLines(const char* data, size_t len, const PacketTimestamps& read_ts, size_t& messages);
+    void onWritable();
+    // write queued output, mutex_ held; return -1 on error
+    int32_t flushOutput();
+    // writev() queued chunks until the socket is full, mutex_ held; return bytes written or -1 on error
+    ssize_t writeChunks();
+    // copy data to the output queue / drop n written bytes from its front, mutex_ held
+    void appendOutput(const char* data, size_t len);
+    void consumeOutput(size_t n);
+    // output_ is only held while not empty, mutex_ held
+    bool hasOutput() const
+    { return output_ && !output_->empty(); }
+    // the output queue, taken from the shared pool when there is none; mutex_ held
+    struct OutputChunk;
+    typedef std::deque<OutputChunk> OutputQueue;
+    OutputQueue& outputQueue();
+    // give output_ back to the pool, dropping what is still queued; mutex_ held
+    void releaseOutput();
+    // drained queues shared by all connections, at most OutputQueuePoolSize()
+    struct OutputPool;
+    static OutputPool& outputPool();
+    // write data now or queue it behind pending output, lock holds mutex_; return 0, or -1 when dropped over
+    // MaxOutputBufferSize() or on a write error(lock released, connection closing)
+    int32_t writeOrQueue(const char* data, size_t len, uint64_t trace_ns, std::unique_lock<std::mutex>& lock);
+    // write as much of data as the socket takes, mutex_ held; return bytes written or -1 on error
+    ssize_t writeSome(const char* data, size_t len);
+    // focus on EPOLLOUT only while output is queued, mutex_ held
+    void updateEvents();
+    // epoll events of the current state, mutex_ held
+    uint32_t eventMask() const;
+    // register eventMask() with the loop, mutex_ held; oneshot fds through handleEvent()
+    void applyEvents();
+    // level/oneshot: (un)register EPOLLIN, a paused or throttled level triggered fd would be reported forever
+    void setReading(bool reading);
+    // read(), with recvmsg() and the kernel receive timestamp when tracing
+    ssize_t readSocket(char* buffer, size_t len, uint64_t& kernel_rx_ns);
+    // a traced reply ending at stream offset end was accepted by the socket, mutex_ held
+    void onReplyWritten(uint64_t end, uint64_t trace_ns);
+    // match transmit timestamps from the error queue to written replies
+    void onTxTimestamps();
+    void closeInLoop();
+    // close callback, then the fd; on the thread dispatching when close came from another one
+    void finishClose();
+    // peer's eof read: half close with the eof callback, otherwise close
+    void onEof();
+    // SHUT_WR now, mutex_ held; return true when the connection is done both ways
+    bool shutdownWrite();
+
+    EventLoopPtr loop_;
+    int32_t fd_ { -1 };
+    TlsSessionPtr tls_; // null for plaintext
+    std::unique_ptr<FrameCodec> codec_; // null without compression, guarded by mutex_
+    std::unique_ptr<LineFramer> framer_; // null without line framing, loop thread
+    LineStats* lineStats_ { nullptr };
+    std::vector<std::string> decoded_; // scratch of decodeInput() and splitLines(), loop thread
+    // one queued message: a private copy or a payload shared with other connections
+    struct OutputChunk
+    {
+        std::string owned;
+        PayloadPtr payload;   // used instead of owned when set
+        size_t offset { 0 };  // bytes already written
+        uint32_t tag { 0 };   // conflation key of shared payloads
+
+        const char* data() const
+        { return payload ? payload->data() : owned.data(); }
+        size_t size() const
+        { return payload ? payload->size() : owned.size(); }
+    };
+    static const size_t kCoalesceLimit = 16 * 1024; // small private sends share one chunk
+    static const int kMaxIovecs = 64; // chunks per writev()
+
+    std::unique_ptr<OutputQueue> output_; // bytes the socket didn't take yet, null while drained
+    size_t outputBytes_ { 0 }; // unwritten bytes in output_
+    bool writing_ { false }; // EPOLLOUT registered
+    std::mutex mutex_; // guard output_, outputBytes_, writing_ and fd_ against send()/close() from other threads
+    std::atomic<bool> closed_ { false };
+    bool closeAfterWrite_ { false }; // closeAfterWrite() waits for output_ to drain
+    bool shutdownAfterWrite_ { false }; // shutdownAfterWrite() waits for output_ to drain
+    bool writeShut_ { false }; // SHUT_WR done
+    bool readEof_ { false };   // peer's eof handed to the eof callback
+    bool readPaused_ { false };
+    TriggerMode trigger_ { TriggerMode::kEdge };
+    bool reading_ { true }; // EPOLLIN registered, always for edge triggered
+    // oneshot: a dispatch thread is in handleEvent(), it re-arms the fd and finishes the close when another
+    // thread closed the connection meanwhile(the fd number must not be reused under its read)
+    bool dispatching_ { false };
+    std::thread::id dispatchThread_;
+    bool closePending_ { false };
+    uint32_t pendingEvents_ { 0 }; // oneshot: events delivered to another thread while dispatching
+    bool rearmPosted_ { false };   // oneshot: handleEvent(0) posted to re-arm with a changed interest
+
+    // latency tracing, stream offsets count plain bytes accepted by the socket
+    struct WriteMark
+    {
+        uint64_t end; // stream offset after the reply
+        uint64_t ns;  // callback time(queued replies) or realtime of the write(tx timestamps)
+    };
+    struct TraceMarks
+    {
+        std::deque<WriteMark> queuedReplies; // traced replies waiting in output_
+        std::deque<WriteMark> txPending; // traced replies waiting for their transmit timestamp
+    };
+    LatencyStats* latency_ { nullptr };
+    bool txTimestamps_ { false }; // SO_TIMESTAMPING transmit timestamps enabled
+    uint64_t bytesWritten_ { 0 };
+    std::unique_ptr<TraceMarks> trace_; // only with latency_, untraced connections don't carry the queues
+
+    TcpCallbacksPtr callbacks_ { noCallbacks() }; // never null, set before start()
+};
+
+#endif//TCPCONNECTION_H
@@ -0,0 +1,37 @@
+/********************************************************************************
+> FileName:	TimeUtil.h
+> Author:	Mingping Zhang
+> Email:	mingpingzhang@163.com
+> Create Time:	Mon Mar 27 10:31:08 2023
+********************************************************************************/
+#ifndef TIMEUTIL_H
+#define TIMEUTIL_H
+
+#include <time.h>
+#include <cstdint>
+
+// monotonic clock in nanoseconds(vdso, no syscall)
+inline uint64_t monotonicNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// cheaper monotonic clock with tick resolution(1-4 ms), good enough for rate limiting
+inline uint64_t coarseMonotonicNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// wall clock in nanoseconds, the clock of kernel SO_TIMESTAMPING software timestamps
+inline uint64_t realtimeNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#endif//TIMEUTIL_H
@@ -0,0 +1,504 @@
+/********************************************************************************
+  > FileName:	TlsContext.cpp
+  > Author:	Mingping Zhang
+  > Email:	mingpingzhang@163.com
+  > Create Time:	Thu Mar 23 15:12:40 2023
+ ********************************************************************************/
+
+#include "TlsContext.h"
+#include <iostream>
+
+#ifdef EPOLL_WITH_TLS
+
+#include <openssl/ec.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include <openssl/x509v3.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <cerrno>
+
+static void printTlsErrors(const char* what)
+{
+    char buf[256] = {0};
+    unsigned long e = 0;
+    std::cout << what << " failed!" << std::endl;
+    while ((e = ERR_get_error()) != 0)
+    {
+        ERR_error_string_n(e, buf, sizeof(buf));
+        std::cout << "  " << buf << std::endl;
+    }
+}
+
+// P-256 key, the keygen calls of openssl 1.1.1(EVP_EC_gen is 3.0 only)
+static EVP_PKEY* generateEcKey()
+{
+    EVP_PKEY* pkey = nullptr;
+    EVP_PKEY_CTX* kctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr);
+    bool ok = kctx && EVP_PKEY_keygen_init(kctx) == 1
+        && EVP_PKEY_CTX_set_ec_paramgen_curve_nid(kctx, NID_X9_62_prime256v1) == 1
+        && EVP_PKEY_keygen(kctx, &pkey) == 1;
+    EVP_PKEY_CTX_free(kctx);
+    if (!ok)
+    {
+        EVP_PKEY_free(pkey);
+        return nullptr;
+    }
+    return pkey;
+}
+
+static SSL_CTX* newContext(const SSL_METHOD* method)
+{
+    SSL_CTX* ctx = SSL_CTX_new(method);
+    if (!ctx)
+    {
+        printTlsErrors("SSL_CTX_new");
+        return nullptr;
+    }
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    // non-blocking sockets: SSL_write may consume part of the buffer, and the retry may come from another buffer copy
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    SSL_CTX_clear_mode(ctx, SSL_MODE_AUTO_RETRY);
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+    // openssl 3 reports a peer closing without close_notify as a protocol error, it is a plain close here
+    SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+    return ctx;
+}
+
+TlsContext::TlsContext(SSL_CTX* ctx)
+    : ctx_ ( ctx )
+{
+    setKtlsEnabled(true);
+}
+
+TlsContext::~TlsContext()
+{
+    SSL_CTX_free(ctx_);
+}
+
+std::shared_ptr<TlsContext> TlsContext::createServer(const std::string& cert_file, const std::string& key_file)
+{
+    SSL_CTX* ctx = newContext(TLS_server_method());
+    if (!ctx)
+    {
+        return nullptr;
+    }
+    if (SSL_CTX_use_certificate_chain_file(ctx, cert_file.c_str()) != 1
+            || SSL_CTX_use_PrivateKey_file(ctx, key_file.c_str(), SSL_FILETYPE_PEM) != 1
+            || SSL_CTX_check_private_key(ctx) != 1)
+    {
+        printTlsErrors("load certificate");
+        SSL_CTX_free(ctx);
+        return nullptr;
+    }
+    return std::shared_ptr<TlsContext>(new TlsContext(ctx));
+}
+
+std::shared_ptr<TlsContext> TlsContext::createSelfSignedServer(const std::string& common_name)
+{
+    SSL_CTX* ctx = newContext(TLS_server_method());
+    if (!ctx)
+    {
+        return nullptr;
+    }
+    EVP_PKEY* pkey = generateEcKey();
+    X509* cert = X509_new();
+    bool ok = pkey && cert;
+    if (ok)
+    {
+        X509_set_version(cert, 2);
+        ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+        X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+        X509_gmtime_adj(X509_getm_notAfter(cert), 365L * 24 * 3600);
+        X509_NAME* name = X509_get_subject_name(cert);
+        X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char*)common_name.c_str(), -1, -1, 0);
+        X509_set_issuer_name(cert, name);
+        ok = X509_set_pubkey(cert, pkey) == 1
+            && X509_sign(cert, pkey, EVP_sha256()) > 0
+            && SSL_CTX_use_certificate(ctx, cert) == 1
+            && SSL_CTX_use_PrivateKey(ctx, pkey) == 1;
+    }
+    // ctx holds its own references
+    X509_free(cert);
+    EVP_PKEY_free(pkey);
+    if (!ok)
+    {
+        printTlsErrors("generate self-signed certificate");
+        SSL_CTX_free(ctx);
+        return nullptr;
+    }
+    return std::shared_ptr<TlsContext>(new TlsContext(ctx));
+}
+
+std::shared_ptr<TlsContext> TlsContext::createClient(const std::string& ca_file, const std::string& host_name)
+{
+    if (!ca_file.empty() && host_name.empty())
+    {
+        std::cout << "tls client verifying " << ca_file << " needs the server host name!" << std::endl;
+        return nullptr;
+    }
+    SSL_CTX* ctx = newContext(TLS_client_method());
+    if (!ctx)
+    {
+        return nullptr;
+    }
+    if (!ca_file.empty())
+    {
+        if (SSL_CTX_load_verify_locations(ctx, ca_file.c_str(), nullptr) != 1)
+        {
+            printTlsErrors("load ca file");
+            SSL_CTX_free(ctx);
+            return nullptr;
+        }
+        SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, nullptr);
+    }
+    else
+    {
+        SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, nullptr);
+    }
+    std::shared_ptr<TlsContext> context(new TlsContext(ctx));
+    context->hostName_ = host_name;
+    return context;
+}
+
+void TlsContext::setKtlsEnabled(bool enabled)
+{
+#ifdef SSL_OP_ENABLE_KTLS
+    // openssl installs TLS_TX/TLS_RX on the socket(setsockopt SOL_TLS) right after handshake
+    if (enabled)
+    {
+        SSL_CTX_set_options(ctx_, SSL_OP_ENABLE_KTLS);
+    }
+    else
+    {
+        SSL_CTX_clear_options(ctx_, SSL_OP_ENABLE_KTLS);
+    }
+    ktls_ = enabled;
+#else
+    ktls_ = false;
+#endif
+}
+
+void TlsContext::setMaxTls12(bool enabled)
+{
+    SSL_CTX_set_max_proto_version(ctx_, enabled ? TLS1_2_VERSION : 0);
+}
+
+
+TlsSession::TlsSession(SSL* ssl)
+    : ssl_ ( ssl )
+{
+}
+
+TlsSession::~TlsSession()
+{
+    SSL_free(ssl_);
+}
+
+// sni and the name the certificate must match(checked only when the context verifies); an ip address is
+// matched against the certificate's ip entries and not sent as sni
+static bool setServerName(SSL* ssl, const std::string& host_name)
+{
+    unsigned char addr[sizeof(struct in6_addr)];
+    if (inet_pton(AF_INET, host_name.c_str(), addr) == 1 || inet_pton(AF_INET6, host_name.c_str(), addr) == 1)
+    {
+        return X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), host_name.c_str()) == 1;
+    }
+    return SSL_set_tlsext_host_name(ssl, host_name.c_str()) == 1 && SSL_set1_host(ssl, host_name.c_str()) == 1;
+}
+
+std::unique_ptr<TlsSession> TlsSession::create(const TlsContextPtr& ctx, int fd, bool server)
+{
+    if (!ctx)
+    {
+        return nullptr;
+    }
+    SSL* ssl = SSL_new(ctx->native());
+    if (!ssl || SSL_set_fd(ssl, fd) != 1)
+    {
+        printTlsErrors("SSL_new");
+        SSL_free(ssl);
+        return nullptr;
+    }
+    if (server)
+    {
+        SSL_set_accept_state(ssl);
+    }
+    else
+    {
+        SSL_set_connect_state(ssl);
+        if (!ctx->hostName().empty() && !setServerName(ssl, ctx->hostName()))
+        {
+            printTlsErrors("set server name");
+            SSL_free(ssl);
+            return nullptr;
+        }
+    }
+    return std::unique_ptr<TlsSession>(new TlsSession(ssl));
+}
+
+TlsSession::Status TlsSession::toStatus(int ret)
+{
+    int err = SSL_get_error(ssl_, ret);
+    switch (err)
+    {
+    case SSL_ERROR_WANT_READ:
+        return kWantRead;
+    case SSL_ERROR_WANT_WRITE:
+        return kWantWrite;
+    case SSL_ERROR_ZERO_RETURN:
+        return kClosed;
+    case SSL_ERROR_SYSCALL:
+        failed_ = true;
+        // unexpected eof from peer is reported as syscall error without errno(openssl 1.1)
+        if (errno == 0 || errno == ECONNRESET || errno == EPIPE)
+        {
+            return kClosed;
+        }
+        return kError;
+    default:
+        failed_ = true;
+#ifdef SSL_R_UNEXPECTED_EOF_WHILE_READING
+        // openssl 3 without SSL_OP_IGNORE_UNEXPECTED_EOF
+        if (ERR_GET_REASON(ERR_peek_error()) == SSL_R_UNEXPECTED_EOF_WHILE_READING)
+        {
+            ERR_clear_error();
+            return kClosed;
+        }
+#endif
+        printTlsErrors("tls operation");
+        return kError;
+    }
+}
+
+TlsSession::Status TlsSession::handshake()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (established_)
+    {
+        return kOk;
+    }
+    ERR_clear_error();
+    errno = 0;
+    int r = SSL_do_handshake(ssl_);
+    if (r == 1)
+    {
+        established_ = true;
+        return kOk;
+    }
+    return toStatus(r);
+}
+
+int TlsSession::read(void* buf, size_t len, Status& status)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    ERR_clear_error();
+    errno = 0;
+    int r = SSL_read(ssl_, buf, len);
+    if (r > 0)
+    {
+        status = kOk;
+        return r;
+    }
+    status = toStatus(r);
+    return -1;
+}
+
+int TlsSession::write(const void* buf, size_t len, Status& status)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    ERR_clear_error();
+    errno = 0;
+    int r = SSL_write(ssl_, buf, len);
+    if (r > 0)
+    {
+        status = kOk;
+        return r;
+    }
+    status = toStatus(r);
+    return -1;
+}
+
+ssize_t TlsSession::sendFile(int file_fd, off_t offset, size_t len, Status& status)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+#ifdef BIO_get_ktls_send
+    if (BIO_get_ktls_send(SSL_get_wbio(ssl_)))
+    {
+        ERR_clear_error();
+        errno = 0;
+        ossl_ssize_t r = SSL_sendfile(ssl_, file_fd, offset, len, 0);
+        if (r >= 0)
+        {
+            status = kOk;
+            return r;
+        }
+        status = (errno == EAGAIN || errno == EWOULDBLOCK) ? kWantWrite : kError;
+        return -1;
+    }
+#endif
+    // userspace encryption has no zero copy path, caller reads the file and calls write()
+    status = kError;
+    return -1;
+}
+
+void TlsSession::shutdown()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!established_ || failed_)
+    {
+        return;
+    }
+    // the peer may be gone, writing the alert must not kill the process with SIGPIPE
+    sigset_t pipe_set;
+    sigset_t old_set;
+    sigset_t pending;
+    sigemptyset(&pipe_set);
+    sigaddset(&pipe_set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_set, &old_set);
+    sigpending(&pending);
+    bool was_pending = sigismember(&pending, SIGPIPE);
+    ERR_clear_error();
+    SSL_shutdown(ssl_);
+    ERR_clear_error();
+    if (!was_pending)
+    {
+        // discard the SIGPIPE of this write, if any
+        struct timespec zero = { 0, 0 };
+        sigtimedwait(&pipe_set, nullptr, &zero);
+    }
+    pthread_sigmask(SIG_SETMASK, &old_set, nullptr);
+}
+
+bool TlsSession::ktlsSend() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+#ifdef BIO_get_ktls_send
+    return BIO_get_ktls_send(SSL_get_wbio(ssl_));
+#else
+    return false;
+#endif
+}
+
+bool TlsSession::ktlsRecv() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+#ifdef BIO_get_ktls_send
+    return BIO_get_ktls_recv(SSL_get_rbio(ssl_));
+#else
+    return false;
+#endif
+}
+
+std::string TlsSession::description() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return std::string(SSL_get_version(ssl_)) + " " + SSL_get_cipher_name(ssl_);
+}
+
+#else // EPOLL_WITH_TLS
+
+// built without openssl: tls can't be enabled, every factory reports failure
+
+TlsContext::TlsContext(SSL_CTX* ctx)
+    : ctx_ ( ctx )
+{
+}
+
+TlsContext::~TlsContext()
+{
+}
+
+std::shared_ptr<TlsContext> TlsContext::createServer(const std::string&, const std::string&)
+{
+    std::cout << "built without tls support!" << std::endl;
+    return nullptr;
+}
+
+std::shared_ptr<TlsContext> TlsContext::createSelfSignedServer(const std::string&)
+{
+    std::cout << "built without tls support!" << std::endl;
+    return nullptr;
+}
+
+std::shared_ptr<TlsContext> TlsContext::createClient(const std::string&, const std::string&)
+{
+    std::cout << "built without tls support!" << std::endl;
+    return nullptr;
+}
+
+void TlsContext::setKtlsEnabled(bool)
+{
+}
+
+void TlsContext::setMaxTls12(bool)
+{
+}
+
+TlsSession::TlsSession(SSL* ssl)
+    : ssl_ ( ssl )
+{
+}
+
+TlsSession::~TlsSession()
+{
+}
+
+std::unique_ptr<TlsSession> TlsSession::create(const TlsContextPtr&, int, bool)
+{
+    return nullptr;
+}
+
+TlsSession::Status TlsSession::toStatus(int)
+{
+    return kError;
+}
+
+TlsSession::Status TlsSession::handshake()
+{
+    return kError;
+}
+
+int TlsSession::read(void*, size_t, Status& status)
+{
+    status = kError;
+    return -1;
+}
+
+int TlsSession::write(const void*, size_t, Status& status)
+{
+    status = kError;
+    return -1;
+}
+
+ssize_t TlsSession::sendFile(int, off_t, size_t, Status& status)
+{
+    status = kError;
+    return -1;
+}
+
+void TlsSession::shutdown()
+{
+}
+
+bool TlsSession::ktlsSend() const
+{
+    return false;
+}
+
+bool TlsSession::ktlsRecv() const
+{
+    return false;
+}
+
+std::string TlsSession::description() const
+{
+    return std::string();
+}
+
+#endif // EPOLL_WITH_TLS
@@ -0,0 +1,116 @@
+/********************************************************************************
+> FileName:	TlsContext.h
+> Author:	Mingping Zhang
+> Email:	mingpingzhang@163.com
+> Create Time:	Thu Mar 23 15:12:40 2023
+********************************************************************************/
+#ifndef TLSCONTEXT_H
+#define TLSCONTEXT_H
+
+#include <sys/types.h>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+
+// implemented with openssl when built with EPOLL_WITH_TLS, otherwise every create function returns nullptr
+
+typedef struct ssl_ctx_st SSL_CTX;
+typedef struct ssl_st SSL;
+
+// certificates and settings shared by all tls connections of a server or client
+class TlsContext
+{
+public:
+    TlsContext(const TlsContext& other)            = delete;
+    TlsContext& operator=(const TlsContext& other) = delete;
+    ~TlsContext();
+
+    // server context from pem certificate chain and private key files
+    static std::shared_ptr<TlsContext> createServer(const std::string& cert_file, const std::string& key_file);
+    // server context with a freshly generated self-signed certificate(for tests and benchmarks)
+    static std::shared_ptr<TlsContext> createSelfSignedServer(const std::string& common_name);
+    // client context for server host_name(dns name or ip address): sent as sni and, when verifying, matched
+    // against the certificate; verify the server certificate against ca_file, empty ca_file means no
+    // verification. verifying without host_name fails, any certificate of the ca would do
+    static std::shared_ptr<TlsContext> createClient(const std::string& ca_file, const std::string& host_name);
+
+public:
+    // after handshake hand record encryption over to kernel(TLS_TX/TLS_RX), on by default;
+    // connections silently stay in userspace if the kernel tls module is missing
+    void setKtlsEnabled(bool enabled);
+    bool ktlsEnabled() const
+    { return ktls_; }
+    // limit protocol to tls1.2, some kernels/openssl versions only offload receive for tls1.2
+    void setMaxTls12(bool enabled);
+    SSL_CTX* native() const
+    { return ctx_; }
+    // expected server of a client context, empty for servers
+    const std::string& hostName() const
+    { return hostName_; }
+
+private:
+    explicit TlsContext(SSL_CTX* ctx);
+
+    SSL_CTX* ctx_ { nullptr };
+    bool ktls_ { false };
+    std::string hostName_;
+};
+
+typedef std::shared_ptr<TlsContext> TlsContextPtr;
+
+// tls state of one non-blocking connection, calls are serialized by an internal mutex so
+// a connection may be written by user thread while the loop thread reads it
+class TlsSession
+{
+public:
+    enum Status
+    {
+        kOk,        // operation done
+        kWantRead,  // wait for EPOLLIN and call again
+        kWantWrite, // wait for EPOLLOUT and call again
+        kClosed,    // peer sent close_notify or closed socket
+        kError,     // fatal error, close the connection
+    };
+
+    TlsSession(const TlsSession& other)            = delete;
+    TlsSession& operator=(const TlsSession& other) = delete;
+    ~TlsSession();
+
+    // attach tls to a connected non-blocking socket, the session doesn't own the fd
+    static std::unique_ptr<TlsSession> create(const TlsContextPtr& ctx, int fd, bool server);
+
+public:
+    // drive the handshake, kOk when established
+    Status handshake();
+    bool established() const
+    { return established_; }
+    // read decrypted bytes, return >0 or -1 with status(kWantRead when drained)
+    int read(void* buf, size_t len, Status& status);
+    // write plain bytes, return bytes consumed(may be partial) or -1 with status
+    int write(const void* buf, size_t len, Status& status);
+    // send a file through the connection, only possible when kernel does transmit encryption
+    ssize_t sendFile(int file_fd, off_t offset, size_t len, Status& status);
+    // send close_notify before the socket is closed, best effort; nothing after a fatal error
+    void shutdown();
+
+    // record encryption done by kernel after handshake
+    bool ktlsSend() const;
+    bool ktlsRecv() const;
+    // negotiated protocol and cipher, e.g. "TLSv1.3 TLS_AES_128_GCM_SHA256"
+    std::string description() const;
+
+private:
+    explicit TlsSession(SSL* ssl);
+    Status toStatus(int ret);
+
+    SSL* ssl_ { nullptr };
+    std::atomic<bool> established_ { false }; // read without the lock by send() of other threads
+    bool failed_ { false }; // fatal error, no close_notify
+    mutable std::mutex mutex_;
+};
+
+typedef std::unique_ptr<TlsSession> TlsSessionPtr;
+
+#endif//TLSCONTEXT_H
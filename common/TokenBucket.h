@@ -0,0 +1,59 @@
+/********************************************************************************
+> FileName:	TokenBucket.h
+> Author:	Mingping Zhang
+> Email:	mingpingzhang@163.com
+> Create Time:	Mon Mar 27 10:31:08 2023
+********************************************************************************/
+#ifndef TOKENBUCKET_H
+#define TOKENBUCKET_H
+
+#include <cstdint>
+
+// rate and burst shared by many buckets, rate 0 means unlimited
+struct RateLimit
+{
+    double rate { 0 };  // tokens per second
+    double burst { 0 }; // bucket capacity, 0 means one second worth of rate
+
+    RateLimit() = default;
+    RateLimit(double r, double b = 0) : rate(r), burst(b > 0 ? b : r) {}
+    bool enabled() const
+    { return rate > 0; }
+};
+
+// token bucket state, 16 bytes, the limit is passed in so many buckets share one RateLimit
+struct TokenBucket
+{
+    double tokens { 0 };
+    uint64_t lastNs { 0 };  // time of last refill, 0: never used, starts full
+
+    // add tokens earned since last refill, capped at burst
+    void refill(const RateLimit& limit, uint64_t now_ns)
+    {
+        if (lastNs == 0)
+        {
+            tokens = limit.burst;
+        }
+        else if (now_ns > lastNs)
+        {
+            tokens += (now_ns - lastNs) * 1e-9 * limit.rate;
+            if (tokens > limit.burst)
+            {
+                tokens = limit.burst;
+            }
+        }
+        lastNs = now_ns;
+    }
+    // tokens that can be taken now(call refill() first)
+    double available(const RateLimit& limit) const
+    { return limit.enabled() ? tokens : 1e18; }
+    void take(const RateLimit& limit, double n)
+    {
+        if (limit.enabled())
+        {
+            tokens -= n;
+        }
+    }
+};
+
+#endif//TOKENBUCKET_H
@@ -0,0 +1,343 @@
+/********************************************************************************
+  > FileName:	KvCacheServer.cpp
+  > Author:	Mingping Zhang
+  > Email:	mingpingzhang@163.com
+  > Create Time:	Fri Apr 14 11:06:52 2023
+ ********************************************************************************/
+
+#include "KvCacheServer.h"
+#include <sys/resource.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <memory>
+
+// memcached's key length limit
+static const size_t kMaxKeyLength = 250;
+
+// next space separated token of [p, end)
+static bool nextToken(const char*& p, const char* end, const char*& token, size_t& token_len)
+{
+    while (p < end && *p == ' ')
+    {
+        ++p;
+    }
+    if (p == end)
+    {
+        return false;
+    }
+    token = p;
+    while (p < end && *p != ' ')
+    {
+        ++p;
+    }
+    token_len = p - token;
+    return true;
+}
+
+static bool parseUnsigned(const char* token, size_t len, uint64_t& value)
+{
+    if (len == 0 || len > 20)
+    {
+        return false;
+    }
+    value = 0;
+    for (size_t i = 0; i < len; ++i)
+    {
+        if (token[i] < '0' || token[i] > '9')
+        {
+            return false;
+        }
+        value = value * 10 + (token[i] - '0');
+    }
+    return true;
+}
+
+static bool parseSigned(const char* token, size_t len, int64_t& value)
+{
+    bool negative = len > 0 && token[0] == '-';
+    uint64_t magnitude = 0;
+    if (!parseUnsigned(token + negative, len - negative, magnitude) || magnitude > (uint64_t)INT64_MAX)
+    {
+        return false;
+    }
+    value = negative ? -(int64_t)magnitude : (int64_t)magnitude;
+    return true;
+}
+
+static bool tokenIs(const char* token, size_t len, const char* word)
+{
+    return len == strlen(word) && memcmp(token, word, len) == 0;
+}
+
+KvCacheServer::KvCacheServer(const SocketAddress& local_addr, const KvServerConfig& config)
+    : config_ ( config ),
+      server_ ( local_addr ),
+      store_ ( config.store, config.threads )
+{
+    server_.registerOnRecvCallback([this](const PacketPtr& data) { onRecv(data); });
+    server_.setCloseCallback([this](int32_t fd) { onClose(fd); });
+    if (config_.threads > 1)
+    {
+        // a connection is handled by one dispatch thread at a time
+        server_.setTriggerMode(TriggerMode::kOneShot);
+        server_.setDispatchThreads(config_.threads);
+    }
+}
+
+KvCacheServer::~KvCacheServer()
+{
+    stop();
+}
+
+bool KvCacheServer::start()
+{
+    // a slot for every fd this process can have: threads never resize it under each other
+    struct rlimit limit;
+    size_t fds = 65536;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY)
+    {
+        fds = std::min<size_t>(limit.rlim_cur, 1 << 20);
+    }
+    sessions_.resize(fds);
+    return server_.start();
+}
+
+bool KvCacheServer::stop()
+{
+    return server_.stop();
+}
+
+void KvCacheServer::onRecv(const PacketPtr& data)
+{
+    int32_t fd = data->fd();
+    if (fd < 0 || (size_t)fd >= sessions_.size())
+    {
+        return;
+    }
+    Session& session = sessions_[fd];
+    const std::string& bytes = data->message();
+    std::string out;
+    if (session.pending.empty())
+    {
+        // the usual case: whole commands, parsed in place
+        size_t used = process(session, bytes.data(), bytes.size(), out);
+        if (used < bytes.size())
+        {
+            session.pending.assign(bytes, used, std::string::npos);
+        }
+    }
+    else
+    {
+        session.pending.append(bytes);
+        size_t used = process(session, session.pending.data(), session.pending.size(), out);
+        session.pending.erase(0, used);
+        if (session.pending.empty() && session.pending.capacity() > 4096)
+        {
+            // a big set went through, idle connections keep little
+            std::string().swap(session.pending);
+        }
+    }
+    if (!out.empty())
+    {
+        server_.sendData(std::make_shared<Packet>(fd, std::move(out)));
+    }
+}
+
+void KvCacheServer::onClose(int32_t fd)
+{
+    if (fd >= 0 && (size_t)fd < sessions_.size())
+    {
+        sessions_[fd] = Session();
+    }
+}
+
+size_t KvCacheServer::process(Session& session, const char* data, size_t len, std::string& out)
+{
+    size_t pos = 0;
+    while (pos < len)
+    {
+        if (session.swallow > 0)
+        {
+            size_t n = std::min(session.swallow, len - pos);
+            session.swallow -= n;
+            pos += n;
+            continue;
+        }
+        const char* nl = (const char*)memchr(data + pos, '\n', len - pos);
+        size_t line_len = nl ? nl - (data + pos) : len - pos;
+        if (line_len > config_.maxLineLength)
+        {
+            // not a command of this protocol, drop what came
+            error("CLIENT_ERROR line too long", out);
+            return len;
+        }
+        if (!nl)
+        {
+            break;
+        }
+        size_t next = nl + 1 - data;
+        if (line_len > 0 && data[pos + line_len - 1] == '\r')
+        {
+            --line_len;
+        }
+        size_t data_used = 0;
+        if (!execute(session, data + pos, line_len, data + next, len - next, data_used, out))
+        {
+            // the data block of a set isn't all there, the line is parsed again then
+            break;
+        }
+        stats_.commands.fetch_add(1, std::memory_order_relaxed);
+        pos = next + data_used;
+    }
+    return pos;
+}
+
+bool KvCacheServer::execute(Session& session, const char* line, size_t line_len, const char* rest, size_t rest_len,
+    size_t& data_used, std::string& out)
+{
+    const char* p = line;
+    const char* end = line + line_len;
+    const char* cmd = nullptr;
+    size_t cmd_len = 0;
+    if (!nextToken(p, end, cmd, cmd_len))
+    {
+        error("ERROR", out);
+        return true;
+    }
+    const char* key = nullptr;
+    size_t key_len = 0;
+    if (tokenIs(cmd, cmd_len, "get"))
+    {
+        // the value is copied out under the shard lock, the buffer keeps its capacity on this thread
+        static thread_local std::string value;
+        bool any = false;
+        while (nextToken(p, end, key, key_len))
+        {
+            any = true;
+            if (key_len > kMaxKeyLength)
+            {
+                error("CLIENT_ERROR bad command line format", out);
+                return true;
+            }
+            uint32_t flags = 0;
+            if (store_.get(key, key_len, value, flags))
+            {
+                char header[48];
+                int n = snprintf(header, sizeof(header), " %u %zu\r\n", flags, value.size());
+                out.append("VALUE ", 6);
+                out.append(key, key_len);
+                out.append(header, n);
+                out.append(value);
+                out.append("\r\n", 2);
+            }
+        }
+        if (!any)
+        {
+            error("ERROR", out);
+            return true;
+        }
+        out.append("END\r\n", 5);
+        return true;
+    }
+    if (tokenIs(cmd, cmd_len, "set"))
+    {
+        const char* token[4];
+        size_t token_len[4];
+        size_t count = 0;
+        if (!nextToken(p, end, key, key_len))
+        {
+            error("ERROR", out);
+            return true;
+        }
+        while (count < 4 && nextToken(p, end, token[count], token_len[count]))
+        {
+            ++count;
+        }
+        uint64_t flags = 0;
+        int64_t exptime = 0;
+        uint64_t bytes = 0;
+        bool noreply = count == 4 && tokenIs(token[3], token_len[3], "noreply");
+        const char* extra = nullptr;
+        size_t extra_len = 0;
+        if (count < 3 || (count == 4 && !noreply) || nextToken(p, end, extra, extra_len) || key_len > kMaxKeyLength ||
+            !parseUnsigned(token[0], token_len[0], flags) || flags > UINT32_MAX ||
+            !parseSigned(token[1], token_len[1], exptime) || !parseUnsigned(token[2], token_len[2], bytes))
+        {
+            error("CLIENT_ERROR bad command line format", out);
+            return true;
+        }
+        if (bytes > store_.config().maxValueSize)
+        {
+            // the data block follows anyway, skipped as it comes
+            error("SERVER_ERROR object too large for cache", out);
+            session.swallow = bytes + 2;
+            return true;
+        }
+        if (rest_len < bytes + 2)
+        {
+            return false;
+        }
+        data_used = bytes + 2;
+        if (rest[bytes] != '\r' || rest[bytes + 1] != '\n')
+        {
+            error("CLIENT_ERROR bad data chunk", out);
+            return true;
+        }
+        if (!store_.set(key, key_len, rest, bytes, (uint32_t)flags, exptime))
+        {
+            error("SERVER_ERROR out of memory storing object", out);
+            return true;
+        }
+        if (!noreply)
+        {
+            out.append("STORED\r\n", 8);
+        }
+        return true;
+    }
+    if (tokenIs(cmd, cmd_len, "delete"))
+    {
+        if (!nextToken(p, end, key, key_len) || key_len > kMaxKeyLength)
+        {
+            error("CLIENT_ERROR bad command line format", out);
+            return true;
+        }
+        // "delete key 0" of old clients is accepted
+        bool noreply = false;
+        const char* option = nullptr;
+        size_t option_len = 0;
+        while (nextToken(p, end, option, option_len))
+        {
+            if (tokenIs(option, option_len, "noreply"))
+            {
+                noreply = true;
+            }
+            else if (!tokenIs(option, option_len, "0"))
+            {
+                error("CLIENT_ERROR bad command line format", out);
+                return true;
+            }
+        }
+        bool found = store_.remove(key, key_len);
+        if (!noreply)
+        {
+            out.append(found ? "DELETED\r\n" : "NOT_FOUND\r\n");
+        }
+        return true;
+    }
+    if (tokenIs(cmd, cmd_len, "version"))
+    {
+        out.append("VERSION 1.6.0-kvcache\r\n");
+        return true;
+    }
+    error("ERROR", out);
+    return true;
+}
+
+void KvCacheServer::error(const char* reply, std::string& out)
+{
+    stats_.errors.fetch_add(1, std::memory_order_relaxed);
+    out.append(reply);
+    out.append("\r\n", 2);
+}
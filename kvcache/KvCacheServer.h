@@ -0,0 +1,81 @@
+/********************************************************************************
+> FileName:	KvCacheServer.h
+> Author:	Mingping Zhang
+> Email:	mingpingzhang@163.com
+> Create Time:	Fri Apr 14 11:06:52 2023
+********************************************************************************/
+#ifndef KVCACHESERVER_H
+#define KVCACHESERVER_H
+
+#include "EpollTcpServer.h"
+#include "KvStore.h"
+#include "SocketAddress.h"
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct KvServerConfig
+{
+    KvConfig store;
+    size_t threads { 1 };           // threads serving the connections(EpollTcpServer::setDispatchThreads())
+    size_t maxLineLength { 2048 };  // command line without its data block, longer lines are an error
+};
+
+// protocol counters, readable from any thread
+struct KvServerStats
+{
+    std::atomic<uint64_t> commands { 0 };
+    std::atomic<uint64_t> errors { 0 }; // ERROR, CLIENT_ERROR and SERVER_ERROR replies
+};
+
+// the memcached text protocol subset get(multiple keys)/set/delete, noreply included, over an
+// EpollTcpServer: requests are parsed from the bytes of every read(a connection keeps what isn't a whole
+// command yet), the replies of one read are sent with one write. compatible with memcached clients and load
+// generators(memtier_benchmark --protocol=memcache_text) for these commands
+class KvCacheServer
+{
+public:
+    KvCacheServer(const SocketAddress& local_addr, const KvServerConfig& config);
+    KvCacheServer(const KvCacheServer& other)            = delete;
+    KvCacheServer& operator=(const KvCacheServer& other) = delete;
+    ~KvCacheServer();
+
+public:
+    // tls, admission control, latency tracing ... of the listening side, configured before start()
+    EpollTcpServer& transport()
+    { return server_; }
+    bool start();
+    bool stop();
+
+    KvStore& store()
+    { return store_; }
+    const KvServerStats& stats() const
+    { return stats_; }
+
+private:
+    // what a connection keeps between reads
+    struct Session
+    {
+        std::string pending; // bytes not parsed yet
+        size_t swallow { 0 }; // data bytes of a refused set still to skip
+    };
+
+    void onRecv(const PacketPtr& data);
+    void onClose(int32_t fd);
+    // execute the whole commands of data, replies appended to out; return the bytes consumed
+    size_t process(Session& session, const char* data, size_t len, std::string& out);
+    // one command line(without \r\n); the data block of a set follows at rest, false when it isn't all there
+    bool execute(Session& session, const char* line, size_t line_len, const char* rest, size_t rest_len,
+        size_t& data_used, std::string& out);
+    void error(const char* reply, std::string& out);
+
+    KvServerConfig config_;
+    EpollTcpServer server_;
+    KvStore store_;
+    // indexed by fd, sized to the fd limit at start(): a connection is served by one thread at a time
+    std::vector<Session> sessions_;
+    KvServerStats stats_;
+};
+
+#endif//KVCACHESERVER_H
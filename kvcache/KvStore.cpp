@@ -0,0 +1,355 @@
+/********************************************************************************
+  > FileName:	KvStore.cpp
+  > Author:	Mingping Zhang
+  > Email:	mingpingzhang@163.com
+  > Create Time:	Fri Apr 14 09:41:27 2023
+ ********************************************************************************/
+
+#include "KvStore.h"
+#include "TimeUtil.h"
+#include <cstring>
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t fmix64(uint64_t k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+uint64_t hashKey(const char* key, size_t len)
+{
+    const uint64_t c1 = 0x87c37b91114253d5ULL;
+    const uint64_t c2 = 0x4cf5ad432745937fULL;
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ len;
+    while (len >= 8)
+    {
+        uint64_t k;
+        memcpy(&k, key, 8);
+        k = rotl64(k * c1, 31) * c2;
+        h = rotl64(h ^ k, 27) * 5 + 0x52dce729;
+        key += 8;
+        len -= 8;
+    }
+    if (len > 0)
+    {
+        uint64_t k = 0;
+        memcpy(&k, key, len);
+        h ^= rotl64(k * c1, 31) * c2;
+    }
+    return fmix64(h);
+}
+
+// the wall clock of memcached expiry times
+static uint64_t nowSeconds()
+{
+    return realtimeNs() / 1000000000ULL;
+}
+
+KvShard::KvShard(size_t memory_limit)
+    : slots_ ( 1024, Slot { 0, 0 } ),
+      mask_ ( 1023 ),
+      limit_ ( memory_limit )
+{
+}
+
+bool KvShard::get(uint64_t hash, const char* key, size_t key_len, std::string& value, uint32_t& flags)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++stats_.gets;
+    size_t slot = find(hash, key, key_len);
+    if (slot == kNotFound)
+    {
+        return false;
+    }
+    uint32_t index = slots_[slot].item;
+    Item& item = items_[index];
+    if (item.expireS != 0 && item.expireS <= nowSeconds())
+    {
+        ++stats_.expired;
+        removeAt(slot);
+        return false;
+    }
+    ++stats_.hits;
+    if (head_ != index)
+    {
+        unlink(index);
+        pushFront(index);
+    }
+    value.assign(item.data, item.keyLen, std::string::npos);
+    flags = item.flags;
+    return true;
+}
+
+bool KvShard::set(uint64_t hash, const char* key, size_t key_len, const char* value, size_t value_len,
+    uint32_t flags, uint64_t expire_s)
+{
+    if (sizeof(Item) + 2 * sizeof(Slot) + key_len + value_len > limit_)
+    {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++stats_.sets;
+    size_t slot = find(hash, key, key_len);
+    uint32_t index;
+    if (slot != kNotFound)
+    {
+        index = slots_[slot].item;
+        Item& item = items_[index];
+        stats_.bytes -= itemBytes(item);
+        item.data.replace(key_len, std::string::npos, value, value_len);
+        unlink(index);
+    }
+    else
+    {
+        if (free_.empty())
+        {
+            index = (uint32_t)items_.size();
+            items_.push_back(Item());
+        }
+        else
+        {
+            index = free_.back();
+            free_.pop_back();
+        }
+        Item& item = items_[index];
+        item.data.reserve(key_len + value_len);
+        item.data.assign(key, key_len);
+        item.data.append(value, value_len);
+        item.hash = hash;
+        item.keyLen = (uint32_t)key_len;
+        if ((stats_.items + 1) * 4 > slots_.size() * 3)
+        {
+            grow();
+        }
+        insertSlot(hash, index);
+        ++stats_.items;
+    }
+    Item& item = items_[index];
+    item.flags = flags;
+    item.expireS = expire_s;
+    stats_.bytes += itemBytes(item);
+    pushFront(index);
+    evict(index);
+    return true;
+}
+
+bool KvShard::remove(uint64_t hash, const char* key, size_t key_len)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t slot = find(hash, key, key_len);
+    if (slot == kNotFound)
+    {
+        return false;
+    }
+    ++stats_.deletes;
+    removeAt(slot);
+    return true;
+}
+
+void KvShard::addStats(KvStats& stats)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats.gets += stats_.gets;
+    stats.hits += stats_.hits;
+    stats.sets += stats_.sets;
+    stats.deletes += stats_.deletes;
+    stats.evictions += stats_.evictions;
+    stats.expired += stats_.expired;
+    stats.items += stats_.items;
+    stats.bytes += stats_.bytes;
+}
+
+size_t KvShard::find(uint64_t hash, const char* key, size_t key_len) const
+{
+    uint32_t tag = (uint32_t)(hash >> 24) | 1;
+    for (size_t i = hash & mask_;; i = (i + 1) & mask_)
+    {
+        const Slot& s = slots_[i];
+        if (s.tag == 0)
+        {
+            return kNotFound;
+        }
+        if (s.tag == tag)
+        {
+            const Item& item = items_[s.item];
+            if (item.keyLen == key_len && memcmp(item.data.data(), key, key_len) == 0)
+            {
+                return i;
+            }
+        }
+    }
+}
+
+void KvShard::removeAt(size_t slot)
+{
+    uint32_t index = slots_[slot].item;
+    Item& item = items_[index];
+    eraseSlot(slot);
+    unlink(index);
+    stats_.bytes -= itemBytes(item);
+    --stats_.items;
+    std::string().swap(item.data);
+    free_.push_back(index);
+}
+
+void KvShard::eraseSlot(size_t slot)
+{
+    size_t hole = slot;
+    for (size_t i = (hole + 1) & mask_; slots_[i].tag != 0; i = (i + 1) & mask_)
+    {
+        size_t home = items_[slots_[i].item].hash & mask_;
+        // stays when its home is cyclically in (hole, i], else the hole would cut it off from its home
+        bool stays = (hole < i) ? (home > hole && home <= i) : (home > hole || home <= i);
+        if (!stays)
+        {
+            slots_[hole] = slots_[i];
+            hole = i;
+        }
+    }
+    slots_[hole].tag = 0;
+}
+
+void KvShard::insertSlot(uint64_t hash, uint32_t item)
+{
+    size_t i = hash & mask_;
+    while (slots_[i].tag != 0)
+    {
+        i = (i + 1) & mask_;
+    }
+    slots_[i].tag = (uint32_t)(hash >> 24) | 1;
+    slots_[i].item = item;
+}
+
+void KvShard::grow()
+{
+    std::vector<Slot> old(slots_.size() * 2, Slot { 0, 0 });
+    old.swap(slots_);
+    mask_ = slots_.size() - 1;
+    for (const Slot& s : old)
+    {
+        if (s.tag != 0)
+        {
+            insertSlot(items_[s.item].hash, s.item);
+        }
+    }
+}
+
+void KvShard::unlink(uint32_t index)
+{
+    Item& item = items_[index];
+    if (item.prev != kNil)
+    {
+        items_[item.prev].next = item.next;
+    }
+    else
+    {
+        head_ = item.next;
+    }
+    if (item.next != kNil)
+    {
+        items_[item.next].prev = item.prev;
+    }
+    else
+    {
+        tail_ = item.prev;
+    }
+}
+
+void KvShard::pushFront(uint32_t index)
+{
+    Item& item = items_[index];
+    item.prev = kNil;
+    item.next = head_;
+    if (head_ != kNil)
+    {
+        items_[head_].prev = index;
+    }
+    head_ = index;
+    if (tail_ == kNil)
+    {
+        tail_ = index;
+    }
+}
+
+void KvShard::evict(uint32_t keep)
+{
+    while (stats_.bytes > limit_ && tail_ != kNil && tail_ != keep)
+    {
+        const Item& item = items_[tail_];
+        size_t slot = find(item.hash, item.data.data(), item.keyLen);
+        ++stats_.evictions;
+        removeAt(slot);
+    }
+}
+
+KvStore::KvStore(const KvConfig& config, size_t threads)
+    : config_ ( config )
+{
+    size_t wanted = config_.shards ? config_.shards : 4 * (threads ? threads : 1);
+    size_t count = 1;
+    while (count < wanted && count < 64)
+    {
+        count *= 2;
+    }
+    config_.shards = count;
+    shardMask_ = count - 1;
+    for (size_t i = 0; i < count; ++i)
+    {
+        shards_.emplace_back(new KvShard(config_.memoryLimit / count));
+    }
+}
+
+bool KvStore::get(const char* key, size_t key_len, std::string& value, uint32_t& flags)
+{
+    uint64_t hash = hashKey(key, key_len);
+    return shardOf(hash).get(hash, key, key_len, value, flags);
+}
+
+bool KvStore::set(const char* key, size_t key_len, const char* value, size_t value_len, uint32_t flags,
+    int64_t exptime)
+{
+    if (value_len > config_.maxValueSize)
+    {
+        return false;
+    }
+    uint64_t expire_s = 0;
+    if (exptime < 0)
+    {
+        // stored expired, the next get removes it
+        expire_s = 1;
+    }
+    else if (exptime > 30 * 24 * 3600)
+    {
+        expire_s = (uint64_t)exptime;
+    }
+    else if (exptime > 0)
+    {
+        expire_s = nowSeconds() + exptime;
+    }
+    uint64_t hash = hashKey(key, key_len);
+    return shardOf(hash).set(hash, key, key_len, value, value_len, flags, expire_s);
+}
+
+bool KvStore::remove(const char* key, size_t key_len)
+{
+    uint64_t hash = hashKey(key, key_len);
+    return shardOf(hash).remove(hash, key, key_len);
+}
+
+KvStats KvStore::stats() const
+{
+    KvStats stats;
+    for (const auto& shard : shards_)
+    {
+        shard->addStats(stats);
+    }
+    return stats;
+}
@@ -0,0 +1,138 @@
+/********************************************************************************
+> FileName:	KvStore.h
+> Author:	Mingping Zhang
+> Email:	mingpingzhang@163.com
+> Create Time:	Fri Apr 14 09:41:27 2023
+********************************************************************************/
+#ifndef KVSTORE_H
+#define KVSTORE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct KvConfig
+{
+    size_t memoryLimit { 64 * 1024 * 1024 }; // keys, values and per item overhead, least recently used items go above
+    size_t shards { 0 };                     // rounded up to a power of two up to 64, 0: four per serving thread
+    size_t maxValueSize { 1024 * 1024 };     // bigger sets are refused
+};
+
+// counters of a KvStore, summed over the shards by KvStore::stats()
+struct KvStats
+{
+    uint64_t gets { 0 };
+    uint64_t hits { 0 };
+    uint64_t sets { 0 };
+    uint64_t deletes { 0 };   // found and removed
+    uint64_t evictions { 0 }; // least recently used items removed for memory
+    uint64_t expired { 0 };   // found expired by a get
+    uint64_t items { 0 };     // stored now
+    uint64_t bytes { 0 };     // accounted now(keys, values and per item overhead)
+};
+
+// a part of the key space with its own lock: an open addressing index of 8 byte slots(32 bits of the key
+// hash and the item number) probed linearly, so a miss or a hit reads one or two cache lines of slots before
+// the item; the items live in one array with an intrusive lru list, freed numbers are reused
+class KvShard
+{
+public:
+    explicit KvShard(size_t memory_limit);
+    KvShard(const KvShard& other)            = delete;
+    KvShard& operator=(const KvShard& other) = delete;
+
+public:
+    // copy the value of key to value, false when missing or expired(then removed)
+    bool get(uint64_t hash, const char* key, size_t key_len, std::string& value, uint32_t& flags);
+    // insert or replace, expire_s 0 never expires; false when the item is bigger than the shard
+    bool set(uint64_t hash, const char* key, size_t key_len, const char* value, size_t value_len, uint32_t flags,
+        uint64_t expire_s);
+    bool remove(uint64_t hash, const char* key, size_t key_len);
+    // add this shard's counters to stats
+    void addStats(KvStats& stats);
+
+private:
+    struct Slot
+    {
+        uint32_t tag;  // bits of the hash, never 0; 0: empty slot
+        uint32_t item; // index in items_
+    };
+    struct Item
+    {
+        std::string data;   // key followed by value, one allocation
+        uint64_t hash;
+        uint64_t expireS;   // wall clock seconds, 0: never
+        uint32_t keyLen;
+        uint32_t flags;
+        uint32_t prev;      // lru list, kNil at the ends
+        uint32_t next;
+    };
+    static const uint32_t kNil = UINT32_MAX;
+    static const size_t kNotFound = SIZE_MAX;
+
+    // slot holding key, kNotFound if missing
+    size_t find(uint64_t hash, const char* key, size_t key_len) const;
+    // remove the item of slot from index, lru and accounting
+    void removeAt(size_t slot);
+    // empty slot, entries displaced past it move back(no tombstones)
+    void eraseSlot(size_t slot);
+    void insertSlot(uint64_t hash, uint32_t item);
+    // double the index when 3/4 full
+    void grow();
+    void unlink(uint32_t item);
+    void pushFront(uint32_t item);
+    // evict from the lru tail until below the limit, keep is never evicted
+    void evict(uint32_t keep);
+    static size_t itemBytes(const Item& item)
+    { return sizeof(Item) + 2 * sizeof(Slot) + item.data.size(); }
+
+    std::mutex mutex_; // guard everything below
+    std::vector<Slot> slots_;
+    size_t mask_ { 0 };
+    std::vector<Item> items_;
+    std::vector<uint32_t> free_; // unused indexes of items_
+    uint32_t head_ { kNil };     // most recently used
+    uint32_t tail_ { kNil };
+    size_t limit_;
+    KvStats stats_; // items and bytes included
+};
+
+// the cache of the kvcache service: keys are spread over the shards by hash, a request locks only the shard
+// of its key so threads serving requests rarely meet on a lock
+class KvStore
+{
+public:
+    // threads: threads calling in, sizes the default shard count
+    KvStore(const KvConfig& config, size_t threads);
+    KvStore(const KvStore& other)            = delete;
+    KvStore& operator=(const KvStore& other) = delete;
+
+public:
+    bool get(const char* key, size_t key_len, std::string& value, uint32_t& flags);
+    // exptime as memcached: 0 never, up to 30 days seconds from now, above a unix time, negative already expired;
+    // false when refused(too big)
+    bool set(const char* key, size_t key_len, const char* value, size_t value_len, uint32_t flags, int64_t exptime);
+    bool remove(const char* key, size_t key_len);
+
+    KvStats stats() const;
+    size_t shardCount() const
+    { return shards_.size(); }
+    const KvConfig& config() const
+    { return config_; }
+
+private:
+    KvShard& shardOf(uint64_t hash) const
+    { return *shards_[(hash >> 58) & shardMask_]; }
+
+    KvConfig config_;
+    std::vector<std::unique_ptr<KvShard>> shards_;
+    size_t shardMask_ { 0 };
+};
+
+// 64 bit hash of the key bytes, 8 bytes a step
+uint64_t hashKey(const char* key, size_t len);
+
+#endif//KVSTORE_H
@@ -0,0 +1,68 @@
+/********************************************************************************
+  > FileName:	main.cpp
+  > Author:	Mingping Zhang
+  > Email:	mingpingzhang@163.com
+  > Create Time:	Fri Apr 14 15:20:38 2023
+ ********************************************************************************/
+
+// in-memory key-value cache speaking the memcached text protocol(get/set/delete)
+//   usage: ./kvcache [ip] [port] [threads] [memory_mb]
+
+#include "KvCacheServer.h"
+#include "SocketAddress.h"
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+
+// set by SIGINT/SIGTERM, main() stops the server and prints the counters
+static volatile std::sig_atomic_t g_stop = 0;
+
+static void onStopSignal(int)
+{
+    g_stop = 1;
+}
+
+int main(int argc, char* argv[])
+{
+    std::string local_ip = argc >= 2 ? argv[1] : "127.0.0.1";
+    uint16_t local_port = argc >= 3 ? std::atoi(argv[2]) : 11211;
+    KvServerConfig config;
+    config.threads = argc >= 4 ? std::strtoul(argv[3], nullptr, 10) : 1;
+    if (argc >= 5)
+    {
+        config.store.memoryLimit = std::strtoull(argv[4], nullptr, 10) * 1024 * 1024;
+    }
+
+    SocketAddress addr;
+    if (!SocketAddress::parse(local_ip, local_port, addr))
+    {
+        std::cout << "invalid address " << local_ip << ":" << local_port << std::endl;
+        return 1;
+    }
+    KvCacheServer server(addr, config);
+    if (!server.start())
+    {
+        std::cout << "kvcache start failed!" << std::endl;
+        return 1;
+    }
+    std::cout << "kvcache on " << local_ip << ":" << local_port << ", " << config.threads << " thread(s), "
+        << server.store().shardCount() << " shards, " << config.store.memoryLimit / (1024 * 1024) << " MB"
+        << std::endl;
+
+    std::signal(SIGINT, onStopSignal);
+    std::signal(SIGTERM, onStopSignal);
+    while (!g_stop)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    }
+    server.stop();
+
+    KvStats stats = server.store().stats();
+    std::cout << "gets " << stats.gets << " hits " << stats.hits << " sets " << stats.sets << " deletes "
+        << stats.deletes << " evictions " << stats.evictions << " expired " << stats.expired << " items "
+        << stats.items << " bytes " << stats.bytes << " errors " << server.stats().errors.load() << std::endl;
+    return 0;
+}
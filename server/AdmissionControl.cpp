@@ -0,0 +1,213 @@
+/********************************************************************************
+  > FileName:	AdmissionControl.cpp
+  > Author:	Mingping Zhang
+  > Email:	mingpingzhang@163.com
+  > Create Time:	Mon Mar 27 11:02:44 2023
+ ********************************************************************************/
+
+#include "AdmissionControl.h"
+#include <netinet/in.h>
+#include <algorithm>
+#include <cstring>
+
+
+void AdmissionControl::configure(const AdmissionConfig& config)
+{
+	config_ = config;
+	enabled_ = config.enabled();
+}
+
+AdmissionControl::IpKey AdmissionControl::makeIpKey(const SocketAddress& peer)
+{
+	IpKey key;
+	if (peer.family() == AF_INET)
+	{
+		key.lo = reinterpret_cast<const struct sockaddr_in*>(peer.addr())->sin_addr.s_addr;
+	}
+	else if (peer.family() == AF_INET6)
+	{
+		const uint8_t* a = reinterpret_cast<const struct sockaddr_in6*>(peer.addr())->sin6_addr.s6_addr;
+		std::memcpy(&key.hi, a, 8);
+		std::memcpy(&key.lo, a + 8, 8);
+	}
+	return key;
+}
+
+bool AdmissionControl::canAccept() const
+{
+	if (config_.maxConnections == 0 || stats_.activeConnections < config_.maxConnections)
+	{
+		return true;
+	}
+	// other policies accept and close, see admit()
+	return config_.shed != ShedPolicy::kStopReading;
+}
+
+void AdmissionControl::deferAccept()
+{
+	++stats_.deferredAccepts;
+}
+
+AdmissionControl::Verdict AdmissionControl::admit(int32_t fd, const SocketAddress& peer, uint64_t now_ns)
+{
+	if (config_.maxConnections > 0 && stats_.activeConnections >= config_.maxConnections)
+	{
+		++stats_.rejectedConnections;
+		return kReject;
+	}
+
+	IpState* ip = nullptr;
+	if (ipLimited())
+	{
+		IpKey key = makeIpKey(peer);
+		ip = &ips_[key];
+		ip->key = key;
+		if (config_.shed == ShedPolicy::kRejectAtAccept)
+		{
+			// a source already out of tokens gets no new connection
+			ip->bytes.refill(config_.ipBytes, now_ns);
+			ip->messages.refill(config_.ipMessages, now_ns);
+			if (ip->bytes.available(config_.ipBytes) < 1 || ip->messages.available(config_.ipMessages) < 1)
+			{
+				if (ip->connections == 0)
+				{
+					ips_.erase(key);
+				}
+				++stats_.rejectedConnections;
+				return kReject;
+			}
+		}
+		++ip->connections;
+	}
+
+	if ((size_t)fd >= conns_.size())
+	{
+		conns_.resize(std::max<size_t>(fd + 1, conns_.size() * 2));
+	}
+	ConnState& c = conns_[fd];
+	c = ConnState();
+	c.ip = ip;
+	c.active = true;
+	++stats_.activeConnections;
+	++stats_.acceptedConnections;
+	return kAdmit;
+}
+
+size_t AdmissionControl::readBudget(int32_t fd, size_t want, uint64_t now_ns)
+{
+	if ((size_t)fd >= conns_.size() || !conns_[fd].active)
+	{
+		return want;
+	}
+	ConnState& c = conns_[fd];
+	if (c.throttled)
+	{
+		return 0;
+	}
+	double budget = want;
+	if (config_.connMessages.enabled())
+	{
+		c.messages.refill(config_.connMessages, now_ns);
+		if (c.messages.tokens < 1)
+		{
+			return 0;
+		}
+	}
+	if (config_.connBytes.enabled())
+	{
+		c.bytes.refill(config_.connBytes, now_ns);
+		budget = std::min(budget, c.bytes.tokens);
+	}
+	if (c.ip)
+	{
+		if (config_.ipMessages.enabled())
+		{
+			c.ip->messages.refill(config_.ipMessages, now_ns);
+			if (c.ip->messages.tokens < 1)
+			{
+				return 0;
+			}
+		}
+		if (config_.ipBytes.enabled())
+		{
+			c.ip->bytes.refill(config_.ipBytes, now_ns);
+			budget = std::min(budget, c.ip->bytes.tokens);
+		}
+	}
+	return budget < 1 ? 0 : (size_t)budget;
+}
+
+void AdmissionControl::consume(int32_t fd, size_t n, size_t messages)
+{
+	if ((size_t)fd >= conns_.size() || !conns_[fd].active)
+	{
+		return;
+	}
+	ConnState& c = conns_[fd];
+	c.bytes.take(config_.connBytes, n);
+	c.messages.take(config_.connMessages, messages);
+	if (c.ip)
+	{
+		c.ip->bytes.take(config_.ipBytes, n);
+		c.ip->messages.take(config_.ipMessages, messages);
+	}
+}
+
+bool AdmissionControl::throttle(int32_t fd)
+{
+	if (config_.shed == ShedPolicy::kClose)
+	{
+		++stats_.closedOverRate;
+		return false;
+	}
+	ConnState& c = conns_[fd];
+	if (!c.throttled)
+	{
+		c.throttled = true;
+		throttled_.push_back(fd);
+		++stats_.throttledReads;
+	}
+	return true;
+}
+
+void AdmissionControl::collectResumable(uint64_t now_ns, std::vector<int32_t>& out)
+{
+	size_t keep = 0;
+	for (size_t i = 0; i < throttled_.size(); ++i)
+	{
+		int32_t fd = throttled_[i];
+		ConnState& c = conns_[fd];
+		if (!c.active || !c.throttled)
+		{
+			// closed(and maybe reused) while parked
+			continue;
+		}
+		c.throttled = false;
+		if (readBudget(fd, 1, now_ns) == 0)
+		{
+			c.throttled = true;
+			throttled_[keep++] = fd;
+			continue;
+		}
+		++stats_.resumedReads;
+		out.push_back(fd);
+	}
+	throttled_.resize(keep);
+}
+
+void AdmissionControl::release(int32_t fd)
+{
+	if ((size_t)fd >= conns_.size() || !conns_[fd].active)
+	{
+		return;
+	}
+	ConnState& c = conns_[fd];
+	if (c.ip && --c.ip->connections == 0)
+	{
+		ips_.erase(c.ip->key);
+	}
+	c.active = false;
+	c.throttled = false;
+	c.ip = nullptr;
+	--stats_.activeConnections;
+}
@@ -0,0 +1,147 @@
+/********************************************************************************
+> FileName:	AdmissionControl.h
+> Author:	Mingping Zhang
+> Email:	mingpingzhang@163.com
+> Create Time:	Mon Mar 27 11:02:44 2023
+********************************************************************************/
+#ifndef ADMISSIONCONTROL_H
+#define ADMISSIONCONTROL_H
+
+#include "SocketAddress.h"
+#include "TokenBucket.h"
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+// what the server does with a connection over its rate, or with new connections over the cap
+enum class ShedPolicy
+{
+    // over rate: stop reading until the buckets refill(socket buffer fills and tcp pushes back on the sender);
+    // over cap: leave new connections in the listen backlog until a connection closes
+    kStopReading,
+    // over rate: close the connection; over cap: accept and close new connections
+    kClose,
+    // decide at accept only: new connections are closed when over cap or when their source ip is out of
+    // tokens; established connections over rate stop reading like kStopReading
+    kRejectAtAccept,
+};
+
+// limits of a server, every limit is off by default
+struct AdmissionConfig
+{
+    RateLimit connBytes;    // bytes/sec read from one connection
+    // packets/sec delivered from one connection, charged after each read for the packets it produced(framing
+    // splits one read into many); a read over the tokens left goes into debt, reading waits until it is paid
+    RateLimit connMessages;
+    RateLimit ipBytes;      // bytes/sec read from all connections of one source ip
+    RateLimit ipMessages;   // packets/sec delivered from all connections of one source ip
+    uint32_t maxConnections { 0 }; // 0 means no cap
+    ShedPolicy shed { ShedPolicy::kStopReading };
+
+    bool enabled() const
+    {
+        return connBytes.enabled() || connMessages.enabled() || ipBytes.enabled() || ipMessages.enabled()
+            || maxConnections > 0;
+    }
+};
+
+// counters of admission control, readable from any thread
+struct AdmissionStats
+{
+    std::atomic<uint64_t> activeConnections { 0 };
+    std::atomic<uint64_t> acceptedConnections { 0 };
+    std::atomic<uint64_t> rejectedConnections { 0 }; // closed right after accept
+    std::atomic<uint64_t> deferredAccepts { 0 };     // times the listen socket was paused at the cap
+    std::atomic<uint64_t> throttledReads { 0 };      // times a connection stopped reading over its rate
+    std::atomic<uint64_t> resumedReads { 0 };        // times a throttled connection was read again
+    std::atomic<uint64_t> closedOverRate { 0 };      // connections closed over their rate(ShedPolicy::kClose)
+};
+
+// token buckets per connection and per source ip plus a connection cap. all calls come from the loop
+// thread; state is a flat array indexed by fd so a read costs a few compares and multiplies
+class AdmissionControl
+{
+public:
+    enum Verdict
+    {
+        kAdmit,  // serve the connection
+        kReject, // close it now
+    };
+
+    AdmissionControl() = default;
+    AdmissionControl(const AdmissionControl& other)            = delete;
+    AdmissionControl& operator=(const AdmissionControl& other) = delete;
+
+public:
+    // set limits, before the server starts
+    void configure(const AdmissionConfig& config);
+    bool enabled() const
+    { return enabled_; }
+    const AdmissionConfig& config() const
+    { return config_; }
+    const AdmissionStats& stats() const
+    { return stats_; }
+
+    // false when the cap is reached and new connections should wait in the backlog
+    bool canAccept() const;
+    // count a pause of the listen socket
+    void deferAccept();
+    // account a new connection, on kReject the caller closes fd without calling release()
+    Verdict admit(int32_t fd, const SocketAddress& peer, uint64_t now_ns);
+    // bytes that may be read from fd now(at most want), 0 when the connection is over a limit
+    size_t readBudget(int32_t fd, size_t want, uint64_t now_ns);
+    // charge a read of n bytes that delivered messages packets to fd and its source ip
+    void consume(int32_t fd, size_t n, size_t messages);
+    // fd is over its rate: return true if it was parked until tokens come back, false if it must be closed
+    bool throttle(int32_t fd);
+    // move throttled fds that may read again into out
+    void collectResumable(uint64_t now_ns, std::vector<int32_t>& out);
+    // forget fd, called once when the connection is closed
+    void release(int32_t fd);
+
+private:
+    // 128 bit source ip, unix peers all share the zero key
+    struct IpKey
+    {
+        uint64_t hi { 0 };
+        uint64_t lo { 0 };
+        bool operator==(const IpKey& other) const
+        { return hi == other.hi && lo == other.lo; }
+    };
+    struct IpKeyHash
+    {
+        size_t operator()(const IpKey& key) const
+        { return std::hash<uint64_t>()(key.hi * 0x9e3779b97f4a7c15ULL ^ key.lo); }
+    };
+    struct IpState
+    {
+        IpKey key; // to erase the node when its last connection is released
+        TokenBucket bytes;
+        TokenBucket messages;
+        uint32_t connections { 0 };
+    };
+    // 48 bytes per fd
+    struct ConnState
+    {
+        TokenBucket bytes;
+        TokenBucket messages;
+        IpState* ip { nullptr }; // node of ips_, stable until its last connection is released
+        bool active { false };
+        bool throttled { false };
+    };
+
+    static IpKey makeIpKey(const SocketAddress& peer);
+    bool ipLimited() const
+    { return config_.ipBytes.enabled() || config_.ipMessages.enabled(); }
+
+    AdmissionConfig config_;
+    bool enabled_ { false };
+    std::vector<ConnState> conns_; // indexed by fd
+    std::unordered_map<IpKey, IpState, IpKeyHash> ips_;
+    std::vector<int32_t> throttled_; // fds parked by throttle()
+    AdmissionStats stats_;
+};
+
+#endif//ADMISSIONCONTROL_H
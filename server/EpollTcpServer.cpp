@@ -7,23 +7,50 @@
 
 #include "EpollTcpServer.h"
 #include "AppDef.h"
+#include "TimeUtil.h"
 #include <iostream>
 #include <cassert>
 #include <sys/epoll.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
+#include <algorithm>
 #include <vector>
 
 
 EpollTcpServer::EpollTcpServer(const std::string& local_ip, uint16_t local_port)
 	: localIP_ ( local_ip ),
 	localPort_ ( local_port )
+{
+	// "unix:/path" and "unix:@name" select a unix domain socket, otherwise ipv4 or ipv6 literal
+	if (!SocketAddress::parse(local_ip, local_port, localAddr_))
+	{
+		std::cout << "invalid local address " << local_ip << ":" << local_port << std::endl;
+	}
+}
+
+EpollTcpServer::EpollTcpServer(const SocketAddress& local_addr)
+	: localIP_ ( local_addr.toString() ),
+	localPort_ ( local_addr.port() ),
+	localAddr_ ( local_addr )
 {
 }
 
+EpollTcpServer::EpollTcpServer(const std::string& local_ip, uint16_t local_port, const EventLoopPtr& loop)
+	: EpollTcpServer(local_ip, local_port)
+{
+	loop_ = loop;
+}
+
+EpollTcpServer::EpollTcpServer(const SocketAddress& local_addr, const EventLoopPtr& loop)
+	: EpollTcpServer(local_addr)
+{
+	loop_ = loop;
+}
+
 EpollTcpServer::~EpollTcpServer()
 {
 	stop();
@@ -32,11 +59,27 @@ EpollTcpServer::~EpollTcpServer()
 
 bool EpollTcpServer::start()
 {
-	// create epoll instance
-	if (createEpoll() < 0)
+	assert(!started_);
+	if (dispatchThreads_ > 1 && (loop_ || triggerMode_ != TriggerMode::kOneShot || admission_.enabled() || balancer_))
+	{
+		std::cout << "several dispatch threads need an own loop in oneshot mode without admission control "
+			"and load balancer!" << std::endl;
+		return false;
+	}
+	if (!loop_)
+	{
+		// no shared loop given: one loop per thread of its own
+		loop_ = std::make_shared<EventLoop>();
+		loop_->setDispatchThreads(dispatchThreads_);
+		ownLoop_ = true;
+	}
+	if (ownLoop_ && !loop_->start())
 	{
 		return false;
 	}
+	assert(loop_->running());
+	connCallbacks_ = makeConnectionCallbacks();
+
 	// create socket and bind
 	int listenfd = createSocket();
 	if (listenfd < 0)
@@ -47,6 +90,7 @@ bool EpollTcpServer::start()
 	int mr = makeSocketNonBlock(listenfd);
 	if (mr < 0)
 	{
+		::close(listenfd);
 		return false;
 	}
 
@@ -54,84 +98,180 @@ bool EpollTcpServer::start()
 	int lr = listen(listenfd);
 	if (lr < 0)
 	{
+		::close(listenfd);
 		return false;
 	}
-	std::cout << "EpollTcpServer Init success!" << std::endl;
+	if (verbose_)
+	{
+		std::cout << "EpollTcpServer Init success!" << std::endl;
+	}
 	handle_ = listenfd;
 
-	// add listen socket to epoll instance, and focus on event EPOLLIN and EPOLLOUT, actually EPOLLIN is enough
-	int er = updateEpollEvents(efd_, EPOLL_CTL_ADD, handle_, EPOLLIN | EPOLLET);
-	if (er < 0)
+	if (capture_ && !capture_->start())
 	{
-		// if something goes wrong, close listen socket and return false
 		::close(handle_);
+		handle_ = -1;
 		return false;
 	}
 
-	assert(!th_loop_);
+	if (balancer_)
+	{
+		// pools and health checks live on the loop thread, ready before the first accept
+		bool ok = false;
+		loop_->runAndWait([this, &ok]() {
+			ok = balancer_->start(loop_);
+			if (!ok)
+			{
+				balancer_->stop();
+			}
+		});
+		if (!ok)
+		{
+			if (capture_)
+			{
+				capture_->stop();
+			}
+			::close(handle_);
+			handle_ = -1;
+			return false;
+		}
+	}
 
-	// the implementation of one loop per thread: create a thread to loop epoll
-	th_loop_ = std::make_shared<std::thread>(&EpollTcpServer::epollLoop, this);
-	if (!th_loop_)
+	// add listen socket to the loop, events are dispatched to handleEvent()
+	int er = loop_->addHandler(handle_, EPOLLIN | triggerFlags(triggerMode_), this);
+	if (er < 0)
 	{
+		// if something goes wrong, close listen socket and return false
+		if (capture_)
+		{
+			capture_->stop();
+		}
+		::close(handle_);
+		handle_ = -1;
 		return false;
 	}
-	// detach the thread(using loop_flag_ to control the start/stop of loop)
-	th_loop_->detach();
-
+	if (admission_.enabled())
+	{
+		// throttled connections and paused accepts don't get new edges, poll them every loop tick
+		resumeTimer_ = loop_->runEvery(EpollWaitTime(), [this]() { resumeThrottled(); });
+	}
+	started_ = true;
 	return true;
 }
 
 bool EpollTcpServer::stop()
 {
-	// set loop_flag_ false to stop epoll loop
-	loopFlag_ = false;
-	::close(handle_);
-	::close(efd_);
-	std::cout << "stop epoll!" << std::endl;
-	unregisterOnRecvCallback();
-	return true;
-}
-
-int32_t EpollTcpServer::createEpoll()
-{
-	// the basic epoll api of create a epoll instance
-	int epollfd = epoll_create(1);
-	if (epollfd < 0)
+	if (started_)
 	{
-		// if something goes wrong, return -1
-		std::cout << "epoll_create failed!" << std::endl;
-		return -1;
+		started_ = false;
+		// listen socket and connections belong to the loop thread, tear them down there
+		loop_->runAndWait([this]() {
+			if (resumeTimer_)
+			{
+				loop_->cancelTimer(resumeTimer_);
+				resumeTimer_ = 0;
+			}
+			loop_->removeHandler(handle_);
+			if (loop_->dispatchThreads() == 1)
+			{
+				::close(handle_);
+				handle_ = -1;
+			}
+			std::vector<TcpConnectionPtr> conns;
+			{
+				std::lock_guard<std::mutex> lock(connMutex_);
+				for (auto& conn : conns_)
+				{
+					if (conn)
+					{
+						conns.push_back(conn);
+					}
+				}
+			}
+			// close callbacks erase them from conns_
+			for (auto& conn : conns)
+			{
+				conn->close();
+			}
+			if (balancer_)
+			{
+				// upstreams still flushing and the idle pools
+				balancer_->stop();
+			}
+		});
+		if (ownLoop_)
+		{
+			loop_->stop();
+		}
+		if (handle_ >= 0)
+		{
+			// a dispatch thread may have been accepting, closed once they are joined
+			::close(handle_);
+			handle_ = -1;
+			std::lock_guard<std::mutex> lock(connMutex_);
+			conns_.clear();
+			connCount_ = 0;
+		}
+		if (capture_)
+		{
+			// close records of the connections are in, write out the rest
+			capture_->stop();
+		}
+		if (verbose_)
+		{
+			std::cout << "stop epoll!" << std::endl;
+		}
 	}
-	efd_ = epollfd;
-	return epollfd;
+	// stop() is also called by destructor, unregister only once
+	if (recvCallback_)
+	{
+		unregisterOnRecvCallback();
+	}
+	return true;
 }
 
 
 int32_t EpollTcpServer::createSocket()
 {
-	// create tcp socket
-	int listenfd = ::socket(AF_INET, SOCK_STREAM, 0);
+	if (!localAddr_.valid())
+	{
+		std::cout << "create socket " << localIP_ << ":" << localPort_ << " failed, invalid address!" << std::endl;
+		return -1;
+	}
+	// create stream socket of the address family(AF_INET/AF_INET6/AF_UNIX)
+	int listenfd = ::socket(localAddr_.family(), SOCK_STREAM, 0);
 	if (listenfd < 0)
 	{
-		std::cout << "create socket " << localIP_ << ":" << localPort_ << " failed!" << std::endl;
+		std::cout << "create socket " << localAddr_.toString() << " failed!" << std::endl;
 		return -1;
 	}
 
-	struct sockaddr_in addr = {0};
-	addr.sin_family = AF_INET;
-	addr.sin_port = htons(localPort_);
-	addr.sin_addr.s_addr  = inet_addr(localIP_.c_str());
+	// a stale socket file left by a previous run makes bind() fail with EADDRINUSE
+	std::string path = localAddr_.unixPath();
+	if (!path.empty())
+	{
+		::unlink(path.c_str());
+	}
+
+	if (!localAddr_.isUnix())
+	{
+		// restart while connections of the previous process are in TIME_WAIT(backends behind a load balancer)
+		int one = 1;
+		setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	}
 
-	// bind to local ip and local port
-	int r = ::bind(listenfd, (struct sockaddr*)&addr, sizeof(struct sockaddr));
+	// bind to local address
+	int r = ::bind(listenfd, localAddr_.addr(), localAddr_.length());
 	if (r != 0)
 	{
-		std::cout << "bind socket " << localIP_ << ":" << localPort_ << " failed!" << std::endl;
+		std::cout << "bind socket " << localAddr_.toString() << " failed!" << std::endl;
 		::close(listenfd);
 		return -1;
 	}
-	std::cout << "create and bind socket " << localIP_ << ":" << localPort_ << " success!" << std::endl;
+	if (verbose_)
+	{
+		std::cout << "create and bind socket " << localAddr_.toString() << " success!" << std::endl;
+	}
 	return listenfd;
 }
 
@@ -165,29 +305,54 @@ int32_t EpollTcpServer::listen(int32_t listenfd)
 	return 0;
 }
 
-// add/modify/remove a item(socket/fd) in epoll instance(rbtree), for this example, just add a socket to epoll rbtree
-int32_t EpollTcpServer::updateEpollEvents(int efd, int op, int fd, int events)
+void EpollTcpServer::handleEvent(uint32_t events)
 {
-	struct epoll_event ev = {0};
-	ev.events = events;
-	ev.data.fd = fd; // ev.data is a enum
-	fprintf(stdout,"%s fd %d events read %d write %d\n", op == EPOLL_CTL_MOD ? "mod" : "add", fd, ev.events & EPOLLIN, ev.events & EPOLLOUT);
-	int r = epoll_ctl(efd, op, fd, &ev);
-	if (r < 0)
+	if (events & EPOLLIN)
 	{
-		std::cout << "epoll_ctl failed!" << std::endl;
-		return -1;
+		// listen fd coming connections
+		acceptConnections();
+	}
+}
+
+void EpollTcpServer::acceptConnections()
+{
+	bool paused = acceptPaused_;
+	onSocketAccept();
+	if (handle_ >= 0 && (triggerMode_ == TriggerMode::kOneShot ||
+		(triggerMode_ == TriggerMode::kLevel && paused != acceptPaused_)))
+	{
+		// level triggered: no EPOLLIN while paused at the connection cap, it would be reported on every wait
+		uint32_t events = acceptPaused_ ? 0 : EPOLLIN;
+		loop_->modifyHandler(handle_, events | triggerFlags(triggerMode_), this);
 	}
-	return 0;
 }
 
 
 void EpollTcpServer::onSocketAccept()
 {
-	// epoll working on et mode, must read all coming data, so use a while loop here
-	while (true)
+	if (acceptPaused_)
 	{
-		struct sockaddr_in in_addr;
+		// only set with admission control, not written on every accept where dispatch threads share the listener
+		acceptPaused_ = false;
+	}
+	// epoll working on et mode, must read all coming data, so use a while loop here;
+	// level triggered/oneshot take a few per event and are reported again
+	uint32_t limit = triggerMode_ == TriggerMode::kEdge ? 0 : LevelReadsPerEvent();
+	uint32_t accepted = 0;
+	while (handle_ >= 0)
+	{
+		if (limit > 0 && accepted == limit)
+		{
+			break;
+		}
+		if (admission_.enabled() && !admission_.canAccept())
+		{
+			// at the connection cap: leave the rest in backlog, a closing connection or the resume timer comes back
+			admission_.deferAccept();
+			acceptPaused_ = true;
+			break;
+		}
+		struct sockaddr_storage in_addr;
 		socklen_t in_len = sizeof(in_addr);
 
 		// accept a new connection and get a new socket
@@ -197,7 +362,6 @@ void EpollTcpServer::onSocketAccept()
 			if ( (errno == EAGAIN) || (errno == EWOULDBLOCK) )
 			{
 				// read all accept finished(epoll et mode only trigger one time,so must read all data in listen socket)
-				std::cout << "accept all coming connections!" << std::endl;
 				break;
 			}
 			else
@@ -206,92 +370,336 @@ void EpollTcpServer::onSocketAccept()
 				continue;
 			}
 		}
+		++accepted;
 
-		sockaddr_in peer;
-		socklen_t p_len = sizeof(peer);
-		// get client ip and port
-		int r = getpeername(cli_fd, (struct sockaddr*)&peer, &p_len);
-		if (r < 0)
+		// client address: ip and port, or unix socket path(usually unnamed)
+		SocketAddress peer = SocketAddress::fromSockaddr((struct sockaddr*)&in_addr, in_len);
+		if (verbose_)
+		{
+			std::cout << "accpet connection from " << peer.toString() << std::endl;
+		}
+		if (admission_.enabled() && admission_.admit(cli_fd, peer, coarseMonotonicNs()) == AdmissionControl::kReject)
 		{
-			std::cout << "getpeername error!" << std::endl;
+			if (verbose_)
+			{
+				std::cout << "reject connection from " << peer.toString() << std::endl;
+			}
+			::close(cli_fd);
 			continue;
 		}
-		std::cout << "accpet connection from " << inet_ntoa(in_addr.sin_addr) << std::endl;
 		int mr = makeSocketNonBlock(cli_fd);
 		if (mr < 0)
 		{
+			admission_.release(cli_fd);
 			::close(cli_fd);
 			continue;
 		}
+		if (peer.family() == AF_INET || peer.family() == AF_INET6)
+		{
+			// echo replies are written as soon as they are read, don't let nagle hold them waiting for delayed ack
+			int one = 1;
+			setsockopt(cli_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		}
+		if (footprint_.socketBuffer > 0)
+		{
+			// fixed small buffers instead of autotuning: an idle connection holds little kernel memory
+			int size = (int)footprint_.socketBuffer;
+			setsockopt(cli_fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+			setsockopt(cli_fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+		}
+
+		// the connection owns cli_fd from here
+		TcpConnectionPtr conn = std::make_shared<TcpConnection>(loop_, cli_fd);
+		conn->setTriggerMode(triggerMode_);
+		conn->setCallbacks(connCallbacks_);
+		if (tlsContext_)
+		{
+			TlsSessionPtr session = TlsSession::create(tlsContext_, cli_fd, true);
+			if (!session)
+			{
+				admission_.release(cli_fd);
+				continue;
+			}
+			conn->setTlsSession(std::move(session));
+		}
+		if (balancer_)
+		{
+			// relayed to a backend, no recv callback; the relay gives the connection callbacks of its own
+			if (!balancer_->attach(conn, peer))
+			{
+				admission_.release(cli_fd);
+				continue;
+			}
+		}
+		else
+		{
+			if (compression_.enabled)
+			{
+				conn->setCompression(compression_, true, &compressionStats_);
+			}
+			if (lineFraming_.enabled)
+			{
+				conn->setLineFraming(lineFraming_, &lineStats_);
+			}
+		}
+		if (latencyTracing_)
+		{
+			conn->setLatencyStats(&latencyStats_);
+		}
+		{
+			std::lock_guard<std::mutex> lock(connMutex_);
+			if ((size_t)cli_fd >= conns_.size())
+			{
+				conns_.resize(std::max<size_t>(cli_fd + 1, conns_.size() * 2));
+			}
+			if (!conns_[cli_fd])
+			{
+				++connCount_;
+			}
+			conns_[cli_fd] = conn;
+		}
+		if (capture_ && !balancer_)
+		{
+			std::string addr = peer.toString();
+			capture_->record(CaptureRecordType::kOpen, cli_fd, addr.data(), addr.size());
+		}
 
-		//  add this new socket to epoll instance, and focus on EPOLLIN and EPOLLOUT and EPOLLRDHUP event
-		int er = updateEpollEvents(efd_, EPOLL_CTL_ADD, cli_fd, EPOLLIN | EPOLLRDHUP | EPOLLET);
-		if (er < 0 )
+		//  add this new socket to the loop, focus on EPOLLIN and EPOLLRDHUP(and EPOLLOUT while output is pending)
+		if (!conn->start())
 		{
 			// if something goes wrong, close this new socket
-			::close(cli_fd);
+			conn->close();
 			continue;
 		}
 	}
 }
 
+TcpCallbacksPtr EpollTcpServer::makeConnectionCallbacks()
+{
+	std::shared_ptr<TcpCallbacks> callbacks = std::make_shared<TcpCallbacks>();
+	if (!balancer_)
+	{
+		if (capture_)
+		{
+			// the bytes as they pass the socket: a replay sends the stream the client sent
+			bool replies = capture_->captureReplies();
+			callbacks->wire = [this, replies](TcpConnection& c, bool out, const char* data, size_t n) {
+				if (!out || replies)
+				{
+					capture_->record(out ? CaptureRecordType::kOut : CaptureRecordType::kIn, c.fd(), data, n);
+				}
+			};
+		}
+		callbacks->recv = [this](const PacketPtr& data) {
+			if (recvCallback_)
+			{
+				// handle recv packet
+				recvCallback_(data);
+			}
+		};
+	}
+	callbacks->close = [this](const TcpConnectionPtr& c) { onConnectionClosed(c); };
+	if (admission_.enabled())
+	{
+		callbacks->readBudget = [this](TcpConnection& c, size_t& want) { return admitRead(c, want); };
+		callbacks->readDone = [this](TcpConnection& c, size_t n, size_t messages) {
+			admission_.consume(c.fd(), n, messages);
+		};
+	}
+	return callbacks;
+}
 
-void EpollTcpServer::registerOnRecvCallback(callback_recv_t callback)
+void EpollTcpServer::onConnectionClosed(const TcpConnectionPtr& conn)
 {
-	assert(!recvCallback_);
-	recvCallback_ = callback;
+	admission_.release(conn->fd());
+	topics_.removeConnection(conn->fd());
+	if (closeCallback_)
+	{
+		closeCallback_(conn->fd());
+	}
+	if (capture_ && !balancer_)
+	{
+		capture_->record(CaptureRecordType::kClose, conn->fd(), nullptr, 0);
+	}
+	if (balancer_)
+	{
+		balancer_->detach(conn);
+	}
+	{
+		std::lock_guard<std::mutex> lock(connMutex_);
+		size_t fd = conn->fd();
+		if (fd < conns_.size() && conns_[fd] == conn)
+		{
+			conns_[fd].reset();
+			--connCount_;
+		}
+	}
+	if (acceptPaused_ && admission_.canAccept())
+	{
+		// a slot below the connection cap is free again
+		acceptConnections();
+	}
 }
 
-void EpollTcpServer::unregisterOnRecvCallback()
+TcpConnectionPtr EpollTcpServer::findConnection(int32_t fd)
 {
-	assert(recvCallback_);
-	recvCallback_ = nullptr;
+	std::lock_guard<std::mutex> lock(connMutex_);
+	return fd >= 0 && (size_t)fd < conns_.size() ? conns_[fd] : nullptr;
+}
+
+void EpollTcpServer::setTlsContext(const TlsContextPtr& ctx)
+{
+	assert(!started_);
+	tlsContext_ = ctx;
 }
 
+void EpollTcpServer::setCompressionConfig(const CompressionConfig& config)
+{
+	assert(!started_);
+	compression_ = config;
+}
+
+void EpollTcpServer::setLineFramingConfig(const LineFramingConfig& config)
+{
+	assert(!started_);
+	lineFraming_ = config;
+}
+
+void EpollTcpServer::setAdmissionConfig(const AdmissionConfig& config)
+{
+	assert(!started_);
+	admission_.configure(config);
+}
 
-void EpollTcpServer::onSocketRead(int32_t fd)
+void EpollTcpServer::setPubSubConfig(const PubSubConfig& config)
 {
-	char buffer[4096] = {0};
-	int n = -1;
-	// epoll working on et mode, must read all data
-	while ( (n = ::read(fd, buffer, sizeof(buffer))) > 0)
+	assert(!started_);
+	topics_.configure(config);
+}
+
+bool EpollTcpServer::subscribe(int32_t fd, const std::string& topic)
+{
+	TcpConnectionPtr conn = findConnection(fd);
+	if (!conn)
 	{
-		// callback for recv
-		std::cout << "fd: " << fd <<  " recv: " << buffer << std::endl;
-		std::string message(buffer, n);
-		// create a recv packet
-		PacketPtr data = std::make_shared<Packet>(fd, message);
-		if (recvCallback_)
-		{
-			// handle recv packet
-			recvCallback_(data);
-		}
+		return false;
+	}
+	return topics_.subscribe(topic, conn);
+}
+
+bool EpollTcpServer::unsubscribe(int32_t fd, const std::string& topic)
+{
+	return topics_.unsubscribe(topic, fd);
+}
+
+size_t EpollTcpServer::publish(const std::string& topic, const std::string& message)
+{
+	// one copy for all subscribers
+	return publish(topic, std::make_shared<const std::string>(message));
+}
+
+size_t EpollTcpServer::publish(const std::string& topic, const PayloadPtr& payload)
+{
+	return topics_.publish(topic, payload);
+}
+
+void EpollTcpServer::setLoadBalancer(const LoadBalancerConfig& config)
+{
+	assert(!started_);
+	balancer_.reset(new LoadBalancer(config));
+}
+
+void EpollTcpServer::setTriggerMode(TriggerMode mode)
+{
+	assert(!started_);
+	triggerMode_ = mode;
+}
+
+void EpollTcpServer::setDispatchThreads(size_t count)
+{
+	assert(!started_);
+	dispatchThreads_ = count;
+}
+
+void EpollTcpServer::setFootprintConfig(const FootprintConfig& config)
+{
+	assert(!started_);
+	footprint_ = config;
+}
+
+size_t EpollTcpServer::connectionCount()
+{
+	std::lock_guard<std::mutex> lock(connMutex_);
+	return connCount_;
+}
+
+void EpollTcpServer::setCaptureConfig(const CaptureConfig& config)
+{
+	assert(!started_);
+	capture_.reset(new TrafficCapture(config));
+}
+
+void EpollTcpServer::setLatencyTracing(bool enabled)
+{
+	assert(!started_);
+	latencyTracing_ = enabled;
+}
+
+bool EpollTcpServer::admitRead(TcpConnection& conn, size_t& want)
+{
+	want = admission_.readBudget(conn.fd(), want, coarseMonotonicNs());
+	if (want > 0)
+	{
+		return true;
+	}
+	if (!admission_.throttle(conn.fd()))
+	{
+		std::cout << "fd: " << conn.fd() << " over rate limit, close it!" << std::endl;
+		conn.close();
 	}
-	if (n == -1)
+	// parked: unread bytes stay in socket buffer, resumeThrottled() reads them when tokens come back
+	return false;
+}
+
+void EpollTcpServer::resumeThrottled()
+{
+	resumable_.clear();
+	admission_.collectResumable(coarseMonotonicNs(), resumable_);
+	for (int32_t fd : resumable_)
 	{
-		if (errno == EAGAIN || errno == EWOULDBLOCK)
+		// no new edge is coming for bytes left in the socket, read them now
+		TcpConnectionPtr conn = findConnection(fd);
+		if (conn)
 		{
-			// read all data finished
-			return;
+			conn->readAll();
 		}
-		// something goes wrong for this fd, should close it
-		::close(fd);
-		return;
 	}
-	if (n == 0)
+	if (acceptPaused_ && admission_.canAccept())
 	{
-		// this may happen when client close socket. EPOLLRDHUP usually handle this, but just make sure; should close this fd
-		::close(fd);
-		return;
+		acceptConnections();
 	}
 }
 
-void EpollTcpServer::onSocketWrite(int32_t fd)
+
+void EpollTcpServer::registerOnRecvCallback(callback_recv_t callback)
+{
+	assert(!recvCallback_);
+	recvCallback_ = callback;
+}
+
+void EpollTcpServer::unregisterOnRecvCallback()
+{
+	assert(recvCallback_);
+	recvCallback_ = nullptr;
+}
+
+void EpollTcpServer::setCloseCallback(std::function<void(int32_t fd)> callback)
 {
-	// TODO(smaugx) not care for now
-	std::cout << "fd: " << fd << " writeable!" << std::endl;
+	assert(!started_);
+	closeCallback_ = std::move(callback);
 }
 
+
 // send packet
 int32_t EpollTcpServer::sendData(const PacketPtr& data)
 {
@@ -299,90 +707,24 @@ int32_t EpollTcpServer::sendData(const PacketPtr& data)
 	{
 		return -1;
 	}
-	// send packet on fd
-	int r = ::write(data->fd(), data->message().data(), data->message().size());
-	if (r == -1)
+	TcpConnectionPtr conn = findConnection(data->fd());
+	if (!conn)
 	{
-		if (errno == EAGAIN || errno == EWOULDBLOCK)
-		{
-			return -1;
-		}
-		// error happend
-		::close(data->fd());
-		std::cout << "fd: " << data->fd() << " write error, close it!" << std::endl;
 		return -1;
 	}
-	std::cout << "fd: " << data->fd() << " write size: " << r << " ok!" << std::endl;
+	// written now if the socket takes it, otherwise queued and flushed on EPOLLOUT
+	int r = conn->send(data->message(), data->timestamps().callbackNs);
+	// -1 when the connection is closing, TcpConnection reports write errors itself
 	return r;
 }
 
-
-void EpollTcpServer::epollLoop()
+ssize_t EpollTcpServer::sendFile(int32_t fd, int file_fd, off_t offset, size_t len)
 {
-	// request some memory, if events ready, socket events will copy to this memory from kernel
-	struct epoll_event* alive_events =  static_cast<epoll_event*>(calloc(MaxEvents(), sizeof(epoll_event)));
-	if (!alive_events)
+	TcpConnectionPtr conn = findConnection(fd);
+	if (!conn)
 	{
-		std::cout << "calloc memory failed for epoll_events!" << std::endl;
-		return;
+		return -1;
 	}
-	// if loop_flag_ is false, will exit this loop
-	while (loopFlag_)
-	{
-		// call epoll_wait and return ready socket
-		int num = epoll_wait(efd_, alive_events, MaxEvents(), EpollWaitTime());
-
-		for (int i = 0; i < num; ++i)
-		{
-			// get fd
-			int fd = alive_events[i].data.fd;
-			// get events(readable/writeable/error)
-			int events = alive_events[i].events;
-
-			if ( (events & EPOLLERR) || (events & EPOLLHUP) )
-			{
-				std::cout << "epoll_wait error!" << std::endl;
-				// An error has occured on this fd, or the socket is not ready for reading (why were we notified then?).
-				::close(fd);
-			}
-			else  if (events & EPOLLRDHUP)
-			{
-				// Stream socket peer closed connection, or shut down writing half of connection.
-				// more inportant, We still to handle disconnection when read()/recv() return 0 or -1 just to be sure.
-				std::cout << "fd:" << fd << " closed EPOLLRDHUP!" << std::endl;
-				// close fd and epoll will remove it
-				::close(fd);
-			}
-			else if ( events & EPOLLIN )
-			{
-				std::cout << "epollin" << std::endl;
-				if (fd == handle_)
-				{
-					// listen fd coming connections
-					onSocketAccept();
-				}
-				else
-				{
-					// other fd read event coming, meaning data coming
-					onSocketRead(fd);
-				}
-			}
-			else if ( events & EPOLLOUT )
-			{
-				std::cout << "epollout" << std::endl;
-				// write event for fd (not including listen-fd), meaning send buffer is available for big files
-				onSocketWrite(fd);
-			}
-			else
-			{
-				std::cout << "unknow epoll event!" << std::endl;
-			}
-		} // end for (int i = 0; ...
-
-	} // end while (loop_flag_)
-
-	free(alive_events);
+	// plaintext or ktls: zero copy from page cache to socket, otherwise caller falls back to sendData()
+	return conn->sendFile(file_fd, offset, len);
 }
-
-
-
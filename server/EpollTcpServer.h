@@ -7,10 +7,21 @@
 #ifndef EPOLLTCPSERVER_H
 #define EPOLLTCPSERVER_H
 
+#include "AdmissionControl.h"
 #include "EpollTcpBase.h"
-#include <thread>
+#include "EventLoop.h"
+#include "LatencyHistogram.h"
+#include "LoadBalancer.h"
+#include "SocketAddress.h"
+#include "TcpConnection.h"
+#include "TlsContext.h"
+#include "TopicRegistry.h"
+#include "TrafficCapture.h"
+#include <memory>
+#include <mutex>
+#include <vector>
 
-class EpollTcpServer : public EpollTcpBase
+class EpollTcpServer : public EpollTcpBase, private EventHandler
 {
 public:
     EpollTcpServer()                                       = default;
@@ -22,6 +33,11 @@ public:
 
     // the local ip and port of tcp server
     EpollTcpServer(const std::string& local_ip, uint16_t local_port);
+    // the local address of tcp server: ipv4, ipv6 or unix domain socket
+    explicit EpollTcpServer(const SocketAddress& local_addr);
+    // run on a started loop shared with other servers/clients instead of an own loop thread
+    EpollTcpServer(const std::string& local_ip, uint16_t local_port, const EventLoopPtr& loop);
+    EpollTcpServer(const SocketAddress& local_addr, const EventLoopPtr& loop);
 
 public:
     // start tcp server
@@ -33,38 +49,135 @@ public:
     // register a callback when packet received
     void registerOnRecvCallback(callback_recv_t callback) override;
     void unregisterOnRecvCallback() override;
+    // called with the fd of every accepted connection that closes, for per connection state of the recv
+    // callback; the fd is closed after it returns, no new connection has the number yet. must be called
+    // before start()
+    void setCloseCallback(std::function<void(int32_t fd)> callback);
+
+    // print start/stop and every accepted connection on stdout(errors are always printed), off by default
+    void setVerbose(bool verbose)
+    { verbose_ = verbose; }
+    // serve tls on every accepted connection, must be called before start()
+    void setTlsContext(const TlsContextPtr& ctx);
+    // send part of a file on connection fd with sendfile(), for tls connections only works
+    // when the kernel does record encryption(ktls tx); return bytes sent or -1
+    ssize_t sendFile(int32_t fd, int file_fd, off_t offset, size_t len);
+    // framed lz4 compression for clients that ask for it(plain stream for the others), must be called before start()
+    void setCompressionConfig(const CompressionConfig& config);
+    const CompressionStats& compressionStats() const
+    { return compressionStats_; }
+    // one packet per line instead of per read, not together with compression(its frames delimit messages);
+    // must be called before start()
+    void setLineFramingConfig(const LineFramingConfig& config);
+    const LineStats& lineStats() const
+    { return lineStats_; }
+    // rate limits per connection/source ip and connection cap, must be called before start()
+    void setAdmissionConfig(const AdmissionConfig& config);
+    const AdmissionStats& admissionStats() const
+    { return admission_.stats(); }
+    // per stage latency histograms fed by kernel timestamps and loop timestamps, must be called before start().
+    // a reply is traced when it carries the request's timestamps(the same packet or Packet::setTimestamps())
+    void setLatencyTracing(bool enabled);
+    LatencyStats& latencyStats()
+    { return latencyStats_; }
+
+    // topic fan-out: connections subscribe(usually from the recv callback on a request of the client),
+    // publish() sends one shared payload to every subscriber of the topic, callable from any thread
+    bool subscribe(int32_t fd, const std::string& topic);
+    bool unsubscribe(int32_t fd, const std::string& topic);
+    // return the number of subscribers the message was written or queued to
+    size_t publish(const std::string& topic, const std::string& message);
+    size_t publish(const std::string& topic, const PayloadPtr& payload);
+    // queue limit and slow subscriber policy, must be called before start()
+    void setPubSubConfig(const PubSubConfig& config);
+    const PubSubStats& pubSubStats() const
+    { return topics_.stats(); }
+    // act as a tcp load balancer: every accepted connection is relayed to a backend picked by consistent
+    // hashing of its source address instead of going to the recv callback; must be called before start()
+    void setLoadBalancer(const LoadBalancerConfig& config);
+    // nullptr when not load balancing, query from the loop thread(runAndWait) except for stats()
+    LoadBalancer* loadBalancer()
+    { return balancer_.get(); }
+    // record every connection's requests(and replies written with sendData()) to rotating capture files
+    // for replay, see TrafficCapture; not for load balancer connections; must be called before start()
+    void setCaptureConfig(const CaptureConfig& config);
+    // nullptr when not capturing
+    const TrafficCapture* capture() const
+    { return capture_.get(); }
+    // epoll trigger mode of the listen socket and connections(default edge), must be called before start().
+    // level triggered and oneshot fds are served a few reads per event in turn instead of being drained
+    void setTriggerMode(TriggerMode mode);
+    // threads handling events of the server's own loop(EventLoop::setDispatchThreads()), more than one needs
+    // oneshot mode and no admission control or load balancer; must be called before start()
+    void setDispatchThreads(size_t count);
+    // small socket buffers for servers of very many mostly idle connections, must be called before start()
+    void setFootprintConfig(const FootprintConfig& config);
+    // accepted connections not closed yet
+    size_t connectionCount();
+    // the loop this server runs on
+    const EventLoopPtr& loop() const
+    { return loop_; }
 
 protected:
-    // create epoll instance using epoll_create and return a fd of epoll
-    int32_t createEpoll();
     // create a socket fd using api socket()
     int32_t createSocket();
     // set socket noblock
     int32_t makeSocketNonBlock(int32_t fd);
     // listen()
     int32_t listen(int32_t listenfd);
-    // add/modify/remove a item(socket/fd) in epoll instance(rbtree), for this example, just add a socket to epoll rbtree
-    int32_t updateEpollEvents(int efd, int op, int fd, int events);
 
+    // listen socket readable
+    void handleEvent(uint32_t events) override;
+    int32_t handlerFd() const override
+    { return handle_; }
     // handle tcp accept event
     void onSocketAccept();
-    // handle tcp socket readable event(read())
-    void onSocketRead(int32_t fd);
-    // handle tcp socket writeable event(write())
-
-    void onSocketWrite(int32_t fd);
-    // one loop per thread, call epoll_wait and return ready socket(accept,readable,writeable,error...)
-    void epollLoop();
+    // accept and update the listen socket's events: oneshot re-arms, level drops EPOLLIN while paused
+    void acceptConnections();
+    // the callbacks every accepted connection shares, from the configuration at start()
+    TcpCallbacksPtr makeConnectionCallbacks();
+    // release admission state of a closed connection
+    void onConnectionClosed(const TcpConnectionPtr& conn);
+    // connection of fd, nullptr if closed
+    TcpConnectionPtr findConnection(int32_t fd);
+    // shrink want to what admission control allows, false when conn must stop reading(parked or closed)
+    bool admitRead(TcpConnection& conn, size_t& want);
+    // read connections whose tokens came back and accept again below the cap
+    void resumeThrottled();
 
 
 private:
     std::string localIP_; // tcp local ip
     uint16_t localPort_ = 0; // tcp bind local port
+    SocketAddress localAddr_; // parsed local address to bind
     int32_t handle_ = -1 ; // listenfd
-    int32_t efd_ = -1 ; // epoll fd
-    std::shared_ptr<std::thread> th_loop_ { nullptr }; // one loop per thread(call epoll_wait in loop)
-    bool loopFlag_ = true ; // if loop_flag_ is false, then exit the epoll loop
+    EventLoopPtr loop_; // loop running this server
+    bool ownLoop_ = false; // loop_ created and started by this server
+    bool started_ = false;
     callback_recv_t recvCallback_ = nullptr ; // callback when received
+    std::function<void(int32_t fd)> closeCallback_; // connection closed
+    TcpCallbacksPtr connCallbacks_; // shared by the accepted connections, built by start()
+    TlsContextPtr tlsContext_; // not null when serving tls
+    CompressionConfig compression_; // enabled: accept compression hellos
+    CompressionStats compressionStats_; // written by connections of this server
+    LineFramingConfig lineFraming_; // enabled: split reads into lines
+    LineStats lineStats_; // written by connections of this server
+    std::vector<TcpConnectionPtr> conns_; // accepted connections indexed by fd, 16 bytes per slot
+    size_t connCount_ = 0; // non-null slots of conns_
+    std::mutex connMutex_; // guard conns_, sendData() comes from any thread
+    AdmissionControl admission_; // rate limits and connection cap
+    TopicRegistry topics_; // subscriptions of connections
+    std::unique_ptr<LoadBalancer> balancer_; // load balancer mode when set
+    std::unique_ptr<TrafficCapture> capture_; // capture mode when set
+    bool latencyTracing_ = false;
+    bool verbose_ = false;
+    LatencyStats latencyStats_; // written by connections of this server
+    EventLoop::TimerId resumeTimer_ = 0; // polls throttled connections
+    bool acceptPaused_ = false; // listen socket left unread at the connection cap
+    TriggerMode triggerMode_ = TriggerMode::kEdge;
+    size_t dispatchThreads_ = 1; // of the own loop
+    FootprintConfig footprint_;
+    std::vector<int32_t> resumable_; // scratch of resumeThrottled()
 };
 
 #endif//EPOLLTCPSERVER_H
@@ -0,0 +1,484 @@
+/********************************************************************************
+  > FileName:	EpollUdpServer.cpp
+  > Author:	Mingping Zhang
+  > Email:	mingpingzhang@163.com
+  > Create Time:	Tue Mar 21 09:35:12 2023
+ ********************************************************************************/
+
+#include "EpollUdpServer.h"
+#include "AppDef.h"
+#include "KernelTimestamp.h"
+#include "TimeUtil.h"
+#include <iostream>
+#include <cassert>
+#include <cstring>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+// biggest payload of one gso send(ipv4 udp limit)
+static const size_t kMaxGsoBytes = 65507;
+
+
+EpollUdpServer::EpollUdpServer(const std::string& local_ip, uint16_t local_port)
+	: localIP_ ( local_ip ),
+	localPort_ ( local_port )
+{
+	if (!SocketAddress::parse(local_ip, local_port, localAddr_))
+	{
+		std::cout << "invalid local address " << local_ip << ":" << local_port << std::endl;
+	}
+}
+
+EpollUdpServer::EpollUdpServer(const SocketAddress& local_addr)
+	: localIP_ ( local_addr.toString() ),
+	localPort_ ( local_addr.port() ),
+	localAddr_ ( local_addr )
+{
+}
+
+EpollUdpServer::EpollUdpServer(const std::string& local_ip, uint16_t local_port, const EventLoopPtr& loop)
+	: EpollUdpServer(local_ip, local_port)
+{
+	loop_ = loop;
+}
+
+EpollUdpServer::EpollUdpServer(const SocketAddress& local_addr, const EventLoopPtr& loop)
+	: EpollUdpServer(local_addr)
+{
+	loop_ = loop;
+}
+
+EpollUdpServer::~EpollUdpServer()
+{
+	stop();
+}
+
+void EpollUdpServer::setBatchSize(uint32_t batch)
+{
+	assert(!started_);
+	batchSize_ = batch;
+}
+
+bool EpollUdpServer::start()
+{
+	assert(!started_);
+	if (batchSize_ == 0)
+	{
+		batchSize_ = UdpBatchSize();
+	}
+	// allocate recvmmsg() slots once, every slot points to its own buffer and address
+	rxBuffer_.assign(batchSize_ * UdpMaxDatagramSize(), 0);
+	rxMsgs_.assign(batchSize_, mmsghdr());
+	rxIovecs_.assign(batchSize_, iovec());
+	rxAddrs_.assign(batchSize_, sockaddr_storage());
+	for (uint32_t i = 0; i < batchSize_; ++i)
+	{
+		rxIovecs_[i].iov_base = &rxBuffer_[i * UdpMaxDatagramSize()];
+		rxIovecs_[i].iov_len = UdpMaxDatagramSize();
+		rxMsgs_[i].msg_hdr.msg_iov = &rxIovecs_[i];
+		rxMsgs_[i].msg_hdr.msg_iovlen = 1;
+		rxMsgs_[i].msg_hdr.msg_name = &rxAddrs_[i];
+	}
+	if (latencyTracing_)
+	{
+		// room for the SCM_TIMESTAMPING message of every slot
+		rxControl_.assign(batchSize_ * kTimestampControlSize, 0);
+	}
+	pending_.reserve(batchSize_);
+
+	if (!loop_)
+	{
+		// no shared loop given: one loop per thread of its own
+		loop_ = std::make_shared<EventLoop>();
+		ownLoop_ = true;
+	}
+	if (ownLoop_ && !loop_->start())
+	{
+		return false;
+	}
+	assert(loop_->running());
+
+	// create socket and bind
+	int fd = createSocket();
+	if (fd < 0)
+	{
+		return false;
+	}
+	if (verbose_)
+	{
+		std::cout << "EpollUdpServer Init success!" << std::endl;
+	}
+	handle_ = fd;
+
+	// add socket to the loop, events are dispatched to handleEvent()
+	int er = loop_->addHandler(handle_, EPOLLIN | triggerFlags(triggerMode_), this);
+	if (er < 0)
+	{
+		::close(handle_);
+		handle_ = -1;
+		return false;
+	}
+	started_ = true;
+	return true;
+}
+
+void EpollUdpServer::setTriggerMode(TriggerMode mode)
+{
+	assert(!started_);
+	triggerMode_ = mode;
+}
+
+void EpollUdpServer::setLatencyTracing(bool enabled)
+{
+	assert(!started_);
+	latencyTracing_ = enabled;
+}
+
+bool EpollUdpServer::stop()
+{
+	if (started_)
+	{
+		started_ = false;
+		// the socket is read by the loop thread, close it there
+		loop_->runAndWait([this]() {
+			loop_->removeHandler(handle_);
+			::close(handle_);
+			handle_ = -1;
+		});
+		if (ownLoop_)
+		{
+			loop_->stop();
+		}
+		if (verbose_)
+		{
+			std::cout << "stop epoll!" << std::endl;
+		}
+	}
+	// stop() is also called by destructor, unregister only once
+	if (recvCallback_)
+	{
+		unregisterOnRecvCallback();
+	}
+	return true;
+}
+
+int32_t EpollUdpServer::createSocket()
+{
+	if (!localAddr_.valid())
+	{
+		std::cout << "create socket " << localIP_ << ":" << localPort_ << " failed, invalid address!" << std::endl;
+		return -1;
+	}
+	int fd = ::socket(localAddr_.family(), SOCK_DGRAM | SOCK_NONBLOCK, 0);
+	if (fd < 0)
+	{
+		std::cout << "create socket " << localAddr_.toString() << " failed!" << std::endl;
+		return -1;
+	}
+
+	// a stale socket file left by a previous run makes bind() fail with EADDRINUSE
+	std::string path = localAddr_.unixPath();
+	if (!path.empty())
+	{
+		::unlink(path.c_str());
+	}
+
+	int r = ::bind(fd, localAddr_.addr(), localAddr_.length());
+	if (r != 0)
+	{
+		std::cout << "bind socket " << localAddr_.toString() << " failed!" << std::endl;
+		::close(fd);
+		return -1;
+	}
+	if (latencyTracing_)
+	{
+		// receive timestamps only, replies are traced until sendmmsg() accepts them
+		enableKernelTimestamps(fd, false);
+	}
+	// gso is a feature of udp only
+	if (localAddr_.family() != AF_INET && localAddr_.family() != AF_INET6)
+	{
+		gsoEnabled_ = false;
+	}
+	if (verbose_)
+	{
+		std::cout << "create and bind socket " << localAddr_.toString() << " success!" << std::endl;
+	}
+	return fd;
+}
+
+void EpollUdpServer::registerOnRecvCallback(callback_recv_t callback)
+{
+	assert(!recvCallback_);
+	recvCallback_ = callback;
+}
+
+void EpollUdpServer::unregisterOnRecvCallback()
+{
+	assert(recvCallback_);
+	recvCallback_ = nullptr;
+}
+
+void EpollUdpServer::onSocketRead()
+{
+	// level triggered/oneshot: a few batches per event, the socket is reported again while datagrams are left
+	uint32_t batches = triggerMode_ == TriggerMode::kEdge ? 0 : LevelReadsPerEvent();
+	while (true)
+	{
+		// kernel overwrites msg_namelen and msg_flags of every returned slot
+		for (uint32_t i = 0; i < batchSize_; ++i)
+		{
+			rxMsgs_[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+			rxMsgs_[i].msg_hdr.msg_flags = 0;
+			if (latencyTracing_)
+			{
+				rxMsgs_[i].msg_hdr.msg_control = &rxControl_[i * kTimestampControlSize];
+				rxMsgs_[i].msg_hdr.msg_controllen = kTimestampControlSize;
+			}
+		}
+		int n = recvmmsg(handle_, rxMsgs_.data(), batchSize_, MSG_DONTWAIT, nullptr);
+		++stats_.rxSyscalls;
+		if (n < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+			{
+				std::cout << "recvmmsg error! errno:" << errno << std::endl;
+			}
+			break;
+		}
+
+		uint64_t recv_ns = latencyTracing_ ? monotonicNs() : 0;
+		uint64_t recv_realtime_ns = latencyTracing_ ? realtimeNs() : 0;
+		for (int i = 0; i < n; ++i)
+		{
+			const struct msghdr& hdr = rxMsgs_[i].msg_hdr;
+			if (hdr.msg_flags & MSG_TRUNC)
+			{
+				++stats_.rxTruncated;
+				continue;
+			}
+			SocketAddress peer = SocketAddress::fromSockaddr((struct sockaddr*)hdr.msg_name, hdr.msg_namelen);
+			PacketPtr data = std::make_shared<DatagramPacket>(peer, (const char*)rxIovecs_[i].iov_base, rxMsgs_[i].msg_len);
+			++stats_.rxDatagrams;
+			if (recvCallback_ && latencyTracing_)
+			{
+				PacketTimestamps& ts = data->mutableTimestamps();
+				ts.recvNs = recv_ns;
+				ts.kernelRxNs = rxTimestampOf(&hdr);
+				if (ts.kernelRxNs)
+				{
+					latencyStats_.kernelToRead.record(recv_realtime_ns > ts.kernelRxNs ? recv_realtime_ns - ts.kernelRxNs : 0);
+				}
+				// later datagrams of the batch wait for the callbacks of earlier ones, that counts as dispatch
+				ts.callbackNs = monotonicNs();
+				latencyStats_.readToCallback.record(ts.callbackNs - recv_ns);
+				inBatch_ = true;
+				recvCallback_(data);
+				inBatch_ = false;
+				latencyStats_.callback.record(monotonicNs() - ts.callbackNs);
+			}
+			else if (recvCallback_)
+			{
+				inBatch_ = true;
+				recvCallback_(data);
+				inBatch_ = false;
+			}
+		}
+		// replies of this batch go out together
+		flushPending();
+
+		// every datagram queued after recvmmsg() returned raises a new edge, so a short batch means drained
+		if ((uint32_t)n < batchSize_ || (batches > 0 && --batches == 0))
+		{
+			break;
+		}
+	}
+}
+
+int32_t EpollUdpServer::sendData(const PacketPtr& data)
+{
+	if (!data->peer().valid() || handle_ < 0)
+	{
+		return -1;
+	}
+	if (inBatch_ && loop_->isInLoopThread())
+	{
+		// called by recv callback: queue it, flushPending() sends the whole batch with sendmmsg()
+		pending_.push_back(PendingReply { data->peer(), data->message(), data->timestamps().callbackNs });
+		return data->message().size();
+	}
+
+	int r = ::sendto(handle_, data->message().data(), data->message().size(), 0, data->peer().addr(), data->peer().length());
+	++stats_.txSyscalls;
+	if (r < 0)
+	{
+		++stats_.txDropped;
+		return -1;
+	}
+	++stats_.txDatagrams;
+	if (latencyTracing_ && data->timestamps().callbackNs)
+	{
+		latencyStats_.callbackToWrite.record(monotonicNs() - data->timestamps().callbackNs);
+	}
+	return r;
+}
+
+void EpollUdpServer::flushPending()
+{
+	if (pending_.empty())
+	{
+		return;
+	}
+
+	const size_t kControlSpace = CMSG_SPACE(sizeof(uint16_t));
+	txMsgs_.assign(pending_.size(), mmsghdr());
+	txIovecs_.assign(pending_.size(), iovec());
+	txControl_.assign(pending_.size() * kControlSpace, 0);
+	// index of the first pending reply of every message, to resume after a failed message
+	std::vector<size_t>& first = txFirst_;
+	first.clear();
+
+	size_t count = 0;
+	size_t i = 0;
+	while (i < pending_.size())
+	{
+		// merge a run of replies to the same peer where all segments have the same size(the last may be shorter),
+		// empty replies are sent alone: gso has no zero sized segments
+		size_t seg = pending_[i].message.size();
+		size_t bytes = seg;
+		size_t j = i + 1;
+		while (gsoEnabled_ && seg > 0 && j < pending_.size() && j - i < UdpMaxGsoSegments()
+				&& pending_[j].peer == pending_[i].peer
+				&& pending_[j - 1].message.size() == seg
+				&& pending_[j].message.size() <= seg
+				&& !pending_[j].message.empty()
+				&& bytes + pending_[j].message.size() <= kMaxGsoBytes)
+		{
+			bytes += pending_[j].message.size();
+			++j;
+		}
+
+		for (size_t k = i; k < j; ++k)
+		{
+			txIovecs_[k].iov_base = const_cast<char*>(pending_[k].message.data());
+			txIovecs_[k].iov_len = pending_[k].message.size();
+		}
+		struct msghdr& hdr = txMsgs_[count].msg_hdr;
+		hdr.msg_name = const_cast<struct sockaddr*>(pending_[i].peer.addr());
+		hdr.msg_namelen = pending_[i].peer.length();
+		hdr.msg_iov = &txIovecs_[i];
+		hdr.msg_iovlen = j - i;
+		if (j - i > 1)
+		{
+			// kernel splits the gathered payload into datagrams of seg bytes
+			hdr.msg_control = &txControl_[count * kControlSpace];
+			hdr.msg_controllen = kControlSpace;
+			struct cmsghdr* cm = CMSG_FIRSTHDR(&hdr);
+			cm->cmsg_level = SOL_UDP;
+			cm->cmsg_type = UDP_SEGMENT;
+			cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+			uint16_t gso_size = seg;
+			std::memcpy(CMSG_DATA(cm), &gso_size, sizeof(gso_size));
+		}
+		first.push_back(i);
+		++count;
+		i = j;
+	}
+	first.push_back(pending_.size());
+
+	size_t off = 0;
+	while (off < count)
+	{
+		int r = sendmmsg(handle_, &txMsgs_[off], count - off, 0);
+		++stats_.txSyscalls;
+		if (r > 0)
+		{
+			stats_.txDatagrams += first[off + r] - first[off];
+			if (latencyTracing_)
+			{
+				uint64_t now = monotonicNs();
+				for (size_t k = first[off]; k < first[off + r]; ++k)
+				{
+					if (pending_[k].traceNs)
+					{
+						latencyStats_.callbackToWrite.record(now - pending_[k].traceNs);
+					}
+				}
+			}
+			off += r;
+			continue;
+		}
+		if (errno == EINTR)
+		{
+			continue;
+		}
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)
+		{
+			// socket buffer is full, udp replies are best effort
+			stats_.txDropped += first[count] - first[off];
+			break;
+		}
+		if (errno == EINVAL && txMsgs_[off].msg_hdr.msg_control)
+		{
+			// the kernel refuses this run only, send its replies one datagram each
+			for (size_t k = first[off]; k < first[off + 1]; ++k)
+			{
+				int n = ::sendto(handle_, pending_[k].message.data(), pending_[k].message.size(), 0,
+						pending_[k].peer.addr(), pending_[k].peer.length());
+				++stats_.txSyscalls;
+				if (n < 0)
+				{
+					++stats_.txDropped;
+					continue;
+				}
+				++stats_.txDatagrams;
+				if (latencyTracing_ && pending_[k].traceNs)
+				{
+					latencyStats_.callbackToWrite.record(monotonicNs() - pending_[k].traceNs);
+				}
+			}
+			++off;
+			continue;
+		}
+		if (errno == EIO && gsoEnabled_ && txMsgs_[off].msg_hdr.msg_control)
+		{
+			// kernel or nic refuses gso for a valid run, send the rest one datagram per message
+			std::cout << "UDP_SEGMENT not supported, disable gso!" << std::endl;
+			gsoEnabled_ = false;
+			pending_.erase(pending_.begin(), pending_.begin() + first[off]);
+			flushPending();
+			return;
+		}
+		// this message failed(e.g. peer unreachable), skip it
+		stats_.txDropped += first[off + 1] - first[off];
+		++off;
+	}
+	pending_.clear();
+}
+
+void EpollUdpServer::handleEvent(uint32_t events)
+{
+	if (events & EPOLLERR)
+	{
+		// icmp errors of earlier sends are queued on the socket, fetch and ignore them
+		int err = 0;
+		socklen_t len = sizeof(err);
+		getsockopt(handle_, SOL_SOCKET, SO_ERROR, &err, &len);
+	}
+	if (events & EPOLLIN)
+	{
+		onSocketRead();
+	}
+	if (triggerMode_ == TriggerMode::kOneShot && handle_ >= 0)
+	{
+		loop_->modifyHandler(handle_, EPOLLIN | EPOLLONESHOT, this);
+	}
+}
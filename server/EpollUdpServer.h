@@ -0,0 +1,137 @@
+/********************************************************************************
+> FileName:	EpollUdpServer.h
+> Author:	Mingping Zhang
+> Email:	mingpingzhang@163.com
+> Create Time:	Tue Mar 21 09:35:12 2023
+********************************************************************************/
+#ifndef EPOLLUDPSERVER_H
+#define EPOLLUDPSERVER_H
+
+#include "EpollTcpBase.h"
+#include "EventLoop.h"
+#include "LatencyHistogram.h"
+#include "SocketAddress.h"
+#include <sys/socket.h>
+#include <atomic>
+#include <vector>
+
+// counters of udp server, updated by the loop thread
+struct UdpServerStats
+{
+    std::atomic<uint64_t> rxDatagrams { 0 }; // datagrams delivered to callback
+    std::atomic<uint64_t> rxSyscalls { 0 };  // recvmmsg() calls
+    std::atomic<uint64_t> rxTruncated { 0 }; // datagrams bigger than UdpMaxDatagramSize(), dropped
+    std::atomic<uint64_t> txDatagrams { 0 }; // datagrams handed to kernel(a gso send counts every segment)
+    std::atomic<uint64_t> txSyscalls { 0 };  // sendmmsg()/sendto() calls
+    std::atomic<uint64_t> txDropped { 0 };   // replies dropped because socket buffer is full
+};
+
+// udp endpoint driven by epoll: batch receive with recvmmsg(), batch reply with sendmmsg(),
+// and consecutive equal sized replies to the same peer are merged into one UDP_SEGMENT(gso) send
+class EpollUdpServer : public EpollTcpBase, private EventHandler
+{
+public:
+    EpollUdpServer()                                       = default;
+    EpollUdpServer(const EpollUdpServer& other)            = delete;
+    EpollUdpServer& operator=(const EpollUdpServer& other) = delete;
+    EpollUdpServer(EpollUdpServer&& other)                 = delete;
+    EpollUdpServer& operator=(EpollUdpServer&& other)      = delete;
+    ~EpollUdpServer() override;
+
+    // the local ip and port of udp server
+    EpollUdpServer(const std::string& local_ip, uint16_t local_port);
+    // the local address of udp server: ipv4, ipv6 or unix datagram socket
+    explicit EpollUdpServer(const SocketAddress& local_addr);
+    // run on a started loop shared with other servers/clients instead of an own loop thread
+    EpollUdpServer(const std::string& local_ip, uint16_t local_port, const EventLoopPtr& loop);
+    EpollUdpServer(const SocketAddress& local_addr, const EventLoopPtr& loop);
+
+public:
+    // start udp server
+    bool start() override;
+    // stop udp server
+    bool stop() override;
+    // send datagram to data->peer()(a DatagramPacket); inside recv callback the reply is queued and flushed with
+    // the whole batch, return the size queued/sent or -1
+    int32_t sendData(const PacketPtr& data) override;
+    // register a callback when datagram received, data->peer() is the source address
+    void registerOnRecvCallback(callback_recv_t callback) override;
+    void unregisterOnRecvCallback() override;
+
+    // datagrams per recvmmsg()/sendmmsg(), must be called before start()
+    void setBatchSize(uint32_t batch);
+    // enable/disable UDP_SEGMENT for bursts to one peer(enabled by default, turned off if kernel refuses it)
+    void setGsoEnabled(bool enabled)
+    { gsoEnabled_ = enabled; }
+    // print start/stop on stdout(errors are always printed), off by default
+    void setVerbose(bool verbose)
+    { verbose_ = verbose; }
+    const UdpServerStats& stats() const
+    { return stats_; }
+    // epoll trigger mode of the socket(default edge), level/oneshot read a few batches per event;
+    // must be called before start()
+    void setTriggerMode(TriggerMode mode);
+    // per stage latency histograms fed by kernel receive timestamps and loop timestamps,
+    // must be called before start(); a reply is traced when it carries the request's timestamps
+    void setLatencyTracing(bool enabled);
+    LatencyStats& latencyStats()
+    { return latencyStats_; }
+    // the loop this server runs on
+    const EventLoopPtr& loop() const
+    { return loop_; }
+
+protected:
+    // create a nonblock datagram socket and bind local address
+    int32_t createSocket();
+    // socket readable or error
+    void handleEvent(uint32_t events) override;
+    int32_t handlerFd() const override
+    { return handle_; }
+    // read all datagrams with recvmmsg() and deliver them to callback
+    void onSocketRead();
+    // send all replies queued by callbacks of the last batch
+    void flushPending();
+
+private:
+    // one reply queued by sendData() from the loop thread
+    struct PendingReply
+    {
+        SocketAddress peer;
+        std::string message;
+        uint64_t traceNs; // callback time of the traced request, 0 if not traced
+    };
+
+    std::string localIP_; // udp local ip
+    uint16_t localPort_ = 0; // udp bind local port
+    SocketAddress localAddr_; // parsed local address to bind
+    int32_t handle_ = -1 ; // udp socket
+    EventLoopPtr loop_; // loop running this server
+    bool ownLoop_ = false; // loop_ created and started by this server
+    bool started_ = false;
+    bool inBatch_ = false; // delivering a recvmmsg() batch, replies are queued
+    callback_recv_t recvCallback_ = nullptr ; // callback when received
+    uint32_t batchSize_ = 0; // datagrams per syscall
+    bool gsoEnabled_ = true; // try UDP_SEGMENT for inet sockets
+    TriggerMode triggerMode_ = TriggerMode::kEdge;
+
+    // recvmmsg() slots, allocated once in start()
+    std::vector<char> rxBuffer_;
+    std::vector<struct mmsghdr> rxMsgs_;
+    std::vector<struct iovec> rxIovecs_;
+    std::vector<struct sockaddr_storage> rxAddrs_;
+    std::vector<char> rxControl_; // SO_TIMESTAMPING control data of every slot when tracing
+
+    // replies queued during one batch and the sendmmsg() scratch used to flush them
+    std::vector<PendingReply> pending_;
+    std::vector<struct mmsghdr> txMsgs_;
+    std::vector<struct iovec> txIovecs_;
+    std::vector<char> txControl_;
+    std::vector<size_t> txFirst_;
+
+    UdpServerStats stats_;
+    bool latencyTracing_ = false;
+    bool verbose_ = false;
+    LatencyStats latencyStats_;
+};
+
+#endif//EPOLLUDPSERVER_H
@@ -0,0 +1,469 @@
+/********************************************************************************
+  > FileName:	LoadBalancer.cpp
+  > Author:	Mingping Zhang
+  > Email:	mingpingzhang@163.com
+  > Create Time:	Tue Apr  4 09:37:12 2023
+ ********************************************************************************/
+
+#include "LoadBalancer.h"
+#include <iostream>
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <algorithm>
+
+#ifndef IP_BIND_ADDRESS_NO_PORT
+#define IP_BIND_ADDRESS_NO_PORT 24
+#endif
+
+
+LoadBalancer::LoadBalancer(const LoadBalancerConfig& config)
+	: config_ ( config ),
+	table_ ( config.tableSize )
+{
+	backends_.resize(config_.backends.size());
+	for (size_t i = 0; i < backends_.size(); ++i)
+	{
+		backends_[i].addr = config_.backends[i];
+		backends_[i].name = config_.backends[i].toString();
+		backends_[i].probe.reset(new Probe());
+		backends_[i].probe->owner = this;
+		backends_[i].probe->backend = i;
+	}
+}
+
+LoadBalancer::~LoadBalancer()
+{
+	// stop() must have run on the loop thread
+	assert(relays_.empty());
+}
+
+bool LoadBalancer::start(const EventLoopPtr& loop)
+{
+	assert(loop->isInLoopThread());
+	loop_ = loop;
+	if (backends_.empty())
+	{
+		std::cout << "load balancer without backends!" << std::endl;
+		return false;
+	}
+	if (!MaglevTable::validSize(config_.tableSize))
+	{
+		std::cout << "maglev table size " << config_.tableSize << " is not a prime >= 2!" << std::endl;
+		return false;
+	}
+	rebuildTable();
+	for (size_t i = 0; i < backends_.size(); ++i)
+	{
+		if (config_.verbose)
+		{
+			std::cout << "backend " << backends_[i].name << std::endl;
+		}
+		refill(i);
+		startProbe(i);
+	}
+	healthTimer_ = loop_->runEvery(config_.healthIntervalMs, [this]() { onHealthTimer(); });
+	return true;
+}
+
+void LoadBalancer::stop()
+{
+	if (!loop_)
+	{
+		return;
+	}
+	assert(loop_->isInLoopThread());
+	loop_->cancelTimer(healthTimer_);
+	healthTimer_ = 0;
+	for (size_t i = 0; i < backends_.size(); ++i)
+	{
+		Backend& b = backends_[i];
+		onProbeDone(i, false);
+		// close callbacks erase them from the pool
+		std::vector<TcpConnectionPtr> idle;
+		idle.swap(b.idle);
+		for (auto& conn : idle)
+		{
+			conn->close();
+		}
+	}
+	std::vector<RelayPtr> relays;
+	for (auto& kv : relays_)
+	{
+		relays.push_back(kv.second);
+	}
+	// close callbacks release them
+	for (auto& relay : relays)
+	{
+		if (relay->upstream)
+		{
+			relay->upstream->close();
+		}
+		if (relay->client)
+		{
+			relay->client->close();
+		}
+	}
+	loop_.reset();
+}
+
+int32_t LoadBalancer::pick(const SocketAddress& peer) const
+{
+	// the source ip only, all connections of one client go to the same backend
+	uint8_t key[16];
+	size_t len = 0;
+	if (peer.family() == AF_INET)
+	{
+		len = 4;
+		std::memcpy(key, &reinterpret_cast<const struct sockaddr_in*>(peer.addr())->sin_addr, len);
+	}
+	else if (peer.family() == AF_INET6)
+	{
+		len = 16;
+		std::memcpy(key, &reinterpret_cast<const struct sockaddr_in6*>(peer.addr())->sin6_addr, len);
+	}
+	return table_.lookup(MaglevTable::hash(key, len));
+}
+
+TcpConnectionPtr LoadBalancer::connectUpstream(size_t index)
+{
+	const SocketAddress& addr = backends_[index].addr;
+	int fd = ::socket(addr.family(), SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+	{
+		std::cout << "create upstream socket failed: " << strerror(errno) << std::endl;
+		++stats_.connectFailed;
+		return nullptr;
+	}
+	if (!addr.isUnix())
+	{
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		for (size_t n = 0; n < config_.sourceAddresses.size(); ++n)
+		{
+			const SocketAddress& src = config_.sourceAddresses[nextSource_++ % config_.sourceAddresses.size()];
+			if (src.family() != addr.family())
+			{
+				continue;
+			}
+			// the port is picked at connect() time for the full 4-tuple, not reserved by bind()
+			setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one));
+			::bind(fd, src.addr(), src.length());
+			break;
+		}
+	}
+	if (::connect(fd, addr.addr(), addr.length()) != 0 && errno != EINPROGRESS)
+	{
+		std::cout << "connect upstream " << backends_[index].name << " failed: " << strerror(errno) << std::endl;
+		::close(fd);
+		++stats_.connectFailed;
+		return nullptr;
+	}
+	// writes before the handshake finished get EAGAIN and are queued until EPOLLOUT, a refused connect
+	// comes as EPOLLERR and closes the connection
+	return std::make_shared<TcpConnection>(loop_, fd);
+}
+
+void LoadBalancer::refill(size_t index)
+{
+	Backend& b = backends_[index];
+	while (b.up && b.idle.size() < config_.idlePerBackend)
+	{
+		TcpConnectionPtr conn = connectUpstream(index);
+		if (!conn)
+		{
+			return;
+		}
+		std::weak_ptr<TcpConnection> weak = conn;
+		conn->setRecvCallback([weak](const PacketPtr&) {
+			// nothing is expected before a client is attached
+			TcpConnectionPtr c = weak.lock();
+			if (c)
+			{
+				c->close();
+			}
+		});
+		conn->setCloseCallback([this, index](const TcpConnectionPtr& c) { removeIdle(index, c); });
+		if (!conn->start())
+		{
+			return;
+		}
+		b.idle.push_back(conn);
+	}
+}
+
+void LoadBalancer::removeIdle(size_t index, const TcpConnectionPtr& conn)
+{
+	std::vector<TcpConnectionPtr>& idle = backends_[index].idle;
+	auto it = std::find(idle.begin(), idle.end(), conn);
+	if (it != idle.end())
+	{
+		idle.erase(it);
+	}
+}
+
+bool LoadBalancer::attach(const TcpConnectionPtr& client, const SocketAddress& peer)
+{
+	int32_t index = pick(peer);
+	if (index < 0)
+	{
+		std::cout << "no backend up for " << peer.toString() << std::endl;
+		++stats_.noBackend;
+		return false;
+	}
+	Backend& b = backends_[index];
+	TcpConnectionPtr upstream;
+	while (!upstream && !b.idle.empty())
+	{
+		// connected ahead of time(or still connecting), saves the connect round trip
+		upstream = b.idle.back();
+		b.idle.pop_back();
+		if (!upstream->connected())
+		{
+			upstream.reset();
+		}
+	}
+	if (upstream)
+	{
+		++stats_.reusedUpstreams;
+	}
+	else
+	{
+		upstream = connectUpstream(index);
+		if (!upstream || !upstream->start())
+		{
+			return false;
+		}
+	}
+
+	RelayPtr relay = std::make_shared<Relay>();
+	relay->client = client;
+	relay->upstream = upstream;
+	relay->backend = index;
+	wire(relay);
+	relays_[client.get()] = relay;
+	++b.active;
+	++stats_.relayed;
+	++stats_.activeRelays;
+	refill(index);
+	return true;
+}
+
+void LoadBalancer::wire(const RelayPtr& relay)
+{
+	// the callbacks keep the relay alive, release() breaks the cycle once both sides are closed
+	TcpConnectionPtr client = relay->client;
+	TcpConnectionPtr upstream = relay->upstream;
+	client->setRecvCallback([this, relay](const PacketPtr& data) { forward(data, relay->client, relay->upstream); });
+	upstream->setRecvCallback([this, relay](const PacketPtr& data) { forward(data, relay->upstream, relay->client); });
+	// a side that stopped reading because the other side's output was full continues once it drained
+	client->setWriteDrainedCallback([relay](TcpConnection&) {
+		if (relay->upstream)
+		{
+			relay->upstream->resumeReading();
+		}
+	});
+	upstream->setWriteDrainedCallback([relay](TcpConnection&) {
+		if (relay->client)
+		{
+			relay->client->resumeReading();
+		}
+	});
+	// a half close goes on to the other side after the bytes before it, both close once done both ways
+	client->setEofCallback([relay](TcpConnection&) {
+		if (relay->upstream)
+		{
+			relay->upstream->shutdownAfterWrite();
+		}
+	});
+	upstream->setEofCallback([relay](TcpConnection&) {
+		if (relay->client)
+		{
+			relay->client->shutdownAfterWrite();
+		}
+	});
+	upstream->setCloseCallback([this, relay](const TcpConnectionPtr&) { onUpstreamClosed(relay); });
+}
+
+void LoadBalancer::forward(const PacketPtr& data, const TcpConnectionPtr& from, const TcpConnectionPtr& to)
+{
+	if (!to || to->send(data->message()) < 0)
+	{
+		from->close();
+		return;
+	}
+	if (to->pendingOutput() > config_.relayHighWater)
+	{
+		// the receiver is slower, let tcp push back on the sender
+		from->pauseReading();
+	}
+}
+
+void LoadBalancer::detach(const TcpConnectionPtr& client)
+{
+	auto it = relays_.find(client.get());
+	if (it == relays_.end())
+	{
+		return;
+	}
+	RelayPtr relay = it->second;
+	if (relay->upstream && relay->upstream->connected())
+	{
+		// the upstream's close callback releases the relay
+		relay->upstream->closeAfterWrite();
+		return;
+	}
+	release(relay);
+}
+
+void LoadBalancer::onUpstreamClosed(const RelayPtr& relay)
+{
+	Backend& b = backends_[relay->backend];
+	--b.active;
+	--stats_.activeRelays;
+	if (relay->client && relay->client->connected())
+	{
+		// detach() releases the relay
+		relay->client->closeAfterWrite();
+		return;
+	}
+	release(relay);
+}
+
+void LoadBalancer::release(const RelayPtr& relay)
+{
+	if (!relay->client)
+	{
+		return;
+	}
+	relays_.erase(relay->client.get());
+	relay->client.reset();
+	relay->upstream.reset();
+}
+
+void LoadBalancer::onHealthTimer()
+{
+	for (size_t i = 0; i < backends_.size(); ++i)
+	{
+		startProbe(i);
+		refill(i);
+	}
+}
+
+void LoadBalancer::startProbe(size_t index)
+{
+	Probe& probe = *backends_[index].probe;
+	if (probe.fd >= 0)
+	{
+		// previous probe still waiting
+		return;
+	}
+	const SocketAddress& addr = backends_[index].addr;
+	int fd = ::socket(addr.family(), SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+	{
+		return;
+	}
+	int r = ::connect(fd, addr.addr(), addr.length());
+	if (r != 0 && errno != EINPROGRESS)
+	{
+		::close(fd);
+		onProbeDone(index, false);
+		return;
+	}
+	probe.fd = fd;
+	if (r == 0)
+	{
+		// unix sockets connect at once
+		onProbeDone(index, true);
+		return;
+	}
+	loop_->addHandler(fd, EPOLLOUT | EPOLLET, &probe);
+	probe.timer = loop_->runAfter(config_.healthTimeoutMs, [this, index]() {
+		backends_[index].probe->timer = 0;
+		onProbeDone(index, false);
+	});
+}
+
+void LoadBalancer::Probe::handleEvent(uint32_t events)
+{
+	int err = 0;
+	socklen_t len = sizeof(err);
+	getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+	owner->onProbeDone(backend, err == 0 && !(events & (EPOLLERR | EPOLLHUP)));
+}
+
+void LoadBalancer::onProbeDone(size_t index, bool ok)
+{
+	Backend& b = backends_[index];
+	Probe& probe = *b.probe;
+	if (probe.fd >= 0)
+	{
+		loop_->removeHandler(probe.fd);
+		::close(probe.fd);
+		probe.fd = -1;
+	}
+	if (probe.timer)
+	{
+		loop_->cancelTimer(probe.timer);
+		probe.timer = 0;
+	}
+	if (!loop_ || !healthTimer_)
+	{
+		// stopping
+		return;
+	}
+	if (ok)
+	{
+		b.failed = 0;
+		++b.passed;
+	}
+	else
+	{
+		b.passed = 0;
+		++b.failed;
+	}
+	bool change = b.up ? (b.failed >= config_.fallCount) : (b.passed >= config_.riseCount);
+	if (!change)
+	{
+		return;
+	}
+	b.up = !b.up;
+	++stats_.healthChanges;
+	if (config_.verbose)
+	{
+		std::cout << "backend " << b.name << (b.up ? " up" : " down") << std::endl;
+	}
+	rebuildTable();
+	if (b.up)
+	{
+		refill(index);
+	}
+	else
+	{
+		// new clients go elsewhere, established relays stay until their backend closes them
+		std::vector<TcpConnectionPtr> idle;
+		idle.swap(b.idle);
+		for (auto& conn : idle)
+		{
+			conn->close();
+		}
+	}
+}
+
+void LoadBalancer::rebuildTable()
+{
+	std::vector<std::string> names;
+	std::vector<bool> up;
+	for (const Backend& b : backends_)
+	{
+		names.push_back(b.name);
+		up.push_back(b.up);
+	}
+	table_.build(names, up);
+}
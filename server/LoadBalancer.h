@@ -0,0 +1,141 @@
+/********************************************************************************
+> FileName:	LoadBalancer.h
+> Author:	Mingping Zhang
+> Email:	mingpingzhang@163.com
+> Create Time:	Tue Apr  4 09:37:12 2023
+********************************************************************************/
+#ifndef LOADBALANCER_H
+#define LOADBALANCER_H
+
+#include "EventLoop.h"
+#include "MaglevTable.h"
+#include "SocketAddress.h"
+#include "TcpConnection.h"
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct LoadBalancerConfig
+{
+    std::vector<SocketAddress> backends;
+    // local addresses upstream connections are bound to in turn(IP_BIND_ADDRESS_NO_PORT), every source address
+    // gives another ~28k ports per backend; empty: the kernel picks
+    std::vector<SocketAddress> sourceAddresses;
+    size_t tableSize { 65537 };     // maglev table size, prime
+    size_t idlePerBackend { 4 };    // connected upstreams kept ready for new clients
+    uint32_t healthIntervalMs { 1000 };
+    uint32_t healthTimeoutMs { 500 };
+    uint32_t riseCount { 2 };       // successful probes in a row to bring a backend up
+    uint32_t fallCount { 3 };       // failed probes in a row to take a backend down
+    size_t relayHighWater { 256 * 1024 }; // stop reading one side while this much is queued to the other
+    bool verbose { false };         // print the backends at start and every health change on stdout
+};
+
+// counters of the load balancer, readable from any thread
+struct LoadBalancerStats
+{
+    std::atomic<uint64_t> relayed { 0 };         // client connections relayed to a backend
+    std::atomic<uint64_t> activeRelays { 0 };
+    std::atomic<uint64_t> reusedUpstreams { 0 }; // relays served by an upstream from the idle pool
+    std::atomic<uint64_t> noBackend { 0 };       // clients closed because no backend was up
+    std::atomic<uint64_t> connectFailed { 0 };   // upstream connect() failed at once
+    std::atomic<uint64_t> healthChanges { 0 };   // backends going up or down
+};
+
+// L4 load balancing of accepted tcp connections: the backend is picked by maglev hashing of the client source
+// address and bytes are relayed both ways through an upstream TcpConnection on the same loop. backends are
+// health checked with tcp connect probes, a backend going down or up only moves the clients hashed to it.
+// everything runs on the loop thread
+class LoadBalancer
+{
+public:
+    explicit LoadBalancer(const LoadBalancerConfig& config);
+    LoadBalancer(const LoadBalancer& other)            = delete;
+    LoadBalancer& operator=(const LoadBalancer& other) = delete;
+    ~LoadBalancer();
+
+public:
+    // build the table, fill the idle pools and start health checks; loop thread only
+    bool start(const EventLoopPtr& loop);
+    // close probes, idle upstreams and relays left after their clients closed; loop thread only
+    void stop();
+    // relay an accepted client connection from peer before it is started, false when no upstream could be made
+    bool attach(const TcpConnectionPtr& client, const SocketAddress& peer);
+    // the client connection closed: its upstream is closed after writing what the client sent
+    void detach(const TcpConnectionPtr& client);
+
+    // backend of a client source address, -1 when no backend is up
+    int32_t pick(const SocketAddress& peer) const;
+    bool backendUp(size_t index) const
+    { return backends_[index].up; }
+    size_t backendCount() const
+    { return backends_.size(); }
+    const LoadBalancerStats& stats() const
+    { return stats_; }
+
+private:
+    // one client and its upstream, released when both are closed
+    struct Relay
+    {
+        TcpConnectionPtr client;
+        TcpConnectionPtr upstream;
+        size_t backend { 0 };
+    };
+    typedef std::shared_ptr<Relay> RelayPtr;
+
+    // non-blocking connect() to a backend, fd registered by the loop only after a result
+    struct Probe : public EventHandler
+    {
+        LoadBalancer* owner { nullptr };
+        size_t backend { 0 };
+        int32_t fd { -1 }; // -1 when no probe is running
+        EventLoop::TimerId timer { 0 };
+
+        void handleEvent(uint32_t events) override;
+        int32_t handlerFd() const override
+        { return fd; }
+    };
+
+    struct Backend
+    {
+        SocketAddress addr;
+        std::string name;
+        bool up { true }; // up until probes say otherwise
+        uint32_t passed { 0 }; // probes in a row
+        uint32_t failed { 0 };
+        size_t active { 0 }; // relays
+        std::vector<TcpConnectionPtr> idle; // upstreams waiting for a client
+        std::unique_ptr<Probe> probe;
+    };
+
+    // socket connecting to backend index, nullptr if connect() failed at once
+    TcpConnectionPtr connectUpstream(size_t index);
+    // top up the idle pool of a backend that is up
+    void refill(size_t index);
+    void removeIdle(size_t index, const TcpConnectionPtr& conn);
+    // relay callbacks of both sides
+    void wire(const RelayPtr& relay);
+    void forward(const PacketPtr& data, const TcpConnectionPtr& from, const TcpConnectionPtr& to);
+    void onUpstreamClosed(const RelayPtr& relay);
+    void release(const RelayPtr& relay);
+    // health checks
+    void onHealthTimer();
+    void startProbe(size_t index);
+    void onProbeDone(size_t index, bool ok);
+    void rebuildTable();
+
+    LoadBalancerConfig config_;
+    LoadBalancerStats stats_;
+    EventLoopPtr loop_;
+    std::vector<Backend> backends_;
+    MaglevTable table_;
+    size_t nextSource_ { 0 }; // round robin over config_.sourceAddresses
+    EventLoop::TimerId healthTimer_ { 0 };
+    // relays by client connection, until both sides are closed
+    std::unordered_map<TcpConnection*, RelayPtr> relays_;
+};
+
+#endif//LOADBALANCER_H
@@ -0,0 +1,97 @@
+/********************************************************************************
+  > FileName:	MaglevTable.cpp
+  > Author:	Mingping Zhang
+  > Email:	mingpingzhang@163.com
+  > Create Time:	Tue Apr  4 09:37:12 2023
+ ********************************************************************************/
+
+#include "MaglevTable.h"
+
+
+MaglevTable::MaglevTable(size_t size)
+	: size_ ( size )
+{
+}
+
+bool MaglevTable::validSize(size_t size)
+{
+	if (size < 2)
+	{
+		return false;
+	}
+	for (size_t d = 2; d <= size / d; ++d)
+	{
+		if (size % d == 0)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+uint64_t MaglevTable::hash(const void* data, size_t len, uint64_t seed)
+{
+	const uint8_t* p = static_cast<const uint8_t*>(data);
+	uint64_t h = 0xcbf29ce484222325ULL ^ seed;
+	for (size_t i = 0; i < len; ++i)
+	{
+		h ^= p[i];
+		h *= 0x100000001b3ULL;
+	}
+	// fnv-1a alone spreads short keys(ipv4 addresses) badly over the low bits, finish like splitmix64
+	h ^= h >> 30;
+	h *= 0xbf58476d1ce4e5b9ULL;
+	h ^= h >> 27;
+	h *= 0x94d049bb133111ebULL;
+	h ^= h >> 31;
+	return h;
+}
+
+void MaglevTable::build(const std::vector<std::string>& names, const std::vector<bool>& up)
+{
+	std::vector<size_t> members;
+	for (size_t i = 0; i < names.size(); ++i)
+	{
+		if (i < up.size() && up[i])
+		{
+			members.push_back(i);
+		}
+	}
+	table_.clear();
+	if (members.empty())
+	{
+		return;
+	}
+	// permutation of backend i: slot(j) = (offset + j * skip) % size, skip is never 0 and size is prime,
+	// so every backend walks all slots
+	std::vector<uint64_t> offset(members.size());
+	std::vector<uint64_t> skip(members.size());
+	std::vector<uint64_t> next(members.size(), 0);
+	for (size_t m = 0; m < members.size(); ++m)
+	{
+		const std::string& name = names[members[m]];
+		offset[m] = hash(name.data(), name.size(), 0x5bd1e995) % size_;
+		skip[m] = hash(name.data(), name.size(), 0x1b873593) % (size_ - 1) + 1;
+	}
+	table_.assign(size_, -1);
+	size_t filled = 0;
+	// round robin over backends, each takes its next preferred slot that is still free
+	while (true)
+	{
+		for (size_t m = 0; m < members.size(); ++m)
+		{
+			uint64_t slot = (offset[m] + next[m] * skip[m]) % size_;
+			while (table_[slot] >= 0)
+			{
+				++next[m];
+				slot = (offset[m] + next[m] * skip[m]) % size_;
+			}
+			table_[slot] = (int32_t)members[m];
+			++next[m];
+			if (++filled == size_)
+			{
+				return;
+			}
+		}
+	}
+}
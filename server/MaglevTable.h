@@ -0,0 +1,43 @@
+/********************************************************************************
+> FileName:	MaglevTable.h
+> Author:	Mingping Zhang
+> Email:	mingpingzhang@163.com
+> Create Time:	Tue Apr  4 09:37:12 2023
+********************************************************************************/
+#ifndef MAGLEVTABLE_H
+#define MAGLEVTABLE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// maglev consistent hashing: a lookup table of prime size where every backend owns an almost equal share of
+// slots. each backend fills slots in the order of its own permutation(offset and skip from the hash of its
+// name), so adding or removing one backend only moves the keys of the slots it takes or gives back
+class MaglevTable
+{
+public:
+    // size must be prime and much larger than the number of backends(65537: < 1% imbalance for 100 backends)
+    explicit MaglevTable(size_t size = 65537);
+
+public:
+    // fill the table with the backends whose up flag is set, names identify backends across rebuilds
+    void build(const std::vector<std::string>& names, const std::vector<bool>& up);
+    // index of the backend owning hash, -1 when no backend is up
+    int32_t lookup(uint64_t hash) const
+    { return table_.empty() ? -1 : table_[hash % table_.size()]; }
+    size_t size() const
+    { return size_; }
+
+    // a usable table size: prime and at least 2, build() never finishes with any other
+    static bool validSize(size_t size);
+    // 64 bit hash of a byte string(fnv-1a with a final mix), for names and keys
+    static uint64_t hash(const void* data, size_t len, uint64_t seed = 0);
+
+private:
+    size_t size_;
+    std::vector<int32_t> table_; // slot -> backend index, empty when no backend is up
+};
+
+#endif//MAGLEVTABLE_H
@@ -0,0 +1,159 @@
+/********************************************************************************
+  > FileName:	TopicRegistry.cpp
+  > Author:	Mingping Zhang
+  > Email:	mingpingzhang@163.com
+  > Create Time:	Mon Apr  3 10:21:56 2023
+ ********************************************************************************/
+
+#include "TopicRegistry.h"
+#include <algorithm>
+
+
+bool TopicRegistry::subscribe(const std::string& topic, const TcpConnectionPtr& conn)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	Topic& t = topics_[topic];
+	if (t.id == 0)
+	{
+		t.id = nextId_++;
+	}
+	if (!t.index.emplace(conn->fd(), t.members.size()).second)
+	{
+		// already subscribed
+		return false;
+	}
+	t.members.push_back(conn);
+	// publishers holding the old snapshot keep using it
+	t.stale = true;
+	topicsOf_[conn->fd()].push_back(topic);
+	return true;
+}
+
+bool TopicRegistry::removeSubscriber(const std::string& topic, int32_t fd)
+{
+	auto it = topics_.find(topic);
+	if (it == topics_.end())
+	{
+		return false;
+	}
+	Topic& t = it->second;
+	auto pos = t.index.find(fd);
+	if (pos == t.index.end())
+	{
+		return false;
+	}
+	// swap with the last one, the order of subscribers doesn't matter
+	size_t i = pos->second;
+	t.index.erase(pos);
+	if (i + 1 != t.members.size())
+	{
+		t.members[i] = std::move(t.members.back());
+		t.index[t.members[i]->fd()] = i;
+	}
+	t.members.pop_back();
+	if (t.members.empty())
+	{
+		topics_.erase(it);
+	}
+	else
+	{
+		t.stale = true;
+	}
+	return true;
+}
+
+bool TopicRegistry::unsubscribe(const std::string& topic, int32_t fd)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (!removeSubscriber(topic, fd))
+	{
+		return false;
+	}
+	auto it = topicsOf_.find(fd);
+	if (it != topicsOf_.end())
+	{
+		std::vector<std::string>& topics = it->second;
+		topics.erase(std::remove(topics.begin(), topics.end(), topic), topics.end());
+		if (topics.empty())
+		{
+			topicsOf_.erase(it);
+		}
+	}
+	return true;
+}
+
+void TopicRegistry::removeConnection(int32_t fd)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	auto it = topicsOf_.find(fd);
+	if (it == topicsOf_.end())
+	{
+		return;
+	}
+	for (const std::string& topic : it->second)
+	{
+		removeSubscriber(topic, fd);
+	}
+	topicsOf_.erase(it);
+}
+
+size_t TopicRegistry::publish(const std::string& topic, const PayloadPtr& payload)
+{
+	uint32_t tag = 0;
+	std::shared_ptr<const Subscribers> subscribers;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		auto it = topics_.find(topic);
+		if (it == topics_.end())
+		{
+			return 0;
+		}
+		Topic& t = it->second;
+		if (t.stale)
+		{
+			// one rebuild for all changes since the last publish
+			t.snapshot = std::make_shared<const Subscribers>(t.members);
+			t.stale = false;
+		}
+		tag = t.id;
+		subscribers = t.snapshot;
+	}
+	++stats_.published;
+
+	bool conflate = (config_.policy == SlowSubscriberPolicy::kConflate);
+	size_t delivered = 0;
+	// writes never block: a subscriber that can't keep up is handled by policy, the others go on
+	for (const TcpConnectionPtr& conn : *subscribers)
+	{
+		switch (conn->sendShared(payload, tag, config_.maxQueuedBytes, conflate))
+		{
+		case TcpConnection::kSharedSent:
+		case TcpConnection::kSharedQueued:
+			++delivered;
+			break;
+		case TcpConnection::kSharedConflated:
+			++stats_.conflated;
+			++delivered;
+			break;
+		case TcpConnection::kSharedOverLimit:
+			++stats_.dropped;
+			if (config_.policy == SlowSubscriberPolicy::kDisconnect)
+			{
+				++stats_.disconnected;
+				conn->close();
+			}
+			break;
+		case TcpConnection::kSharedClosed:
+			break;
+		}
+	}
+	stats_.delivered += delivered;
+	return delivered;
+}
+
+size_t TopicRegistry::subscriberCount(const std::string& topic)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	auto it = topics_.find(topic);
+	return it == topics_.end() ? 0 : it->second.members.size();
+}
@@ -0,0 +1,89 @@
+/********************************************************************************
+> FileName:	TopicRegistry.h
+> Author:	Mingping Zhang
+> Email:	mingpingzhang@163.com
+> Create Time:	Mon Apr  3 10:21:56 2023
+********************************************************************************/
+#ifndef TOPICREGISTRY_H
+#define TOPICREGISTRY_H
+
+#include "TcpConnection.h"
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// what publish() does with a subscriber that already has PubSubConfig::maxQueuedBytes queued
+enum class SlowSubscriberPolicy
+{
+    // skip this message for the subscriber
+    kDropMessage,
+    // replace the subscriber's queued older message of the same topic that hasn't started to be written,
+    // so it gets the newest value; skip the message if there is none
+    kConflate,
+    // close the subscriber
+    kDisconnect,
+};
+
+struct PubSubConfig
+{
+    size_t maxQueuedBytes { 1024 * 1024 }; // per subscriber, including bytes of private sends
+    SlowSubscriberPolicy policy { SlowSubscriberPolicy::kConflate };
+};
+
+// counters of publish fan-out, readable from any thread
+struct PubSubStats
+{
+    std::atomic<uint64_t> published { 0 };    // publish() calls
+    std::atomic<uint64_t> delivered { 0 };    // subscriber messages written or queued
+    std::atomic<uint64_t> conflated { 0 };    // queued older message replaced
+    std::atomic<uint64_t> dropped { 0 };      // subscriber messages skipped over the queue limit
+    std::atomic<uint64_t> disconnected { 0 }; // slow subscribers closed(SlowSubscriberPolicy::kDisconnect)
+};
+
+// topic -> subscribed connections. publish() from any thread only takes the lock to grab an immutable
+// snapshot of the list and fans out without it; every subscriber's output queue references the one payload
+// instead of a copy. subscribe/unsubscribe change the list in place in O(1), the snapshot is rebuilt by the
+// next publish() after changes, once for all of them
+class TopicRegistry
+{
+public:
+    void configure(const PubSubConfig& config)
+    { config_ = config; }
+    const PubSubStats& stats() const
+    { return stats_; }
+
+    bool subscribe(const std::string& topic, const TcpConnectionPtr& conn);
+    bool unsubscribe(const std::string& topic, int32_t fd);
+    // drop all subscriptions of a closed connection
+    void removeConnection(int32_t fd);
+    // return the number of subscribers the payload was written or queued to
+    size_t publish(const std::string& topic, const PayloadPtr& payload);
+    size_t subscriberCount(const std::string& topic);
+
+private:
+    typedef std::vector<TcpConnectionPtr> Subscribers;
+    struct Topic
+    {
+        uint32_t id { 0 }; // conflation tag
+        Subscribers members; // current subscribers, unordered
+        std::unordered_map<int32_t, size_t> index; // fd -> position in members
+        std::shared_ptr<const Subscribers> snapshot; // what publish() fans out to, publishers may hold it
+        bool stale { true }; // members changed since snapshot was taken
+    };
+
+    // mutex_ held
+    bool removeSubscriber(const std::string& topic, int32_t fd);
+
+    PubSubConfig config_;
+    PubSubStats stats_;
+    std::mutex mutex_; // guard topics_, topicsOf_ and nextId_
+    std::unordered_map<std::string, Topic> topics_;
+    std::unordered_map<int32_t, std::vector<std::string>> topicsOf_; // subscriptions of every fd
+    uint32_t nextId_ { 1 };
+};
+
+#endif//TOPICREGISTRY_H
@@ -0,0 +1,374 @@
+/********************************************************************************
+  > FileName:	TrafficCapture.cpp
+  > Author:	Mingping Zhang
+  > Email:	mingpingzhang@163.com
+  > Create Time:	Thu Apr  6 10:15:42 2023
+ ********************************************************************************/
+
+#include "TrafficCapture.h"
+#include "TimeUtil.h"
+#include <iostream>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <glob.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char kMagic[8] = { 'E', 'P', 'C', 'A', 'P', '0', '0', '1' };
+// the writer is woken early once this much is buffered, otherwise it polls every kFlushInterval
+static const size_t kWakeBytes = 256 * 1024;
+static const std::chrono::milliseconds kFlushInterval(10);
+
+
+TrafficCapture::TrafficCapture(const CaptureConfig& config)
+	: config_ ( config )
+{
+}
+
+TrafficCapture::~TrafficCapture()
+{
+	stop();
+}
+
+bool TrafficCapture::start()
+{
+	if (thread_.joinable())
+	{
+		return true;
+	}
+	startNs_ = monotonicNs();
+	// open the first file here so a bad path fails start() instead of the writer thread
+	if (!openFile(0))
+	{
+		return false;
+	}
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		running_ = true;
+		stopping_ = false;
+	}
+	thread_ = std::thread([this]() { writerLoop(); });
+	return true;
+}
+
+void TrafficCapture::stop()
+{
+	if (!thread_.joinable())
+	{
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		stopping_ = true;
+	}
+	cond_.notify_one();
+	thread_.join();
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		running_ = false;
+	}
+	closeFile();
+}
+
+void TrafficCapture::record(CaptureRecordType type, int32_t stream, const char* data, size_t len)
+{
+	size_t size = kRecordHeaderSize + len;
+	bool wake = false;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (!running_ || stopping_)
+		{
+			return;
+		}
+		if (pending_.size() + size > config_.maxBuffered)
+		{
+			stats_.dropped.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+		// timestamp taken under the lock: records of all threads are in time order
+		uint64_t ns = monotonicNs() - startNs_;
+		uint32_t s = (uint32_t)stream;
+		uint32_t l = (uint32_t)len;
+		char header[kRecordHeaderSize] = { 0 };
+		memcpy(header, &ns, sizeof(ns));
+		memcpy(header + 8, &s, sizeof(s));
+		memcpy(header + 12, &l, sizeof(l));
+		header[16] = (char)type;
+		pending_.append(header, sizeof(header));
+		if (len > 0)
+		{
+			pending_.append(data, len);
+		}
+		// notify only when crossing the mark, not on every record behind it
+		wake = pending_.size() >= kWakeBytes && pending_.size() - size < kWakeBytes;
+	}
+	stats_.records.fetch_add(1, std::memory_order_relaxed);
+	stats_.bytes.fetch_add(len, std::memory_order_relaxed);
+	if (wake)
+	{
+		cond_.notify_one();
+	}
+}
+
+void TrafficCapture::writerLoop()
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+	while (true)
+	{
+		cond_.wait_for(lock, kFlushInterval, [this]() { return stopping_ || pending_.size() >= kWakeBytes; });
+		bool stopping = stopping_;
+		// producers continue on the emptied buffer of the previous round
+		writing_.swap(pending_);
+		lock.unlock();
+		if (!writing_.empty())
+		{
+			writeRecords(writing_);
+			writing_.clear();
+		}
+		lock.lock();
+		// record() refuses new records once stopping, so this round emptied the buffer
+		if (stopping)
+		{
+			break;
+		}
+	}
+}
+
+void TrafficCapture::writeRecords(const std::string& buffer)
+{
+	const char* data = buffer.data();
+	size_t pos = 0;
+	while (pos < buffer.size())
+	{
+		// the run of records that fits the current file
+		size_t end = pos;
+		size_t next = 0;
+		while (end < buffer.size())
+		{
+			uint32_t len;
+			memcpy(&len, data + end + 12, sizeof(len));
+			next = kRecordHeaderSize + len;
+			if (map_ == nullptr || used_ + (end - pos) + next > mapSize_)
+			{
+				break;
+			}
+			end += next;
+		}
+		if (end > pos)
+		{
+			memcpy(map_ + used_, data + pos, end - pos);
+			used_ += end - pos;
+			pos = end;
+			continue;
+		}
+		// records never span files, a record larger than fileSize gets a file of its own size
+		closeFile();
+		if (!openFile(next))
+		{
+			// count what is lost and give up on this buffer
+			for (; pos < buffer.size(); pos += next)
+			{
+				uint32_t len;
+				memcpy(&len, data + pos + 12, sizeof(len));
+				next = kRecordHeaderSize + len;
+				stats_.dropped.fetch_add(1, std::memory_order_relaxed);
+			}
+			return;
+		}
+	}
+}
+
+bool TrafficCapture::openFile(size_t min_size)
+{
+	char name[32];
+	snprintf(name, sizeof(name), ".%06u.cap", ++fileIndex_);
+	std::string path = config_.path + name;
+	int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+	{
+		std::cout << "open capture file " << path << " failed!" << std::endl;
+		return false;
+	}
+	size_t size = config_.fileSize;
+	if (size < kFileHeaderSize + min_size)
+	{
+		size = kFileHeaderSize + min_size;
+	}
+	// sized up front, written through the mapping and truncated to the used length on rotation
+	if (ftruncate(fd, size) != 0)
+	{
+		std::cout << "ftruncate capture file " << path << " failed!" << std::endl;
+		::close(fd);
+		return false;
+	}
+	void* map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+	{
+		std::cout << "mmap capture file " << path << " failed!" << std::endl;
+		::close(fd);
+		return false;
+	}
+	fd_ = fd;
+	map_ = (char*)map;
+	mapSize_ = size;
+	uint64_t start = realtimeNs() - (monotonicNs() - startNs_);
+	uint64_t reserved = 0;
+	memcpy(map_, kMagic, sizeof(kMagic));
+	memcpy(map_ + 8, &start, sizeof(start));
+	memcpy(map_ + 16, &reserved, sizeof(reserved));
+	used_ = kFileHeaderSize;
+
+	stats_.files.fetch_add(1, std::memory_order_relaxed);
+	files_.push_back(path);
+	if (config_.maxFiles > 0 && files_.size() > config_.maxFiles)
+	{
+		::unlink(files_.front().c_str());
+		files_.pop_front();
+	}
+	return true;
+}
+
+void TrafficCapture::closeFile()
+{
+	if (map_ == nullptr)
+	{
+		return;
+	}
+	munmap(map_, mapSize_);
+	// drop the unused tail of the preallocated size
+	if (ftruncate(fd_, used_) != 0)
+	{
+		std::cout << "ftruncate capture file failed!" << std::endl;
+	}
+	::close(fd_);
+	fd_ = -1;
+	map_ = nullptr;
+	mapSize_ = 0;
+	used_ = 0;
+}
+
+
+CaptureReader::~CaptureReader()
+{
+	unmap();
+}
+
+bool CaptureReader::open(const std::string& path)
+{
+	files_.clear();
+	current_ = 0;
+	unmap();
+	struct stat st;
+	if (path.size() > 4 && path.compare(path.size() - 4, 4, ".cap") == 0 && ::stat(path.c_str(), &st) == 0)
+	{
+		files_.push_back(path);
+		return true;
+	}
+	// all files of a capture, the zero padded index sorts them in order
+	std::string pattern = path + ".*.cap";
+	glob_t g;
+	if (glob(pattern.c_str(), 0, nullptr, &g) != 0)
+	{
+		std::cout << "no capture files " << pattern << std::endl;
+		return false;
+	}
+	for (size_t i = 0; i < g.gl_pathc; ++i)
+	{
+		files_.push_back(g.gl_pathv[i]);
+	}
+	globfree(&g);
+	return true;
+}
+
+bool CaptureReader::next(CaptureRecord& record)
+{
+	while (true)
+	{
+		if (map_ == nullptr)
+		{
+			if (current_ >= files_.size() || !mapFile(current_++))
+			{
+				return false;
+			}
+		}
+		if (offset_ + TrafficCapture::kRecordHeaderSize > size_)
+		{
+			// a capture still being written may end in a partial record
+			unmap();
+			continue;
+		}
+		const char* p = map_ + offset_;
+		uint32_t stream;
+		uint32_t len;
+		memcpy(&record.ns, p, sizeof(record.ns));
+		memcpy(&stream, p + 8, sizeof(stream));
+		memcpy(&len, p + 12, sizeof(len));
+		record.stream = (int32_t)stream;
+		record.type = (CaptureRecordType)p[16];
+		if (p[16] < (char)CaptureRecordType::kOpen || p[16] > (char)CaptureRecordType::kClose)
+		{
+			// zeroed preallocated tail of a file whose writer was killed
+			unmap();
+			continue;
+		}
+		if (offset_ + TrafficCapture::kRecordHeaderSize + len > size_)
+		{
+			std::cout << "truncated record in " << files_[current_ - 1] << std::endl;
+			unmap();
+			continue;
+		}
+		record.payload = p + TrafficCapture::kRecordHeaderSize;
+		record.length = len;
+		offset_ += TrafficCapture::kRecordHeaderSize + len;
+		return true;
+	}
+}
+
+bool CaptureReader::mapFile(size_t index)
+{
+	const std::string& path = files_[index];
+	int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+	{
+		std::cout << "open capture file " << path << " failed!" << std::endl;
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < TrafficCapture::kFileHeaderSize)
+	{
+		std::cout << "capture file " << path << " too short!" << std::endl;
+		::close(fd);
+		return false;
+	}
+	void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if (map == MAP_FAILED)
+	{
+		std::cout << "mmap capture file " << path << " failed!" << std::endl;
+		return false;
+	}
+	map_ = (const char*)map;
+	size_ = st.st_size;
+	if (memcmp(map_, kMagic, sizeof(kMagic)) != 0)
+	{
+		std::cout << path << " is not a capture file!" << std::endl;
+		unmap();
+		return false;
+	}
+	offset_ = TrafficCapture::kFileHeaderSize;
+	return true;
+}
+
+void CaptureReader::unmap()
+{
+	if (map_ != nullptr)
+	{
+		munmap((void*)map_, size_);
+		map_ = nullptr;
+		size_ = 0;
+		offset_ = 0;
+	}
+}
@@ -0,0 +1,142 @@
+/********************************************************************************
+> FileName:	TrafficCapture.h
+> Author:	Mingping Zhang
+> Email:	mingpingzhang@163.com
+> Create Time:	Thu Apr  6 10:15:42 2023
+********************************************************************************/
+#ifndef TRAFFICCAPTURE_H
+#define TRAFFICCAPTURE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// capture file layout, little endian:
+//   file header(24 bytes): "EPCAP001", capture start(CLOCK_REALTIME ns, u64), reserved(u64)
+//   records: time since capture start(ns, u64), stream(u32), length(u32), type(u8), 3 bytes padding, payload
+// a stream is the fd of a server connection, reused by a later connection after its close record
+enum class CaptureRecordType : uint8_t
+{
+    kOpen = 1,    // payload: peer address as text
+    kIn = 2,      // bytes read from the client
+    kOut = 3,     // bytes the server sent to the client
+    kClose = 4,
+};
+
+struct CaptureConfig
+{
+    std::string path;                       // files are <path>.000001.cap, <path>.000002.cap ...
+    size_t fileSize { 64 * 1024 * 1024 };   // rotate to the next file beyond this
+    size_t maxFiles { 8 };                  // oldest files are deleted beyond this, 0 keeps all
+    size_t maxBuffered { 64 * 1024 * 1024 }; // records waiting for the writer, new ones are dropped beyond
+    bool captureReplies { true };           // record kOut, needed by the replay tool to measure latency
+};
+
+// counters of a capture, readable from any thread
+struct CaptureStats
+{
+    std::atomic<uint64_t> records { 0 };
+    std::atomic<uint64_t> bytes { 0 };   // payload bytes written
+    std::atomic<uint64_t> dropped { 0 }; // records lost because the writer fell behind
+    std::atomic<uint64_t> files { 0 };
+};
+
+// appends timestamped per connection byte streams to rotating memory mapped files. record() only copies
+// into a buffer under a short lock, a background thread moves full buffers to the mapped file
+class TrafficCapture
+{
+public:
+    static const size_t kFileHeaderSize = 24;
+    static const size_t kRecordHeaderSize = 20;
+
+    explicit TrafficCapture(const CaptureConfig& config);
+    TrafficCapture(const TrafficCapture& other)            = delete;
+    TrafficCapture& operator=(const TrafficCapture& other) = delete;
+    ~TrafficCapture();
+
+public:
+    // open the first file and start the writer thread
+    bool start();
+    // write what is buffered and join the writer
+    void stop();
+    // callable from any thread
+    void record(CaptureRecordType type, int32_t stream, const char* data, size_t len);
+    bool captureReplies() const
+    { return config_.captureReplies; }
+    const CaptureStats& stats() const
+    { return stats_; }
+
+private:
+    void writerLoop();
+    // copy whole records of buffer to the mapped file, rotating at record boundaries
+    void writeRecords(const std::string& buffer);
+    bool openFile(size_t min_size);
+    void closeFile();
+
+    CaptureConfig config_;
+    CaptureStats stats_;
+    uint64_t startNs_ { 0 }; // monotonic time of start()
+
+    std::mutex mutex_; // guard pending_, running_ and stopping_
+    std::condition_variable cond_;
+    std::string pending_; // records appended by record()
+    bool running_ { false };
+    bool stopping_ { false };
+    std::thread thread_;
+
+    // writer thread only
+    std::string writing_; // swapped with pending_, capacity is kept
+    int fd_ { -1 };
+    char* map_ { nullptr };
+    size_t mapSize_ { 0 };
+    size_t used_ { 0 };
+    uint32_t fileIndex_ { 0 };
+    std::deque<std::string> files_; // written files, oldest first
+};
+
+// one record of a capture, payload points into the mapped file
+struct CaptureRecord
+{
+    uint64_t ns { 0 };
+    int32_t stream { -1 };
+    CaptureRecordType type { CaptureRecordType::kOpen };
+    const char* payload { nullptr };
+    size_t length { 0 };
+};
+
+// reads the files of a capture in order
+class CaptureReader
+{
+public:
+    CaptureReader() = default;
+    CaptureReader(const CaptureReader& other)            = delete;
+    CaptureReader& operator=(const CaptureReader& other) = delete;
+    ~CaptureReader();
+
+public:
+    // path: a single .cap file or the prefix given in CaptureConfig::path
+    bool open(const std::string& path);
+    // next record, false at the end of the last file or on a damaged file; the payload stays valid until
+    // the next call
+    bool next(CaptureRecord& record);
+    const std::vector<std::string>& files() const
+    { return files_; }
+
+private:
+    bool mapFile(size_t index);
+    void unmap();
+
+    std::vector<std::string> files_;
+    size_t current_ { 0 };
+    const char* map_ { nullptr };
+    size_t size_ { 0 };
+    size_t offset_ { 0 };
+};
+
+#endif//TRAFFICCAPTURE_H
@@ -6,9 +6,11 @@
 #include <cstring>
 #include <stdlib.h>
 #include <sys/epoll.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <unistd.h>
 #include <cassert>
+#include <csignal>
 
 #include <iostream>
 #include <string>
@@ -17,6 +19,15 @@
 #include <functional>
 
 #include "EpollTcpServer.h"
+#include "EpollUdpServer.h"
+
+// set by SIGINT/SIGTERM, main() stops the server(capture files are completed)
+static volatile std::sig_atomic_t g_stop = 0;
+
+static void onStopSignal(int)
+{
+    g_stop = 1;
+}
 
 // callback when packet received
 
@@ -33,8 +44,89 @@ int main(int argc, char* argv[])
     {
         local_port = std::atoi(argv[2]);
     }
-    // create a epoll tcp server
-    auto epoll_server = std::make_shared<EpollTcpServer>(local_ip, local_port);
+    // the third argument "udp" starts a udp echo server instead of tcp,
+    // "tls" serves tls with certificate argv[4] and key argv[5](self-signed if not given)
+    bool udp = (argc >= 4 && std::string(argv[3]) == "udp");
+    bool tls = (argc >= 4 && std::string(argv[3]) == "tls");
+    // "lb" relays every connection to one of the backends argv[4..](ip:port, [ipv6]:port or unix:/path)
+    bool lb = (argc >= 5 && std::string(argv[3]) == "lb");
+    // "capture" records the echo traffic to files argv[4].000001.cap ... for capture_replay
+    bool capture = (argc >= 5 && std::string(argv[3]) == "capture");
+    // "lines" echoes newline delimited lines, one packet per line
+    bool lines = (argc >= 4 && std::string(argv[3]) == "lines");
+
+    // create a epoll tcp/udp server
+    std::shared_ptr<EpollTcpBase> epoll_server;
+    if (udp)
+    {
+        auto udp_server = std::make_shared<EpollUdpServer>(local_ip, local_port);
+        udp_server->setVerbose(true);
+        epoll_server = udp_server;
+    }
+    else
+    {
+        auto tcp_server = std::make_shared<EpollTcpServer>(local_ip, local_port);
+        tcp_server->setVerbose(true);
+        if (tls)
+        {
+            TlsContextPtr ctx = (argc >= 6) ? TlsContext::createServer(argv[4], argv[5])
+                : TlsContext::createSelfSignedServer("localhost");
+            if (!ctx)
+            {
+                std::cout << "tls context create failed!" << std::endl;
+                exit(-1);
+            }
+            tcp_server->setTlsContext(ctx);
+        }
+        if (lb)
+        {
+            LoadBalancerConfig config;
+            config.verbose = true;
+            for (int i = 4; i < argc; ++i)
+            {
+                std::string backend(argv[i]);
+                size_t colon = backend.rfind(':');
+                std::string host = backend.substr(0, colon);
+                if (host.size() > 2 && host.front() == '[' && host.back() == ']')
+                {
+                    host = host.substr(1, host.size() - 2);
+                }
+                SocketAddress addr;
+                bool ok = (backend.compare(0, 5, "unix:") == 0) ? SocketAddress::parse(backend, 0, addr)
+                    : (colon != std::string::npos && SocketAddress::parse(host, std::atoi(backend.c_str() + colon + 1), addr));
+                if (!ok)
+                {
+                    std::cout << "invalid backend " << backend << std::endl;
+                    exit(-1);
+                }
+                config.backends.push_back(addr);
+            }
+            // every relay takes two fds, lift the soft limit to the hard one
+            struct rlimit rl;
+            if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+            {
+                rl.rlim_cur = rl.rlim_max;
+                if (setrlimit(RLIMIT_NOFILE, &rl) != 0)
+                {
+                    std::cout << "setrlimit(RLIMIT_NOFILE) failed: " << strerror(errno) << std::endl;
+                }
+            }
+            tcp_server->setLoadBalancer(config);
+        }
+        if (capture)
+        {
+            CaptureConfig config;
+            config.path = argv[4];
+            tcp_server->setCaptureConfig(config);
+        }
+        if (lines)
+        {
+            LineFramingConfig config;
+            config.enabled = true;
+            tcp_server->setLineFramingConfig(config);
+        }
+        epoll_server = tcp_server;
+    }
     if (!epoll_server)
     {
         std::cout << "tcp_server create faield!" << std::endl;
@@ -60,8 +152,10 @@ int main(int argc, char* argv[])
     }
     std::cout << "############tcp_server started!################" << std::endl;
 
-    // block here
-    while (true)
+    // block here until interrupted
+    std::signal(SIGINT, onStopSignal);
+    std::signal(SIGTERM, onStopSignal);
+    while (!g_stop)
     {
         std::this_thread::sleep_for(std::chrono::seconds(1));
     }
@@ -0,0 +1,561 @@
+/********************************************************************************
+  > FileName:	ParserTest.cpp
+  > Author:	Mingping Zhang
+  > Email:	mingpingzhang@163.com
+  > Create Time:	Thu Apr 13 10:12:40 2023
+ ********************************************************************************/
+
+// the decoders fed by the network: well formed input round trips whatever way it is split into reads, and
+// truncated or forged input is rejected instead of read past; and the maglev table the load balancer picks
+// backends from. every failed check is printed, the exit status is the number of failed checks(ctest: parser_test)
+
+#include "AppDef.h"
+#include "FrameCodec.h"
+#include "LineFramer.h"
+#include "MaglevTable.h"
+#include "Lz4Codec.h"
+#include "RpcCodec.h"
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+static int g_failures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) \
+        { \
+            ++g_failures; \
+            printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+        } \
+    } while (0)
+
+static std::string randomBytes(size_t n, uint32_t seed)
+{
+    std::mt19937 rng(seed);
+    std::string s(n, '\0');
+    for (size_t i = 0; i < n; ++i)
+    {
+        s[i] = (char)(rng() & 0xff);
+    }
+    return s;
+}
+
+// text with repeats at short and long distances
+static std::string repetitiveText(size_t n)
+{
+    static const char* words[] = { "epoll ", "wait ", "ready ", "socket ", "\n", "aaaaaaaaaaaaaaaaaaaa" };
+    std::string s;
+    uint32_t x = 7;
+    while (s.size() < n)
+    {
+        x = x * 1103515245 + 12345;
+        s += words[(x >> 16) % 6];
+    }
+    s.resize(n);
+    return s;
+}
+
+static std::string compressBlock(Lz4Codec& codec, const std::string& input)
+{
+    std::string out(Lz4Codec::compressBound(input.size()), '\0');
+    size_t n = codec.compress(input.data(), input.size(), &out[0], out.size());
+    out.resize(n);
+    return out;
+}
+
+static void testLz4RoundTrip()
+{
+    Lz4Codec codec;
+    std::vector<std::string> inputs = {
+        std::string(),
+        std::string("a"),
+        std::string("abcd"),
+        std::string(13, 'x'),
+        std::string(100000, 'z'),
+        repetitiveText(64 * 1024),
+        randomBytes(4096, 1),
+        repetitiveText(300) + randomBytes(300, 2) + repetitiveText(300),
+    };
+    for (const std::string& input : inputs)
+    {
+        std::string block = compressBlock(codec, input);
+        CHECK(!block.empty());
+        std::string output(input.size(), '\0');
+        ssize_t r = Lz4Codec::decompress(block.data(), block.size(), &output[0], output.size());
+        CHECK(r == (ssize_t)input.size());
+        CHECK(output == input);
+        if (!input.empty())
+        {
+            // one byte short of room
+            CHECK(Lz4Codec::decompress(block.data(), block.size(), &output[0], output.size() - 1) == -1);
+        }
+    }
+    // the hash table kept between calls only gives hints
+    std::string a = repetitiveText(5000);
+    std::string b = randomBytes(5000, 3);
+    compressBlock(codec, a);
+    std::string block = compressBlock(codec, b);
+    std::string output(b.size(), '\0');
+    CHECK(Lz4Codec::decompress(block.data(), block.size(), &output[0], output.size()) == (ssize_t)b.size());
+    CHECK(output == b);
+    // too little room for the output
+    std::string small(4, '\0');
+    CHECK(codec.compress(a.data(), a.size(), &small[0], small.size()) == 0);
+}
+
+static void testLz4Malformed()
+{
+    Lz4Codec codec;
+    std::string input = repetitiveText(2000);
+    std::string block = compressBlock(codec, input);
+    std::string output(input.size(), '\0');
+    // every strict prefix is rejected or decodes to less than the whole input, never more
+    for (size_t n = 0; n < block.size(); ++n)
+    {
+        ssize_t r = Lz4Codec::decompress(block.data(), n, &output[0], output.size());
+        CHECK(r < (ssize_t)input.size());
+    }
+
+    // 1 literal 'a', then a match 2 bytes back: before the start of the output
+    const char bad_offset[] = { 0x10, 'a', 0x02, 0x00 };
+    CHECK(Lz4Codec::decompress(bad_offset, sizeof(bad_offset), &output[0], output.size()) == -1);
+    // offset 0
+    const char zero_offset[] = { 0x10, 'a', 0x00, 0x00 };
+    CHECK(Lz4Codec::decompress(zero_offset, sizeof(zero_offset), &output[0], output.size()) == -1);
+    // a match without its offset
+    const char no_offset[] = { 0x10, 'a', 0x01 };
+    CHECK(Lz4Codec::decompress(no_offset, sizeof(no_offset), &output[0], output.size()) == -1);
+    // offset 1 repeats 'a': 1 + 4 bytes
+    const char overlap[] = { 0x10, 'a', 0x01, 0x00 };
+    char small[5];
+    CHECK(Lz4Codec::decompress(overlap, sizeof(overlap), small, sizeof(small)) == 5);
+    CHECK(std::memcmp(small, "aaaaa", 5) == 0);
+    CHECK(Lz4Codec::decompress(overlap, sizeof(overlap), small, 4) == -1);
+
+    // literal length extension claiming far more than the block holds
+    std::string huge_literals(1, (char)0xf0);
+    huge_literals.append(1000, (char)0xff);
+    huge_literals.push_back(0x10);
+    huge_literals += "abc";
+    CHECK(Lz4Codec::decompress(huge_literals.data(), huge_literals.size(), &output[0], output.size()) == -1);
+    // length extension cut off at the end of the block
+    std::string open_length(1, (char)0xf0);
+    open_length.append(3, (char)0xff);
+    CHECK(Lz4Codec::decompress(open_length.data(), open_length.size(), &output[0], output.size()) == -1);
+    // match length extension larger than the output room
+    std::string huge_match = { 0x1f, 'a', 0x01, 0x00 };
+    huge_match.append(100, (char)0xff);
+    huge_match.push_back(0x00);
+    CHECK(Lz4Codec::decompress(huge_match.data(), huge_match.size(), &output[0], output.size()) == -1);
+}
+
+static void putLe32(std::string& out, uint32_t v)
+{
+    for (int i = 0; i < 4; ++i)
+    {
+        out.push_back((char)(v >> (8 * i)));
+    }
+}
+
+// a client and a server codec after the handshake
+struct CodecPair
+{
+    CompressionConfig config;
+    FrameCodec client;
+    FrameCodec server;
+
+    explicit CodecPair(const CompressionConfig& c)
+        : config ( c ), client ( c, false, nullptr ), server ( c, true, nullptr )
+    {
+        std::vector<std::string> messages;
+        std::string reply;
+        std::string hello = client.hello();
+        server.decode(hello.data(), hello.size(), messages, reply);
+        std::string ack;
+        ack.swap(reply);
+        client.decode(ack.data(), ack.size(), messages, reply);
+    }
+};
+
+static CompressionConfig compressing()
+{
+    CompressionConfig config;
+    config.enabled = true;
+    config.minSize = 64;
+    return config;
+}
+
+static void testFrameHandshake()
+{
+    CompressionConfig config = compressing();
+    FrameCodec client(config, false, nullptr);
+    FrameCodec server(config, true, nullptr);
+    std::string hello = client.hello();
+    CHECK(!hello.empty());
+    CHECK(server.hello().empty());
+    // messages sent before the ack are held and come out as frames with it
+    const char* wire = nullptr;
+    size_t wire_len = 0;
+    CHECK(!client.encode("early", 5, wire, wire_len));
+
+    std::vector<std::string> messages;
+    std::string reply;
+    // the hello one byte per read
+    for (char c : hello)
+    {
+        CHECK(server.decode(&c, 1, messages, reply));
+    }
+    CHECK(server.framed());
+    CHECK(messages.empty());
+    std::string ack;
+    ack.swap(reply);
+    CHECK(client.decode(ack.data(), ack.size(), messages, reply));
+    CHECK(client.framed());
+    CHECK(server.decode(reply.data(), reply.size(), messages, ack));
+    CHECK(messages.size() == 1 && messages[0] == "early");
+
+    // a client without compression: its first bytes are data
+    FrameCodec plain_server(config, true, nullptr);
+    messages.clear();
+    reply.clear();
+    CHECK(plain_server.decode("GET / HTTP/1.1\r\n", 16, messages, reply));
+    CHECK(!plain_server.framed());
+    CHECK(reply.empty());
+    std::string joined;
+    for (const std::string& m : messages)
+    {
+        joined += m;
+    }
+    CHECK(joined == "GET / HTTP/1.1\r\n");
+}
+
+static void testFrameDecode()
+{
+    CodecPair pair(compressing());
+    std::vector<std::string> sent = {
+        std::string(),
+        std::string("short"),
+        repetitiveText(10000),      // compressed
+        randomBytes(3000, 4),       // doesn't pay, raw
+        repetitiveText(200),
+    };
+    std::string stream;
+    for (const std::string& message : sent)
+    {
+        const char* wire = nullptr;
+        size_t wire_len = 0;
+        CHECK(pair.client.encode(message.data(), message.size(), wire, wire_len));
+        stream.append(wire, wire_len);
+    }
+    CHECK(stream.size() < 10000 + 3000);
+    // the whole stream in reads of every size from 1 byte up
+    for (size_t chunk = 1; chunk <= stream.size(); chunk = chunk < 16 ? chunk + 1 : chunk * 3)
+    {
+        CodecPair reader(compressing());
+        std::vector<std::string> messages;
+        std::string reply;
+        for (size_t off = 0; off < stream.size(); off += chunk)
+        {
+            size_t n = stream.size() - off < chunk ? stream.size() - off : chunk;
+            CHECK(reader.server.decode(stream.data() + off, n, messages, reply));
+        }
+        CHECK(messages == sent);
+        CHECK(reply.empty());
+    }
+}
+
+static void testFrameMalformed()
+{
+    std::vector<std::string> messages;
+    std::string reply;
+    {
+        // body length over the output buffer limit, rejected before waiting for the body
+        CodecPair pair(compressing());
+        std::string frame;
+        putLe32(frame, MaxOutputBufferSize() + 1);
+        CHECK(!pair.server.decode(frame.data(), frame.size(), messages, reply));
+    }
+    {
+        // compressed frame without the original length
+        CodecPair pair(compressing());
+        std::string frame;
+        putLe32(frame, 0x80000000U | 2);
+        frame += "ab";
+        CHECK(!pair.server.decode(frame.data(), frame.size(), messages, reply));
+    }
+    {
+        // compressed frame claiming an original length over the limit
+        CodecPair pair(compressing());
+        std::string frame;
+        putLe32(frame, 0x80000000U | 8);
+        putLe32(frame, MaxOutputBufferSize() + 1);
+        putLe32(frame, 0);
+        CHECK(!pair.server.decode(frame.data(), frame.size(), messages, reply));
+    }
+    {
+        // original length not matching what the block decodes to
+        CodecPair pair(compressing());
+        Lz4Codec codec;
+        std::string input = repetitiveText(1000);
+        std::string block = compressBlock(codec, input);
+        std::string frame;
+        putLe32(frame, 0x80000000U | (uint32_t)(4 + block.size()));
+        putLe32(frame, (uint32_t)input.size() + 1);
+        frame += block;
+        CHECK(!pair.server.decode(frame.data(), frame.size(), messages, reply));
+    }
+    {
+        // a bad block after a good frame in the same read
+        CodecPair pair(compressing());
+        std::string frame;
+        putLe32(frame, 3);
+        frame += "one";
+        putLe32(frame, 0x80000000U | 8);
+        putLe32(frame, 5);
+        frame += std::string("\x10" "a" "\x02\x00", 4);
+        messages.clear();
+        CHECK(!pair.server.decode(frame.data(), frame.size(), messages, reply));
+    }
+}
+
+static void testLineFeed()
+{
+    LineFramingConfig config;
+    config.enabled = true;
+    config.maxLineLength = 64;
+    std::string stream = "one\n\ntwo three\n" + std::string(40, 'x') + "\nlast";
+    std::vector<std::string> expected = { "one\n", "\n", "two three\n", std::string(40, 'x') + "\n" };
+    // every split into reads of the same size
+    for (size_t chunk = 1; chunk <= stream.size(); ++chunk)
+    {
+        LineFramer framer(config);
+        std::vector<std::string> lines;
+        for (size_t off = 0; off < stream.size(); off += chunk)
+        {
+            size_t n = stream.size() - off < chunk ? stream.size() - off : chunk;
+            CHECK(framer.feed(stream.data() + off, n, lines));
+        }
+        CHECK(lines == expected);
+        CHECK(framer.buffered() == 4);
+    }
+
+    config.keepDelimiter = false;
+    config.delimiter = ';';
+    LineFramer framer(config);
+    std::vector<std::string> lines;
+    CHECK(framer.feed("a;b", 3, lines));
+    CHECK(framer.feed("c;;", 3, lines));
+    CHECK((lines == std::vector<std::string> { "a", "bc", "" }));
+    CHECK(framer.buffered() == 0);
+
+    // the limit counts the delimiter, and a line split over reads as a whole
+    config.keepDelimiter = true;
+    config.delimiter = '\n';
+    std::string exact(63, 'y');
+    exact += '\n';
+    LineFramer at_limit(config);
+    lines.clear();
+    CHECK(at_limit.feed(exact.data(), 30, lines));
+    CHECK(at_limit.feed(exact.data() + 30, exact.size() - 30, lines));
+    CHECK(lines.size() == 1 && lines[0] == exact);
+    std::string over(64, 'y');
+    over += '\n';
+    LineFramer too_long(config);
+    CHECK(too_long.feed(over.data(), 40, lines));
+    CHECK(!too_long.feed(over.data() + 40, over.size() - 40, lines));
+    // no delimiter at all
+    std::string endless_line(65, 'y');
+    LineFramer endless(config);
+    CHECK(!endless.feed(endless_line.data(), endless_line.size(), lines));
+}
+
+// the scans findByte() picks from agree with each other on every length and position
+static void testFindByte()
+{
+    std::string buf(300, 'a');
+    for (size_t len = 0; len < 100; ++len)
+    {
+        for (size_t pos = 0; pos <= len; ++pos)
+        {
+            if (pos < len)
+            {
+                buf[pos] = '\n';
+            }
+            size_t expect = pos;
+            CHECK(findByte(buf.data(), len, '\n') == expect);
+            CHECK(findByteScalar(buf.data(), len, '\n') == expect);
+            CHECK(findByteSse2(buf.data(), len, '\n') == expect);
+            if (std::string(findByteName()) == "avx2")
+            {
+                CHECK(findByteAvx2(buf.data(), len, '\n') == expect);
+            }
+            buf[pos] = 'a';
+        }
+    }
+}
+
+static void testRpcFeed()
+{
+    std::string stream;
+    std::vector<std::pair<uint64_t, std::string>> sent = {
+        { 1, "ping" },
+        { 0xffffffffffffULL, std::string() },
+        { 7, std::string(1000, 'r') },
+        { 2, std::string("\0\1\2", 3) },
+    };
+    for (const auto& m : sent)
+    {
+        encodeRpcFrame(m.first, m.second.data(), m.second.size(), stream);
+    }
+    for (size_t chunk = 1; chunk <= stream.size(); chunk = chunk < 32 ? chunk + 1 : chunk * 2)
+    {
+        RpcDecoder decoder(4096);
+        std::vector<RpcFrame> frames;
+        for (size_t off = 0; off < stream.size(); off += chunk)
+        {
+            size_t n = stream.size() - off < chunk ? stream.size() - off : chunk;
+            CHECK(decoder.feed(stream.data() + off, n, frames));
+        }
+        CHECK(frames.size() == sent.size());
+        for (size_t i = 0; i < frames.size() && i < sent.size(); ++i)
+        {
+            CHECK(frames[i].id == sent[i].first);
+            CHECK(frames[i].body == sent[i].second);
+        }
+        CHECK(decoder.buffered() == 0);
+    }
+
+    // a partial frame is kept across a read that completes earlier ones
+    RpcDecoder decoder(4096);
+    std::vector<RpcFrame> frames;
+    std::string two;
+    encodeRpcFrame(5, "abc", 3, two);
+    encodeRpcFrame(6, "defg", 4, two);
+    CHECK(decoder.feed(two.data(), two.size() - 2, frames));
+    CHECK(frames.size() == 1 && decoder.buffered() == 4 + 8 + 2);
+    CHECK(decoder.feed(two.data() + two.size() - 2, 2, frames));
+    CHECK(frames.size() == 2 && frames[1].id == 6 && frames[1].body == "defg");
+
+    // a length shorter than the id, or above the limit
+    std::string short_frame("\x04\x00\x00\x00" "abcd", 8);
+    RpcDecoder short_decoder(4096);
+    CHECK(!short_decoder.feed(short_frame.data(), short_frame.size(), frames));
+    std::string big;
+    encodeRpcFrame(9, std::string(4089, 'b').data(), 4089, big);
+    RpcDecoder big_decoder(4096);
+    CHECK(!big_decoder.feed(big.data(), 4, frames));
+    std::string at_limit;
+    encodeRpcFrame(9, std::string(4088, 'b').data(), 4088, at_limit);
+    RpcDecoder limit_decoder(4096);
+    frames.clear();
+    CHECK(limit_decoder.feed(at_limit.data(), at_limit.size(), frames));
+    CHECK(frames.size() == 1 && frames[0].body.size() == 4088);
+    // a bad length behind a partial frame buffered earlier
+    std::string mixed;
+    encodeRpcFrame(3, "x", 1, mixed);
+    mixed += short_frame;
+    RpcDecoder mixed_decoder(4096);
+    frames.clear();
+    CHECK(mixed_decoder.feed(mixed.data(), 5, frames));
+    CHECK(!mixed_decoder.feed(mixed.data() + 5, mixed.size() - 5, frames));
+}
+
+static void testMaglevBuild()
+{
+    CHECK(!MaglevTable::validSize(0));
+    CHECK(!MaglevTable::validSize(1));
+    CHECK(MaglevTable::validSize(2));
+    CHECK(MaglevTable::validSize(3));
+    CHECK(!MaglevTable::validSize(4));
+    CHECK(!MaglevTable::validSize(65535));
+    CHECK(MaglevTable::validSize(65537));
+    CHECK(!MaglevTable::validSize(65537ULL * 65537));
+
+    std::vector<std::string> names;
+    for (int i = 0; i < 10; ++i)
+    {
+        names.push_back("10.0.0." + std::to_string(i + 1) + ":80");
+    }
+    std::vector<bool> up(names.size(), true);
+    const size_t kSize = 65537;
+    MaglevTable table(kSize);
+    table.build(names, up);
+    // every slot owned, shares within a few percent of each other
+    std::vector<size_t> owned(names.size(), 0);
+    for (uint64_t h = 0; h < kSize; ++h)
+    {
+        int32_t b = table.lookup(h);
+        CHECK(b >= 0 && b < (int32_t)names.size());
+        if (b >= 0 && b < (int32_t)names.size())
+        {
+            ++owned[b];
+        }
+    }
+    for (size_t count : owned)
+    {
+        CHECK(count > kSize / names.size() * 95 / 100 && count < kSize / names.size() * 105 / 100);
+    }
+
+    // taking one backend down only moves its own slots
+    std::vector<int32_t> before(kSize);
+    for (uint64_t h = 0; h < kSize; ++h)
+    {
+        before[h] = table.lookup(h);
+    }
+    up[3] = false;
+    table.build(names, up);
+    size_t moved = 0;
+    for (uint64_t h = 0; h < kSize; ++h)
+    {
+        int32_t b = table.lookup(h);
+        CHECK(b != 3);
+        if (before[h] != 3 && b != before[h])
+        {
+            ++moved;
+        }
+    }
+    // maglev trades a little disruption for balance
+    CHECK(moved < kSize / 100);
+
+    // the smallest tables still fill every slot
+    MaglevTable two(2);
+    two.build(names, std::vector<bool>(names.size(), true));
+    CHECK(two.lookup(0) >= 0 && two.lookup(1) >= 0);
+    MaglevTable seven(7);
+    std::vector<std::string> one_name(1, "solo");
+    seven.build(one_name, std::vector<bool>(1, true));
+    for (uint64_t h = 0; h < 7; ++h)
+    {
+        CHECK(seven.lookup(h) == 0);
+    }
+    // nothing up
+    seven.build(one_name, std::vector<bool>(1, false));
+    CHECK(seven.lookup(0) == -1);
+}
+
+int main()
+{
+    testLz4RoundTrip();
+    testLz4Malformed();
+    testFrameHandshake();
+    testFrameDecode();
+    testFrameMalformed();
+    testLineFeed();
+    testFindByte();
+    testRpcFeed();
+    testMaglevBuild();
+    if (g_failures)
+    {
+        printf("%d check(s) failed\n", g_failures);
+    }
+    else
+    {
+        printf("all checks passed\n");
+    }
+    return g_failures;
+}